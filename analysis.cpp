@@ -0,0 +1,183 @@
+#include "analysis.h"
+
+#define assert(c) if(!(c)) throw InvalidBytecodeError{}
+
+using namespace rvm;
+using namespace rvm::assembly;
+
+namespace {
+
+bool is_branch_target(const FunctionInfo& f, size_t pc) {
+    for (auto&& i : f.code) {
+        if ((i.op == Operation::br || i.op == Operation::brtrue) && i.index == pc) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Stack slots popped and pushed by the instruction at `pc`.
+void stack_effect(const Assembly& a, const FunctionInfo& f, size_t pc,
+                  const std::vector<index_t>& native_arities,
+                  int32_t* pops, int32_t* pushes) {
+    auto&& i = f.code[pc];
+    *pops = 0;
+    *pushes = 0;
+    switch (i.op) {
+        case Operation::add:
+        case Operation::sub:
+        case Operation::mul:
+        case Operation::div:
+        case Operation::rem:
+        case Operation::band:
+        case Operation::bor:
+        case Operation::bxor:
+        case Operation::teq:
+        case Operation::tne:
+        case Operation::tlt:
+        case Operation::tlt_un:
+        case Operation::tle:
+        case Operation::tle_un:
+        case Operation::tgt:
+        case Operation::tgt_un:
+        case Operation::tge:
+        case Operation::tge_un:
+            *pops = 2;
+            *pushes = 1;
+            break;
+        case Operation::bnot:
+        case Operation::ldind:
+        case Operation::ldctor:
+        case Operation::ldfld:
+            *pops = 1;
+            *pushes = 1;
+            break;
+        case Operation::dup:
+            *pops = 1;
+            *pushes = 2;
+            break;
+        case Operation::drop:
+        case Operation::stloc:
+        case Operation::starg:
+        case Operation::brtrue:
+        case Operation::switch_:
+        case Operation::switchctor:
+        case Operation::dladt:
+        case Operation::ret:
+            *pops = 1;
+            break;
+        case Operation::ldc:
+        case Operation::ldloc:
+        case Operation::ldarg:
+        case Operation::ldloca:
+        case Operation::ldarga:
+        case Operation::ldfuna:
+            *pushes = 1;
+            break;
+        case Operation::call:
+            *pops = a.function_table[i.index].num_args;
+            *pushes = 1;
+            break;
+        case Operation::callnative:
+            assert(i.index < native_arities.size());
+            *pops = native_arities[i.index];
+            *pushes = 1;
+            break;
+        case Operation::calla:
+            *pops = 1 + calla_arity(a, f, pc);
+            *pushes = 1;
+            break;
+        case Operation::tailcall:
+            *pops = a.function_table[i.index].num_args;
+            break;
+        case Operation::tailcalla:
+            *pops = 1 + calla_arity(a, f, pc);
+            break;
+        case Operation::stind:
+        case Operation::stfld:
+            *pops = 2;
+            break;
+        case Operation::br:
+            break;
+        case Operation::mkadt:
+            *pops = a.adt_table[i.index][i.index2].num_fields;
+            *pushes = 1;
+            break;
+    }
+}
+
+}
+
+index_t rvm::assembly::calla_arity(const Assembly& a, const FunctionInfo& f, size_t pc) {
+    if (pc > 0 && f.code[pc - 1].op == Operation::ldfuna && !is_branch_target(f, pc)) {
+        return a.function_table[f.code[pc - 1].index].num_args;
+    }
+    auto arity = int32_t{-1};
+    for (auto&& g : a.function_table) {
+        for (auto&& i : g.code) {
+            if (i.op != Operation::ldfuna) {
+                continue;
+            }
+            auto n = a.function_table[i.index].num_args;
+            assert(arity == -1 || arity == n);
+            arity = n;
+        }
+    }
+    assert(arity != -1);
+    return static_cast<index_t>(arity);
+}
+
+StackLayout rvm::assembly::analyze_stack(const Assembly& a, const FunctionInfo& f,
+                                         const std::vector<index_t>& native_arities) {
+    auto re = StackLayout{};
+    re.depth.assign(f.code.size(), -1);
+    if (f.code.empty()) {
+        return re;
+    }
+    auto work = std::vector<size_t>{0};
+    re.depth[0] = 0;
+    auto flow = [&](size_t target, int32_t depth) {
+        assert(target < f.code.size());
+        if (re.depth[target] == -1) {
+            re.depth[target] = depth;
+            work.push_back(target);
+        }
+        else {
+            assert(re.depth[target] == depth);
+        }
+    };
+    while (!work.empty()) {
+        auto pc = work.back();
+        work.pop_back();
+        int32_t pops, pushes;
+        stack_effect(a, f, pc, native_arities, &pops, &pushes);
+        auto depth = re.depth[pc];
+        assert(depth >= pops);
+        depth += pushes - pops;
+        re.max_depth = std::max<index_t>(re.max_depth, static_cast<index_t>(depth));
+        auto&& i = f.code[pc];
+        switch (i.op) {
+            case Operation::ret:
+            case Operation::tailcall:
+            case Operation::tailcalla:
+                break;
+            case Operation::br:
+                flow(i.index, depth);
+                break;
+            case Operation::brtrue:
+                flow(i.index, depth);
+                flow(pc + 1, depth);
+                break;
+            case Operation::switch_:
+            case Operation::switchctor:
+                for (size_t k = 1; k <= i.index + 1u; ++k) {
+                    flow(pc + k, depth);
+                }
+                break;
+            default:
+                flow(pc + 1, depth);
+                break;
+        }
+    }
+    return re;
+}
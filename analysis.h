@@ -0,0 +1,29 @@
+#pragma once
+#include <stdint.h>
+#include <vector>
+#include "assembly.h"
+
+namespace rvm {
+namespace assembly {
+
+// Operand stack depth, counted above the locals of the frame, on entry to
+// every pc of a function. Unreachable pcs have depth -1.
+struct StackLayout {
+    std::vector<int32_t> depth;
+    index_t max_depth{0};
+};
+
+// Number of arguments consumed by the calla or tailcalla at `pc`. The target is taken
+// from an ldfuna right before it, or else from the arity shared by every
+// function whose address is taken anywhere in the assembly.
+index_t calla_arity(const Assembly&, const FunctionInfo&, size_t pc);
+
+// Computes the stack layout of a validated function. Throws
+// InvalidBytecodeError when the depth at a pc depends on the path taken, the
+// stack underflows the frame, or a calla target cannot be determined.
+// `native_arities` holds NativeInfo::num_args of the natives in order.
+StackLayout analyze_stack(const Assembly&, const FunctionInfo&,
+                          const std::vector<index_t>& native_arities);
+
+}
+}
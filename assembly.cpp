@@ -1,4 +1,5 @@
 #include "assembly.h"
+#include <string.h>
 
 #define assert(c) if(!(c)) throw InvalidBytecodeError{}
 
@@ -7,207 +8,298 @@ using namespace rvm::assembly;
 
 namespace {
 
-void dump(uint8_t i, std::ostream& out) {
-    out.put(i);
-}
-
-void dump(uint16_t i, std::ostream& out) {
-    dump(static_cast<uint8_t>((i & 0xFF00) >> 8), out);
-    dump(static_cast<uint8_t>((i & 0x00FF) >> 0), out);
-}
-
-void dump(uint32_t i, std::ostream& out) {
-    dump(static_cast<uint8_t>((i & 0xFF000000) >> 24), out);
-    dump(static_cast<uint8_t>((i & 0x00FF0000) >> 16), out);
-    dump(static_cast<uint8_t>((i & 0x0000FF00) >>  8), out);
-    dump(static_cast<uint8_t>((i & 0x000000FF) >>  0), out);
-}
-
-template <class T>
-void dump(const std::vector<T>& xs, std::ostream& out) {
-    dump(xs.size(), out);
-    for (auto&& x : xs) {
-        dump(x, out);
-    }
-}
-
-void dump(const ConstructorInfo& c, std::ostream& out) {
-    dump(c.num_fields, out);
-}
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+uint16_t big_endian(uint16_t i) { return i; }
+uint32_t big_endian(uint32_t i) { return i; }
+#else
+uint16_t big_endian(uint16_t i) { return __builtin_bswap16(i); }
+uint32_t big_endian(uint32_t i) { return __builtin_bswap32(i); }
+#endif
 
-void dump(const ConstantInfo&, std::ostream&);
-
-void dump(const AdtConstant& a, std::ostream& out) {
-    dump(a.adt_table_index, out);
-    dump(a.constructor_index, out);
-    dump(a.num_fields, out);
-    for (int32_t i = 0; i < a.num_fields; ++i) {
-        dump(a.fields[i], out);
-    }
-}
-
-void dump(const ConstantInfo& c, std::ostream& out) {
-    dump(static_cast<uint8_t>(c.type), out);
+// Bytes taken by each part in the stream format.
+size_t encoded_size(const ConstantInfo& c) {
     switch (c.type) {
         case ConstantType::int8:
-            dump(static_cast<uint8_t>(c.int8), out);
-            break;
+            return 2;
         case ConstantType::int32:
-            dump(static_cast<uint32_t>(c.int32), out);
-            break;
+            return 5;
         case ConstantType::adt:
-            dump(c.adt, out);
-            break;
+        {
+            auto re = size_t{6};
+            for (index_t i = 0; i < c.adt.num_fields; ++i) {
+                re += encoded_size(c.adt.fields[i]);
+            }
+            return re;
+        }
     }
+    return 1;
 }
 
-void dump(Operation t, std::ostream& out) {
-    dump(static_cast<uint8_t>(t), out);
+size_t encoded_size(const Assembly& a) {
+    auto re = size_t{4 + 4 + 4 + 4};
+    for (auto&& adt : a.adt_table) {
+        re += 4 + adt.size();
+    }
+    for (auto&& c : a.constant_table) {
+        re += encoded_size(c);
+    }
+    for (auto&& f : a.function_table) {
+        re += 2 + 2 + 4 + 4 * f.code.size();
+    }
+    return re;
 }
 
-void dump(const Instruction& i, std::ostream& out) {
-    dump(i.op, out);
-    dump(i.index, out);
-    dump(i.index2, out);
-}
+// Writes big-endian fields into a buffer that is already large enough.
+class Writer {
+public:
+    explicit Writer(uint8_t* p): p(p) {}
 
-void dump(const FunctionInfo& f, std::ostream& out) {
-    dump(f.num_args, out);
-    dump(f.num_locals, out);
-    dump(f.code, out);
-}
+    void u8(uint8_t i) {
+        *p++ = i;
+    }
+    void u16(uint16_t i) {
+        i = big_endian(i);
+        memcpy(p, &i, sizeof(i));
+        p += sizeof(i);
+    }
+    void u32(uint32_t i) {
+        i = big_endian(i);
+        memcpy(p, &i, sizeof(i));
+        p += sizeof(i);
+    }
 
-uint8_t& parse(uint8_t* i, std::istream& in) {
-    auto re = in.get();
-    if (re == std::istream::traits_type::eof()) {
-        throw ParseError{};
+    void constant(const ConstantInfo& c) {
+        u8(static_cast<uint8_t>(c.type));
+        switch (c.type) {
+            case ConstantType::int8:
+                u8(static_cast<uint8_t>(c.int8));
+                break;
+            case ConstantType::int32:
+                u32(static_cast<uint32_t>(c.int32));
+                break;
+            case ConstantType::adt:
+                u16(c.adt.adt_table_index);
+                u8(c.adt.constructor_index);
+                u16(c.adt.num_fields);
+                for (index_t i = 0; i < c.adt.num_fields; ++i) {
+                    constant(c.adt.fields[i]);
+                }
+                break;
+        }
+    }
+    void assembly(const Assembly& a) {
+        u32(MAGIC_NUMBER);
+        u32(static_cast<uint32_t>(a.adt_table.size()));
+        for (auto&& adt : a.adt_table) {
+            u32(static_cast<uint32_t>(adt.size()));
+            for (auto&& c : adt) {
+                u8(c.num_fields);
+            }
+        }
+        u32(static_cast<uint32_t>(a.constant_table.size()));
+        for (auto&& c : a.constant_table) {
+            constant(c);
+        }
+        u32(static_cast<uint32_t>(a.function_table.size()));
+        for (auto&& f : a.function_table) {
+            u16(f.num_args);
+            u16(f.num_locals);
+            u32(static_cast<uint32_t>(f.code.size()));
+            for (auto&& i : f.code) {
+                u8(static_cast<uint8_t>(i.op));
+                u16(i.index);
+                u8(i.index2);
+            }
+        }
     }
-    *i = re;
-    return *i;
-}
 
-uint16_t& parse(uint16_t* i, std::istream& in) {
-    auto re = uint16_t{};
-    auto tmp = uint8_t{};
-    re |= parse(&tmp, in) << 8;
-    re |= parse(&tmp, in) << 0;
-    *i = re;
-    return *i;
-}
+private:
+    uint8_t* p;
+};
 
-uint32_t& parse(uint32_t* i, std::istream& in) {
-    auto re = uint32_t{};
-    auto tmp = uint8_t{};
-    re |= parse(&tmp, in) << 24;
-    re |= parse(&tmp, in) << 16;
-    re |= parse(&tmp, in) << 8;
-    re |= parse(&tmp, in) << 0;
-    *i = re;
-    return *i;
-}
+// Reads big-endian fields, throwing ParseError at the end of the input.
+// Over a stream, the bytes are pulled in as need() asks for them; every
+// count is checked against the least its elements take, so nothing past
+// the assembly is read.
+class Reader {
+public:
+    Reader(const uint8_t* p, size_t size): p(p), end(p + size) {}
+    explicit Reader(std::istream& in): p(nullptr), end(nullptr), in(&in) {}
 
-template <class T>
-std::vector<T>& parse(std::vector<T>* v, std::istream& in) {
-    auto size = uint32_t{};
-    parse(&size, in);
-    std::vector<T> re(size);
-    for (auto&& i : re) {
-        parse(&i, in);
+    size_t consumed(const uint8_t* start) const {
+        return static_cast<size_t>(p - start);
+    }
+    void need(size_t n) {
+        if (static_cast<size_t>(end - p) < n && !(in != nullptr && fill(n))) {
+            throw ParseError{};
+        }
+    }
+    uint8_t u8() {
+        need(1);
+        return *p++;
+    }
+    uint16_t u16() {
+        need(sizeof(uint16_t));
+        return unchecked_u16();
+    }
+    uint32_t u32() {
+        need(sizeof(uint32_t));
+        auto re = uint32_t{};
+        memcpy(&re, p, sizeof(re));
+        p += sizeof(re);
+        return big_endian(re);
+    }
+    // a count of elements taking at least `size` bytes each
+    uint32_t count(size_t size) {
+        auto re = u32();
+        need(re * size);
+        return re;
     }
-    *v = re;
-    return *v;
-}
-
-ConstructorInfo& parse(ConstructorInfo* c, std::istream& in) {
-    parse(&c->num_fields, in);
-    return *c;
-}
 
-ConstantType& parse(ConstantType* c, std::istream& in) {
-    auto re = uint8_t{};
-    parse(&re, in);
-    *c = static_cast<ConstantType>(re);
-    return *c;
-}
+    ConstantInfo constant() {
+        auto type = static_cast<ConstantType>(u8());
+        switch (type) {
+            case ConstantType::int8:
+                return ConstantInfo{static_cast<int8_t>(u8())};
+            case ConstantType::int32:
+                return ConstantInfo{static_cast<int32_t>(u32())};
+            case ConstantType::adt:
+            {
+                auto re = AdtConstant{};
+                re.adt_table_index = u16();
+                re.constructor_index = u8();
+                re.num_fields = u16();
+                need(re.num_fields * size_t{2});
+                re.fields = new ConstantInfo[re.num_fields];
+                for (index_t i = 0; i < re.num_fields; ++i) {
+                    re.fields[i] = constant();
+                }
+                return ConstantInfo{re};
+            }
+        }
+        // unknown types are kept for validate() to see, as before
+        auto re = ConstantInfo{};
+        re.type = type;
+        return re;
+    }
+    Assembly assembly() {
+        if (u32() != MAGIC_NUMBER) {
+            throw ParseError{};
+        }
+        auto re = Assembly{};
+        auto num_adts = count(4);
+        re.adt_table.reserve(num_adts);
+        for (uint32_t i = 0; i < num_adts; ++i) {
+            auto n = count(1);
+            auto ctors = std::vector<ConstructorInfo>(n);
+            for (auto&& c : ctors) {
+                c.num_fields = *p++;
+            }
+            re.adt_table.emplace_back(std::move(ctors));
+        }
+        auto num_constants = count(2);
+        re.constant_table.reserve(num_constants);
+        for (uint32_t i = 0; i < num_constants; ++i) {
+            re.constant_table.push_back(constant());
+        }
+        auto num_functions = count(8);
+        re.function_table.reserve(num_functions);
+        for (uint32_t i = 0; i < num_functions; ++i) {
+            auto f = FunctionInfo{};
+            f.num_args = u16();
+            f.num_locals = u16();
+            auto n = count(4);
+            auto code = std::vector<Instruction>(n);
+            for (auto&& c : code) {
+                c.op = static_cast<Operation>(*p++);
+                c.index = unchecked_u16();
+                c.index2 = *p++;
+            }
+            f.code = Bytecode(std::move(code));
+            re.function_table.push_back(std::move(f));
+        }
+        return re;
+    }
 
-ConstantInfo& parse(ConstantInfo*, std::istream&);
+private:
+    const uint8_t* p;
+    const uint8_t* end;
+    std::istream* in{nullptr};
+    std::vector<uint8_t> buffer{};
 
-AdtConstant& parse(AdtConstant* a, std::istream& in) {
-    auto re = AdtConstant{};
-    parse(&re.adt_table_index, in);
-    parse(&re.constructor_index, in);
-    parse(&re.num_fields, in);
-    re.fields = new ConstantInfo[re.num_fields];
-    for (auto i = re.num_fields; i != 0; --i) {
-        parse(&re.fields[re.num_fields - i], in);
+    // Reads what is missing for `n` bytes after p, in bounded chunks so
+    // that a corrupt count fails at the end of the stream rather than
+    // allocating for it.
+    bool fill(size_t n) {
+        auto offset = static_cast<size_t>(p - buffer.data());
+        while (static_cast<size_t>(end - p) < n) {
+            auto have = buffer.size();
+            auto chunk = std::min(n - static_cast<size_t>(end - p), size_t{1} << 16);
+            buffer.resize(have + chunk);
+            in->read(reinterpret_cast<char*>(buffer.data() + have), static_cast<std::streamsize>(chunk));
+            buffer.resize(have + static_cast<size_t>(in->gcount()));
+            p = buffer.data() + offset;
+            end = buffer.data() + buffer.size();
+            if (buffer.size() != have + chunk) {
+                return false;
+            }
+        }
+        return true;
     }
-    *a = re;
-    return *a;
-}
 
-ConstantInfo& parse(ConstantInfo* c, std::istream& in) {
-    auto re = ConstantInfo{};
-    parse(&re.type, in);
-    switch (re.type) {
-        case ConstantType::int8:
-            parse(reinterpret_cast<uint8_t*>(&re.int8), in);
-            break;
-        case ConstantType::int32:
-            parse(reinterpret_cast<uint32_t*>(&re.int32), in);
-            break;
-        case ConstantType::adt:
-            parse(&re.adt, in);
-            break;
+    uint16_t unchecked_u16() {
+        auto re = uint16_t{};
+        memcpy(&re, p, sizeof(re));
+        p += sizeof(re);
+        return big_endian(re);
     }
-    *c = re;
-    return *c;
-}
+};
 
-Operation& parse(Operation* i, std::istream& in) {
-    parse(reinterpret_cast<uint8_t*>(i), in);
-    return *i;
+void check_operand_type(rvm::OperandType t) {
+    auto code = static_cast<int8_t>(t);
+    assert(code >= 1 && code <= 4);
 }
 
-Instruction& parse(Instruction* i, std::istream& in) {
-    auto re = Instruction{};
-    parse(&re.op, in);
-    parse(&re.index, in);
-    parse(&re.index2, in);
-    *i = re;
-    return *i;
+void check_scalar_type(rvm::OperandType t) {
+    assert(t == OperandType::int8
+        || t == OperandType::int32
+        || t == OperandType::pointer);
 }
 
-FunctionInfo& parse(FunctionInfo* f, std::istream& in) {
-    auto re = FunctionInfo{};
-    parse(&re.num_args, in);
-    parse(&re.num_locals, in);
-    parse(&re.code, in);
-    *f = re;
-    return *f;
 }
 
-void check_operand_type(rvm::OperandType t) {
-    auto code = static_cast<int8_t>(t);
-    assert(code >= 1 && code <= 4);
+std::vector<uint8_t> rvm::assembly::dump(const Assembly& a) {
+    auto re = std::vector<uint8_t>(encoded_size(a));
+    Writer{re.data()}.assembly(a);
+    return re;
 }
 
+void rvm::assembly::dump(const Assembly& a, std::ostream& out) {
+    auto bytes = dump(a);
+    out.write(reinterpret_cast<const char*>(bytes.data()), static_cast<std::streamsize>(bytes.size()));
 }
 
-void rvm::assembly::dump(const Assembly& a, std::ostream& out) {
-    ::dump(MAGIC_NUMBER, out);
-    ::dump(a.adt_table, out);
-    ::dump(a.constant_table, out);
-    ::dump(a.function_table, out);
+Assembly Assembly::parse(const uint8_t* data, size_t size) {
+    return Reader{data, size}.assembly();
 }
 
 Assembly Assembly::parse(std::istream& in) {
-    auto re = Assembly{};
-    auto magic = uint32_t{};
-    ::parse(&magic, in);
-    if (magic != MAGIC_NUMBER) throw ParseError{};
-    ::parse(&re.adt_table, in);
-    ::parse(&re.constant_table, in);
-    ::parse(&re.function_table, in);
+    // one read of the rest of a seekable stream
+    auto start = in.tellg();
+    if (start == std::istream::pos_type(-1) || !in.seekg(0, std::ios_base::end)) {
+        in.clear();
+        return Reader{in}.assembly();
+    }
+    auto bytes = std::vector<uint8_t>(static_cast<size_t>(in.tellg() - start));
+    in.seekg(start);
+    in.read(reinterpret_cast<char*>(bytes.data()), static_cast<std::streamsize>(bytes.size()));
+    bytes.resize(static_cast<size_t>(in.gcount()));
+    auto reader = Reader{bytes.data(), bytes.size()};
+    auto re = reader.assembly();
+    // leave the stream good and right after the assembly, as reading it
+    // byte by byte would
+    in.clear();
+    in.seekg(start + static_cast<std::streamoff>(reader.consumed(bytes.data())));
     return re;
 }
 
@@ -224,7 +316,7 @@ void rvm::assembly::validate(const Assembly& a) {
                 case Operation::bor:
                 case Operation::bxor:
                 case Operation::bnot:
-                    check_operand_type(pc.type);
+                    check_scalar_type(pc.type);
                     break;
                 case Operation::dup:
                 case Operation::drop:
@@ -245,6 +337,7 @@ void rvm::assembly::validate(const Assembly& a) {
                     assert(pc.index < this_func.num_args);
                     break;
                 case Operation::call:
+                case Operation::tailcall:
                     assert(pc.index < a.function_table.size());
                     break;
                 case Operation::ret:
@@ -259,11 +352,14 @@ void rvm::assembly::validate(const Assembly& a) {
                     assert(pc.index < a.function_table.size());
                     break;
                 case Operation::calla:
+                case Operation::tailcalla:
                 case Operation::ldind:
                 case Operation::stind:
                     break;
                 case Operation::teq:
                 case Operation::tne:
+                    check_operand_type(pc.type);
+                    break;
                 case Operation::tlt:
                 case Operation::tlt_un:
                 case Operation::tle:
@@ -272,7 +368,7 @@ void rvm::assembly::validate(const Assembly& a) {
                 case Operation::tgt_un:
                 case Operation::tge:
                 case Operation::tge_un:
-                    check_operand_type(pc.type);
+                    check_scalar_type(pc.type);
                     break;
                 case Operation::br:
                 case Operation::brtrue:
@@ -287,6 +383,17 @@ void rvm::assembly::validate(const Assembly& a) {
                 case Operation::ldfld:
                 case Operation::stfld:
                     break;
+                case Operation::switch_:
+                case Operation::switchctor:
+                {
+                    // the table and the instruction past it
+                    auto at = static_cast<size_t>(&pc - this_func.code.begin());
+                    assert(at + pc.index + 1 < this_func.code.size());
+                    for (size_t k = 1; k <= pc.index; ++k) {
+                        assert(this_func.code[at + k].op == Operation::br);
+                    }
+                    break;
+                }
             }
         }
     }
@@ -1,7 +1,10 @@
 #pragma once
+#include <stddef.h>
 #include <stdint.h>
 #include <vector>
 #include <algorithm>
+#include <initializer_list>
+#include <memory>
 #include <string>
 #include <iostream>
 #include "instruction.h"
@@ -9,13 +12,70 @@
 namespace rvm {
 namespace assembly {
 
+// Stream format, read by Assembly::parse().
 static constexpr uint32_t MAGIC_NUMBER = 0xBADDCAFE;
+// Image format, mapped by Assembly::load(); see image.cpp.
+static constexpr uint32_t IMAGE_MAGIC_NUMBER = 0xBADDC0DE;
+static constexpr uint32_t IMAGE_VERSION = 1;
 static constexpr index_t MAIN_FUNCTION_INDEX = 0;
 
+// A read-only array that either owns its elements or refers to them in
+// place, inside an image mapped by Assembly::load(). Modifying a view
+// copies it first.
+template <class T>
+class Sequence {
+public:
+    Sequence() = default;
+    Sequence(std::initializer_list<T> xs): owned(xs) {}
+    Sequence(std::vector<T> xs): owned(std::move(xs)) {}
+
+    // The caller keeps the `n` elements at `p` alive for every copy.
+    static Sequence view(const T* p, size_t n) {
+        auto re = Sequence{};
+        re.mapped = n != 0 ? p : nullptr;
+        re.mapped_size = n;
+        return re;
+    }
+
+    size_t size() const {
+        return mapped != nullptr ? mapped_size : owned.size();
+    }
+    bool empty() const {
+        return size() == 0;
+    }
+    const T* data() const {
+        return mapped != nullptr ? mapped : owned.data();
+    }
+    const T& operator[](size_t i) const {
+        return data()[i];
+    }
+    const T& back() const {
+        return data()[size() - 1];
+    }
+    const T* begin() const {
+        return data();
+    }
+    const T* end() const {
+        return data() + size();
+    }
+    void push_back(const T& x) {
+        if (mapped != nullptr) {
+            owned.assign(mapped, mapped + mapped_size);
+            mapped = nullptr;
+        }
+        owned.push_back(x);
+    }
+
+private:
+    std::vector<T> owned{};
+    const T* mapped{nullptr};
+    size_t mapped_size{0};
+};
+
 struct ConstructorInfo {
     sindex_t num_fields;
 };
-using AdtInfo = std::vector<ConstructorInfo>;
+using AdtInfo = Sequence<ConstructorInfo>;
 using AdtTable = std::vector<AdtInfo>;
 
 enum class ConstantType: sindex_t {
@@ -42,7 +102,7 @@ struct ConstantInfo {
 };
 using ConstantTable = std::vector<ConstantInfo>;
 
-using Bytecode = std::vector<Instruction>;
+using Bytecode = Sequence<Instruction>;
 struct FunctionInfo {
     index_t num_args;
     index_t num_locals;
@@ -56,12 +116,24 @@ struct Assembly {
     AdtTable adt_table;
     ConstantTable constant_table;
     FunctionTable function_table;
+    // What the tables of a loaded image refer to, shared by all copies.
+    std::shared_ptr<const void> storage{};
 
+    // Reads an assembly and leaves the stream right after it. A seekable
+    // stream is read into memory in one go, others as the format asks for
+    // bytes, so parsing stops at the end of the assembly on pipes too.
     static Assembly parse(std::istream&);
+    static Assembly parse(const uint8_t* data, size_t size);
+    // Maps an image file and uses its code and constructor tables in
+    // place; pages are read as they are touched. Files in the stream
+    // format are parsed instead.
+    static Assembly load(const std::string& path);
 };
 
 void validate(const Assembly&);
 void dump(const Assembly&, std::ostream&);
+std::vector<uint8_t> dump(const Assembly&);
+void dump_image(const Assembly&, std::ostream&);
 
 }
 }
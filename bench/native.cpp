@@ -0,0 +1,105 @@
+// Throughput of callnative: a loop calling a two-argument native, through
+// the raw NativeFunction interface and through native<>() wrappers, with
+// each engine.
+//
+//   g++ -std=c++17 -O2 -I.. native.cpp ../assembly.cpp ../image.cpp ../interpreter.cpp
+//       ../decoder.cpp ../threaded.cpp ../fusion.cpp ../analysis.cpp ../verifier.cpp
+//       ../jit.cpp ../heap.cpp ../vm_stack.cpp ../module.cpp ../profile.cpp -o native
+//   ./native [iterations]
+#include <chrono>
+#include <iostream>
+#include <stdlib.h>
+#include <string>
+#include "../interpreter.h"
+
+using namespace rvm;
+using namespace rvm::assembly;
+using namespace rvm::interpreter;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+Operand raw_add(Operand* args, void*) {
+    return Operand{static_cast<int32_t>(args[0].int32 + args[1].int32)};
+}
+
+int32_t typed_add(int32_t x, int32_t y) {
+    return x + y;
+}
+
+int32_t nothrow_add(int32_t x, int32_t y) noexcept {
+    return x + y;
+}
+
+struct Counter {
+    int64_t calls;
+};
+
+int32_t counted_add(Counter* c, int32_t x, int32_t y) noexcept {
+    ++c->calls;
+    return x + y;
+}
+
+// acc = 0; for (i = 0; i < n; ++i) acc = native(acc, i); return acc
+Assembly loop(int32_t n) {
+    auto code = Bytecode{
+        Instruction{Operation::ldc, 0}, Instruction{Operation::stloc, 0},
+        Instruction{Operation::ldc, 0}, Instruction{Operation::stloc, 1},
+        Instruction{Operation::ldloc, 1}, Instruction{Operation::ldloc, 0},
+        Instruction{Operation::callnative, 0}, Instruction{Operation::stloc, 1},
+        Instruction{Operation::ldloc, 0}, Instruction{Operation::ldc, 1},
+        Instruction{Operation::add, OperandType::int32}, Instruction{Operation::stloc, 0},
+        Instruction{Operation::ldloc, 0}, Instruction{Operation::ldc, 2},
+        Instruction{Operation::tlt, OperandType::int32}, Instruction{Operation::brtrue, 4},
+        Instruction{Operation::ldloc, 1}, Instruction{Operation::ret}};
+    return Assembly{{}, {ConstantInfo{0}, ConstantInfo{1}, ConstantInfo{n}}, {FunctionInfo{0, 2, code}}};
+}
+
+double seconds(const Assembly& a, Options o, NativeInfo native, int32_t* result) {
+    auto vm = Interpreter{a, o};
+    vm.add_native_function(native);
+    auto start = Clock::now();
+    vm.run();
+    auto t = std::chrono::duration<double>(Clock::now() - start).count();
+    *result = vm.result().int32;
+    return t;
+}
+
+}
+
+int main(int argc, char** argv) {
+    auto n = argc > 1 ? static_cast<int32_t>(strtol(argv[1], nullptr, 10)) : 20000000;
+    auto a = loop(n);
+    auto counter = Counter{0};
+    struct {
+        const char* name;
+        NativeInfo native;
+    } natives[] = {
+        {"raw       ", NativeInfo{raw_add, 2}},
+        {"typed     ", native<typed_add>()},
+        {"noexcept  ", native<nothrow_add>()},
+        {"userdata  ", native<counted_add>(&counter)},
+    };
+    struct {
+        const char* name;
+        Options options;
+    } engines[3];
+    engines[0].name = "switch";
+    engines[0].options.dispatch = Dispatch::switch_loop;
+    engines[1].name = "threaded";
+    engines[1].options.jit = false;
+    engines[2].name = "jit";
+    engines[2].options.jit_threshold = 1;
+
+    auto checksum = int64_t{0};
+    for (auto&& e : engines) {
+        for (auto&& native : natives) {
+            auto result = int32_t{0};
+            auto t = seconds(a, e.options, native.native, &result);
+            checksum += result;
+            std::cout << native.name << e.name << "\t" << n / t / 1e6 << " M calls/s\n";
+        }
+    }
+    return checksum == 0 && counter.calls == 0;
+}
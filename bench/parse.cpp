@@ -0,0 +1,97 @@
+// Throughput of the stream format: dump() and parse() of a synthetic
+// assembly of a few megabytes, through string streams and directly on
+// memory buffers.
+//
+//   g++ -std=c++17 -O2 -I.. parse.cpp ../assembly.cpp ../image.cpp -o parse
+//   ./parse [functions] [instructions per function]
+#include <chrono>
+#include <iostream>
+#include <sstream>
+#include <stdlib.h>
+#include "../assembly.h"
+
+using namespace rvm;
+using namespace rvm::assembly;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+Assembly synthetic(size_t num_functions, size_t code_size) {
+    auto re = Assembly{};
+    for (sindex_t i = 0; i < 64; ++i) {
+        re.adt_table.push_back(AdtInfo{ConstructorInfo{0}, ConstructorInfo{i}, ConstructorInfo{2}});
+    }
+    for (int32_t i = 0; i < 4096; ++i) {
+        if (i % 4 == 3) {
+            auto fields = new ConstantInfo[2]{ConstantInfo{i}, ConstantInfo{static_cast<int8_t>(i)}};
+            re.constant_table.push_back(ConstantInfo{AdtConstant{static_cast<index_t>(i % 64), 2, 2, fields}});
+        }
+        else {
+            re.constant_table.push_back(ConstantInfo{i});
+        }
+    }
+    for (size_t f = 0; f < num_functions; ++f) {
+        auto code = std::vector<Instruction>{};
+        code.reserve(code_size);
+        for (size_t pc = 0; pc < code_size; ++pc) {
+            switch (pc % 4) {
+                case 0: code.push_back(Instruction{Operation::ldloc, static_cast<index_t>(pc % 8)}); break;
+                case 1: code.push_back(Instruction{Operation::ldc, static_cast<index_t>(pc % 4096)}); break;
+                case 2: code.push_back(Instruction{Operation::add, OperandType::int32}); break;
+                case 3: code.push_back(Instruction{Operation::stloc, static_cast<index_t>(pc % 8)}); break;
+            }
+        }
+        re.function_table.push_back(FunctionInfo{2, 8, Bytecode(std::move(code))});
+    }
+    return re;
+}
+
+template <class F>
+double best_seconds(F f) {
+    auto best = 1e30;
+    for (auto i = 0; i < 5; ++i) {
+        auto start = Clock::now();
+        f();
+        best = std::min(best, std::chrono::duration<double>(Clock::now() - start).count());
+    }
+    return best;
+}
+
+}
+
+int main(int argc, char** argv) {
+    auto num_functions = argc > 1 ? strtoul(argv[1], nullptr, 10) : 1000;
+    auto code_size = argc > 2 ? strtoul(argv[2], nullptr, 10) : 4000;
+    auto a = synthetic(num_functions, code_size);
+
+    auto image = std::string{};
+    auto dump_time = best_seconds([&] {
+        auto out = std::ostringstream{};
+        dump(a, out);
+        image = out.str();
+    });
+    auto size = 0.0;
+    auto parse_time = best_seconds([&] {
+        auto in = std::istringstream{image};
+        auto b = Assembly::parse(in);
+        size += b.function_table.size();
+    });
+
+    auto buffer = std::vector<uint8_t>{};
+    auto dump_buffer_time = best_seconds([&] {
+        buffer = dump(a);
+    });
+    auto parse_buffer_time = best_seconds([&] {
+        auto b = Assembly::parse(buffer.data(), buffer.size());
+        size += b.function_table.size();
+    });
+
+    auto mb = image.size() / 1e6;
+    std::cout << "image          " << mb << " MB\n"
+              << "dump  (stream) " << mb / dump_time << " MB/s\n"
+              << "parse (stream) " << mb / parse_time << " MB/s\n"
+              << "dump  (buffer) " << mb / dump_buffer_time << " MB/s\n"
+              << "parse (buffer) " << mb / parse_buffer_time << " MB/s\n";
+    return size == 0;
+}
@@ -0,0 +1,616 @@
+// The benchmark suite: dispatch of single operations, calls, allocation
+// heavy list and tree workloads, callnative, matches on a constructor, and
+// dump()/parse() of the stream format, each program built in code. Every benchmark runs with
+// every engine in a child process of its own, so peak RSS is its own, and
+// reports the best of a few timed runs after a warm-up.
+//
+//   g++ -std=c++17 -O2 -I.. suite.cpp ../assembly.cpp ../image.cpp ../interpreter.cpp
+//       ../decoder.cpp ../threaded.cpp ../fusion.cpp ../analysis.cpp ../verifier.cpp
+//       ../jit.cpp ../heap.cpp ../vm_stack.cpp ../module.cpp ../profile.cpp -o suite
+//   ./suite [--filter substring] [--repeat n] > baseline.tsv
+//   ./suite --baseline baseline.tsv [--threshold percent]
+//
+// From the top of the tree, `make baseline` writes build/baseline.tsv and
+// `make bench BASELINE=build/baseline.tsv` compares against it. No baseline
+// is kept in the tree: the numbers only compare on the machine that
+// measured them.
+//
+// Output is tab-separated, one line per benchmark and engine: the
+// bytecode instructions one run executes (counted by a profiled run) or,
+// for dump and parse, the instructions in the image; nanoseconds per
+// instruction; instructions per second; and peak RSS in KiB. With
+// --baseline the ns/op of the same benchmark in the baseline and the change
+// are appended, and the exit status is 1 if anything got slower by more
+// than the threshold, 10% unless given.
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+#include "../interpreter.h"
+
+using namespace rvm;
+using namespace rvm::assembly;
+using namespace rvm::interpreter;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+using O = Operation;
+using T = OperandType;
+
+struct Measurement {
+    uint64_t ops;
+    double seconds;
+};
+
+struct Benchmark {
+    std::string name;
+    // runs the benchmark `repeat` times with `engine`, returning the best
+    std::function<Measurement(const std::string& engine, int repeat)> run;
+    std::vector<std::string> engines;
+};
+
+const std::vector<std::string> all_engines = {"switch", "threaded", "unchecked", "jit"};
+
+Options engine_options(const std::string& engine) {
+    auto o = Options{};
+    if (engine == "switch") {
+        o.dispatch = Dispatch::switch_loop;
+    }
+    else if (engine == "threaded") {
+        o.jit = false;
+    }
+    else if (engine == "unchecked") {
+        o.jit = false;
+        o.unchecked = true;
+    }
+    return o;
+}
+
+int32_t mix(int32_t x, int32_t y) {
+    return x ^ y;
+}
+
+void add_natives(Interpreter& vm) {
+    vm.add_native_function(native<mix>());
+}
+
+// Instructions a run of `a` executes, as the reference loop counts them.
+uint64_t count_instructions(const Assembly& a) {
+    auto o = Options{};
+    o.record_profile = true;
+    auto vm = Interpreter{a, o};
+    add_natives(vm);
+    vm.run();
+    auto n = uint64_t{0};
+    for (auto c : vm.detailed_profile().operations) {
+        n += c;
+    }
+    return n;
+}
+
+// Runs MAIN once to warm up, JIT included, then `repeat` more times.
+Measurement measure(const Assembly& a, const std::string& engine, int repeat) {
+    auto ops = count_instructions(a);
+    auto vm = Interpreter{a, engine_options(engine)};
+    add_natives(vm);
+    vm.run();
+    auto best = 1e30;
+    for (auto i = 0; i < repeat; ++i) {
+        vm.restart(MAIN_FUNCTION_INDEX, {});
+        auto start = Clock::now();
+        vm.run();
+        best = std::min(best, std::chrono::duration<double>(Clock::now() - start).count());
+    }
+    return Measurement{ops, best};
+}
+
+// Constants and locals of the dispatch loops.
+enum : index_t {
+    c_zero, c_one, c_count, c_seed, c_true,
+};
+enum : index_t {
+    l_i, l_x, l_one, l_scratch, l_true,
+};
+
+// for (i = 0; i < count; ++i) { 16 x body } return x
+Assembly dispatch_loop(const std::function<void(std::vector<Instruction>&)>& body, int32_t count) {
+    auto code = std::vector<Instruction>{
+        Instruction{O::ldc, c_zero}, Instruction{O::stloc, l_i},
+        Instruction{O::ldc, c_seed}, Instruction{O::stloc, l_x},
+        Instruction{O::ldc, c_one}, Instruction{O::stloc, l_one},
+        Instruction{O::ldc, c_true}, Instruction{O::stloc, l_true}};
+    auto head = static_cast<index_t>(code.size());
+    for (auto i = 0; i < 16; ++i) {
+        body(code);
+    }
+    code.insert(code.end(), {
+        Instruction{O::ldloc, l_i}, Instruction{O::ldc, c_one},
+        Instruction{O::add, T::int32}, Instruction{O::stloc, l_i},
+        Instruction{O::ldloc, l_i}, Instruction{O::ldc, c_count},
+        Instruction{O::tlt, T::int32}, Instruction{O::brtrue, head},
+        Instruction{O::ldloc, l_x}, Instruction{O::ret}});
+    auto constants = ConstantTable{
+        ConstantInfo{0}, ConstantInfo{1}, ConstantInfo{count}, ConstantInfo{1000003},
+        ConstantInfo{static_cast<int8_t>(1)}};
+    return Assembly{{}, constants, {FunctionInfo{0, 5, Bytecode(std::move(code))}}};
+}
+
+// x = x op 1
+std::function<void(std::vector<Instruction>&)> binary(Operation op) {
+    return [op](std::vector<Instruction>& code) {
+        code.insert(code.end(), {
+            Instruction{O::ldloc, l_x}, Instruction{O::ldloc, l_one},
+            Instruction{op, T::int32}, Instruction{O::stloc, l_x}});
+    };
+}
+
+std::vector<std::pair<std::string, std::function<void(std::vector<Instruction>&)>>> dispatch_bodies() {
+    using Code = std::vector<Instruction>;
+    return {
+        {"ldloc_stloc", [](Code& c) {
+            c.insert(c.end(), {Instruction{O::ldloc, l_x}, Instruction{O::stloc, l_scratch}});
+        }},
+        {"ldc", [](Code& c) {
+            c.insert(c.end(), {Instruction{O::ldc, c_seed}, Instruction{O::stloc, l_scratch}});
+        }},
+        {"dup_drop", [](Code& c) {
+            c.insert(c.end(), {Instruction{O::ldloc, l_x}, Instruction{O::dup}, Instruction{O::drop},
+                               Instruction{O::stloc, l_scratch}});
+        }},
+        {"add", binary(O::add)},
+        {"sub", binary(O::sub)},
+        {"mul", binary(O::mul)},
+        {"div", binary(O::div)},
+        {"rem", binary(O::rem)},
+        {"band", binary(O::band)},
+        {"bor", binary(O::bor)},
+        {"bxor", binary(O::bxor)},
+        {"bnot", [](Code& c) {
+            c.insert(c.end(), {Instruction{O::ldloc, l_x}, Instruction{O::bnot, T::int32},
+                               Instruction{O::stloc, l_x}});
+        }},
+        {"tlt", [](Code& c) {
+            c.insert(c.end(), {Instruction{O::ldloc, l_x}, Instruction{O::ldloc, l_one},
+                               Instruction{O::tlt, T::int32}, Instruction{O::stloc, l_scratch}});
+        }},
+        {"br", [](Code& c) {
+            c.push_back(Instruction{O::br, static_cast<index_t>(c.size() + 1)});
+        }},
+        {"brtrue", [](Code& c) {
+            c.insert(c.end(), {Instruction{O::ldloc, l_true},
+                               Instruction{O::brtrue, static_cast<index_t>(c.size() + 2)}});
+        }},
+        {"ldloca_ldind", [](Code& c) {
+            c.insert(c.end(), {Instruction{O::ldloca, l_x}, Instruction{O::ldind},
+                               Instruction{O::stloc, l_scratch}});
+        }},
+    };
+}
+
+// for (i = 0; i < count; ++i) { 8 x f(i) } with f(x) = x; `indirect` calls
+// f through calla, with f kept in a local so its origin is not visible at
+// the call site
+Assembly leaf_calls(int32_t count, bool indirect) {
+    auto code = std::vector<Instruction>{Instruction{O::ldfuna, 1}, Instruction{O::stloc, 1},
+                                         Instruction{O::ldc, 0}, Instruction{O::stloc, 0}};
+    auto loop = static_cast<index_t>(code.size());
+    for (auto i = 0; i < 8; ++i) {
+        code.push_back(Instruction{O::ldloc, 0});
+        if (indirect) {
+            code.insert(code.end(), {Instruction{O::ldloc, 1}, Instruction{O::calla}});
+        }
+        else {
+            code.push_back(Instruction{O::call, 1});
+        }
+        code.push_back(Instruction{O::drop});
+    }
+    code.insert(code.end(), {
+        Instruction{O::ldloc, 0}, Instruction{O::ldc, 1}, Instruction{O::add, T::int32},
+        Instruction{O::stloc, 0}, Instruction{O::ldloc, 0}, Instruction{O::ldc, 2},
+        Instruction{O::tlt, T::int32}, Instruction{O::brtrue, loop},
+        Instruction{O::ldloc, 0}, Instruction{O::ret}});
+    auto leaf = Bytecode{Instruction{O::ldarg, 0}, Instruction{O::ret}};
+    return Assembly{{}, {ConstantInfo{0}, ConstantInfo{1}, ConstantInfo{count}},
+                    {FunctionInfo{0, 2, Bytecode(std::move(code))}, FunctionInfo{1, 0, leaf}}};
+}
+
+// `count` times depth(d), which recurses d calls deep:
+//   depth(d) = d != 0 ? depth(d - 1) + 1 : 0
+Assembly deep_calls(int32_t d, int32_t count) {
+    auto main = Bytecode{
+        Instruction{O::ldc, 0}, Instruction{O::stloc, 0}, Instruction{O::ldc, 0}, Instruction{O::stloc, 1},
+        Instruction{O::ldc, 3}, Instruction{O::call, 1}, Instruction{O::ldloc, 1},     // 4
+        Instruction{O::add, T::int32}, Instruction{O::stloc, 1},
+        Instruction{O::ldloc, 0}, Instruction{O::ldc, 1}, Instruction{O::add, T::int32},
+        Instruction{O::stloc, 0}, Instruction{O::ldloc, 0}, Instruction{O::ldc, 2},
+        Instruction{O::tlt, T::int32}, Instruction{O::brtrue, 4},
+        Instruction{O::ldloc, 1}, Instruction{O::ret}};
+    auto depth = Bytecode{
+        Instruction{O::ldarg, 0}, Instruction{O::ldc, 0}, Instruction{O::tne, T::int32},
+        Instruction{O::brtrue, 6}, Instruction{O::ldc, 0}, Instruction{O::ret},
+        Instruction{O::ldarg, 0}, Instruction{O::ldc, 1}, Instruction{O::sub, T::int32},  // 6
+        Instruction{O::call, 1}, Instruction{O::ldc, 1}, Instruction{O::add, T::int32},
+        Instruction{O::ret}};
+    return Assembly{{}, {ConstantInfo{0}, ConstantInfo{1}, ConstantInfo{count}, ConstantInfo{d}},
+                    {FunctionInfo{0, 2, main}, FunctionInfo{1, 0, depth}}};
+}
+
+// countdown(n) = n != 0 ? countdown(n - 1) : 0, as a tail call
+Assembly tail_calls(int32_t n) {
+    auto main = Bytecode{Instruction{O::ldc, 2}, Instruction{O::call, 1}, Instruction{O::ret}};
+    auto countdown = Bytecode{
+        Instruction{O::ldarg, 0}, Instruction{O::ldc, 0}, Instruction{O::tne, T::int32},
+        Instruction{O::brtrue, 6}, Instruction{O::ldc, 0}, Instruction{O::ret},
+        Instruction{O::ldarg, 0}, Instruction{O::ldc, 1}, Instruction{O::sub, T::int32},  // 6
+        Instruction{O::tailcall, 1}};
+    return Assembly{{}, {ConstantInfo{0}, ConstantInfo{1}, ConstantInfo{n}},
+                    {FunctionInfo{0, 0, main}, FunctionInfo{1, 0, countdown}}};
+}
+
+// list = nil | cons(int, list)
+const AdtTable list_adts = {AdtInfo{ConstructorInfo{0}, ConstructorInfo{2}}};
+
+// `rounds` times: build a list of `length` cells, then sum it in a loop
+Assembly lists(int32_t length, int32_t rounds) {
+    auto main = Bytecode{
+        Instruction{O::ldc, 0}, Instruction{O::stloc, 0},                                 // round = 0
+        Instruction{O::ldc, 0}, Instruction{O::stloc, 4},                                 // total = 0
+        Instruction{O::mkadt, 0, 0}, Instruction{O::stloc, 2},                            // 4: l = nil
+        Instruction{O::ldc, 0}, Instruction{O::stloc, 1},                                 // i = 0
+        Instruction{O::ldloc, 1}, Instruction{O::ldloc, 2}, Instruction{O::mkadt, 0, 1},  // 8: l = cons(i, l)
+        Instruction{O::stloc, 2},
+        Instruction{O::ldloc, 1}, Instruction{O::ldc, 1}, Instruction{O::add, T::int32},
+        Instruction{O::stloc, 1}, Instruction{O::ldloc, 1}, Instruction{O::ldc, 2},
+        Instruction{O::tlt, T::int32}, Instruction{O::brtrue, 8},
+        Instruction{O::ldloc, 2}, Instruction{O::ldctor}, Instruction{O::ldc, 0},         // 20: while l is a cons
+        Instruction{O::teq, T::int32}, Instruction{O::brtrue, 34},
+        Instruction{O::ldloc, 2}, Instruction{O::ldfld, 0}, Instruction{O::ldloc, 4},     // total += head
+        Instruction{O::add, T::int32}, Instruction{O::stloc, 4},
+        Instruction{O::ldloc, 2}, Instruction{O::ldfld, 1}, Instruction{O::stloc, 2},     // l = tail
+        Instruction{O::br, 20},
+        Instruction{O::ldloc, 0}, Instruction{O::ldc, 1}, Instruction{O::add, T::int32},  // 34
+        Instruction{O::stloc, 0}, Instruction{O::ldloc, 0}, Instruction{O::ldc, 3},
+        Instruction{O::tlt, T::int32}, Instruction{O::brtrue, 4},
+        Instruction{O::ldloc, 4}, Instruction{O::ret}};
+    return Assembly{list_adts, {ConstantInfo{0}, ConstantInfo{1}, ConstantInfo{length}, ConstantInfo{rounds}},
+                    {FunctionInfo{0, 5, main}}};
+}
+
+// tree = leaf | node(tree, tree)
+const AdtTable tree_adts = {AdtInfo{ConstructorInfo{0}, ConstructorInfo{2}}};
+
+// `rounds` times count(make(depth)), the binary-trees workload:
+//   make(d) = d != 0 ? node(make(d - 1), make(d - 1)) : leaf
+//   count(t) = t is a node ? count(left) + count(right) + 1 : 1
+Assembly trees(int32_t depth, int32_t rounds) {
+    auto main = Bytecode{
+        Instruction{O::ldc, 0}, Instruction{O::stloc, 0}, Instruction{O::ldc, 0}, Instruction{O::stloc, 1},
+        Instruction{O::ldc, 3}, Instruction{O::call, 1}, Instruction{O::call, 2},        // 4
+        Instruction{O::ldloc, 1}, Instruction{O::add, T::int32}, Instruction{O::stloc, 1},
+        Instruction{O::ldloc, 0}, Instruction{O::ldc, 1}, Instruction{O::add, T::int32},
+        Instruction{O::stloc, 0}, Instruction{O::ldloc, 0}, Instruction{O::ldc, 2},
+        Instruction{O::tlt, T::int32}, Instruction{O::brtrue, 4},
+        Instruction{O::ldloc, 1}, Instruction{O::ret}};
+    auto make = Bytecode{
+        Instruction{O::ldarg, 0}, Instruction{O::ldc, 0}, Instruction{O::tne, T::int32},
+        Instruction{O::brtrue, 6}, Instruction{O::mkadt, 0, 0}, Instruction{O::ret},
+        Instruction{O::ldarg, 0}, Instruction{O::ldc, 1}, Instruction{O::sub, T::int32},  // 6
+        Instruction{O::dup}, Instruction{O::stloc, 0}, Instruction{O::call, 1},
+        Instruction{O::ldloc, 0}, Instruction{O::call, 1}, Instruction{O::mkadt, 0, 1},
+        Instruction{O::ret}};
+    auto count = Bytecode{
+        Instruction{O::ldarg, 0}, Instruction{O::ldctor}, Instruction{O::ldc, 0},
+        Instruction{O::teq, T::int32}, Instruction{O::brtrue, 15},
+        Instruction{O::ldarg, 0}, Instruction{O::ldfld, 0}, Instruction{O::call, 2},
+        Instruction{O::ldarg, 0}, Instruction{O::ldfld, 1}, Instruction{O::call, 2},
+        Instruction{O::add, T::int32}, Instruction{O::ldc, 1}, Instruction{O::add, T::int32},
+        Instruction{O::ret}, Instruction{O::ldc, 1}, Instruction{O::ret}};  // 15
+    return Assembly{tree_adts, {ConstantInfo{0}, ConstantInfo{1}, ConstantInfo{rounds}, ConstantInfo{depth}},
+                    {FunctionInfo{0, 2, main}, FunctionInfo{1, 1, make}, FunctionInfo{1, 0, count}}};
+}
+
+// color = c0 | c1 | ... | c23
+const AdtTable color_adts = {AdtInfo(std::vector<ConstructorInfo>(24, ConstructorInfo{0}))};
+
+// for (i = 0; i < count; ++i) sum += match colors[i % 24] { cj => j }, the
+// colors kept in locals 0 .. 23; `table` matches with switchctor, otherwise
+// with a chain of ldctor comparisons
+Assembly matches(int32_t count, bool table) {
+    enum : index_t { l_i = 24, l_sum, c_num = 24, c_count };
+    auto code = std::vector<Instruction>{};
+    for (index_t j = 0; j < 24; ++j) {
+        code.insert(code.end(), {Instruction{O::mkadt, 0, static_cast<sindex_t>(j)}, Instruction{O::stloc, j}});
+    }
+    code.insert(code.end(), {
+        Instruction{O::ldc, 0}, Instruction{O::stloc, l_i}, Instruction{O::ldc, 0}, Instruction{O::stloc, l_sum}});
+    auto loop = static_cast<index_t>(code.size());
+    code.insert(code.end(), {
+        Instruction{O::ldloca, 0}, Instruction{O::ldloc, l_i}, Instruction{O::ldc, c_num},
+        Instruction{O::rem, T::int32}, Instruction{O::add, T::int32}, Instruction{O::ldind}});
+    // the branches to case j, patched once the cases are laid out
+    auto cases = std::vector<size_t>{};
+    if (table) {
+        code.push_back(Instruction{O::switchctor, 24});
+        for (auto j = 0; j < 24; ++j) {
+            cases.push_back(code.size());
+            code.push_back(Instruction{O::br, 0});
+        }
+    }
+    else {
+        code.push_back(Instruction{O::ldctor});
+        for (index_t j = 0; j < 24; ++j) {
+            code.insert(code.end(), {Instruction{O::dup}, Instruction{O::ldc, j}, Instruction{O::teq, T::int32}});
+            cases.push_back(code.size());
+            code.push_back(Instruction{O::brtrue, 0});
+        }
+        code.push_back(Instruction{O::drop});
+    }
+    // the chain leaves the constructor index on the stack
+    auto case_size = table ? 2 : 3;
+    auto add = static_cast<index_t>(code.size() + 2 + case_size * 24);
+    code.insert(code.end(), {Instruction{O::ldc, 0}, Instruction{O::br, add}});
+    for (index_t j = 0; j < 24; ++j) {
+        code[cases[j]] = Instruction{code[cases[j]].op, static_cast<index_t>(code.size())};
+        if (!table) {
+            code.push_back(Instruction{O::drop});
+        }
+        code.insert(code.end(), {Instruction{O::ldc, j}, Instruction{O::br, add}});
+    }
+    code.insert(code.end(), {
+        Instruction{O::ldloc, l_sum}, Instruction{O::add, T::int32}, Instruction{O::stloc, l_sum},
+        Instruction{O::ldloc, l_i}, Instruction{O::ldc, 1}, Instruction{O::add, T::int32},
+        Instruction{O::stloc, l_i}, Instruction{O::ldloc, l_i}, Instruction{O::ldc, c_count},
+        Instruction{O::tlt, T::int32}, Instruction{O::brtrue, loop},
+        Instruction{O::ldloc, l_sum}, Instruction{O::ret}});
+    auto constants = ConstantTable{};
+    for (auto j = 0; j < 24; ++j) {
+        constants.push_back(ConstantInfo{j});
+    }
+    constants.insert(constants.end(), {ConstantInfo{24}, ConstantInfo{count}});
+    return Assembly{color_adts, constants, {FunctionInfo{0, 26, Bytecode(std::move(code))}}};
+}
+
+// for (i = 0; i < count; ++i) acc = mix(acc, i)
+Assembly native_calls(int32_t count) {
+    auto code = Bytecode{
+        Instruction{O::ldc, 0}, Instruction{O::stloc, 0}, Instruction{O::ldc, 0}, Instruction{O::stloc, 1},
+        Instruction{O::ldloc, 1}, Instruction{O::ldloc, 0}, Instruction{O::callnative, 0},  // 4
+        Instruction{O::stloc, 1},
+        Instruction{O::ldloc, 0}, Instruction{O::ldc, 1}, Instruction{O::add, T::int32}, Instruction{O::stloc, 0},
+        Instruction{O::ldloc, 0}, Instruction{O::ldc, 2}, Instruction{O::tlt, T::int32},
+        Instruction{O::brtrue, 4},
+        Instruction{O::ldloc, 1}, Instruction{O::ret}};
+    return Assembly{{}, {ConstantInfo{0}, ConstantInfo{1}, ConstantInfo{count}}, {FunctionInfo{0, 2, code}}};
+}
+
+// what bench/parse.cpp reads and writes, smaller
+Assembly image_source() {
+    auto re = Assembly{};
+    for (sindex_t i = 0; i < 64; ++i) {
+        re.adt_table.push_back(AdtInfo{ConstructorInfo{0}, ConstructorInfo{i}, ConstructorInfo{2}});
+    }
+    for (int32_t i = 0; i < 4096; ++i) {
+        re.constant_table.push_back(ConstantInfo{i});
+    }
+    for (size_t f = 0; f < 200; ++f) {
+        auto code = std::vector<Instruction>{};
+        for (size_t pc = 0; pc < 4000; ++pc) {
+            switch (pc % 4) {
+                case 0: code.push_back(Instruction{O::ldloc, static_cast<index_t>(pc % 8)}); break;
+                case 1: code.push_back(Instruction{O::ldc, static_cast<index_t>(pc % 4096)}); break;
+                case 2: code.push_back(Instruction{O::add, T::int32}); break;
+                case 3: code.push_back(Instruction{O::stloc, static_cast<index_t>(pc % 8)}); break;
+            }
+        }
+        re.function_table.push_back(FunctionInfo{2, 8, Bytecode(std::move(code))});
+    }
+    return re;
+}
+
+Measurement measure_image(bool parse, const std::string& engine, int repeat) {
+    auto a = image_source();
+    auto ops = uint64_t{0};
+    for (auto&& f : a.function_table) {
+        ops += f.code.size();
+    }
+    auto image = std::string{};
+    {
+        auto out = std::ostringstream{};
+        dump(a, out);
+        image = out.str();
+    }
+    auto buffer = dump(a);
+    auto check = size_t{0};
+    auto best = 1e30;
+    for (auto i = 0; i <= repeat; ++i) {
+        auto start = Clock::now();
+        if (parse && engine == "stream") {
+            auto in = std::istringstream{image};
+            check += Assembly::parse(in).function_table.size();
+        }
+        else if (parse) {
+            check += Assembly::parse(buffer.data(), buffer.size()).function_table.size();
+        }
+        else if (engine == "stream") {
+            auto out = std::ostringstream{};
+            dump(a, out);
+            check += out.str().size();
+        }
+        else {
+            check += dump(a).size();
+        }
+        auto t = std::chrono::duration<double>(Clock::now() - start).count();
+        // the first run warms up
+        if (i > 0) {
+            best = std::min(best, t);
+        }
+    }
+    if (check == 0) {
+        abort();
+    }
+    return Measurement{ops, best};
+}
+
+std::vector<Benchmark> benchmarks() {
+    auto re = std::vector<Benchmark>{};
+    auto program = [&](std::string name, Assembly a) {
+        auto shared = std::make_shared<Assembly>(std::move(a));
+        re.push_back(Benchmark{std::move(name), [shared](const std::string& engine, int repeat) {
+            return measure(*shared, engine, repeat);
+        }, all_engines});
+    };
+    for (auto&& body : dispatch_bodies()) {
+        program("dispatch." + body.first, dispatch_loop(body.second, 200000));
+    }
+    program("call.leaf", leaf_calls(500000, false));
+    program("call.indirect", leaf_calls(500000, true));
+    program("call.depth10", deep_calls(10, 200000));
+    program("call.depth1000", deep_calls(1000, 2000));
+    program("call.depth100000", deep_calls(100000, 20));
+    program("call.tail", tail_calls(2000000));
+    program("alloc.list", lists(1000, 500));
+    program("alloc.tree", trees(16, 10));
+    program("native.call", native_calls(1000000));
+    program("match.chain", matches(500000, false));
+    program("match.table", matches(500000, true));
+    for (auto parse : {false, true}) {
+        re.push_back(Benchmark{parse ? "image.parse" : "image.dump", [parse](const std::string& engine, int repeat) {
+            return measure_image(parse, engine, repeat);
+        }, {"stream", "buffer"}});
+    }
+    return re;
+}
+
+// Runs one benchmark in a child process and prints its line.
+bool run_isolated(const Benchmark& b, const std::string& engine, int repeat,
+                  const std::map<std::string, double>& baseline, double threshold) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        perror("pipe");
+        exit(2);
+    }
+    auto child = fork();
+    if (child == 0) {
+        close(fds[0]);
+        auto line = std::string{};
+        try {
+            auto m = b.run(engine, repeat);
+            line = std::to_string(m.ops) + " " + std::to_string(m.seconds);
+        }
+        catch (...) {
+            line = "error";
+        }
+        auto written = write(fds[1], line.data(), line.size());
+        _exit(written == static_cast<ssize_t>(line.size()) ? 0 : 1);
+    }
+    close(fds[1]);
+    auto reply = std::string{};
+    char buf[256];
+    for (ssize_t n; (n = read(fds[0], buf, sizeof(buf))) > 0;) {
+        reply.append(buf, static_cast<size_t>(n));
+    }
+    close(fds[0]);
+    auto status = 0;
+    auto usage = rusage{};
+    wait4(child, &status, 0, &usage);
+
+    auto key = b.name + "\t" + engine;
+    auto ops = uint64_t{0};
+    auto seconds = 0.0;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0 || !(std::istringstream{reply} >> ops >> seconds)) {
+        std::cout << key << "\terror\n";
+        return false;
+    }
+    auto ns = seconds * 1e9 / static_cast<double>(ops);
+    std::cout << key << "\t" << ops << "\t" << ns << "\t" << static_cast<double>(ops) / seconds
+              << "\t" << usage.ru_maxrss;
+    auto found = baseline.find(key);
+    auto ok = true;
+    if (found != baseline.end()) {
+        auto change = 100 * (ns - found->second) / found->second;
+        ok = change <= threshold;
+        std::cout << "\t" << found->second << "\t" << (change >= 0 ? "+" : "") << change << "%"
+                  << (ok ? "" : "\tSLOWER");
+    }
+    std::cout << std::endl;
+    return ok;
+}
+
+// ns/op by "name\tengine" from an earlier run's output
+std::map<std::string, double> read_baseline(const char* path) {
+    auto in = std::ifstream{path};
+    if (!in) {
+        std::cerr << "cannot read " << path << "\n";
+        exit(2);
+    }
+    auto re = std::map<std::string, double>{};
+    for (std::string line; std::getline(in, line);) {
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        auto fields = std::vector<std::string>{};
+        auto s = std::istringstream{line};
+        for (std::string f; std::getline(s, f, '\t');) {
+            fields.push_back(f);
+        }
+        if (fields.size() >= 4 && fields[2] != "error") {
+            re[fields[0] + "\t" + fields[1]] = strtod(fields[3].c_str(), nullptr);
+        }
+    }
+    return re;
+}
+
+}
+
+int main(int argc, char** argv) {
+    auto filter = std::string{};
+    auto repeat = 5;
+    auto baseline = std::map<std::string, double>{};
+    auto threshold = 10.0;
+    for (auto i = 1; i < argc; ++i) {
+        auto arg = std::string{argv[i]};
+        if (i + 1 == argc) {
+            std::cerr << "usage: suite [--filter substring] [--repeat n] [--baseline file] [--threshold percent]\n";
+            return 2;
+        }
+        if (arg == "--filter") {
+            filter = argv[++i];
+        }
+        else if (arg == "--repeat") {
+            repeat = std::max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--baseline") {
+            baseline = read_baseline(argv[++i]);
+        }
+        else if (arg == "--threshold") {
+            threshold = strtod(argv[++i], nullptr);
+        }
+        else {
+            std::cerr << "unknown option " << arg << "\n";
+            return 2;
+        }
+    }
+
+    std::cout << "# name\tengine\tops\tns/op\tops/s\tpeak_rss_kb" << (baseline.empty() ? "" : "\tbaseline_ns/op\tchange")
+              << std::endl;
+    auto ok = true;
+    for (auto&& b : benchmarks()) {
+        if (b.name.find(filter) == std::string::npos) {
+            continue;
+        }
+        for (auto&& engine : b.engines) {
+            ok = run_isolated(b, engine, repeat, baseline, threshold) && ok;
+        }
+    }
+    return ok ? 0 : 1;
+}
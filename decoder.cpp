@@ -0,0 +1,111 @@
+#include "decoder.h"
+#include "vm_stack.h"
+
+using namespace rvm;
+using namespace rvm::interpreter;
+using namespace rvm::assembly;
+
+namespace {
+
+// Pointers are int32 stack indices, so they share the int32 handlers.
+Opcode typed(OperandType t, Opcode i8, Opcode i32) {
+    switch (t) {
+        case OperandType::int8: return i8;
+        case OperandType::int32:
+        case OperandType::pointer: return i32;
+        default: throw InvalidBytecodeError{};
+    }
+}
+
+Opcode opcode_of(const Instruction& i) {
+    switch (i.op) {
+        case Operation::add: return typed(i.type, Opcode::add_i8, Opcode::add_i32);
+        case Operation::sub: return typed(i.type, Opcode::sub_i8, Opcode::sub_i32);
+        case Operation::mul: return typed(i.type, Opcode::mul_i8, Opcode::mul_i32);
+        case Operation::div: return typed(i.type, Opcode::div_i8, Opcode::div_i32);
+        case Operation::rem: return typed(i.type, Opcode::rem_i8, Opcode::rem_i32);
+        case Operation::band: return typed(i.type, Opcode::band_i8, Opcode::band_i32);
+        case Operation::bor: return typed(i.type, Opcode::bor_i8, Opcode::bor_i32);
+        case Operation::bxor: return typed(i.type, Opcode::bxor_i8, Opcode::bxor_i32);
+        case Operation::bnot: return typed(i.type, Opcode::bnot_i8, Opcode::bnot_i32);
+        case Operation::dup: return Opcode::dup;
+        case Operation::drop: return Opcode::drop;
+        case Operation::ldc: return Opcode::ldc;
+        case Operation::ldloc: return Opcode::ldloc;
+        case Operation::stloc: return Opcode::stloc;
+        case Operation::ldarg: return Opcode::ldarg;
+        case Operation::starg: return Opcode::starg;
+        case Operation::call: return Opcode::call;
+        case Operation::callnative: return Opcode::callnative;
+        case Operation::ret: return Opcode::ret;
+        case Operation::ldloca: return Opcode::ldloca;
+        case Operation::ldarga: return Opcode::ldarga;
+        case Operation::ldfuna: return Opcode::ldfuna;
+        case Operation::calla: return Opcode::calla;
+        case Operation::ldind: return Opcode::ldind;
+        case Operation::stind: return Opcode::stind;
+        case Operation::teq: return Opcode::teq;
+        case Operation::tne: return Opcode::tne;
+        case Operation::tlt: return typed(i.type, Opcode::tlt_i8, Opcode::tlt_i32);
+        case Operation::tlt_un: return typed(i.type, Opcode::tlt_un_i8, Opcode::tlt_un_i32);
+        case Operation::tle: return typed(i.type, Opcode::tle_i8, Opcode::tle_i32);
+        case Operation::tle_un: return typed(i.type, Opcode::tle_un_i8, Opcode::tle_un_i32);
+        case Operation::tgt: return typed(i.type, Opcode::tgt_i8, Opcode::tgt_i32);
+        case Operation::tgt_un: return typed(i.type, Opcode::tgt_un_i8, Opcode::tgt_un_i32);
+        case Operation::tge: return typed(i.type, Opcode::tge_i8, Opcode::tge_i32);
+        case Operation::tge_un: return typed(i.type, Opcode::tge_un_i8, Opcode::tge_un_i32);
+        case Operation::br: return Opcode::br;
+        case Operation::brtrue: return Opcode::brtrue;
+        case Operation::mkadt: return Opcode::mkadt;
+        case Operation::dladt: return Opcode::dladt;
+        case Operation::ldctor: return Opcode::ldctor;
+        case Operation::ldfld: return Opcode::ldfld;
+        case Operation::stfld: return Opcode::stfld;
+        case Operation::tailcall: return Opcode::tailcall;
+        case Operation::tailcalla: return Opcode::tailcalla;
+        case Operation::switch_: return Opcode::switch_;
+        case Operation::switchctor: return Opcode::switchctor;
+    }
+    throw InvalidBytecodeError{};
+}
+
+}
+
+DecodedCode rvm::interpreter::decode(const Assembly& a, const FunctionInfo& f) {
+    auto re = DecodedCode(f.code.size());
+    for (size_t pc = 0; pc < f.code.size(); ++pc) {
+        auto&& in = f.code[pc];
+        auto&& out = re[pc];
+        out.op = opcode_of(in);
+        out.index = in.index;
+        out.index2 = in.index2;
+        switch (in.op) {
+            case Operation::drop:
+                // the operand stack of this frame starts after the locals
+                out.imm = f.num_locals;
+                break;
+            case Operation::ldarg:
+            case Operation::starg:
+            case Operation::ldarga:
+                // arguments sit below the frame header
+                out.imm = -FRAME_HEADER_SIZE - f.num_args + in.index;
+                break;
+            case Operation::ret:
+                out.imm = f.num_args;
+                break;
+            case Operation::call:
+                out.imm = a.function_table[in.index].num_locals;
+                break;
+            case Operation::tailcall:
+                out.imm = a.function_table[in.index].num_locals;
+                out.imm2 = a.function_table[in.index].num_args;
+                break;
+            case Operation::mkadt:
+                out.imm = a.adt_table[in.index][in.index2].num_fields;
+                break;
+            default:
+                break;
+        }
+    }
+    return re;
+}
@@ -0,0 +1,59 @@
+#pragma once
+#include <stdint.h>
+#include <vector>
+#include "instruction.h"
+#include "assembly.h"
+
+namespace rvm {
+namespace interpreter {
+
+// Internal opcodes executed by the threaded engine. The list is kept as an
+// X-macro so that the opcode enum and the label table of the run loop can
+// never drift apart. Instructions carrying an OperandType are lowered to one
+// opcode per type when decoding, so no handler looks at the type again.
+#define RVM_OPCODES(X) \
+    X(add_i8) X(add_i32) X(sub_i8) X(sub_i32) \
+    X(mul_i8) X(mul_i32) X(div_i8) X(div_i32) X(rem_i8) X(rem_i32) \
+    X(band_i8) X(band_i32) X(bor_i8) X(bor_i32) X(bxor_i8) X(bxor_i32) \
+    X(bnot_i8) X(bnot_i32) \
+    X(dup) X(drop) \
+    X(ldc) X(ldloc) X(stloc) X(ldarg) X(starg) \
+    X(call) X(callnative) X(ret) \
+    X(ldloca) X(ldarga) X(ldfuna) X(calla) X(ldind) X(stind) \
+    X(teq) X(tne) \
+    X(tlt_i8) X(tlt_i32) X(tlt_un_i8) X(tlt_un_i32) \
+    X(tle_i8) X(tle_i32) X(tle_un_i8) X(tle_un_i32) \
+    X(tgt_i8) X(tgt_i32) X(tgt_un_i8) X(tgt_un_i32) \
+    X(tge_i8) X(tge_i32) X(tge_un_i8) X(tge_un_i32) \
+    X(br) X(brtrue) \
+    X(mkadt) X(dladt) X(ldctor) X(ldfld) X(stfld) \
+    X(tailcall) X(tailcalla) X(switch_) X(switchctor) \
+    X(inc_local_by_const) X(add_local_const) X(ldloc_ldloc) X(stloc_ldloc) \
+    X(cmp_local_const_branch_lt) X(cmp_local_const_branch_le) \
+    X(cmp_local_const_branch_gt) X(cmp_local_const_branch_ge) \
+    X(cmp_local_const_branch_eq) X(cmp_local_const_branch_ne)
+
+enum class Opcode: uint8_t {
+#define RVM_OPCODE_ENUM(name) name,
+    RVM_OPCODES(RVM_OPCODE_ENUM)
+#undef RVM_OPCODE_ENUM
+};
+
+// One pre-decoded instruction. `handler` is the label address of the
+// opcode when the compiler supports labels-as-values, and is bound lazily
+// by the run loop. `imm` and `imm2` carry whatever the decoder could resolve
+// ahead of time (frame-relative offsets, field counts, constants, ...).
+struct DecodedInstruction {
+    const void* handler{nullptr};
+    int32_t imm{0};
+    int32_t imm2{0};
+    index_t index{0};
+    Opcode op;
+    sindex_t index2{0};
+};
+using DecodedCode = std::vector<DecodedInstruction>;
+
+DecodedCode decode(const assembly::Assembly&, const assembly::FunctionInfo&);
+
+}
+}
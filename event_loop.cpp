@@ -0,0 +1,176 @@
+#include "event_loop.h"
+#include <errno.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <utility>
+
+using namespace rvm;
+using namespace rvm::interpreter;
+
+EventLoop::EventLoop(uint64_t s): slice(s) {
+    epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll < 0) {
+        throw SystemError{errno};
+    }
+}
+
+EventLoop::~EventLoop() {
+    close(epoll);
+}
+
+void EventLoop::spawn(Interpreter& vm, Completion done) {
+    auto t = tasks.size();
+    if (!free_tasks.empty()) {
+        t = free_tasks.back();
+        free_tasks.pop_back();
+    }
+    else {
+        tasks.emplace_back();
+    }
+    tasks[t] = Task{&vm, std::move(done)};
+    runnable.push_back(t);
+}
+
+Operand EventLoop::start(Operation op) {
+    auto id = operations.size();
+    if (!free_operations.empty()) {
+        id = free_operations.back();
+        free_operations.pop_back();
+    }
+    else {
+        operations.emplace_back();
+    }
+    op.used = true;
+    operations[id] = std::move(op);
+    return Operand{static_cast<int32_t>(id)};
+}
+
+Operand EventLoop::watch(int fd, uint32_t events, std::function<Operand()> on_ready) {
+    auto token = start(Operation{std::move(on_ready), fd});
+    auto ev = epoll_event{};
+    ev.events = events | EPOLLONESHOT;
+    ev.data.u32 = static_cast<uint32_t>(token.int32);
+    if (epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        auto error = errno;
+        operations[token.int32] = Operation{};
+        free_operations.push_back(token.int32);
+        throw SystemError{error};
+    }
+    return token;
+}
+
+Operand EventLoop::ready(Operand result) {
+    auto op = Operation{};
+    op.completed = true;
+    op.result = result;
+    return start(std::move(op));
+}
+
+void EventLoop::run() {
+    while (!runnable.empty() || num_waiting > 0) {
+        // one turn for everything runnable, then whatever I/O is ready;
+        // only block when nothing is left to run
+        for (auto n = runnable.size(); n > 0; --n) {
+            auto t = runnable.front();
+            runnable.pop_front();
+            run_task(t);
+        }
+        if (num_waiting > 0) {
+            poll(runnable.empty() ? -1 : 0);
+        }
+    }
+}
+
+void EventLoop::run_task(size_t t) {
+    auto vm = tasks[t].vm;
+    auto status = RunStatus::finished;
+    try {
+        status = vm->run_for(slice);
+    }
+    catch (...) {
+        finish(t, std::current_exception());
+        return;
+    }
+    switch (status) {
+        case RunStatus::finished:
+            finish(t, nullptr);
+            break;
+        case RunStatus::suspended:
+            runnable.push_back(t);
+            break;
+        case RunStatus::waiting:
+        {
+            auto id = static_cast<size_t>(static_cast<uint32_t>(vm->pending().int32));
+            if (id >= operations.size() || !operations[id].used || operations[id].task >= 0) {
+                finish(t, std::make_exception_ptr(InvalidTokenError{}));
+                break;
+            }
+            operations[id].task = static_cast<int32_t>(t);
+            ++num_waiting;
+            if (operations[id].completed) {
+                complete(id, operations[id].result);
+            }
+            break;
+        }
+    }
+}
+
+void EventLoop::poll(int timeout) {
+    epoll_event events[64];
+    auto n = epoll_wait(epoll, events, 64, timeout);
+    if (n < 0) {
+        if (errno == EINTR) {
+            return;
+        }
+        throw SystemError{errno};
+    }
+    for (auto i = 0; i < n; ++i) {
+        auto id = static_cast<size_t>(events[i].data.u32);
+        epoll_ctl(epoll, EPOLL_CTL_DEL, operations[id].fd, nullptr);
+        // on_ready may start operations of its own
+        auto on_ready = std::move(operations[id].on_ready);
+        auto result = Operand{};
+        try {
+            result = on_ready();
+        }
+        catch (...) {
+            auto t = operations[id].task;
+            operations[id] = Operation{};
+            free_operations.push_back(id);
+            if (t >= 0) {
+                --num_waiting;
+                finish(static_cast<size_t>(t), std::current_exception());
+            }
+            continue;
+        }
+        if (operations[id].task < 0) {
+            // started by an interpreter this loop does not run; kept for
+            // when one waits for it
+            operations[id].completed = true;
+            operations[id].result = result;
+            continue;
+        }
+        complete(id, result);
+    }
+}
+
+void EventLoop::complete(size_t id, Operand result) {
+    auto t = static_cast<size_t>(operations[id].task);
+    operations[id] = Operation{};
+    free_operations.push_back(id);
+    --num_waiting;
+    tasks[t].vm->resume(result);
+    runnable.push_back(t);
+}
+
+void EventLoop::finish(size_t t, std::exception_ptr error) {
+    auto task = std::move(tasks[t]);
+    tasks[t] = Task{};
+    free_tasks.push_back(t);
+    if (task.done) {
+        task.done(*task.vm, error);
+    }
+    else if (error) {
+        std::rethrow_exception(error);
+    }
+}
@@ -0,0 +1,90 @@
+#pragma once
+#include <deque>
+#include <exception>
+#include <functional>
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include "operand.h"
+#include "interpreter.h"
+
+namespace rvm {
+namespace interpreter {
+
+// Runs many interpreters on one thread, Linux epoll underneath. Each takes
+// turns of run_for(slice); one that calls an async native waits off the
+// queue until the operation the native started completes, and then runs
+// on from the instruction after the callnative.
+//
+// Async natives get the loop as their userdata and start operations with
+// watch() or ready(), returning the token either gives back:
+//
+//     Operand read_int(EventLoop* loop, int32_t fd) {
+//         return loop->watch(fd, EPOLLIN, [fd] { ...read(fd)...; });
+//     }
+//     module->add_native_function(async_native<read_int>(&loop));
+class EventLoop {
+public:
+    struct SystemError {
+        int error;
+    };
+    // an async native returned something that is not a token of this loop
+    struct InvalidTokenError {};
+    // Called once an interpreter has finished, with the exception it threw
+    // if it failed.
+    using Completion = std::function<void(Interpreter&, std::exception_ptr)>;
+
+    explicit EventLoop(uint64_t slice = Interpreter::deadline_slice);
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+    ~EventLoop();
+
+    // The interpreter is run by run() and must outlive it.
+    void spawn(Interpreter&, Completion = Completion{});
+    // An operation that completes once `fd` is ready for `events`, with the
+    // value `on_ready` then returns. Only one operation may watch an fd at
+    // a time.
+    Operand watch(int fd, uint32_t events, std::function<Operand()> on_ready);
+    // An operation that has already completed with `result`.
+    Operand ready(Operand result);
+    // Runs until every spawned interpreter has finished.
+    void run();
+
+    // interpreters waiting for an operation
+    size_t waiting() const {
+        return num_waiting;
+    }
+
+private:
+    struct Task {
+        Interpreter* vm{nullptr};
+        Completion done{};
+    };
+    struct Operation {
+        std::function<Operand()> on_ready{};
+        int fd{-1};
+        bool completed{false};
+        Operand result{};
+        // the task waiting for it, -1 until its native has returned
+        int32_t task{-1};
+        bool used{false};
+    };
+
+    int epoll{-1};
+    uint64_t slice;
+    std::vector<Task> tasks{};
+    std::vector<size_t> free_tasks{};
+    std::deque<size_t> runnable{};
+    std::vector<Operation> operations{};
+    std::vector<size_t> free_operations{};
+    size_t num_waiting{0};
+
+    Operand start(Operation);
+    void run_task(size_t task);
+    void poll(int timeout);
+    void complete(size_t operation, Operand result);
+    void finish(size_t task, std::exception_ptr);
+};
+
+}
+}
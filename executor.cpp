@@ -0,0 +1,188 @@
+#include "executor.h"
+#include <algorithm>
+#include <deque>
+#include <exception>
+#include <thread>
+#include <utility>
+
+using namespace rvm;
+using namespace rvm::interpreter;
+
+namespace {
+    using Clock = std::chrono::steady_clock;
+}
+
+struct Executor::Task {
+    Job job;
+    std::promise<Operand> result;
+    Clock::time_point submitted;
+};
+
+struct Executor::Worker {
+    // guards `tasks` and `stats`
+    mutable std::mutex lock{};
+    // The owner takes from the front, so its jobs start in submission
+    // order; thieves take from the back, the jobs the owner would reach
+    // last.
+    std::deque<Task> tasks{};
+    WorkerStats stats{};
+    // interpreters by module, least recently used first; only touched by
+    // the worker's thread
+    std::vector<std::unique_ptr<Interpreter>> contexts{};
+    std::vector<const Module*> context_modules{};
+    std::thread thread{};
+};
+
+Executor::Executor(ExecutorOptions o): options(o) {
+    auto n = options.workers != 0 ? options.workers
+                                  : std::max<size_t>(std::thread::hardware_concurrency(), 1);
+    options.contexts_per_worker = std::max<size_t>(options.contexts_per_worker, 1);
+    for (size_t i = 0; i < n; ++i) {
+        workers.push_back(std::make_unique<Worker>());
+    }
+    for (size_t i = 0; i < n; ++i) {
+        workers[i]->thread = std::thread([this, i] { work(i); });
+    }
+}
+
+Executor::~Executor() {
+    {
+        std::lock_guard<std::mutex> l(idle_lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (auto&& w : workers) {
+        w->thread.join();
+    }
+}
+
+std::future<Operand> Executor::submit(Job job) {
+    auto task = Task{std::move(job), std::promise<Operand>{}, Clock::now()};
+    auto re = task.result.get_future();
+    {
+        std::lock_guard<std::mutex> l(idle_lock);
+        ++pending;
+    }
+    auto&& w = *workers[next_worker++ % workers.size()];
+    {
+        std::lock_guard<std::mutex> l(w.lock);
+        w.tasks.push_back(std::move(task));
+    }
+    wake.notify_one();
+    return re;
+}
+
+std::vector<WorkerStats> Executor::stats() const {
+    auto re = std::vector<WorkerStats>{};
+    for (auto&& w : workers) {
+        std::lock_guard<std::mutex> l(w->lock);
+        re.push_back(w->stats);
+    }
+    return re;
+}
+
+void Executor::work(size_t self) {
+    for (;;) {
+        auto task = Task{};
+        if (take(self, task)) {
+            execute(*workers[self], task);
+            continue;
+        }
+        std::unique_lock<std::mutex> l(idle_lock);
+        wake.wait(l, [this] { return pending > 0 || stopping; });
+        if (pending == 0 && stopping) {
+            return;
+        }
+    }
+}
+
+// Takes the next job of worker `self`, or steals one, starting with the
+// worker after it.
+bool Executor::take(size_t self, Task& task) {
+    for (size_t i = 0; i < workers.size(); ++i) {
+        auto&& w = *workers[(self + i) % workers.size()];
+        {
+            std::lock_guard<std::mutex> l(w.lock);
+            if (w.tasks.empty()) {
+                continue;
+            }
+            if (i == 0) {
+                task = std::move(w.tasks.front());
+                w.tasks.pop_front();
+            }
+            else {
+                task = std::move(w.tasks.back());
+                w.tasks.pop_back();
+            }
+            --pending;
+        }
+        if (i != 0) {
+            // never holding two workers' locks at once
+            std::lock_guard<std::mutex> l(workers[self]->lock);
+            ++workers[self]->stats.stolen;
+        }
+        return true;
+    }
+    return false;
+}
+
+void Executor::execute(Worker& w, Task& task) {
+    auto start = Clock::now();
+    auto result = Operand{};
+    auto error = std::exception_ptr{};
+    try {
+        auto&& vm = context(w, task.job.module);
+        vm.restart(task.job.function, task.job.args);
+        if (vm.run_for(UINT64_MAX) == RunStatus::waiting) {
+            throw AsyncNativeError{};
+        }
+        if (vm.in_heap(vm.result())) {
+            throw AdtResultError{};
+        }
+        result = vm.result();
+    }
+    catch (...) {
+        error = std::current_exception();
+    }
+    auto end = Clock::now();
+    auto latency = std::chrono::duration_cast<std::chrono::nanoseconds>(start - task.submitted);
+    {
+        // before the future is ready, so that stats() counts every job
+        // whose result has been seen
+        std::lock_guard<std::mutex> l(w.lock);
+        ++w.stats.jobs;
+        w.stats.busy += std::chrono::duration_cast<std::chrono::nanoseconds>(end - start);
+        w.stats.total_queue_latency += latency;
+        w.stats.max_queue_latency = std::max(w.stats.max_queue_latency, latency);
+    }
+    if (error) {
+        task.result.set_exception(error);
+    }
+    else {
+        task.result.set_value(result);
+    }
+}
+
+Interpreter& Executor::context(Worker& w, const std::shared_ptr<Module>& module) {
+    auto found = std::find(w.context_modules.begin(), w.context_modules.end(), module.get());
+    if (found != w.context_modules.end()) {
+        auto i = static_cast<size_t>(found - w.context_modules.begin());
+        auto vm = std::move(w.contexts[i]);
+        w.contexts.erase(w.contexts.begin() + i);
+        w.context_modules.erase(found);
+        w.contexts.push_back(std::move(vm));
+        w.context_modules.push_back(module.get());
+        return *w.contexts.back();
+    }
+    if (w.contexts.size() == options.contexts_per_worker) {
+        w.contexts.erase(w.contexts.begin());
+        w.context_modules.erase(w.context_modules.begin());
+    }
+    w.contexts.push_back(std::make_unique<Interpreter>(module, options.interpreter));
+    w.context_modules.push_back(module.get());
+    {
+        std::lock_guard<std::mutex> l(w.lock);
+        ++w.stats.interpreters;
+    }
+    return *w.contexts.back();
+}
@@ -0,0 +1,100 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include "instruction.h"
+#include "assembly.h"
+#include "operand.h"
+#include "interpreter.h"
+#include "module.h"
+
+namespace rvm {
+namespace interpreter {
+
+// One script to run: `function` of `module`, called with `args`.
+struct Job {
+    std::shared_ptr<Module> module;
+    index_t function{assembly::MAIN_FUNCTION_INDEX};
+    std::vector<Operand> args{};
+};
+
+struct ExecutorOptions {
+    // worker threads; 0 means one per hardware thread
+    size_t workers{0};
+    // Options of the interpreters the workers create.
+    Options interpreter{};
+    // Interpreters each worker keeps for reuse, one per module, the least
+    // recently used one going first.
+    size_t contexts_per_worker{4};
+};
+
+struct WorkerStats {
+    uint64_t jobs{0};
+    // jobs taken from another worker's queue
+    uint64_t stolen{0};
+    // interpreters created; the other jobs ran on one kept from before
+    uint64_t interpreters{0};
+    // time spent running jobs; jobs / busy is the worker's throughput
+    std::chrono::nanoseconds busy{0};
+    // time jobs waited between submit() and a worker starting them
+    std::chrono::nanoseconds total_queue_latency{0};
+    std::chrono::nanoseconds max_queue_latency{0};
+};
+
+// Runs jobs on a fixed pool of worker threads. Every worker has a queue of
+// its own, which submit() fills round-robin; a worker with an empty queue
+// steals from the others before going to sleep. Workers keep the
+// interpreters they created and restart() them for the next job of the same
+// module, so the stack, the heap and the compiled code are reused.
+//
+// A job's result is the value its function returns, or the exception the
+// interpreter threw. An ADT made by the job would point into the worker's
+// heap, which the next job reuses, so a job returning one fails with
+// AdtResultError instead; ADT constants live in the module and are fine.
+// The destructor finishes every job already submitted.
+class Executor {
+public:
+    // A job called an async native; jobs run to completion on their worker,
+    // so async natives need an EventLoop.
+    struct AsyncNativeError {};
+    // A job returned an ADT it made.
+    struct AdtResultError {};
+
+    explicit Executor(ExecutorOptions = ExecutorOptions{});
+    Executor(const Executor&) = delete;
+    Executor& operator=(const Executor&) = delete;
+    ~Executor();
+
+    std::future<Operand> submit(Job);
+    // One entry per worker, counting every job whose future is ready.
+    std::vector<WorkerStats> stats() const;
+
+private:
+    struct Task;
+    struct Worker;
+
+    ExecutorOptions options;
+    std::vector<std::unique_ptr<Worker>> workers{};
+    std::atomic<size_t> next_worker{0};
+    // Sleeping workers wait for `pending`, the number of queued jobs, to
+    // become positive. It is raised before a job is queued, so it can
+    // briefly count a job no queue holds yet, but never misses one.
+    std::mutex idle_lock{};
+    std::condition_variable wake{};
+    std::atomic<size_t> pending{0};
+    bool stopping{false};
+
+    void work(size_t self);
+    bool take(size_t self, Task&);
+    void execute(Worker&, Task&);
+    Interpreter& context(Worker&, const std::shared_ptr<Module>&);
+};
+
+}
+}
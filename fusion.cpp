@@ -0,0 +1,201 @@
+#include "fusion.h"
+#include "vm_stack.h"
+
+using namespace rvm;
+using namespace rvm::interpreter;
+using namespace rvm::assembly;
+
+namespace {
+
+struct Match {
+    Superinstruction family;
+    size_t length;
+    DecodedInstruction fused;
+};
+
+// Frame-relative slot of a local or an argument, as resolved by decode().
+bool local_load(const FunctionInfo& f, const Instruction& i, int32_t* slot) {
+    switch (i.op) {
+        case Operation::ldloc:
+            *slot = i.index;
+            return true;
+        case Operation::ldarg:
+            *slot = -FRAME_HEADER_SIZE - f.num_args + i.index;
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool local_store(const FunctionInfo& f, const Instruction& i, int32_t* slot) {
+    switch (i.op) {
+        case Operation::stloc:
+            *slot = i.index;
+            return true;
+        case Operation::starg:
+            *slot = -FRAME_HEADER_SIZE - f.num_args + i.index;
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool int32_constant(const Assembly& a, const Instruction& i, int32_t* k) {
+    if (i.op != Operation::ldc
+     || a.constant_table[i.index].type != ConstantType::int32) {
+        return false;
+    }
+    *k = a.constant_table[i.index].int32;
+    return true;
+}
+
+bool int32_typed(const Instruction& i) {
+    return i.type == OperandType::int32 || i.type == OperandType::pointer;
+}
+
+// Folds `add k` and `sub k` into a single wrapping addend.
+bool addend(const Instruction& i, int32_t k, int32_t* delta) {
+    if (!int32_typed(i)) {
+        return false;
+    }
+    switch (i.op) {
+        case Operation::add:
+            *delta = k;
+            return true;
+        case Operation::sub:
+            *delta = static_cast<int32_t>(0u - static_cast<uint32_t>(k));
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool comparison(const Instruction& i, Opcode* op) {
+    switch (i.op) {
+        case Operation::teq:
+            *op = Opcode::cmp_local_const_branch_eq;
+            return true;
+        case Operation::tne:
+            *op = Opcode::cmp_local_const_branch_ne;
+            return true;
+        default:
+            break;
+    }
+    if (!int32_typed(i)) {
+        return false;
+    }
+    switch (i.op) {
+        case Operation::tlt: *op = Opcode::cmp_local_const_branch_lt; return true;
+        case Operation::tle: *op = Opcode::cmp_local_const_branch_le; return true;
+        case Operation::tgt: *op = Opcode::cmp_local_const_branch_gt; return true;
+        case Operation::tge: *op = Opcode::cmp_local_const_branch_ge; return true;
+        default: return false;
+    }
+}
+
+DecodedInstruction fused(Opcode op, int32_t imm, int32_t imm2, index_t index = 0) {
+    auto re = DecodedInstruction{};
+    re.op = op;
+    re.imm = imm;
+    re.imm2 = imm2;
+    re.index = index;
+    return re;
+}
+
+std::vector<Match> candidates(const Assembly& a, const FunctionInfo& f,
+                              size_t pc, FusionSet set) {
+    auto re = std::vector<Match>{};
+    auto&& c = f.code;
+    auto remaining = c.size() - pc;
+    int32_t slot, slot2, k, delta;
+    Opcode cmp;
+    if (remaining >= 2 && local_load(f, c[pc], &slot)) {
+        if (local_load(f, c[pc + 1], &slot2)
+         && set.contains(Superinstruction::ldloc_ldloc)) {
+            re.push_back({Superinstruction::ldloc_ldloc, 2,
+                          fused(Opcode::ldloc_ldloc, slot, slot2)});
+        }
+        if (remaining >= 3 && int32_constant(a, c[pc + 1], &k)) {
+            if (addend(c[pc + 2], k, &delta)
+             && set.contains(Superinstruction::add_local_const)) {
+                re.push_back({Superinstruction::add_local_const, 3,
+                              fused(Opcode::add_local_const, delta, slot)});
+            }
+            if (remaining >= 4
+             && addend(c[pc + 2], k, &delta)
+             && local_store(f, c[pc + 3], &slot2) && slot == slot2
+             && set.contains(Superinstruction::inc_local_by_const)) {
+                re.push_back({Superinstruction::inc_local_by_const, 4,
+                              fused(Opcode::inc_local_by_const, delta, slot)});
+            }
+            if (remaining >= 4
+             && comparison(c[pc + 2], &cmp)
+             && c[pc + 3].op == Operation::brtrue
+             && set.contains(Superinstruction::cmp_local_const_branch)) {
+                re.push_back({Superinstruction::cmp_local_const_branch, 4,
+                              fused(cmp, k, slot, c[pc + 3].index)});
+            }
+        }
+    }
+    if (remaining >= 2
+     && local_store(f, c[pc], &slot)
+     && local_load(f, c[pc + 1], &slot2)
+     && set.contains(Superinstruction::stloc_ldloc)) {
+        re.push_back({Superinstruction::stloc_ldloc, 2,
+                      fused(Opcode::stloc_ldloc, slot, slot2)});
+    }
+    return re;
+}
+
+bool falls_through(const Instruction& i) {
+    return i.op != Operation::br && i.op != Operation::ret
+        && i.op != Operation::tailcall && i.op != Operation::tailcalla
+        && i.op != Operation::switch_ && i.op != Operation::switchctor;
+}
+
+}
+
+void rvm::interpreter::fuse(const Assembly& a, const FunctionInfo& f,
+                            DecodedCode& code, FusionSet set) {
+    // Every pc may start its own superinstruction, since jumps can land on
+    // any of them. Which one pays off depends on what follows, so choose
+    // backwards by the number of dispatches left on the fall-through path.
+    auto n = f.code.size();
+    auto cost = std::vector<size_t>(n + 1, 0);
+    for (auto pc = n; pc-- != 0;) {
+        cost[pc] = 1 + (falls_through(f.code[pc]) ? cost[pc + 1] : 0);
+        for (auto&& m : candidates(a, f, pc, set)) {
+            auto c = 1 + cost[pc + m.length];
+            if (c <= cost[pc]) {
+                cost[pc] = c;
+                code[pc] = m.fused;
+            }
+        }
+    }
+}
+
+FusionSet rvm::interpreter::derive_fusion_set(const Assembly& a,
+                                              const ExecutionProfile& profile,
+                                              double min_share) {
+    auto saved = std::vector<uint64_t>(static_cast<size_t>(Superinstruction::count), 0);
+    auto total = uint64_t{0};
+    for (size_t i = 0; i < profile.size() && i < a.function_table.size(); ++i) {
+        auto&& f = a.function_table[i];
+        for (size_t pc = 0; pc < profile[i].size() && pc < f.code.size(); ++pc) {
+            total += profile[i][pc];
+            for (auto&& m : candidates(a, f, pc, FusionSet::all())) {
+                saved[static_cast<size_t>(m.family)] += profile[i][pc] * (m.length - 1);
+            }
+        }
+    }
+    auto re = FusionSet::none();
+    if (total == 0) {
+        return re;
+    }
+    for (size_t s = 0; s < saved.size(); ++s) {
+        if (static_cast<double>(saved[s]) / total >= min_share) {
+            re.insert(static_cast<Superinstruction>(s));
+        }
+    }
+    return re;
+}
@@ -0,0 +1,74 @@
+#pragma once
+#include <stdint.h>
+#include <vector>
+#include "assembly.h"
+#include "decoder.h"
+
+namespace rvm {
+namespace interpreter {
+
+// Families of superinstructions the decoder can fuse. "Local" covers both
+// locals and arguments, which are all frame-relative slots once decoded.
+//
+//  inc_local_by_const      ldloc a; ldc k; add|sub <int32>; stloc a
+//  add_local_const         ldloc a; ldc k; add|sub <int32>
+//  ldloc_ldloc             ldloc a; ldloc b
+//  stloc_ldloc             stloc a; ldloc b
+//  cmp_local_const_branch  ldloc a; ldc k; t{lt,le,gt,ge} <int32>|teq|tne; brtrue t
+#define RVM_SUPERINSTRUCTIONS(X) \
+    X(inc_local_by_const) X(add_local_const) X(ldloc_ldloc) X(stloc_ldloc) \
+    X(cmp_local_const_branch)
+
+enum class Superinstruction: uint8_t {
+#define RVM_SUPERINSTRUCTION_ENUM(name) name,
+    RVM_SUPERINSTRUCTIONS(RVM_SUPERINSTRUCTION_ENUM)
+#undef RVM_SUPERINSTRUCTION_ENUM
+    count
+};
+
+class FusionSet {
+public:
+    static FusionSet none() { return FusionSet{0}; }
+    static FusionSet all() {
+        return FusionSet{(1u << static_cast<unsigned>(Superinstruction::count)) - 1};
+    }
+
+    bool contains(Superinstruction s) const {
+        return bits & bit(s);
+    }
+    FusionSet& insert(Superinstruction s) {
+        bits |= bit(s);
+        return *this;
+    }
+    FusionSet& erase(Superinstruction s) {
+        bits &= ~bit(s);
+        return *this;
+    }
+
+private:
+    explicit FusionSet(uint32_t b): bits{b} {}
+    static uint32_t bit(Superinstruction s) {
+        return 1u << static_cast<unsigned>(s);
+    }
+
+    uint32_t bits;
+};
+
+// Number of times each instruction was executed, indexed by function table
+// index and then by pc. Recorded by an Interpreter with
+// Options::record_profile set.
+using ExecutionProfile = std::vector<std::vector<uint64_t>>;
+
+// Rewrites the first instruction of every matched sequence in `code` into
+// its superinstruction. The remaining instructions of the sequence are left
+// in place, so pcs and branch targets into the middle of it stay valid.
+void fuse(const assembly::Assembly&, const assembly::FunctionInfo&,
+          DecodedCode&, FusionSet);
+
+// Picks the families whose fusion would have saved at least `min_share` of
+// all dispatches in the profiled run.
+FusionSet derive_fusion_set(const assembly::Assembly&, const ExecutionProfile&,
+                            double min_share = 0.01);
+
+}
+}
@@ -0,0 +1,462 @@
+#include "heap.h"
+#include <algorithm>
+#include <math.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+using namespace rvm;
+using namespace rvm::interpreter;
+using namespace rvm::assembly;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+static_assert(offsetof(Adt, fields) == sizeof(Operand), "the Adt header is one slot");
+
+// Fields actually reserved for an object: one even without fields, where a
+// minor collection keeps the forwarding address.
+size_t capacity(const Adt* a) {
+    return std::max<size_t>(a->num_fields, 1);
+}
+
+size_t bytes(size_t capacity) {
+    return sizeof(Operand) * (1 + capacity);
+}
+
+Operand scalar(const ConstantInfo& c) {
+    return c.type == ConstantType::int8 ? Operand{c.int8} : Operand{c.int32};
+}
+
+size_t round_up(size_t n, size_t to) {
+    return (n + to - 1) / to * to;
+}
+
+}
+
+Heap::Heap(size_t nursery, size_t capacity, HeapMode m)
+    : mode(m), nursery_size((std::max<size_t>(nursery, 256) + 7) & ~size_t{7}) {
+    // the old generation starts on a page boundary so that trim() can hand
+    // whole slabs back
+    auto nursery_region = round_up(nursery_size, static_cast<size_t>(sysconf(_SC_PAGESIZE)));
+    auto size = nursery_region + round_up(std::max(capacity, slab_size), slab_size);
+    // Ask for memory far above 4GiB; the kernel places it there anyway on
+    // 64-bit targets, but the hint keeps small address spaces honest.
+    auto hint = reinterpret_cast<void*>(uintptr_t{1} << 44);
+    auto p = mmap(hint, size, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) {
+        throw OutOfMemoryError{};
+    }
+    begin = reinterpret_cast<uintptr_t>(p);
+    end = begin + size;
+    if ((begin >> 32) == 0) {
+        release_memory();
+        throw OutOfMemoryError{};
+    }
+    nursery_top = begin;
+    old_begin = old_top = begin + nursery_region;
+    next_major = 4 * nursery_size;
+}
+
+Heap::Heap(Heap&& other) {
+    *this = std::move(other);
+}
+
+Heap& Heap::operator=(Heap&& other) {
+    if (this != &other) {
+        release_memory();
+        mode = other.mode;
+        begin = other.begin;
+        end = other.end;
+        nursery_size = other.nursery_size;
+        nursery_top = other.nursery_top;
+        old_begin = other.old_begin;
+        old_top = other.old_top;
+        next_major = other.next_major;
+        old_used = other.old_used;
+        remembered_set = std::move(other.remembered_set);
+        slabs = std::move(other.slabs);
+        unused_slabs = std::move(other.unused_slabs);
+        classes = std::move(other.classes);
+        class_of = std::move(other.class_of);
+        heap_stats = other.heap_stats;
+        other.begin = other.end = 0;
+    }
+    return *this;
+}
+
+Heap::~Heap() {
+    release_memory();
+}
+
+void Heap::release_memory() {
+    if (begin != 0) {
+        munmap(reinterpret_cast<void*>(begin), end - begin);
+        begin = end = 0;
+    }
+}
+
+void Heap::remember(Adt* a) {
+    a->gc |= remembered;
+    remembered_set.push_back(a);
+}
+
+size_t Heap::size_class(size_t cap) {
+    if (class_of.size() <= cap) {
+        class_of.resize(cap + 1, -1);
+    }
+    if (class_of[cap] < 0) {
+        class_of[cap] = static_cast<int32_t>(classes.size());
+        classes.push_back(SizeClass{cap});
+    }
+    return static_cast<size_t>(class_of[cap]);
+}
+
+void Heap::add_size_classes(const AdtTable& adts) {
+    for (auto&& adt : adts) {
+        for (auto&& ctor : adt) {
+            size_class(std::max<size_t>(ctor.num_fields, 1));
+        }
+    }
+}
+
+size_t Heap::new_slab(size_t size_class) {
+    size_t re;
+    if (!unused_slabs.empty()) {
+        re = unused_slabs.back();
+        unused_slabs.pop_back();
+    }
+    else if (end - old_top >= slab_size) {
+        re = slabs.size();
+        slabs.emplace_back();
+        old_top += slab_size;
+    }
+    else {
+        throw OutOfMemoryError{};
+    }
+    slabs[re].size_class = static_cast<int32_t>(size_class);
+    slabs[re].live = 0;
+    slabs[re].top = old_begin + re * slab_size;
+    return re;
+}
+
+Adt* Heap::allocate_old(size_t cap) {
+    auto k = size_class(cap);
+    auto&& c = classes[k];
+    auto size = bytes(cap);
+    Adt* re;
+    if (c.free != nullptr) {
+        re = c.free;
+        c.free = re->fields[0].adt;
+        --c.free_cells;
+    }
+    else {
+        if (c.slab == no_slab || slabs[c.slab].top + size > old_begin + (c.slab + 1) * slab_size) {
+            c.slab = new_slab(k);
+        }
+        re = reinterpret_cast<Adt*>(slabs[c.slab].top);
+        slabs[c.slab].top += size;
+    }
+    ++slab_of(re).live;
+    old_used += size;
+    return re;
+}
+
+void Heap::free_object(Adt* a) {
+    auto&& slab = slab_of(a);
+    auto&& c = classes[static_cast<size_t>(slab.size_class)];
+    a->gc = free_cell;
+    a->fields[0].adt = c.free;
+    c.free = a;
+    ++c.free_cells;
+    --slab.live;
+    old_used -= bytes(c.capacity);
+}
+
+Adt* Heap::allocate(size_t cap, bool old) {
+    heap_stats.bytes_allocated += bytes(cap);
+    if (old) {
+        // fields are filled in by the caller and may point into the nursery
+        auto re = allocate_old(cap);
+        re->gc = 0;
+        if (mode == HeapMode::garbage_collected) {
+            remember(re);
+        }
+        return re;
+    }
+    auto re = reinterpret_cast<Adt*>(nursery_top);
+    nursery_top += bytes(cap);
+    re->gc = 0;
+    return re;
+}
+
+Adt* Heap::make(index_t adt, sindex_t ctor, index_t num_fields,
+                Operand* roots, Operand* roots_end) {
+    auto cap = std::max<size_t>(num_fields, 1);
+    auto old = mode == HeapMode::manual || bytes(cap) > nursery_size / 4;
+    if (!old && begin + nursery_size - nursery_top < bytes(cap)) {
+        collect_nursery(roots, roots_end);
+    }
+    else if (old && mode == HeapMode::garbage_collected && old_used + bytes(cap) > next_major) {
+        // large objects skip the nursery, so they start major collections
+        // themselves
+        collect(roots, roots_end);
+    }
+    auto re = allocate(cap, old);
+    re->adt_table_index = adt;
+    re->constructor_index = ctor;
+    re->num_fields = num_fields;
+    return re;
+}
+
+std::vector<Operand> Heap::constants(const ConstantTable& table) {
+    std::vector<Operand> re;
+    for (auto&& c : table) {
+        re.push_back(c.type == ConstantType::adt ? Operand{copy_constant(c)} : scalar(c));
+    }
+    return re;
+}
+
+Adt* Heap::copy_constant(const ConstantInfo& c) {
+    auto cap = std::max<size_t>(c.adt.num_fields, 1);
+    heap_stats.bytes_allocated += bytes(cap);
+    // only ever refers to other constants, so it is neither remembered nor
+    // traced by the collector
+    auto re = allocate_old(cap);
+    re->gc = constant_object;
+    re->adt_table_index = c.adt.adt_table_index;
+    re->constructor_index = c.adt.constructor_index;
+    re->num_fields = c.adt.num_fields;
+    for (index_t i = 0; i < c.adt.num_fields; ++i) {
+        auto&& f = c.adt.fields[i];
+        re->fields[i] = f.type == ConstantType::adt ? Operand{copy_constant(f)} : scalar(f);
+    }
+    return re;
+}
+
+Adt* Heap::forward(Adt* a) {
+    if (a->gc & forwarded) {
+        return a->fields[0].adt;
+    }
+    auto size = bytes(capacity(a));
+    auto re = allocate_old(capacity(a));
+    memcpy(re, a, size);
+    re->gc = 0;
+    a->gc = forwarded;
+    a->fields[0].adt = re;
+    gray.push_back(re);
+    heap_stats.bytes_promoted += size;
+    return re;
+}
+
+void Heap::minor(Operand* roots, Operand* roots_end) {
+    auto evacuate = [this](Operand& slot) {
+        if (in_nursery(slot)) {
+            slot.adt = forward(slot.adt);
+        }
+    };
+    for (auto p = roots; p != roots_end; ++p) {
+        evacuate(*p);
+    }
+    for (auto a : remembered_set) {
+        a->gc &= ~remembered;
+        for (index_t i = 0; i < a->num_fields; ++i) {
+            evacuate(a->fields[i]);
+        }
+    }
+    remembered_set.clear();
+    while (!gray.empty()) {
+        auto a = gray.back();
+        gray.pop_back();
+        for (index_t i = 0; i < a->num_fields; ++i) {
+            evacuate(a->fields[i]);
+        }
+    }
+    nursery_top = begin;
+    ++heap_stats.minor_collections;
+}
+
+void Heap::major(Operand* roots, Operand* roots_end) {
+    // before a minor collection, marks reach into the nursery too, see
+    // room_for_nursery()
+    auto mark = [this](Operand slot) {
+        if ((in_old(slot) || in_nursery(slot)) && !(slot.adt->gc & (marked | constant_object))) {
+            slot.adt->gc |= marked;
+            gray.push_back(slot.adt);
+        }
+    };
+    for (auto p = roots; p != roots_end; ++p) {
+        mark(*p);
+    }
+    while (!gray.empty()) {
+        auto a = gray.back();
+        gray.pop_back();
+        for (index_t i = 0; i < a->num_fields; ++i) {
+            mark(a->fields[i]);
+        }
+    }
+    sweep(true);
+    // remembered objects that died no longer point anywhere
+    remembered_set.erase(std::remove_if(remembered_set.begin(), remembered_set.end(), [](const Adt* a) {
+        return (a->gc & free_cell) != 0;
+    }), remembered_set.end());
+    ++heap_stats.major_collections;
+    heap_stats.old_live_bytes = old_used;
+    next_major = std::max(4 * nursery_size, 2 * old_used);
+}
+
+void Heap::sweep(bool free_unmarked) {
+    old_used = 0;
+    for (auto&& c : classes) {
+        c.free = nullptr;
+        c.free_cells = 0;
+    }
+    for (size_t i = 0; i < slabs.size(); ++i) {
+        auto&& slab = slabs[i];
+        if (slab.size_class < 0) {
+            continue;
+        }
+        auto&& c = classes[static_cast<size_t>(slab.size_class)];
+        auto size = bytes(c.capacity);
+        slab.live = 0;
+        for (auto p = old_begin + i * slab_size; p < slab.top; p += size) {
+            auto a = reinterpret_cast<Adt*>(p);
+            if (free_unmarked && !(a->gc & (marked | free_cell | constant_object))) {
+                a->gc = free_cell;
+            }
+            if (a->gc & free_cell) {
+                a->fields[0].adt = c.free;
+                c.free = a;
+                ++c.free_cells;
+            }
+            else {
+                a->gc &= ~marked;
+                ++slab.live;
+                old_used += size;
+            }
+        }
+    }
+}
+
+bool Heap::room_for_nursery(bool marked_only) {
+    auto fresh = unused_slabs.size() + (end - old_top) / slab_size;
+    auto used = nursery_top - begin;
+    // Without looking: a class fills its slabs at least half, but for the
+    // last one, and m different sizes take at least 4m² bytes.
+    auto sizes = static_cast<size_t>(sqrt(static_cast<double>(used / 4))) + 1;
+    if (!marked_only && fresh >= 2 * used / slab_size + sizes) {
+        return true;
+    }
+    auto wanted = std::vector<size_t>(classes.size(), 0);
+    for (auto p = begin; p < nursery_top; p += bytes(capacity(reinterpret_cast<Adt*>(p)))) {
+        auto a = reinterpret_cast<Adt*>(p);
+        if (marked_only && !(a->gc & marked)) {
+            continue;
+        }
+        a->gc &= ~marked;
+        auto k = size_class(capacity(a));
+        if (wanted.size() <= k) {
+            wanted.resize(k + 1, 0);
+        }
+        ++wanted[k];
+    }
+    auto slabs_wanted = size_t{0};
+    for (size_t k = 0; k < wanted.size(); ++k) {
+        auto&& c = classes[k];
+        auto size = bytes(c.capacity);
+        auto cells = c.free_cells;
+        if (c.slab != no_slab) {
+            cells += (old_begin + (c.slab + 1) * slab_size - slabs[c.slab].top) / size;
+        }
+        if (wanted[k] > cells) {
+            auto per_slab = std::max<size_t>(slab_size / size, 1);
+            slabs_wanted += (wanted[k] - cells + per_slab - 1) / per_slab;
+        }
+    }
+    return slabs_wanted <= fresh;
+}
+
+void Heap::make_room(Operand* roots, Operand* roots_end) {
+    if (room_for_nursery(false)) {
+        return;
+    }
+    // The old generation may be mostly garbage that only a major
+    // collection finds. It traces through the nursery, and the objects it
+    // marks there are the most the minor collection can promote.
+    major(roots, roots_end);
+    if (!room_for_nursery(true)) {
+        throw OutOfMemoryError{};
+    }
+}
+
+void Heap::collect_nursery(Operand* roots, Operand* roots_end) {
+    auto start = Clock::now();
+    make_room(roots, roots_end);
+    minor(roots, roots_end);
+    if (old_used > next_major) {
+        major(roots, roots_end);
+    }
+    record_pause(Clock::now() - start);
+}
+
+void Heap::collect(Operand* roots, Operand* roots_end) {
+    if (mode == HeapMode::manual) {
+        return;
+    }
+    auto start = Clock::now();
+    make_room(roots, roots_end);
+    minor(roots, roots_end);
+    major(roots, roots_end);
+    record_pause(Clock::now() - start);
+}
+
+void Heap::trim(Operand* roots, Operand* roots_end) {
+    if (mode == HeapMode::garbage_collected) {
+        collect(roots, roots_end);
+        madvise(reinterpret_cast<void*>(begin), old_begin - begin, MADV_DONTNEED);
+    }
+    for (size_t i = 0; i < slabs.size(); ++i) {
+        auto&& slab = slabs[i];
+        if (slab.size_class < 0 || slab.live != 0) {
+            continue;
+        }
+        auto&& c = classes[static_cast<size_t>(slab.size_class)];
+        if (c.slab == i) {
+            c.slab = no_slab;
+        }
+        auto start = old_begin + i * slab_size;
+        madvise(reinterpret_cast<void*>(start), slab_size, MADV_DONTNEED);
+        slab.size_class = -1;
+        slab.top = start;
+        unused_slabs.push_back(i);
+    }
+    // drop the cells of the released slabs from the free lists
+    sweep(false);
+}
+
+std::vector<SizeClassStats> Heap::size_classes() const {
+    std::vector<SizeClassStats> re;
+    for (auto&& c : classes) {
+        re.push_back(SizeClassStats{c.capacity, 0, 0, 0});
+    }
+    for (auto&& slab : slabs) {
+        if (slab.size_class >= 0) {
+            auto&& s = re[static_cast<size_t>(slab.size_class)];
+            ++s.slabs;
+            s.objects += slab.live;
+            s.cells += slab_size / bytes(s.capacity);
+        }
+    }
+    std::sort(re.begin(), re.end(), [](const SizeClassStats& a, const SizeClassStats& b) {
+        return a.capacity < b.capacity;
+    });
+    return re;
+}
+
+void Heap::record_pause(std::chrono::nanoseconds pause) {
+    heap_stats.total_pause += pause;
+    heap_stats.max_pause = std::max(heap_stats.max_pause, pause);
+}
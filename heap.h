@@ -0,0 +1,213 @@
+#pragma once
+#include <chrono>
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include "instruction.h"
+#include "assembly.h"
+#include "operand.h"
+
+namespace rvm {
+namespace interpreter {
+
+enum class HeapMode {
+    // objects are freed by the collector; dladt is a hint
+    garbage_collected,
+    // no collector: objects live until dladt
+    manual
+};
+
+struct HeapStats {
+    // bytes handed out by make() and constants(), including headers
+    uint64_t bytes_allocated{0};
+    // bytes copied out of the nursery by minor collections
+    uint64_t bytes_promoted{0};
+    uint64_t minor_collections{0};
+    uint64_t major_collections{0};
+    // old generation bytes still reachable after the last major collection
+    size_t old_live_bytes{0};
+    std::chrono::nanoseconds total_pause{0};
+    std::chrono::nanoseconds max_pause{0};
+};
+
+// Occupancy of one old generation size class.
+struct SizeClassStats {
+    // fields per object
+    size_t capacity;
+    size_t slabs;
+    // objects allocated and not yet freed or swept
+    size_t objects;
+    // objects the slabs can hold
+    size_t cells;
+};
+
+// Garbage collected storage for ADT values. New objects are bump-allocated
+// in a nursery; when it fills up, a copying minor collection moves the
+// survivors to the old generation, which is collected by mark-sweep once it
+// has grown enough since the last major collection.
+//
+// The old generation is carved into slabs, each serving one object size
+// (one field count) from a free list, so allocating and freeing there is a
+// pointer pop or push. In HeapMode::manual there is no nursery and no
+// collector: mkadt and dladt go straight to the slabs.
+//
+// Roots are precise: every allocating call receives the range of operand
+// slots that are live, and a slot holds a reference exactly when its value
+// is an address inside the heap. The whole heap is one reservation above
+// the 4GiB line, where zero-extended scalars never reach. Collections move
+// objects and update the root slots in place, so nothing may keep an Adt*
+// outside the roots across an allocation.
+class Heap {
+public:
+    struct OutOfMemoryError {};
+
+    // `capacity` is address space reserved for the old generation; pages
+    // are only committed as they are used.
+    explicit Heap(size_t nursery_size = size_t{1} << 20, size_t capacity = size_t{1} << 30,
+                  HeapMode mode = HeapMode::garbage_collected);
+    Heap(const Heap&) = delete;
+    Heap(Heap&&);
+    Heap& operator=(const Heap&) = delete;
+    Heap& operator=(Heap&&);
+    ~Heap();
+
+    // A new object with uninitialized fields, to be filled in before the
+    // next allocation.
+    Adt* make(index_t adt, sindex_t ctor, index_t num_fields, Operand* roots, Operand* roots_end);
+    // Materializes every constant of the table once, for ldc to share. ADT
+    // constants go to the old generation, where they are never moved or
+    // freed and must not be modified, see is_constant().
+    std::vector<Operand> constants(const assembly::ConstantTable&);
+    static bool is_constant(const Adt* a) {
+        return (a->gc & constant_object) != 0;
+    }
+    // Field store with the generational write barrier.
+    void store(Adt* adt, index_t idx, Operand v) {
+        adt->fields[idx] = v;
+        if (in_nursery(v) && !in_nursery(adt) && !(adt->gc & remembered)) {
+            remember(adt);
+        }
+    }
+    // dladt. With a collector, reachability decides what is freed, so this
+    // is only a hint and releasing an object that is still referenced is
+    // harmless.
+    void release(Adt* a) {
+        if (mode == HeapMode::manual && !(a->gc & (free_cell | constant_object))) {
+            free_object(a);
+        }
+    }
+    // Runs a minor and a major collection; does nothing in manual mode.
+    void collect(Operand* roots, Operand* roots_end);
+    // Collects everything (with a collector) and gives the nursery and the
+    // slabs left empty back to the operating system. Meant for when a
+    // script has finished; the address space stays reserved.
+    void trim(Operand* roots, Operand* roots_end);
+
+    // Sets up the size classes of every constructor up front. Other sizes
+    // get a class on first use.
+    void add_size_classes(const assembly::AdtTable&);
+    std::vector<SizeClassStats> size_classes() const;
+
+    bool contains(Operand o) const {
+        return address(o) - begin < end - begin;
+    }
+    const HeapStats& stats() const {
+        return heap_stats;
+    }
+
+private:
+    enum: uint8_t {
+        forwarded = 1,
+        remembered = 2,
+        marked = 4,
+        free_cell = 8,
+        constant_object = 16
+    };
+    static constexpr size_t slab_size = size_t{1} << 20;
+    static constexpr size_t no_slab = SIZE_MAX;
+
+    struct Slab {
+        // index into `classes`, -1 while the slab is unused
+        int32_t size_class{-1};
+        uint32_t live{0};
+        // cells below `top` have been handed out at least once
+        uintptr_t top{0};
+    };
+    struct SizeClass {
+        size_t capacity;
+        // free cells, linked through fields[0], and how many there are
+        Adt* free{nullptr};
+        size_t free_cells{0};
+        // slab new cells are carved from
+        size_t slab{no_slab};
+    };
+
+    HeapMode mode{HeapMode::garbage_collected};
+    uintptr_t begin{0};
+    uintptr_t end{0};
+    size_t nursery_size{0};
+    uintptr_t nursery_top{0};
+    uintptr_t old_begin{0};
+    uintptr_t old_top{0};
+    // old generation bytes in use, and the value that starts a major
+    // collection at the next minor one
+    size_t old_used{0};
+    size_t next_major{0};
+    // old objects that may point into the nursery
+    std::vector<Adt*> remembered_set{};
+    // slabs in address order from old_begin; old_top is the end of the last
+    std::vector<Slab> slabs{};
+    std::vector<size_t> unused_slabs{};
+    std::vector<SizeClass> classes{};
+    // size class by capacity, -1 when there is none yet
+    std::vector<int32_t> class_of{};
+    std::vector<Adt*> gray{};
+    HeapStats heap_stats{};
+
+    static uintptr_t address(Operand o) {
+        return reinterpret_cast<uintptr_t>(o.adt);
+    }
+    static uintptr_t address(const Adt* a) {
+        return reinterpret_cast<uintptr_t>(a);
+    }
+    bool in_nursery(Operand o) const {
+        return address(o) - begin < nursery_size;
+    }
+    bool in_nursery(const Adt* a) const {
+        return address(a) - begin < nursery_size;
+    }
+    bool in_old(Operand o) const {
+        return address(o) - old_begin < old_top - old_begin;
+    }
+
+    void remember(Adt*);
+    Adt* allocate(size_t capacity, bool old);
+    Adt* allocate_old(size_t capacity);
+    size_t size_class(size_t capacity);
+    size_t new_slab(size_t size_class);
+    Slab& slab_of(const Adt* a) {
+        return slabs[(address(a) - old_begin) / slab_size];
+    }
+    void free_object(Adt*);
+    Adt* copy_constant(const assembly::ConstantInfo&);
+    Adt* forward(Adt*);
+    // Whether the old generation can take every object in the nursery, or
+    // every marked one, so that promoting them cannot run out of slabs
+    // halfway. Clears the marks it looks at.
+    bool room_for_nursery(bool marked_only);
+    // Makes sure minor() can promote everything it finds, with a major
+    // collection first if need be.
+    void make_room(Operand* roots, Operand* roots_end);
+    void collect_nursery(Operand* roots, Operand* roots_end);
+    void minor(Operand* roots, Operand* roots_end);
+    // Also runs before a minor collection, and then marks the nursery
+    // objects it reaches and leaves them in place.
+    void major(Operand* roots, Operand* roots_end);
+    // rebuilds the free lists; with `free_unmarked`, unmarked objects die
+    void sweep(bool free_unmarked);
+    void record_pause(std::chrono::nanoseconds);
+    void release_memory();
+};
+
+}
+}
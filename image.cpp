@@ -0,0 +1,297 @@
+#include "assembly.h"
+#include <fcntl.h>
+#include <fstream>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace rvm;
+using namespace rvm::assembly;
+
+// Image format. Everything is in the byte order of the machine that wrote
+// it, and each section is an array of fixed-width records starting on an
+// 8 byte boundary, so that a mapped image can be used without parsing:
+//
+//   ImageHeader
+//   adts          ImageAdt[num_adts]
+//   constructors  ConstructorInfo[num_constructors]
+//   constants     ImageConstant[num_constant_records]
+//   functions     ImageFunction[num_functions]
+//   code          Instruction[num_instructions]
+//
+// The first num_constants constant records are the constant table; the
+// fields of ADT constants are records further down the same array.
+
+namespace {
+
+struct ImageHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t num_adts;
+    uint32_t num_constructors;
+    uint32_t num_constants;
+    uint32_t num_constant_records;
+    uint32_t num_functions;
+    uint32_t num_instructions;
+    uint64_t adts;
+    uint64_t constructors;
+    uint64_t constants;
+    uint64_t functions;
+    uint64_t code;
+    uint64_t size;
+};
+
+struct ImageAdt {
+    uint32_t first_constructor;
+    uint32_t num_constructors;
+};
+
+struct ImageConstant {
+    uint8_t type;
+    uint8_t constructor_index;
+    uint16_t adt_table_index;
+    uint16_t num_fields;
+    uint16_t reserved;
+    // the value of a scalar, the record of the first field of an ADT
+    uint32_t value;
+};
+
+struct ImageFunction {
+    uint16_t num_args;
+    uint16_t num_locals;
+    uint32_t first_instruction;
+    uint32_t num_instructions;
+    uint32_t reserved;
+};
+
+static_assert(sizeof(ConstructorInfo) == 1, "constructors are stored as bytes");
+static_assert(sizeof(Instruction) == 6 && alignof(Instruction) == 2,
+              "instructions are stored as they are laid out in memory");
+
+// A mapped image and the constant table decoded from it.
+struct MappedImage {
+    void* memory{nullptr};
+    size_t size{0};
+    std::vector<ConstantInfo> constant_records{};
+
+    MappedImage() = default;
+    MappedImage(const MappedImage&) = delete;
+    MappedImage& operator=(const MappedImage&) = delete;
+    ~MappedImage() {
+        if (memory != nullptr) {
+            munmap(memory, size);
+        }
+    }
+};
+
+size_t align(size_t n) {
+    return (n + 7) & ~size_t{7};
+}
+
+template <class T>
+void append(std::string& out, const T& x) {
+    out.append(reinterpret_cast<const char*>(&x), sizeof(x));
+}
+
+void pad(std::string& out) {
+    out.resize(align(out.size()), '\0');
+}
+
+// Stores `c` as record `at`; the fields of an ADT go to the end of `records`.
+void add_constant(std::vector<ImageConstant>& records, size_t at, const ConstantInfo& c) {
+    auto re = ImageConstant{};
+    re.type = static_cast<uint8_t>(c.type);
+    switch (c.type) {
+        case ConstantType::int8:
+            re.value = static_cast<uint8_t>(c.int8);
+            break;
+        case ConstantType::int32:
+            re.value = static_cast<uint32_t>(c.int32);
+            break;
+        case ConstantType::adt:
+        {
+            re.constructor_index = c.adt.constructor_index;
+            re.adt_table_index = c.adt.adt_table_index;
+            re.num_fields = c.adt.num_fields;
+            auto first = records.size();
+            re.value = static_cast<uint32_t>(first);
+            records.resize(first + c.adt.num_fields);
+            for (index_t i = 0; i < c.adt.num_fields; ++i) {
+                add_constant(records, first + i, c.adt.fields[i]);
+            }
+            break;
+        }
+    }
+    records[at] = re;
+}
+
+bool in_file(const ImageHeader& h, uint64_t offset, uint64_t count, size_t size) {
+    return offset % 8 == 0 && offset <= h.size && count <= (h.size - offset) / size;
+}
+
+Assembly map_image(void* memory, size_t size, std::shared_ptr<MappedImage> image) {
+    if (size < sizeof(ImageHeader)) {
+        throw ParseError{};
+    }
+    auto base = static_cast<const char*>(memory);
+    auto&& h = *reinterpret_cast<const ImageHeader*>(base);
+    if (h.magic != IMAGE_MAGIC_NUMBER || h.version != IMAGE_VERSION || h.size != size
+     || !in_file(h, h.adts, h.num_adts, sizeof(ImageAdt))
+     || !in_file(h, h.constructors, h.num_constructors, sizeof(ConstructorInfo))
+     || !in_file(h, h.constants, h.num_constant_records, sizeof(ImageConstant))
+     || !in_file(h, h.functions, h.num_functions, sizeof(ImageFunction))
+     || !in_file(h, h.code, h.num_instructions, sizeof(Instruction))
+     || h.num_constants > h.num_constant_records) {
+        throw ParseError{};
+    }
+
+    auto re = Assembly{};
+    auto adts = reinterpret_cast<const ImageAdt*>(base + h.adts);
+    auto constructors = reinterpret_cast<const ConstructorInfo*>(base + h.constructors);
+    re.adt_table.reserve(h.num_adts);
+    for (uint32_t i = 0; i < h.num_adts; ++i) {
+        auto&& adt = adts[i];
+        if (adt.first_constructor > h.num_constructors
+         || adt.num_constructors > h.num_constructors - adt.first_constructor) {
+            throw ParseError{};
+        }
+        re.adt_table.push_back(AdtInfo::view(constructors + adt.first_constructor, adt.num_constructors));
+    }
+
+    // ConstantInfo holds pointers, so constants cannot be used in place;
+    // they are decoded into one array instead of one allocation per ADT.
+    auto constants = reinterpret_cast<const ImageConstant*>(base + h.constants);
+    auto&& records = image->constant_records;
+    records.resize(h.num_constant_records);
+    for (uint32_t i = 0; i < h.num_constant_records; ++i) {
+        auto&& c = constants[i];
+        switch (static_cast<ConstantType>(c.type)) {
+            case ConstantType::int8:
+                records[i] = ConstantInfo{static_cast<int8_t>(c.value)};
+                break;
+            case ConstantType::int32:
+                records[i] = ConstantInfo{static_cast<int32_t>(c.value)};
+                break;
+            case ConstantType::adt:
+                // fields come after their ADT, so constants cannot be cyclic
+                if (c.num_fields != 0 && (c.value <= i || c.value > h.num_constant_records
+                                          || c.num_fields > h.num_constant_records - c.value)) {
+                    throw ParseError{};
+                }
+                records[i] = ConstantInfo{AdtConstant{c.adt_table_index, c.constructor_index, c.num_fields,
+                                                      c.num_fields != 0 ? records.data() + c.value : nullptr}};
+                break;
+            default:
+                throw ParseError{};
+        }
+    }
+    re.constant_table.assign(records.begin(), records.begin() + h.num_constants);
+
+    auto functions = reinterpret_cast<const ImageFunction*>(base + h.functions);
+    auto code = reinterpret_cast<const Instruction*>(base + h.code);
+    re.function_table.reserve(h.num_functions);
+    for (uint32_t i = 0; i < h.num_functions; ++i) {
+        auto&& f = functions[i];
+        if (f.first_instruction > h.num_instructions
+         || f.num_instructions > h.num_instructions - f.first_instruction) {
+            throw ParseError{};
+        }
+        re.function_table.push_back(FunctionInfo{f.num_args, f.num_locals,
+            Bytecode::view(code + f.first_instruction, f.num_instructions)});
+    }
+    re.storage = std::move(image);
+    return re;
+}
+
+}
+
+void rvm::assembly::dump_image(const Assembly& a, std::ostream& out) {
+    auto h = ImageHeader{};
+    h.magic = IMAGE_MAGIC_NUMBER;
+    h.version = IMAGE_VERSION;
+    auto data = std::string(sizeof(ImageHeader), '\0');
+
+    h.adts = data.size();
+    h.num_adts = static_cast<uint32_t>(a.adt_table.size());
+    for (auto&& adt : a.adt_table) {
+        append(data, ImageAdt{h.num_constructors, static_cast<uint32_t>(adt.size())});
+        h.num_constructors += static_cast<uint32_t>(adt.size());
+    }
+    pad(data);
+    h.constructors = data.size();
+    for (auto&& adt : a.adt_table) {
+        for (auto&& c : adt) {
+            append(data, c);
+        }
+    }
+    pad(data);
+
+    auto records = std::vector<ImageConstant>(a.constant_table.size());
+    for (size_t i = 0; i < a.constant_table.size(); ++i) {
+        add_constant(records, i, a.constant_table[i]);
+    }
+    h.constants = data.size();
+    h.num_constants = static_cast<uint32_t>(a.constant_table.size());
+    h.num_constant_records = static_cast<uint32_t>(records.size());
+    for (auto&& r : records) {
+        append(data, r);
+    }
+    pad(data);
+
+    h.functions = data.size();
+    h.num_functions = static_cast<uint32_t>(a.function_table.size());
+    for (auto&& f : a.function_table) {
+        append(data, ImageFunction{f.num_args, f.num_locals, h.num_instructions,
+                                   static_cast<uint32_t>(f.code.size()), 0});
+        h.num_instructions += static_cast<uint32_t>(f.code.size());
+    }
+    pad(data);
+    h.code = data.size();
+    for (auto&& f : a.function_table) {
+        for (auto&& i : f.code) {
+            // padding bytes are written as zeros
+            char bytes[sizeof(Instruction)] = {};
+            memcpy(bytes + offsetof(Instruction, op), &i.op, sizeof(i.op));
+            memcpy(bytes + offsetof(Instruction, index), &i.index, sizeof(i.index));
+            memcpy(bytes + offsetof(Instruction, index2), &i.index2, sizeof(i.index2));
+            data.append(bytes, sizeof(bytes));
+        }
+    }
+    pad(data);
+
+    h.size = data.size();
+    memcpy(&data[0], &h, sizeof(h));
+    out.write(data.data(), static_cast<std::streamsize>(data.size()));
+}
+
+Assembly Assembly::load(const std::string& path) {
+    auto fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw ParseError{};
+    }
+    struct stat st;
+    unsigned char magic[4];
+    if (fstat(fd, &st) != 0 || st.st_size < 4 || pread(fd, magic, 4, 0) != 4) {
+        close(fd);
+        throw ParseError{};
+    }
+    // the stream format starts with MAGIC_NUMBER, big-endian
+    auto stream_magic = uint32_t{magic[0]} << 24 | uint32_t{magic[1]} << 16
+                      | uint32_t{magic[2]} << 8 | uint32_t{magic[3]};
+    if (stream_magic == MAGIC_NUMBER) {
+        close(fd);
+        auto in = std::ifstream{path, std::ios_base::in | std::ios_base::binary};
+        return parse(in);
+    }
+    auto size = static_cast<size_t>(st.st_size);
+    auto memory = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED) {
+        throw ParseError{};
+    }
+    auto image = std::make_shared<MappedImage>();
+    image->memory = memory;
+    image->size = size;
+    return map_image(memory, size, std::move(image));
+}
@@ -57,6 +57,17 @@ enum class Operation: int8_t {
     ldctor,
     ldfld,  // field_index
     stfld,  // field_index
+
+    tailcall,   // #function_table
+    tailcalla,
+
+    // Jump tables. The #entries instructions that follow are br, one for
+    // each value 0 .. #entries - 1 of what is popped; control goes to that
+    // br, or past the table when the value is out of range. switch_ pops an
+    // int32, compared unsigned, and switchctor an ADT, dispatching on its
+    // constructor index.
+    switch_,    // #entries
+    switchctor, // #entries
 };
 
 using index_t = uint16_t;
@@ -71,7 +82,11 @@ struct Instruction {
 
     Instruction() = default;
     explicit Instruction(Operation o): op{o} {}
-    Instruction(Operation o, OperandType t): op{o}, type{t} {}
+    // Assigned over index{0}: initialising type leaves the other byte of
+    // index undefined, and instructions are compared and written by index.
+    Instruction(Operation o, OperandType t): op{o} {
+        type = t;
+    }
     Instruction(Operation o, index_t d): op{o}, index{d} {}
     Instruction(Operation o, index_t d, sindex_t s): op{o}, index{d}, index2{s} {}
 };
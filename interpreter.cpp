@@ -1,38 +1,45 @@
 #include "interpreter.h"
+#include <algorithm>
 #include <functional>
 #include <stdlib.h>
+#include <string.h>
 
 using namespace rvm;
 using namespace rvm::interpreter;
 using namespace rvm::assembly;
 
 namespace {
-    Operand pop(std::vector<Operand>& v) {
+    Operand pop(VmStack& v) {
         auto re = v.back();
         v.pop_back();
         return re;
     }
 }
 
-FunctionInfo& Interpreter::current_function() {
+const FunctionInfo& Interpreter::current_function() const {
     return assembly.function_table[current_function_index];
 }
 
-index_t Interpreter::arg_offset(index_t idx) {
-    return frames.top()
-         - 2
-         - current_function().num_args
-         + idx;
-}
-
-index_t Interpreter::local_offset(index_t idx) {
-    return frames.top() + idx;
-}
-
 void Interpreter::enter(index_t idx) {
     operand_stack.push_back(Operand{current_function_index});
     operand_stack.push_back(Operand{program_counter});
-    frames.push(operand_stack.size());
+    operand_stack.push_back(Operand{slot(*frame)});
+    frame = operand_stack.data() + operand_stack.size();
+    ++frame_count;
+    operand_stack.resize(operand_stack.size()
+        + assembly.function_table[idx].num_locals);
+    current_function_index = idx;
+    program_counter = 0;
+}
+
+void Interpreter::tail_enter(index_t idx) {
+    auto num_args = assembly.function_table[idx].num_args;
+    auto args = &arg(0);
+    Operand header[FRAME_HEADER_SIZE];
+    std::copy(frame - FRAME_HEADER_SIZE, frame, header);
+    memmove(args, operand_stack.data() + operand_stack.size() - num_args, num_args * sizeof(Operand));
+    frame = std::copy(header, header + FRAME_HEADER_SIZE, args + num_args);
+    operand_stack.set_top(frame);
     operand_stack.resize(operand_stack.size()
         + assembly.function_table[idx].num_locals);
     current_function_index = idx;
@@ -41,26 +48,35 @@ void Interpreter::enter(index_t idx) {
 
 void Interpreter::call_native(index_t idx) {
     auto&& ni = native_table[idx];
-    auto re = ni.func(&operand_stack[operand_stack.size() - ni.num_args]);
-    operand_stack.resize(operand_stack.size() - ni.num_args);
-    operand_stack.push_back(re);
+    auto args = operand_stack.data() + operand_stack.size() - ni.num_args;
+    auto re = ni.func(args, ni.userdata);
+    // grows by one slot when there were no arguments
+    operand_stack.resize(operand_stack.size() - ni.num_args + 1);
+    *args = re;
+    if (ni.async) {
+        pending_token = re;
+        waiting = true;
+    }
 }
 
 void Interpreter::leave() {
     auto retval = pop(operand_stack);
-    if (frames.size() != 1) {
-        operand_stack.resize(frames.top());
+    if (frame_count != 1) {
+        operand_stack.resize(slot(*frame));
+        auto old_frame = pop(operand_stack).int32;
         auto old_pc = pop(operand_stack).int32;
         auto old_func = pop(operand_stack).int32;
         operand_stack.resize(operand_stack.size()
                            - current_function().num_args);
         operand_stack.push_back(retval);
-        frames.pop();
+        frame = operand_stack.data() + old_frame;
+        --frame_count;
         current_function_index = old_func;
         program_counter = old_pc;
     }
     else {
         running = false;
+        return_value = retval;
     }
 }
 
@@ -75,6 +91,7 @@ void Interpreter::arithmetic_binop(Func f) {
             break;
         }
         case OperandType::int32:
+        case OperandType::pointer:
         {
             auto y = pop(operand_stack).int32;
             auto x = pop(operand_stack).int32;
@@ -95,6 +112,7 @@ void Interpreter::logic_binop(Func f) {
             break;
         }
         case OperandType::int32:
+        case OperandType::pointer:
         {
             auto y = pop(operand_stack).int32;
             auto x = pop(operand_stack).int32;
@@ -115,6 +133,7 @@ void Interpreter::logic_binop_un(Func f) {
             break;
         }
         case OperandType::int32:
+        case OperandType::pointer:
         {
             auto y = static_cast<uint32_t>(pop(operand_stack).int32);
             auto x = static_cast<uint32_t>(pop(operand_stack).int32);
@@ -124,13 +143,160 @@ void Interpreter::logic_binop_un(Func f) {
     }
 }
 
+void Interpreter::restart(index_t idx, const std::vector<Operand>& args) {
+    if (idx >= assembly.function_table.size()
+        || args.size() != assembly.function_table[idx].num_args) {
+        throw IndexOutOfBoundError{};
+    }
+    operand_stack.resize(0);
+    for (auto&& a : args) {
+        operand_stack.push_back(a);
+    }
+    frame = operand_stack.data();
+    frame_count = 0;
+    current_function_index = 0;
+    program_counter = 0;
+    running = true;
+    waiting = false;
+    return_value = Operand{};
+    enter(idx);
+    if (options.record_profile) {
+        execution_profile.start(idx);
+    }
+}
+
 void Interpreter::run() {
-    while (running) {
-        step();
+    run_for(UINT64_MAX);
+}
+
+RunStatus Interpreter::run_for(uint64_t instructions) {
+    if (waiting) {
+        return RunStatus::waiting;
+    }
+    budget = static_cast<int64_t>(std::min<uint64_t>(instructions, INT64_MAX));
+    // Marks the position outside also when the run throws, or a Sampler
+    // would go on reading the one the run left and count its ticks as
+    // samples rather than idle.
+    struct Leave {
+        Position& position;
+        ~Leave() {
+            position.function = Position::outside;
+        }
+    } leave{position};
+    if (options.dispatch == Dispatch::threaded && !options.record_profile) {
+        if (module->options().unchecked) {
+            run_threaded<false>();
+        }
+        else {
+            run_threaded<true>();
+        }
+    }
+    else if (options.record_profile) {
+        run_steps<true>();
+    }
+    else {
+        run_steps<false>();
+    }
+    if (waiting) {
+        return RunStatus::waiting;
+    }
+    return running ? RunStatus::suspended : RunStatus::finished;
+}
+
+RunStatus Interpreter::run_until(std::chrono::steady_clock::time_point deadline) {
+    while (std::chrono::steady_clock::now() < deadline) {
+        auto status = run_for(deadline_slice);
+        if (status != RunStatus::suspended) {
+            return status;
+        }
+    }
+    return running ? RunStatus::suspended : RunStatus::finished;
+}
+
+std::vector<CallSiteStats> Interpreter::call_site_stats() const {
+    auto stats = std::vector<CallSiteStats>{};
+    auto&& locations = module->call_sites;
+    // the last cache belongs to the sites without one of their own
+    for (size_t i = 0; i + 1 < call_sites.size(); ++i) {
+        auto&& c = call_sites[i];
+        if (c.hits + c.misses == 0) {
+            continue;
+        }
+        auto targets = std::vector<index_t>{};
+        for (auto t : c.targets) {
+            if (t != -1) {
+                targets.push_back(static_cast<index_t>(t));
+            }
+        }
+        stats.push_back(CallSiteStats{locations[i].first, locations[i].second, c.hits, c.misses,
+                                      std::move(targets), c.megamorphic});
+    }
+    return stats;
+}
+
+std::vector<std::vector<int32_t>> Interpreter::call_targets() const {
+    auto targets = std::vector<std::vector<int32_t>>{};
+    for (auto&& f : assembly.function_table) {
+        targets.emplace_back(f.code.size(), -1);
+    }
+    for (auto&& s : call_site_stats()) {
+        if (s.targets.size() == 1 && !s.megamorphic) {
+            targets[s.function][s.pc] = s.targets[0];
+        }
+    }
+    return targets;
+}
+
+template <bool Profiled>
+void Interpreter::run_steps() {
+    position.function = Position::current;
+    while (running && !waiting && budget-- > 0) {
+        if (Profiled) {
+            profiled_step();
+        }
+        else {
+            execute();
+        }
     }
 }
 
 void Interpreter::step() {
+    if (options.record_profile) {
+        profiled_step();
+    }
+    else {
+        execute();
+    }
+}
+
+void Interpreter::profiled_step() {
+    auto function = current_function_index;
+    auto pc = program_counter;
+    auto&& i = current_function().code[pc];
+    auto frames = frame_count;
+    execution_profile.instruction(function, pc, i.op);
+    if (i.op == Operation::callnative) {
+        auto start = std::chrono::steady_clock::now();
+        execute();
+        execution_profile.native(i.index, std::chrono::steady_clock::now() - start);
+        return;
+    }
+    execute();
+    if (frame_count > frames) {
+        execution_profile.enter(current_function_index);
+    }
+    else if (frame_count < frames) {
+        execution_profile.leave();
+    }
+    else if (i.op == Operation::tailcall || i.op == Operation::tailcalla) {
+        execution_profile.tail_enter(current_function_index);
+    }
+    else if ((i.op == Operation::br || i.op == Operation::brtrue) && program_counter <= pc) {
+        execution_profile.back_edge(function, pc);
+    }
+}
+
+void Interpreter::execute() {
     switch (current_function().code[program_counter].op) {
         case Operation::add:
             arithmetic_binop(std::plus<>{});
@@ -160,6 +326,7 @@ void Interpreter::step() {
         {
             switch (current_function().code[program_counter].type) {
                 case OperandType::int32:
+                case OperandType::pointer:
                 {
                     auto x = pop(operand_stack).int32;
                     operand_stack.push_back(Operand{static_cast<int32_t>(~x)});
@@ -183,7 +350,7 @@ void Interpreter::step() {
         }
         case Operation::drop:
         {
-            if (operand_stack.size() == frames.top() + current_function().num_locals) {
+            if (operand_stack.size() == slot(frame[current_function().num_locals])) {
                 --program_counter;
                 throw StackUnderflowError{};
             }
@@ -195,44 +362,40 @@ void Interpreter::step() {
         case Operation::ldc:
         {
             auto idx = current_function().code[program_counter].index;
-            operand_stack.push_back(Operand{assembly.constant_table[idx]});
+            operand_stack.push_back(constants[idx]);
             break;
         }
         case Operation::ldloc:
         {
             auto idx = current_function().code[program_counter].index;
-            auto offset = local_offset(idx);
-            operand_stack.push_back(operand_stack[offset]);
+            operand_stack.push_back(frame[idx]);
             break;
         }
         case Operation::stloc:
         {
             auto idx = current_function().code[program_counter].index;
             auto v = pop(operand_stack);
-            auto offset = local_offset(idx);
-            operand_stack[offset] = v;
+            frame[idx] = v;
             break;
         }
         case Operation::ldarg:
         {
             auto idx = current_function().code[program_counter].index;
-            auto offset = arg_offset(idx);
-            operand_stack.push_back(operand_stack[offset]);
+            operand_stack.push_back(arg(idx));
             break;
         }
         case Operation::starg:
         {
             auto idx = current_function().code[program_counter].index;
             auto v = pop(operand_stack);
-            auto offset = arg_offset(idx);
-            operand_stack[offset] = v;
+            arg(idx) = v;
             break;
         }
         case Operation::call:
         {
             auto idx = current_function().code[program_counter].index;
             enter(idx);
-            break;
+            return;
         }
         case Operation::callnative:
         {
@@ -246,13 +409,13 @@ void Interpreter::step() {
         case Operation::ldloca:
         {
             auto idx = current_function().code[program_counter].index;
-            operand_stack.push_back(Operand{local_offset(idx)});
+            operand_stack.push_back(Operand{slot(frame[idx])});
             break;
         }
         case Operation::ldarga:
         {
             auto idx = current_function().code[program_counter].index;
-            operand_stack.push_back(Operand{arg_offset(idx)});
+            operand_stack.push_back(Operand{slot(arg(idx))});
             break;
         }
         case Operation::ldfuna:
@@ -269,7 +432,23 @@ void Interpreter::step() {
                 throw IndexOutOfBoundError{};
             }
             enter(idx);
-            break;
+            return;
+        }
+        case Operation::tailcall:
+        {
+            auto idx = current_function().code[program_counter].index;
+            tail_enter(idx);
+            return;
+        }
+        case Operation::tailcalla:
+        {
+            auto idx = static_cast<index_t>(pop(operand_stack).int32);
+            if (idx >= assembly.function_table.size()) {
+                --program_counter;
+                throw IndexOutOfBoundError{};
+            }
+            tail_enter(idx);
+            return;
         }
         case Operation::ldind:
         {
@@ -313,21 +492,21 @@ void Interpreter::step() {
             logic_binop_un(std::less_equal<>{});
             break;
         case Operation::tgt:
-            logic_binop(std::less<>{});
+            logic_binop(std::greater<>{});
             break;
         case Operation::tgt_un:
-            logic_binop_un(std::less<>{});
+            logic_binop_un(std::greater<>{});
             break;
         case Operation::tge:
-            logic_binop(std::less_equal<>{});
+            logic_binop(std::greater_equal<>{});
             break;
         case Operation::tge_un:
-            logic_binop_un(std::less_equal<>{});
+            logic_binop_un(std::greater_equal<>{});
             break;
         case Operation::br:
         {
             auto idx = current_function().code[program_counter].index;
-            program_counter = idx;
+            program_counter = idx - 1;
             break;
         }
         case Operation::brtrue:
@@ -343,7 +522,8 @@ void Interpreter::step() {
             auto idx = current_function().code[program_counter].index;
             auto ctor = current_function().code[program_counter].index2;
             auto n = assembly.adt_table[idx][ctor].num_fields;
-            auto adt = (Adt*) malloc(sizeof(Adt) + n);
+            auto adt = heap.make(idx, ctor, n, operand_stack.data(),
+                                 operand_stack.data() + operand_stack.size());
             while (n-- != 0) {
                 adt->fields[n] = pop(operand_stack);
             }
@@ -352,7 +532,7 @@ void Interpreter::step() {
         }
         case Operation::dladt:
         {
-            pop(operand_stack).free_adt();
+            heap.release(pop(operand_stack).adt);
             break;
         }
         case Operation::ldctor:
@@ -365,7 +545,7 @@ void Interpreter::step() {
         {
             auto idx = current_function().code[program_counter].index;
             auto adt = pop(operand_stack).adt;
-            if (idx >= assembly.adt_table[adt->adt_table_index][adt->constructor_index].num_fields) {
+            if (idx >= adt->num_fields) {
                 throw IndexOutOfBoundError{};
             }
             operand_stack.push_back(adt->fields[idx]);
@@ -376,7 +556,23 @@ void Interpreter::step() {
             auto idx = current_function().code[program_counter].index;
             auto adt = pop(operand_stack).adt;
             auto v = pop(operand_stack);
-            adt->fields[idx] = v;
+            if (idx >= adt->num_fields) {
+                throw IndexOutOfBoundError{};
+            }
+            if (Heap::is_constant(adt)) {
+                throw ConstantModificationError{};
+            }
+            heap.store(adt, idx, v);
+            break;
+        }
+        case Operation::switch_:
+        case Operation::switchctor:
+        {
+            auto&& i = current_function().code[program_counter];
+            auto v = pop(operand_stack);
+            auto k = i.op == Operation::switch_ ? static_cast<uint32_t>(v.int32) : v.adt->constructor_index;
+            // onto the k-th br of the table, or past the table
+            program_counter += static_cast<index_t>(std::min<uint32_t>(k, i.index));
             break;
         }
     }
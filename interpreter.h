@@ -1,70 +1,285 @@
 #pragma once
-#include <functional>
+#include <chrono>
+#include <memory>
 #include <stdint.h>
 #include <vector>
-#include <stack>
 #include "instruction.h"
 #include "assembly.h"
+#include "operand.h"
+#include "decoder.h"
+#include "fusion.h"
+#include "heap.h"
+#include "jit.h"
+#include "module.h"
+#include "native.h"
+#include "profile.h"
+#include "verifier.h"
+#include "vm_stack.h"
 
 namespace rvm {
 namespace interpreter {
 
-struct Adt;
-struct Operand {
-    union {
-        int8_t int8;
-        int32_t int32;
-        Adt* adt;
-    };
+// Execution engine used by Interpreter::run(). `switch_loop` is the
+// reference implementation that goes through step() for every instruction;
+// `threaded` runs pre-decoded code in a single loop and uses computed gotos
+// when the compiler supports them.
+enum class Dispatch {
+    switch_loop,
+    threaded
+};
 
-    Operand() = default;
-    explicit Operand(int8_t i): int8{i} {}
-    explicit Operand(int32_t i): int32{i} {}
-    explicit Operand(Adt* a): adt{a} {}
-    explicit Operand(assembly::ConstantInfo&);
-    void free_adt() {
-        free(adt);
-    }
+// What run_for() and run_until() stopped at.
+enum class RunStatus {
+    // the entry function returned, see Interpreter::result()
+    finished,
+    // the budget ran out; running again resumes where this stopped
+    suspended,
+    // an async native started an operation, see Interpreter::pending();
+    // running resumes once resume() has delivered its result
+    waiting
 };
-struct Adt {
-    index_t adt_table_index;
-    sindex_t constructor_index;
-    Operand fields[1];
+
+struct Options {
+    Dispatch dispatch{Dispatch::threaded};
+    // Superinstructions fused into the threaded code. Like `unchecked`, only
+    // used by an interpreter that loads its own Module; a shared one has
+    // these in its ModuleOptions.
+    FusionSet fusion{FusionSet::all()};
+    // Record a Profile: executions per operation, function and pc, loop
+    // back-edges, native times and call stacks; see detailed_profile().
+    // Profiling always runs on the reference loop, in an instantiation of
+    // its own, so runs without it pay nothing.
+    bool record_profile{false};
+    // Compile a function to machine code once its calls plus loop back-edges
+    // reach jit_threshold. Threaded engine only; see Interpreter::set_jit().
+    bool jit{true};
+    uint32_t jit_threshold{1000};
+    // Heap sizes, see Heap::Heap().
+    size_t nursery_size{size_t{1} << 20};
+    size_t heap_capacity{size_t{1} << 30};
+    // HeapMode::manual frees objects on dladt only.
+    HeapMode heap_mode{HeapMode::garbage_collected};
+    // Operand stack slots, frames included; calls that would go past this
+    // throw StackOverflowError.
+    size_t stack_size{size_t{1} << 20};
+    // Verify every function on the first run() and leave out the runtime
+    // checks verification makes redundant: stack space is reserved once per
+    // call instead of on every push, drop does not check for underflow and
+    // calla does not check targets that come from ldfuna. Threaded engine
+    // only; run() throws InvalidBytecodeError if verification fails.
+    bool unchecked{false};
 };
 
-struct NativeInfo {
-    std::function<Operand(Operand[])> func;
-    index_t num_args;
+// What the inline cache of one calla or tailcalla saw, see
+// Interpreter::call_site_stats().
+struct CallSiteStats {
+    index_t function;
+    index_t pc;
+    // calls to a target the cache held, and calls that had to look the
+    // target up and check it
+    uint64_t hits;
+    uint64_t misses;
+    // cached targets, the first one checked inline
+    std::vector<index_t> targets;
+    // saw more targets than the cache holds and stopped adding them
+    bool megamorphic;
+
+    double hit_rate() const {
+        auto calls = hits + misses;
+        return calls == 0 ? 0 : static_cast<double>(hits) / static_cast<double>(calls);
+    }
 };
 
 class Interpreter {
 public:
     struct IndexOutOfBoundError {};
     struct StackUnderflowError {};
+    using StackOverflowError = VmStack::StackOverflowError;
+    // stfld on an object loaded by ldc; constants are shared
+    struct ConstantModificationError {};
+    // add_native_function() on a module that is not this interpreter's alone
+    struct SharedModuleError {};
 
-    Interpreter(const assembly::Assembly& a): assembly(a) {
+    // Runs a module that other interpreters may be running at the same
+    // time; this one only owns the operand stack, the heap and the JIT.
+    Interpreter(std::shared_ptr<Module> m, Options o = Options{})
+        : module(std::move(m)), assembly(module->assembly()), options(o),
+          heap(o.nursery_size, o.heap_capacity, o.heap_mode), constants(module->constants()),
+          native_table(module->natives()), operand_stack(o.stack_size) {
+        heap.add_size_classes(assembly.adt_table);
+        if (options.dispatch == Dispatch::threaded) {
+            hotness.assign(assembly.function_table.size(), 0);
+        }
+        frame = operand_stack.data();
         enter(assembly::MAIN_FUNCTION_INDEX);
+        if (options.record_profile) {
+            execution_profile = Profile{assembly};
+            execution_profile.start(assembly::MAIN_FUNCTION_INDEX);
+        }
     }
+    Interpreter(const assembly::Assembly& a, Options o = Options{})
+        : Interpreter(std::make_shared<Module>(a, ModuleOptions{o.fusion, o.unchecked}), o) {}
+    // Runs until the entry function returns, or an async native has to wait.
     void run();
+    // Runs about `instructions` instructions and returns, so that one thread
+    // can take turns between many interpreters. The threaded engine and the
+    // JIT only look at the budget on calls, which charge the length of the
+    // callee, and on loop back-edges, which charge the length of the loop,
+    // so a run can overshoot by the straight-line code in between; the
+    // reference loop counts exactly.
+    RunStatus run_for(uint64_t instructions);
+    // Runs until the entry function returns or `deadline` has passed, in
+    // slices of run_for(deadline_slice) with a look at the clock in between.
+    RunStatus run_until(std::chrono::steady_clock::time_point deadline);
+    static constexpr uint64_t deadline_slice = uint64_t{1} << 16;
+    // Token returned by the async native the interpreter is waiting for.
+    Operand pending() const {
+        return pending_token;
+    }
+    // Completes the operation of pending(): `result` becomes the value of
+    // the callnative, and the next run continues after it.
+    void resume(Operand result) {
+        operand_stack.back() = result;
+        waiting = false;
+    }
     void step();
+    // Starts over with a call of function `idx`, dropping whatever was on
+    // the operand stack. The heap, the compiled code and the hotness counts
+    // are kept, so running many scripts this way is cheaper than creating
+    // an interpreter for each.
+    void restart(index_t idx, const std::vector<Operand>& args);
+    // Adds to the module, before the first run; Module::PreparedError after
+    // it. Only for an interpreter made from an Assembly, whose module no one
+    // else holds: natives of a shared module are every interpreter's, so
+    // they go through Module::add_native_function(), and this throws
+    // SharedModuleError.
     void add_native_function(NativeInfo f) {
-        native_table.push_back(f);
+        if (module.use_count() != 1) {
+            throw SharedModuleError{};
+        }
+        module->add_native_function(f);
+    }
+    // Executions per pc, for derive_fusion_set().
+    const ExecutionProfile& profile() const {
+        return execution_profile.pcs;
+    }
+    const Profile& detailed_profile() const {
+        return execution_profile;
+    }
+    // Inline caches of the calla and tailcalla sites the threaded engine
+    // has run, in no particular order; the reference loop does not cache.
+    std::vector<CallSiteStats> call_site_stats() const;
+    // By function and pc: the one target a calla or tailcalla has called,
+    // or -1 where it called none or several; for assembly::devirtualize().
+    std::vector<std::vector<int32_t>> call_targets() const;
+    // Compiled code is kept when the JIT is switched off, but no longer
+    // entered until it is switched on again.
+    void set_jit(bool enabled) {
+        options.jit = enabled;
+    }
+    // Whether function `idx` has been compiled to machine code.
+    bool compiled(index_t idx) const {
+        return jit.compiled(idx);
+    }
+    const HeapStats& heap_stats() const {
+        return heap.stats();
+    }
+    // Full collection with the operand stack as roots.
+    void collect_garbage() {
+        heap.collect(operand_stack.data(), operand_stack.data() + operand_stack.size());
+    }
+    std::vector<SizeClassStats> heap_size_classes() const {
+        return heap.size_classes();
+    }
+    // Gives unused heap memory back to the operating system, typically
+    // once run() has finished.
+    void trim_heap() {
+        heap.trim(operand_stack.data(), operand_stack.data() + operand_stack.size());
+    }
+    // value returned by the entry function once run() has finished
+    Operand result() const {
+        return return_value;
+    }
+    // Whether `o` refers to an object of this interpreter's heap, and so is
+    // only valid as long as the heap keeps it. Constants belong to the
+    // module and are not in it.
+    bool in_heap(Operand o) const {
+        return heap.contains(o);
     }
 
 private:
-    assembly::Assembly assembly{};
-    std::vector<NativeInfo> native_table{};
+    friend class Sampler;
 
-    std::vector<Operand> operand_stack{};
-    std::stack<int32_t> frames{{}};
+    std::shared_ptr<Module> module;
+    const assembly::Assembly& assembly;
+    Options options{};
+    Heap heap;
+    const std::vector<Operand>& constants;
+    const std::vector<NativeInfo>& native_table;
+    Profile execution_profile{};
+    Jit jit{};
+    std::vector<uint32_t> hotness{};
+    // One per calla and tailcalla of the module, by the number in the
+    // decoded instruction's `index`, and a last one for the sites without
+    // a number of their own, which never caches. A target is cached once
+    // it passed the checks calla makes, so a call to a cached target skips
+    // them; the first way is compared inline, the others on a miss of it.
+    struct CallSiteCache {
+        static constexpr size_t ways = 4;
+        int32_t targets[ways]{-1, -1, -1, -1};
+        uint64_t hits{0};
+        uint64_t misses{0};
+        bool megamorphic{false};
+    };
+    std::vector<CallSiteCache> call_sites{};
+
+    VmStack operand_stack;
+    // locals of the current function, see VmStack for the frame layout
+    Operand* frame{nullptr};
+    // frames on the stack, including the one of the entry function
+    uint32_t frame_count{0};
     index_t current_function_index{0};
-    index_t program_counter;
+    index_t program_counter{0};
     bool running{true};
+    Operand return_value{};
+    // instructions the current run may still execute
+    int64_t budget{INT64_MAX};
+    // suspended by an async native until resume()
+    bool waiting{false};
+    Operand pending_token{};
+    // Where the interpreter is, for a Sampler interrupting its thread: the
+    // function, the pc and the frame as a slot number. The threaded engine
+    // updates it on calls, returns and loop back-edges; the reference loop
+    // sets `function` to `current`, meaning current_function_index,
+    // program_counter and frame are up to date.
+    struct Position {
+        static constexpr int32_t current = -1;
+        // between runs
+        static constexpr int32_t outside = -2;
+        volatile int32_t function;
+        volatile int32_t pc;
+        volatile int32_t frame;
+    };
+    Position position{Position::outside, 0, 0};
 
-    assembly::FunctionInfo& current_function();
-    index_t arg_offset(index_t);
-    index_t local_offset(index_t);
+    template <bool Checked>
+    void run_threaded();
+    template <bool Profiled>
+    void run_steps();
+    void execute();
+    void profiled_step();
+    bool jit_ready(index_t);
+    index_t call_site_miss(CallSiteCache&, index_t target, bool check, int32_t arity);
+
+    const assembly::FunctionInfo& current_function() const;
+    Operand& arg(index_t idx) {
+        return frame[idx - FRAME_HEADER_SIZE - current_function().num_args];
+    }
+    int32_t slot(const Operand& o) const {
+        return static_cast<int32_t>(&o - operand_stack.data());
+    }
     void enter(index_t);
+    void tail_enter(index_t);
     void call_native(index_t);
     void leave();
     template <class Func>
@@ -75,22 +290,5 @@ private:
     void logic_binop_un(Func);
 };
 
-inline Operand::Operand(assembly::ConstantInfo& c) {
-    switch (c.type) {
-        case assembly::ConstantType::int8:
-            int8 = c.int8;
-            break;
-        case assembly::ConstantType::int32:
-            int32 = c.int32;
-            break;
-        case assembly::ConstantType::adt:
-            adt = (Adt*) malloc(sizeof(Adt) + c.adt.num_fields - 1);
-            for (auto i = c.adt.num_fields; i != 0; --i) {
-                adt->fields[i - 1] = Operand{c.adt.fields[i - 1]};
-            }
-            break;
-    }
-}
-
 }
 }
@@ -0,0 +1,693 @@
+#include "jit.h"
+#include <initializer_list>
+#include <string.h>
+#include <type_traits>
+#include <utility>
+#include "analysis.h"
+#include "interpreter.h"
+#if RVM_JIT
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+using namespace rvm;
+using namespace rvm::interpreter;
+using namespace rvm::assembly;
+
+#if RVM_JIT
+namespace {
+
+// Helper thunks called from compiled code. None of them may throw: there
+// is no unwind information for the compiled frames, so failures are
+// reported back and the compiled code exits to the interpreter, which
+// re-executes the instruction and raises the error itself, or rethrows
+// what the thunk left in JitRuntime::error.
+
+bool thunk_mkadt(JitRuntime* rt, Operand* args, uint32_t adt, uint32_t ctor, uint32_t n) {
+    try {
+        // the fields are still on the stack, so the collector sees them
+        auto re = rt->heap->make(static_cast<index_t>(adt), static_cast<sindex_t>(ctor),
+                                 static_cast<index_t>(n), rt->base, args + n);
+        memcpy(re->fields, args, n * sizeof(Operand));
+        args[0] = Operand{re};
+        return true;
+    }
+    catch (...) {
+        rt->error = std::current_exception();
+        return false;
+    }
+}
+
+void thunk_dladt(JitRuntime* rt, Operand* slot) {
+    rt->heap->release(slot->adt);
+}
+
+bool thunk_stfld(JitRuntime* rt, Operand* slots, uint32_t idx) {
+    if (idx >= slots[1].adt->num_fields || Heap::is_constant(slots[1].adt)) {
+        return false;
+    }
+    try {
+        rt->heap->store(slots[1].adt, static_cast<index_t>(idx), slots[0]);
+        return true;
+    }
+    catch (...) {
+        rt->error = std::current_exception();
+        return false;
+    }
+}
+
+bool thunk_callnative(JitRuntime* rt, Operand* args, uint32_t idx) {
+    try {
+        auto&& ni = (*rt->natives)[idx];
+        args[0] = ni.func(args, ni.userdata);
+        return true;
+    }
+    catch (...) {
+        rt->error = std::current_exception();
+        return false;
+    }
+}
+
+// Entering and leaving compiled code costs about as much as interpreting a
+// dozen instructions, so compiled code only pays off when it runs more than
+// that between a call, calla, ret or other exit and the next.
+constexpr size_t min_run = 16;
+
+// Whether compiled code would mostly be entering and leaving, which the
+// threaded engine does faster. A loop runs its body once per call it makes,
+// as the call returns into it; ret and tail calls leave the loop for good.
+// A function without loops runs all of it once per exit.
+bool call_bound(index_t idx, const FunctionInfo& f, const std::vector<NativeInfo>& natives) {
+    auto exits = [&](size_t from, size_t to, bool loop) {
+        auto re = size_t{0};
+        for (auto pc = from; pc <= to; ++pc) {
+            auto&& i = f.code[pc];
+            switch (i.op) {
+                case Operation::call:
+                case Operation::calla:
+                    ++re;
+                    break;
+                case Operation::tailcalla:
+                case Operation::ret:
+                    re += !loop;
+                    break;
+                case Operation::tailcall:
+                    re += !loop && i.index != idx;
+                    break;
+                case Operation::callnative:
+                    re += i.index >= natives.size() || natives[i.index].async;
+                    break;
+                default:
+                    break;
+            }
+        }
+        return re;
+    };
+    auto looped = false;
+    for (size_t pc = 0; pc < f.code.size(); ++pc) {
+        auto&& i = f.code[pc];
+        auto back = (i.op == Operation::br || i.op == Operation::brtrue) && i.index <= pc;
+        auto self = i.op == Operation::tailcall && i.index == idx;
+        if (!back && !self) {
+            continue;
+        }
+        auto from = self ? size_t{0} : size_t{i.index};
+        if (pc - from + 1 >= min_run * exits(from, pc, true)) {
+            return false;
+        }
+        looped = true;
+    }
+    return looped || f.code.size() < min_run * exits(0, f.code.size() - 1, false);
+}
+
+// Compiled code calls nothrow natives directly and takes the result from rax.
+static_assert(std::is_trivially_copyable<Operand>::value && sizeof(Operand) == 8,
+              "Operand must be returned in a register");
+
+// disp8 of JitRuntime::budget, loaded into r14 on entry and stored back on exit
+constexpr uint8_t budget_offset = offsetof(JitRuntime, budget);
+static_assert(offsetof(JitRuntime, budget) < 128, "budget must be reachable with a disp8");
+
+enum Register {
+    rax = 0,
+    rcx = 1,
+    rdx = 2,
+    rsi = 6,
+    rdi = 7,
+    r8 = 8
+};
+
+// Condition codes, as the low nibble of setcc/jcc.
+enum Condition: uint8_t {
+    below = 0x2,
+    above_equal = 0x3,
+    equal = 0x4,
+    not_equal = 0x5,
+    below_equal = 0x6,
+    above = 0x7,
+    less = 0xc,
+    greater_equal = 0xd,
+    less_equal = 0xe,
+    greater = 0xf
+};
+
+// Machine code for one function. The frame pointer lives in rbx, the base
+// of the operand stack in r12, the JitRuntime in r13 and its budget in r14;
+// rax, rcx and rdx are scratch and never hold a value across instructions.
+class Emitter {
+public:
+    std::vector<uint8_t> bytes{};
+
+    size_t here() const {
+        return bytes.size();
+    }
+    void emit(std::initializer_list<uint8_t> bs) {
+        bytes.insert(bytes.end(), bs);
+    }
+    void u32(uint32_t v) {
+        for (auto i = 0; i < 4; ++i) {
+            bytes.push_back(static_cast<uint8_t>(v >> (8 * i)));
+        }
+    }
+    void u64(uint64_t v) {
+        u32(static_cast<uint32_t>(v));
+        u32(static_cast<uint32_t>(v >> 32));
+    }
+    void patch32(size_t at, int32_t v) {
+        for (auto i = 0; i < 4; ++i) {
+            bytes[at + i] = static_cast<uint8_t>(static_cast<uint32_t>(v) >> (8 * i));
+        }
+    }
+
+    // `opcode` with a [rbx + 8 * slot] memory operand and `reg` in ModRM.reg
+    void slot(std::initializer_list<uint8_t> opcode, int reg, int32_t s) {
+        emit(opcode);
+        auto disp = s * static_cast<int32_t>(sizeof(Operand));
+        if (disp >= -128 && disp <= 127) {
+            emit({static_cast<uint8_t>(0x40 | reg << 3 | 3), static_cast<uint8_t>(disp)});
+        }
+        else {
+            emit({static_cast<uint8_t>(0x80 | reg << 3 | 3)});
+            u32(static_cast<uint32_t>(disp));
+        }
+    }
+    void load64(Register r, int32_t s) { slot({0x48, 0x8b}, r, s); }
+    void store64(int32_t s, Register r) { slot({0x48, 0x89}, r, s); }
+    void load32(Register r, int32_t s) { slot({0x8b}, r, s); }
+    void lea(Register r, int32_t s) { slot({0x48, 0x8d}, r, s); }
+    void mov_imm32(Register r, uint32_t v) {
+        if (r >= r8) {
+            emit({0x41});
+        }
+        emit({static_cast<uint8_t>(0xb8 + (r & 7))});
+        u32(v);
+    }
+    void mov_imm64(Register r, uint64_t v) {
+        emit({static_cast<uint8_t>(r >= r8 ? 0x49 : 0x48), static_cast<uint8_t>(0xb8 + (r & 7))});
+        u64(v);
+    }
+    void zero_extend_al() { emit({0x0f, 0xb6, 0xc0}); }
+    void call(const void* f) {
+        mov_imm64(rax, reinterpret_cast<uint64_t>(f));
+        emit({0xff, 0xd0});
+    }
+    void runtime_to_rdi() { emit({0x4c, 0x89, 0xef}); }
+    // returns the position of the rel32 to patch
+    size_t jmp() {
+        emit({0xe9});
+        u32(0);
+        return here() - 4;
+    }
+    size_t jcc(Condition c) {
+        emit({0x0f, static_cast<uint8_t>(0x80 | c)});
+        u32(0);
+        return here() - 4;
+    }
+    // setcc al; movzx eax, al
+    void setcc(Condition c) {
+        emit({0x0f, static_cast<uint8_t>(0x90 | c), 0xc0});
+        zero_extend_al();
+    }
+    // setcc al; neg al; movzx eax, al: -1 or 0, as teq and tne push
+    void setcc_mask(Condition c) {
+        emit({0x0f, static_cast<uint8_t>(0x90 | c), 0xc0, 0xf6, 0xd8});
+        zero_extend_al();
+    }
+};
+
+class Compiler {
+public:
+    Compiler(const Assembly& a, index_t idx, const StackLayout& layout,
+             const std::vector<NativeInfo>& natives, const std::vector<Operand>& constants)
+        : a(a), idx(idx), f(a.function_table[idx]), layout(layout), natives(natives),
+          constants(constants) {}
+
+    std::vector<uint8_t> compile() {
+        // push rbx; push r12; push r13; push r14; sub rsp, 8
+        e.emit({0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x48, 0x83, 0xec, 0x08});
+        // mov rbx, rdi; mov r12, rsi; mov r13, rcx; mov edx, edx
+        e.emit({0x48, 0x89, 0xfb, 0x49, 0x89, 0xf4, 0x49, 0x89, 0xcd, 0x89, 0xd2});
+        // mov r14, [r13 + budget]
+        e.emit({0x4d, 0x8b, 0x75, budget_offset});
+        // lea rax, [rip + table]; movsxd rdx, [rax + 4 * rdx]; add rax, rdx; jmp rax
+        e.emit({0x48, 0x8d, 0x05});
+        e.u32(0);
+        table_refs.push_back(e.here() - 4);
+        e.emit({0x48, 0x63, 0x14, 0x90, 0x48, 0x01, 0xd0, 0xff, 0xe0});
+        epilogue = e.here();
+        // mov [r13 + budget], r14; add rsp, 8; pop r14; pop r13; pop r12; pop rbx; ret
+        e.emit({0x4d, 0x89, 0x75, budget_offset});
+        e.emit({0x48, 0x83, 0xc4, 0x08, 0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c, 0x5b, 0xc3});
+
+        for (size_t pc = 0; pc < f.code.size(); ++pc) {
+            labels.push_back(e.here());
+            if (layout.depth[pc] < 0) {
+                exit(pc);
+            }
+            else {
+                instruction(pc, f.num_locals + layout.depth[pc]);
+            }
+        }
+        for (auto&& fixup : fixups) {
+            e.patch32(fixup.first, static_cast<int32_t>(labels[fixup.second] - (fixup.first + 4)));
+        }
+
+        while (e.here() % 4 != 0) {
+            e.emit({0xcc});
+        }
+        auto table = e.here();
+        for (auto&& at : table_refs) {
+            e.patch32(at, static_cast<int32_t>(table - (at + 4)));
+        }
+        for (auto&& label : labels) {
+            e.u32(static_cast<uint32_t>(static_cast<int32_t>(label - table)));
+        }
+        return std::move(e.bytes);
+    }
+
+private:
+    const Assembly& a;
+    index_t idx;
+    const FunctionInfo& f;
+    const StackLayout& layout;
+    const std::vector<NativeInfo>& natives;
+    const std::vector<Operand>& constants;
+    Emitter e{};
+    size_t epilogue{0};
+    std::vector<size_t> labels{};
+    // (rel32 position, target pc)
+    std::vector<std::pair<size_t, size_t>> fixups{};
+    // rel32 positions of lea rax/rdx, [rip + table]
+    std::vector<size_t> table_refs{};
+
+    void exit(size_t pc) {
+        e.mov_imm32(rax, static_cast<uint32_t>(pc));
+        auto at = e.jmp();
+        e.patch32(at, static_cast<int32_t>(epilogue - (at + 4)));
+    }
+    // continues at the next instruction when the thunk returned true
+    void exit_unless_al(size_t pc) {
+        // test al, al; jnz +10
+        e.emit({0x84, 0xc0, 0x75, 0x0a});
+        exit(pc);
+    }
+    void branch(size_t at, size_t target) {
+        fixups.emplace_back(at, target);
+    }
+    // Jumps back to `target` after charging `cost` instructions to the
+    // budget, or leaves there once the budget is used up.
+    void back_edge(size_t target, size_t cost) {
+        // sub r14, cost
+        e.emit({0x49, 0x81, 0xee});
+        e.u32(static_cast<uint32_t>(cost));
+        branch(e.jcc(greater), target);
+        exit(target);
+    }
+
+    void arithmetic(OperandType t, std::initializer_list<uint8_t> opcode, int32_t top) {
+        e.load32(rax, top - 2);
+        e.slot(opcode, rax, top - 1);
+        if (t == OperandType::int8) {
+            e.zero_extend_al();
+        }
+        e.store64(top - 2, rax);
+    }
+    void division(OperandType t, bool remainder, int32_t top) {
+        if (t == OperandType::int8) {
+            // movsx eax, byte [x]; movsx ecx, byte [y]; cdq; idiv ecx
+            e.slot({0x0f, 0xbe}, rax, top - 2);
+            e.slot({0x0f, 0xbe}, rcx, top - 1);
+            e.emit({0x99, 0xf7, 0xf9});
+        }
+        else {
+            // mov eax, [x]; cdq; idiv dword [y]
+            e.load32(rax, top - 2);
+            e.emit({0x99});
+            e.slot({0xf7}, 7, top - 1);
+        }
+        if (remainder) {
+            e.emit({0x89, 0xd0});
+        }
+        if (t == OperandType::int8) {
+            e.zero_extend_al();
+        }
+        e.store64(top - 2, rax);
+    }
+    void compare(OperandType t, bool is_unsigned, Condition s, Condition u, int32_t top) {
+        if (t == OperandType::int8) {
+            auto widen = static_cast<uint8_t>(is_unsigned ? 0xb6 : 0xbe);
+            e.slot({0x0f, widen}, rax, top - 2);
+            e.slot({0x0f, widen}, rcx, top - 1);
+            // cmp eax, ecx
+            e.emit({0x39, 0xc8});
+        }
+        else {
+            e.load32(rax, top - 2);
+            e.slot({0x3b}, rax, top - 1);
+        }
+        e.setcc(is_unsigned ? u : s);
+        e.store64(top - 2, rax);
+    }
+    void equality(Condition c, int32_t top) {
+        e.load64(rax, top - 2);
+        e.slot({0x48, 0x3b}, rax, top - 1);
+        e.setcc_mask(c);
+        e.store64(top - 2, rax);
+    }
+
+    void instruction(size_t pc, int32_t top) {
+        auto&& i = f.code[pc];
+        auto arg = [&](index_t idx) {
+            return -FRAME_HEADER_SIZE - static_cast<int32_t>(f.num_args) + idx;
+        };
+        switch (i.op) {
+            case Operation::add: arithmetic(i.type, {0x03}, top); break;
+            case Operation::sub: arithmetic(i.type, {0x2b}, top); break;
+            case Operation::mul: arithmetic(i.type, {0x0f, 0xaf}, top); break;
+            case Operation::band: arithmetic(i.type, {0x23}, top); break;
+            case Operation::bor: arithmetic(i.type, {0x0b}, top); break;
+            case Operation::bxor: arithmetic(i.type, {0x33}, top); break;
+            case Operation::div: division(i.type, false, top); break;
+            case Operation::rem: division(i.type, true, top); break;
+            case Operation::bnot:
+                e.load32(rax, top - 1);
+                e.emit({0xf7, 0xd0});
+                if (i.type == OperandType::int8) {
+                    e.zero_extend_al();
+                }
+                e.store64(top - 1, rax);
+                break;
+            case Operation::dup:
+                e.load64(rax, top - 1);
+                e.store64(top, rax);
+                break;
+            case Operation::drop:
+                break;
+            case Operation::ldc:
+            {
+                auto&& c = a.constant_table[i.index];
+                if (c.type == ConstantType::int8) {
+                    e.mov_imm32(rax, static_cast<uint8_t>(c.int8));
+                }
+                else if (c.type == ConstantType::int32) {
+                    e.mov_imm32(rax, static_cast<uint32_t>(c.int32));
+                }
+                else {
+                    // materialized constants never move
+                    e.mov_imm64(rax, reinterpret_cast<uint64_t>(constants[i.index].adt));
+                }
+                e.store64(top, rax);
+                break;
+            }
+            case Operation::ldloc:
+                e.load64(rax, i.index);
+                e.store64(top, rax);
+                break;
+            case Operation::stloc:
+                e.load64(rax, top - 1);
+                e.store64(i.index, rax);
+                break;
+            case Operation::ldarg:
+                e.load64(rax, arg(i.index));
+                e.store64(top, rax);
+                break;
+            case Operation::starg:
+                e.load64(rax, top - 1);
+                e.store64(arg(i.index), rax);
+                break;
+            case Operation::tailcall:
+                if (i.index != idx) {
+                    exit(pc);
+                    break;
+                }
+                // a self tail call is a loop: new arguments, fresh locals
+                for (index_t k = 0; k < f.num_args; ++k) {
+                    e.load64(rax, top - f.num_args + k);
+                    e.store64(arg(k), rax);
+                }
+                // xor eax, eax
+                e.emit({0x31, 0xc0});
+                for (index_t k = 0; k < f.num_locals; ++k) {
+                    e.store64(k, rax);
+                }
+                back_edge(0, pc + 1);
+                break;
+            case Operation::call:
+            case Operation::calla:
+            case Operation::tailcalla:
+            case Operation::ret:
+                exit(pc);
+                break;
+            case Operation::callnative:
+            {
+                // async natives suspend the interpreter, which compiled
+                // code cannot do
+                if (i.index >= natives.size() || natives[i.index].async) {
+                    exit(pc);
+                    break;
+                }
+                auto&& ni = natives[i.index];
+                auto args = top - static_cast<int32_t>(ni.num_args);
+                if (ni.nothrow) {
+                    e.lea(rdi, args);
+                    e.mov_imm64(rsi, reinterpret_cast<uint64_t>(ni.userdata));
+                    e.call(reinterpret_cast<const void*>(ni.func));
+                    e.store64(args, rax);
+                    break;
+                }
+                e.runtime_to_rdi();
+                e.lea(rsi, args);
+                e.mov_imm32(rdx, i.index);
+                e.call(reinterpret_cast<const void*>(&thunk_callnative));
+                exit_unless_al(pc);
+                break;
+            }
+            case Operation::ldloca:
+            case Operation::ldarga:
+                e.lea(rax, i.op == Operation::ldloca ? i.index : arg(i.index));
+                // sub rax, r12; shr rax, 3; mov eax, eax
+                e.emit({0x4c, 0x29, 0xe0, 0x48, 0xc1, 0xe8, 0x03, 0x89, 0xc0});
+                e.store64(top, rax);
+                break;
+            case Operation::ldfuna:
+                e.mov_imm32(rax, i.index);
+                e.store64(top, rax);
+                break;
+            case Operation::ldind:
+                // movsxd rax, dword [p]; mov rax, [r12 + 8 * rax]
+                e.slot({0x48, 0x63}, rax, top - 1);
+                e.emit({0x49, 0x8b, 0x04, 0xc4});
+                e.store64(top - 1, rax);
+                break;
+            case Operation::stind:
+                // movsxd rax, dword [p]; mov rcx, [v]; mov [r12 + 8 * rax], rcx
+                e.slot({0x48, 0x63}, rax, top - 2);
+                e.load64(rcx, top - 1);
+                e.emit({0x49, 0x89, 0x0c, 0xc4});
+                break;
+            case Operation::teq: equality(equal, top); break;
+            case Operation::tne: equality(not_equal, top); break;
+            case Operation::tlt: compare(i.type, false, less, below, top); break;
+            case Operation::tlt_un: compare(i.type, true, less, below, top); break;
+            case Operation::tle: compare(i.type, false, less_equal, below_equal, top); break;
+            case Operation::tle_un: compare(i.type, true, less_equal, below_equal, top); break;
+            case Operation::tgt: compare(i.type, false, greater, above, top); break;
+            case Operation::tgt_un: compare(i.type, true, greater, above, top); break;
+            case Operation::tge: compare(i.type, false, greater_equal, above_equal, top); break;
+            case Operation::tge_un: compare(i.type, true, greater_equal, above_equal, top); break;
+            case Operation::br:
+                if (i.index <= pc) {
+                    back_edge(i.index, pc - i.index + 1);
+                }
+                else {
+                    branch(e.jmp(), i.index);
+                }
+                break;
+            case Operation::brtrue:
+                // cmp byte [c], 0
+                e.slot({0x80}, 7, top - 1);
+                e.emit({0x00});
+                if (i.index <= pc) {
+                    auto skip = e.jcc(equal);
+                    back_edge(i.index, pc - i.index + 1);
+                    e.patch32(skip, static_cast<int32_t>(e.here() - (skip + 4)));
+                }
+                else {
+                    branch(e.jcc(not_equal), i.index);
+                }
+                break;
+            case Operation::switch_:
+            case Operation::switchctor:
+                if (i.op == Operation::switch_) {
+                    e.load32(rax, top - 1);
+                }
+                else {
+                    // mov rax, [adt]; movzx eax, byte [rax + offsetof(constructor_index)]
+                    e.load64(rax, top - 1);
+                    e.emit({0x0f, 0xb6, 0x40, static_cast<uint8_t>(offsetof(Adt, constructor_index))});
+                }
+                // cmp eax, #entries; jb +5; mov eax, #entries
+                e.emit({0x3d});
+                e.u32(i.index);
+                e.emit({0x72, 0x05});
+                e.mov_imm32(rax, i.index);
+                // The label of entry k is the pc + 1 + k-th of the table.
+                // add eax, pc + 1; lea rdx, [rip + table]
+                e.emit({0x05});
+                e.u32(static_cast<uint32_t>(pc + 1));
+                e.emit({0x48, 0x8d, 0x15});
+                e.u32(0);
+                table_refs.push_back(e.here() - 4);
+                // movsxd rax, [rdx + 4 * rax]; add rax, rdx; jmp rax
+                e.emit({0x48, 0x63, 0x04, 0x82, 0x48, 0x01, 0xd0, 0xff, 0xe0});
+                break;
+            case Operation::mkadt:
+            {
+                auto n = a.adt_table[i.index][i.index2].num_fields;
+                e.runtime_to_rdi();
+                e.lea(rsi, top - static_cast<int32_t>(n));
+                e.mov_imm32(rdx, i.index);
+                e.mov_imm32(rcx, i.index2);
+                e.mov_imm32(r8, n);
+                e.call(reinterpret_cast<const void*>(&thunk_mkadt));
+                exit_unless_al(pc);
+                break;
+            }
+            case Operation::dladt:
+                e.runtime_to_rdi();
+                e.lea(rsi, top - 1);
+                e.call(reinterpret_cast<const void*>(&thunk_dladt));
+                break;
+            case Operation::ldctor:
+                // mov rax, [adt]; movzx eax, byte [rax + offsetof(constructor_index)]
+                e.load64(rax, top - 1);
+                e.emit({0x0f, 0xb6, 0x40, static_cast<uint8_t>(offsetof(Adt, constructor_index))});
+                e.store64(top - 1, rax);
+                break;
+            case Operation::ldfld:
+                // mov rax, [adt]; cmp word [rax + offsetof(num_fields)], index; ja ok
+                e.load64(rax, top - 1);
+                e.emit({0x66, 0x81, 0x78, static_cast<uint8_t>(offsetof(Adt, num_fields))});
+                e.emit({static_cast<uint8_t>(i.index), static_cast<uint8_t>(i.index >> 8)});
+                e.emit({0x77, 0x0a});
+                exit(pc);
+                // ok: mov rax, [rax + offsetof(fields[index])]
+                e.emit({0x48, 0x8b, 0x80});
+                e.u32(static_cast<uint32_t>(offsetof(Adt, fields) + i.index * sizeof(Operand)));
+                e.store64(top - 1, rax);
+                break;
+            case Operation::stfld:
+                e.runtime_to_rdi();
+                e.lea(rsi, top - 2);
+                e.mov_imm32(rdx, i.index);
+                e.call(reinterpret_cast<const void*>(&thunk_stfld));
+                exit_unless_al(pc);
+                break;
+        }
+    }
+};
+
+}
+#endif
+
+Jit::Jit(Jit&& other): functions(std::move(other.functions)) {
+    other.functions.clear();
+}
+
+Jit& Jit::operator=(Jit&& other) {
+    if (this != &other) {
+        release();
+        functions = std::move(other.functions);
+        other.functions.clear();
+    }
+    return *this;
+}
+
+Jit::~Jit() {
+    release();
+}
+
+void Jit::release() {
+#if RVM_JIT
+    for (auto&& c : functions) {
+        if (c.memory != nullptr) {
+            munmap(c.memory, c.size);
+        }
+    }
+#endif
+    functions.clear();
+}
+
+bool Jit::compile(const Assembly& a, index_t idx, const std::vector<NativeInfo>& natives,
+                  const std::vector<Operand>& constants) {
+#if RVM_JIT
+    auto&& f = a.function_table[idx];
+    if (f.code.empty() || call_bound(idx, f, natives)) {
+        return false;
+    }
+    auto arities = std::vector<index_t>{};
+    for (auto&& n : natives) {
+        arities.push_back(n.num_args);
+    }
+    auto layout = StackLayout{};
+    try {
+        layout = analyze_stack(a, f, arities);
+    }
+    catch (InvalidBytecodeError&) {
+        return false;
+    }
+
+    auto code = Compiler{a, idx, layout, natives, constants}.compile();
+    auto page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    auto size = (code.size() + page - 1) / page * page;
+    auto memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        return false;
+    }
+    memcpy(memory, code.data(), code.size());
+    if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(memory, size);
+        return false;
+    }
+
+    if (functions.size() < a.function_table.size()) {
+        functions.resize(a.function_table.size());
+    }
+    auto&& c = functions[idx];
+    if (c.memory != nullptr) {
+        munmap(c.memory, c.size);
+    }
+    c.entry = reinterpret_cast<Entry>(memory);
+    c.memory = memory;
+    c.size = size;
+    c.frame_size = f.num_locals + layout.max_depth;
+    c.depth = std::move(layout.depth);
+    return true;
+#else
+    (void) a;
+    (void) idx;
+    (void) natives;
+    (void) constants;
+    return false;
+#endif
+}
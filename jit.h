@@ -0,0 +1,93 @@
+#pragma once
+#include <exception>
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include "instruction.h"
+#include "assembly.h"
+
+// Baseline template JIT. Only available on x86-64 with POSIX mmap; elsewhere
+// Jit::compile() always fails and everything stays interpreted.
+#if !defined(RVM_NO_JIT) && defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+#define RVM_JIT 1
+#else
+#define RVM_JIT 0
+#endif
+
+namespace rvm {
+namespace interpreter {
+
+struct Operand;
+struct NativeInfo;
+class Heap;
+
+// State shared by compiled code and the helper thunks it calls.
+struct JitRuntime {
+    const assembly::Assembly* assembly;
+    const std::vector<NativeInfo>* natives;
+    Heap* heap;
+    // operand stack the compiled code runs on, the bottom of the GC roots
+    Operand* base;
+    // instructions left before the run suspends, see Interpreter::run_for();
+    // compiled code charges loop back-edges and exits once it is used up
+    int64_t budget;
+    // set when a native function threw; compiled code then exits at the
+    // callnative and the interpreter rethrows
+    std::exception_ptr error;
+};
+
+// Compiles whole functions to machine code that works directly on the
+// interpreter's operand stack: every operand stack slot lives at a fixed
+// offset from the frame pointer, given by the stack depth analysis, so each
+// instruction of the compiled code can be entered or left independently.
+// Compiled code returns the pc of the first instruction it leaves to the
+// interpreter: calls, tail calls to other functions and ret, so that frames
+// are only ever built by the interpreter, plus anything the JIT does not
+// handle. A tail call of the function to itself becomes a jump. Loop
+// back-edges also leave, at the branch target, when the budget runs out.
+class Jit {
+public:
+    Jit() = default;
+    Jit(const Jit&) = delete;
+    Jit(Jit&&);
+    Jit& operator=(const Jit&) = delete;
+    Jit& operator=(Jit&&);
+    ~Jit();
+
+    // Returns false when the function cannot be compiled, or when it calls
+    // or returns too often for compiled code to pay off, so it stays
+    // interpreted. `constants` are the materialized constant table, embedded
+    // into the code.
+    bool compile(const assembly::Assembly&, index_t idx, const std::vector<NativeInfo>&,
+                 const std::vector<Operand>& constants);
+    bool compiled(index_t idx) const {
+        return idx < functions.size() && functions[idx].entry != nullptr;
+    }
+    // Operand stack depth expected at `pc`, not counting locals.
+    int32_t depth(index_t idx, index_t pc) const {
+        return functions[idx].depth[pc];
+    }
+    // Slots above the frame pointer the compiled code may touch.
+    size_t frame_size(index_t idx) const {
+        return functions[idx].frame_size;
+    }
+    index_t run(index_t idx, Operand* fp, Operand* base, index_t pc, JitRuntime* rt) const {
+        return static_cast<index_t>(functions[idx].entry(fp, base, pc, rt));
+    }
+
+private:
+    using Entry = uint32_t (*)(Operand* fp, Operand* base, uint32_t pc, JitRuntime*);
+    struct Compiled {
+        Entry entry{nullptr};
+        void* memory{nullptr};
+        size_t size{0};
+        size_t frame_size{0};
+        std::vector<int32_t> depth{};
+    };
+    std::vector<Compiled> functions{};
+
+    void release();
+};
+
+}
+}
@@ -3,9 +3,9 @@
 #include <fstream>
 #include <stdlib.h>
 
-rvm::interpreter::Operand native_print_int32(rvm::interpreter::Operand* v) {
-    std::cout << v[0].int32 << std::endl;
-    return rvm::interpreter::Operand{0};
+int32_t native_print_int32(int32_t v) {
+    std::cout << v << std::endl;
+    return 0;
 }
 
 int main() {
@@ -47,7 +47,7 @@ int main() {
     assembly::validate(newassfile);
 
     auto vm = interpreter::Interpreter{newassfile};
-    vm.add_native_function({native_print_int32, 1});
+    vm.add_native_function(interpreter::native<native_print_int32>());
     vm.run();
 
     auto a = '\0';
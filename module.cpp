@@ -0,0 +1,80 @@
+#include "module.h"
+#include <algorithm>
+#include <utility>
+#include "analysis.h"
+#include "verifier.h"
+#include "vm_stack.h"
+
+using namespace rvm;
+using namespace rvm::interpreter;
+using namespace rvm::assembly;
+
+Module::Module(Assembly a, ModuleOptions o)
+    // constants are never freed or moved, so no collector and no nursery
+    : loaded(std::move(a)), module_options(o), constant_heap(0, size_t{1} << 30, HeapMode::manual) {
+    constant_values = constant_heap.constants(loaded.constant_table);
+}
+
+void Module::prepare(const void* const* labels) const {
+    std::call_once(prepared, [&] {
+        auto lock = std::lock_guard<std::mutex>{setup};
+        preparing = true;
+        auto code = std::vector<DecodedCode>{};
+        for (auto&& f : loaded.function_table) {
+            code.push_back(decode(loaded, f));
+            fuse(loaded, f, code.back(), module_options.fusion);
+        }
+        decoded = std::move(code);
+        number_call_sites();
+        if (module_options.unchecked) {
+            verify_unchecked();
+        }
+        if (labels) {
+            for (auto&& c : decoded) {
+                for (auto&& i : c) {
+                    i.handler = labels[static_cast<size_t>(i.op)];
+                }
+            }
+        }
+    });
+}
+
+void Module::number_call_sites() const {
+    for (size_t idx = 0; idx < decoded.size(); ++idx) {
+        for (size_t pc = 0; pc < decoded[idx].size(); ++pc) {
+            auto&& i = decoded[idx][pc];
+            if (i.op != Opcode::calla && i.op != Opcode::tailcalla) {
+                continue;
+            }
+            i.index = static_cast<index_t>(std::min(call_sites.size(), max_call_sites));
+            if (call_sites.size() < max_call_sites) {
+                call_sites.emplace_back(static_cast<index_t>(idx), static_cast<index_t>(pc));
+            }
+        }
+    }
+}
+
+// Records what an unchecked run needs from the verifier: the stack space of
+// every function and which calla targets are known to be functions.
+void Module::verify_unchecked() const {
+    auto arities = std::vector<index_t>{};
+    for (auto&& n : native_table) {
+        arities.push_back(n.num_args);
+    }
+    auto space = std::vector<size_t>{};
+    for (size_t idx = 0; idx < loaded.function_table.size(); ++idx) {
+        auto&& f = loaded.function_table[idx];
+        auto v = verify(loaded, f, arities);
+        space.push_back(FRAME_HEADER_SIZE + f.num_locals + v.max_stack);
+        for (size_t pc = 0; pc < f.code.size(); ++pc) {
+            // every function whose address is taken has the arity the
+            // verifier assumed, see calla_arity()
+            auto op = f.code[pc].op;
+            if ((op == Operation::calla || op == Operation::tailcalla) && v.depth[pc] > 0) {
+                decoded[idx][pc].imm = v.types[pc].back() == ValueType::function;
+                decoded[idx][pc].imm2 = calla_arity(loaded, f, pc);
+            }
+        }
+    }
+    frame_space = std::move(space);
+}
@@ -0,0 +1,106 @@
+#pragma once
+#include <mutex>
+#include <utility>
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include "instruction.h"
+#include "assembly.h"
+#include "operand.h"
+#include "decoder.h"
+#include "fusion.h"
+#include "heap.h"
+#include "native.h"
+
+namespace rvm {
+namespace interpreter {
+
+struct ModuleOptions {
+    // Superinstructions fused into the threaded code.
+    FusionSet fusion{FusionSet::all()};
+    // Verify every function before the first run and let interpreters leave
+    // out the checks verification makes redundant, see Options::unchecked.
+    bool unchecked{false};
+};
+
+// The part of a loaded program that does not change while it runs: the
+// assembly, its constants materialized once, the natives and the code
+// pre-decoded for the threaded engine. Any number of interpreters, on any
+// number of threads, can run one module at the same time; each brings only
+// its own operand stack, heap and JIT, and nothing shared is locked.
+//
+// Decoding, fusion, verification and handler binding happen once, when the
+// first interpreter starts running; natives have to be added before that,
+// and adding one later throws PreparedError. The reference loop does not
+// prepare the module, so with it nothing catches a native added while it
+// runs: add them all before the first run, whatever the engine.
+// Constants live in a heap of their own that no interpreter collects, so
+// they are shared by all of them, which is why stfld refuses to modify one.
+class Module {
+public:
+    explicit Module(assembly::Assembly, ModuleOptions = ModuleOptions{});
+    Module(const Module&) = delete;
+    Module& operator=(const Module&) = delete;
+
+    struct PreparedError {};
+
+    void add_native_function(NativeInfo f) {
+        // running interpreters read native_table without a lock, so it
+        // only changes before prepare() starts
+        auto lock = std::lock_guard<std::mutex>{setup};
+        if (preparing) {
+            throw PreparedError{};
+        }
+        native_table.push_back(f);
+    }
+
+    const assembly::Assembly& assembly() const {
+        return loaded;
+    }
+    const ModuleOptions& options() const {
+        return module_options;
+    }
+    // the constant table, materialized once; ldc pushes these
+    const std::vector<Operand>& constants() const {
+        return constant_values;
+    }
+    const std::vector<NativeInfo>& natives() const {
+        return native_table;
+    }
+
+private:
+    friend class Interpreter;
+
+    assembly::Assembly loaded;
+    ModuleOptions module_options;
+    Heap constant_heap;
+    std::vector<Operand> constant_values{};
+    std::vector<NativeInfo> native_table{};
+
+    // Filled in by prepare() and read-only afterwards.
+    mutable std::once_flag prepared{};
+    // held by prepare() and add_native_function()
+    mutable std::mutex setup{};
+    mutable bool preparing{false};
+    mutable std::vector<DecodedCode> decoded{};
+    // per function: operand stack slots a call needs, including the frame
+    // header; only with ModuleOptions::unchecked
+    mutable std::vector<size_t> frame_space{};
+    // Function and pc of every calla and tailcalla, by the number prepare()
+    // puts in their decoded `index`: each interpreter keeps an inline cache
+    // per site.
+    // Sites past max_call_sites all get the number max_call_sites and share
+    // a slot that caches nothing.
+    static constexpr size_t max_call_sites = UINT16_MAX;
+    mutable std::vector<std::pair<index_t, index_t>> call_sites{};
+
+    // Decodes every function and binds each instruction to its handler in
+    // `labels`, which is null without computed gotos. Safe to call from
+    // several threads; only the first call does anything.
+    void prepare(const void* const* labels) const;
+    void number_call_sites() const;
+    void verify_unchecked() const;
+};
+
+}
+}
@@ -0,0 +1,126 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <type_traits>
+#include <utility>
+#include "instruction.h"
+#include "operand.h"
+
+namespace rvm {
+namespace interpreter {
+
+// A native function reads its arguments from args[0] to args[num_args - 1]
+// and returns the result, which callnative writes over args[0]. `userdata`
+// is whatever was registered along with the function.
+using NativeFunction = Operand (*)(Operand* args, void* userdata);
+
+struct NativeInfo {
+    NativeFunction func;
+    index_t num_args;
+    void* userdata{nullptr};
+    // The function never throws, so compiled code calls it directly
+    // instead of through a thunk that catches exceptions.
+    bool nothrow{false};
+    // The function only starts an operation and returns a token for it.
+    // callnative leaves the token in the result slot and suspends the
+    // interpreter with RunStatus::waiting until Interpreter::resume()
+    // delivers the result, see EventLoop.
+    bool async{false};
+};
+
+namespace native_detail {
+
+template <class T> struct Convert;
+template <> struct Convert<int8_t> {
+    static int8_t from(Operand o) { return o.int8; }
+    static Operand to(int8_t v) { return Operand{v}; }
+};
+template <> struct Convert<int32_t> {
+    static int32_t from(Operand o) { return o.int32; }
+    static Operand to(int32_t v) { return Operand{v}; }
+};
+template <> struct Convert<Adt*> {
+    static Adt* from(Operand o) { return o.adt; }
+    static Operand to(Adt* v) { return Operand{v}; }
+};
+template <> struct Convert<Operand> {
+    static Operand from(Operand o) { return o; }
+    static Operand to(Operand v) { return v; }
+};
+
+template <auto F, class R, class... A>
+struct Call {
+    template <class... B, size_t... I>
+    static Operand invoke(Operand* args, std::index_sequence<I...>, B... bound) {
+        if constexpr (std::is_void<R>::value) {
+            F(bound..., Convert<A>::from(args[I])...);
+            return Operand{};
+        }
+        else {
+            return Convert<R>::to(F(bound..., Convert<A>::from(args[I])...));
+        }
+    }
+};
+
+template <class F> struct Unbound;
+template <class R, class... A> struct Unbound<R (*)(A...)> {
+    static constexpr bool nothrow = false;
+    static constexpr index_t arity = sizeof...(A);
+    template <auto F> static Operand call(Operand* args, void*) {
+        return Call<F, R, A...>::invoke(args, std::index_sequence_for<A...>{});
+    }
+};
+template <class R, class... A> struct Unbound<R (*)(A...) noexcept> {
+    static constexpr bool nothrow = true;
+    static constexpr index_t arity = sizeof...(A);
+    template <auto F> static Operand call(Operand* args, void*) noexcept {
+        return Call<F, R, A...>::invoke(args, std::index_sequence_for<A...>{});
+    }
+};
+
+template <class F> struct Bound;
+template <class R, class T, class... A> struct Bound<R (*)(T*, A...)> {
+    static constexpr bool nothrow = false;
+    static constexpr index_t arity = sizeof...(A);
+    template <auto F> static Operand call(Operand* args, void* userdata) {
+        return Call<F, R, A...>::invoke(args, std::index_sequence_for<A...>{}, static_cast<T*>(userdata));
+    }
+};
+template <class R, class T, class... A> struct Bound<R (*)(T*, A...) noexcept> {
+    static constexpr bool nothrow = true;
+    static constexpr index_t arity = sizeof...(A);
+    template <auto F> static Operand call(Operand* args, void* userdata) noexcept {
+        return Call<F, R, A...>::invoke(args, std::index_sequence_for<A...>{}, static_cast<T*>(userdata));
+    }
+};
+
+}
+
+// Wraps a typed C++ function as a native, e.g. native<gcd>() for
+// `int32_t gcd(int32_t, int32_t)`. Parameters and the result may be int8_t,
+// int32_t, Adt* or Operand, and the result also void (callnative then
+// pushes zero). Functions declared noexcept are registered as nothrow.
+template <auto F>
+NativeInfo native() {
+    using Traits = native_detail::Unbound<decltype(F)>;
+    return NativeInfo{&Traits::template call<F>, Traits::arity, nullptr, Traits::nothrow};
+}
+
+// Same for a function whose first parameter is a T*, which receives
+// `userdata` rather than an operand.
+template <auto F, class T>
+NativeInfo native(T* userdata) {
+    using Traits = native_detail::Bound<decltype(F)>;
+    return NativeInfo{&Traits::template call<F>, Traits::arity, userdata, Traits::nothrow};
+}
+
+// An async native: F returns the token of the operation it started.
+template <auto F, class T>
+NativeInfo async_native(T* userdata) {
+    auto re = native<F>(userdata);
+    re.async = true;
+    return re;
+}
+
+}
+}
@@ -0,0 +1,38 @@
+#pragma once
+#include <stdint.h>
+#include "instruction.h"
+
+namespace rvm {
+namespace interpreter {
+
+struct Adt;
+struct Operand {
+    union {
+        int8_t int8;
+        int32_t int32;
+        Adt* adt;
+    };
+
+    // Scalars always clear the whole slot so that operands can be compared
+    // bitwise (teq/tne) regardless of the type they were written as. The
+    // collector relies on it too: a slot is a reference exactly when it
+    // holds an address inside the heap, which scalars never do.
+    Operand() = default;
+    explicit Operand(int8_t i): adt{nullptr} { int8 = i; }
+    explicit Operand(int32_t i): adt{nullptr} { int32 = i; }
+    explicit Operand(Adt* a): adt{a} {}
+};
+
+// ADT values live in the Heap. `gc` belongs to the collector; `num_fields`
+// is a copy of the constructor's field count so that objects can be walked
+// without the AdtTable.
+struct Adt {
+    index_t adt_table_index;
+    sindex_t constructor_index;
+    uint8_t gc;
+    index_t num_fields;
+    Operand fields[1];
+};
+
+}
+}
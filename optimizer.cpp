@@ -0,0 +1,762 @@
+#include "optimizer.h"
+#include <algorithm>
+#include <map>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+#include "analysis.h"
+
+using namespace rvm;
+using namespace rvm::assembly;
+
+namespace {
+
+using Code = std::vector<Instruction>;
+
+bool is_branch(const Instruction& i) {
+    return i.op == Operation::br || i.op == Operation::brtrue;
+}
+
+bool is_switch(const Instruction& i) {
+    return i.op == Operation::switch_ || i.op == Operation::switchctor;
+}
+
+// Instructions control never falls through from.
+bool ends_flow(Operation op) {
+    return op == Operation::br || op == Operation::ret
+        || op == Operation::tailcall || op == Operation::tailcalla
+        || op == Operation::switch_ || op == Operation::switchctor;
+}
+
+// Pushes one value without side effects, so it can go together with a
+// drop right after it.
+bool is_pure_push(Operation op) {
+    switch (op) {
+        case Operation::ldc:
+        case Operation::ldloc:
+        case Operation::ldarg:
+        case Operation::ldloca:
+        case Operation::ldarga:
+        case Operation::ldfuna:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// The entries of a jump table and what follows it count as targets too.
+std::vector<bool> branch_targets(const Code& code) {
+    auto re = std::vector<bool>(code.size() + 1, false);
+    for (size_t pc = 0; pc < code.size(); ++pc) {
+        auto&& i = code[pc];
+        if (is_branch(i)) {
+            re[i.index] = true;
+        }
+        else if (is_switch(i)) {
+            std::fill_n(re.begin() + pc + 1, i.index + 1, true);
+        }
+    }
+    return re;
+}
+
+// The br of jump tables, which have to stay where they are.
+std::vector<bool> table_entries(const Code& code) {
+    auto re = std::vector<bool>(code.size(), false);
+    for (size_t pc = 0; pc < code.size(); ++pc) {
+        if (is_switch(code[pc])) {
+            std::fill_n(re.begin() + pc + 1, code[pc].index, true);
+        }
+    }
+    return re;
+}
+
+// Removes the instructions not in `keep`; a branch to a removed one goes
+// to the next one kept.
+void compact(Code& code, const std::vector<bool>& keep) {
+    auto new_pc = std::vector<index_t>(code.size() + 1);
+    auto n = index_t{0};
+    for (size_t pc = 0; pc < code.size(); ++pc) {
+        new_pc[pc] = n;
+        n += keep[pc];
+    }
+    new_pc[code.size()] = n;
+    auto re = Code{};
+    re.reserve(n);
+    for (size_t pc = 0; pc < code.size(); ++pc) {
+        if (keep[pc]) {
+            re.push_back(code[pc]);
+            if (is_branch(re.back())) {
+                re.back().index = new_pc[re.back().index];
+            }
+        }
+    }
+    code = std::move(re);
+}
+
+// A scalar constant as an operand slot holds it: the value in the low
+// bytes and zeros above, so that teq can compare slots bitwise.
+uint32_t bits(const ConstantInfo& c) {
+    return c.type == ConstantType::int8 ? static_cast<uint8_t>(c.int8) : static_cast<uint32_t>(c.int32);
+}
+
+int8_t as_int8(uint32_t x) {
+    return static_cast<int8_t>(static_cast<uint8_t>(x));
+}
+
+int32_t as_int32(uint32_t x) {
+    return static_cast<int32_t>(x);
+}
+
+// What the interpreter computes for `op` on `x` and `y`, or false where it
+// fails at run time.
+bool evaluate(Operation op, OperandType type, uint32_t x, uint32_t y, ConstantInfo* re) {
+    auto truth = [&](bool b) {
+        *re = ConstantInfo{static_cast<int8_t>(b)};
+        return true;
+    };
+    switch (op) {
+        case Operation::teq:
+            *re = ConstantInfo{static_cast<int8_t>(x == y ? -1 : 0)};
+            return true;
+        case Operation::tne:
+            *re = ConstantInfo{static_cast<int8_t>(x == y ? 0 : -1)};
+            return true;
+        default:
+            break;
+    }
+    if (type == OperandType::int8) {
+        int a = as_int8(x);
+        int b = as_int8(y);
+        auto ua = static_cast<uint8_t>(x);
+        auto ub = static_cast<uint8_t>(y);
+        auto result = 0;
+        switch (op) {
+            case Operation::add: result = a + b; break;
+            case Operation::sub: result = a - b; break;
+            case Operation::mul: result = a * b; break;
+            case Operation::div:
+                if (b == 0) {
+                    return false;
+                }
+                result = a / b;
+                break;
+            case Operation::rem:
+                if (b == 0) {
+                    return false;
+                }
+                result = a % b;
+                break;
+            case Operation::band: result = a & b; break;
+            case Operation::bor: result = a | b; break;
+            case Operation::bxor: result = a ^ b; break;
+            case Operation::bnot: result = ~a; break;
+            case Operation::tlt: return truth(a < b);
+            case Operation::tle: return truth(a <= b);
+            case Operation::tgt: return truth(a > b);
+            case Operation::tge: return truth(a >= b);
+            case Operation::tlt_un: return truth(ua < ub);
+            case Operation::tle_un: return truth(ua <= ub);
+            case Operation::tgt_un: return truth(ua > ub);
+            case Operation::tge_un: return truth(ua >= ub);
+            default: return false;
+        }
+        *re = ConstantInfo{static_cast<int8_t>(result)};
+        return true;
+    }
+    if (type != OperandType::int32 && type != OperandType::pointer) {
+        return false;
+    }
+    int64_t a = as_int32(x);
+    int64_t b = as_int32(y);
+    auto result = int64_t{0};
+    switch (op) {
+        case Operation::add: result = a + b; break;
+        case Operation::sub: result = a - b; break;
+        case Operation::mul: result = a * b; break;
+        case Operation::div:
+            if (b == 0 || (a == INT32_MIN && b == -1)) {
+                return false;
+            }
+            result = a / b;
+            break;
+        case Operation::rem:
+            if (b == 0 || (a == INT32_MIN && b == -1)) {
+                return false;
+            }
+            result = a % b;
+            break;
+        case Operation::band: result = a & b; break;
+        case Operation::bor: result = a | b; break;
+        case Operation::bxor: result = a ^ b; break;
+        case Operation::bnot: result = ~a; break;
+        case Operation::tlt: return truth(a < b);
+        case Operation::tle: return truth(a <= b);
+        case Operation::tgt: return truth(a > b);
+        case Operation::tge: return truth(a >= b);
+        case Operation::tlt_un: return truth(x < y);
+        case Operation::tle_un: return truth(x <= y);
+        case Operation::tgt_un: return truth(x > y);
+        case Operation::tge_un: return truth(x >= y);
+        default: return false;
+    }
+    *re = ConstantInfo{static_cast<int32_t>(static_cast<uint32_t>(result))};
+    return true;
+}
+
+bool is_binary(Operation op) {
+    switch (op) {
+        case Operation::add:
+        case Operation::sub:
+        case Operation::mul:
+        case Operation::div:
+        case Operation::rem:
+        case Operation::band:
+        case Operation::bor:
+        case Operation::bxor:
+        case Operation::teq:
+        case Operation::tne:
+        case Operation::tlt:
+        case Operation::tlt_un:
+        case Operation::tle:
+        case Operation::tle_un:
+        case Operation::tgt:
+        case Operation::tgt_un:
+        case Operation::tge:
+        case Operation::tge_un:
+            return true;
+        default:
+            return false;
+    }
+}
+
+class Optimizer {
+public:
+    explicit Optimizer(Assembly& assembly): a(assembly) {
+        for (size_t c = 0; c < a.constant_table.size(); ++c) {
+            auto&& info = a.constant_table[c];
+            if (info.type != ConstantType::adt) {
+                constants.emplace(key(info), static_cast<index_t>(c));
+            }
+        }
+    }
+
+    void function(FunctionInfo& f) {
+        auto code = Code(f.code.begin(), f.code.end());
+        auto size = code.size();
+        auto changed = false;
+        while (fold(code) | forward(code, f) | drop_pushes(code) | thread_jumps(code) | remove_unreachable(code)) {
+            changed = true;
+        }
+        changed = drop_unused_locals(code, f) || changed;
+        if (changed) {
+            stats.removed += size - code.size();
+            f.code = Bytecode(std::move(code));
+        }
+    }
+
+    OptimizationStats stats{};
+
+private:
+    Assembly& a;
+    // scalar constants by type and bits
+    std::map<std::pair<ConstantType, uint32_t>, index_t> constants{};
+
+    static std::pair<ConstantType, uint32_t> key(const ConstantInfo& c) {
+        return {c.type, bits(c)};
+    }
+
+    // The scalar constant at `idx`, if it is one.
+    const ConstantInfo* scalar(index_t idx) const {
+        auto&& c = a.constant_table[idx];
+        return c.type == ConstantType::adt ? nullptr : &c;
+    }
+
+    // Index of a constant equal to `c`, appended if there is none. Stops
+    // folding once the table is full.
+    bool constant(const ConstantInfo& c, index_t* idx) {
+        auto found = constants.find(key(c));
+        if (found != constants.end()) {
+            *idx = found->second;
+            return true;
+        }
+        if (a.constant_table.size() > UINT16_MAX) {
+            return false;
+        }
+        *idx = static_cast<index_t>(a.constant_table.size());
+        a.constant_table.push_back(c);
+        constants.emplace(key(c), *idx);
+        return true;
+    }
+
+    bool fold(Code& code) {
+        auto targets = branch_targets(code);
+        auto keep = std::vector<bool>(code.size(), true);
+        auto folded = size_t{0};
+        for (size_t pc = 0; pc + 1 < code.size(); ++pc) {
+            if (code[pc].op != Operation::ldc || !keep[pc] || targets[pc + 1]) {
+                continue;
+            }
+            auto x = scalar(code[pc].index);
+            if (x == nullptr) {
+                continue;
+            }
+            auto&& next = code[pc + 1];
+            auto result = ConstantInfo{};
+            auto idx = index_t{0};
+            if (next.op == Operation::brtrue) {
+                if (as_int8(bits(*x)) != 0) {
+                    code[pc] = Instruction{Operation::br, next.index};
+                }
+                else {
+                    keep[pc] = false;
+                }
+                keep[pc + 1] = false;
+                ++folded;
+            }
+            else if (next.op == Operation::switch_) {
+                // straight onto the entry, the table goes once unreachable
+                auto k = std::min<uint32_t>(bits(*x), next.index);
+                code[pc + 1] = Instruction{Operation::br, static_cast<index_t>(pc + 2 + k)};
+                keep[pc] = false;
+                ++folded;
+            }
+            else if (next.op == Operation::bnot) {
+                if (evaluate(next.op, next.type, bits(*x), 0, &result) && constant(result, &idx)) {
+                    code[pc] = Instruction{Operation::ldc, idx};
+                    keep[pc + 1] = false;
+                    ++folded;
+                }
+            }
+            else if (next.op == Operation::ldc && pc + 2 < code.size() && !targets[pc + 2]
+                     && is_binary(code[pc + 2].op)) {
+                auto y = scalar(next.index);
+                auto&& op = code[pc + 2];
+                if (y != nullptr && evaluate(op.op, op.type, bits(*x), bits(*y), &result)
+                    && constant(result, &idx)) {
+                    code[pc] = Instruction{Operation::ldc, idx};
+                    keep[pc + 1] = false;
+                    keep[pc + 2] = false;
+                    ++folded;
+                }
+            }
+        }
+        stats.folded += folded;
+        return apply(code, keep) || folded != 0;
+    }
+
+    // Locals and arguments are handled alike: `load` and `store` are ldloc
+    // and stloc or ldarg and starg.
+    bool forward(Code& code, const FunctionInfo& f) {
+        // a pointer into the frame reaches every slot of it with some
+        // arithmetic
+        auto addressed = std::any_of(code.begin(), code.end(), [](const Instruction& i) {
+            return i.op == Operation::ldloca || i.op == Operation::ldarga;
+        });
+        if (addressed) {
+            return false;
+        }
+        auto changes = forward(code, f.num_locals, Operation::ldloc, Operation::stloc);
+        changes += forward(code, f.num_args, Operation::ldarg, Operation::starg);
+        return changes != 0;
+    }
+
+    size_t forward(Code& code, index_t slots, Operation load, Operation store) {
+        auto reads = std::vector<size_t>(slots, 0);
+        auto last_read = std::vector<size_t>(slots, 0);
+        for (size_t pc = 0; pc < code.size(); ++pc) {
+            if (code[pc].op == load) {
+                ++reads[code[pc].index];
+                last_read[code[pc].index] = pc;
+            }
+        }
+        auto targets = branch_targets(code);
+        auto keep = std::vector<bool>(code.size(), true);
+        auto changes = size_t{0};
+        for (index_t n = 0; n < slots; ++n) {
+            if (reads[n] > 1) {
+                continue;
+            }
+            auto pc = last_read[n];
+            if (reads[n] == 1) {
+                // only a read of what was stored right before can go
+                if (pc == 0 || targets[pc] || code[pc - 1].op != store || code[pc - 1].index != n) {
+                    continue;
+                }
+                keep[pc - 1] = false;
+                keep[pc] = false;
+                ++changes;
+            }
+            // the other stores are never read
+            for (size_t s = 0; s < code.size(); ++s) {
+                if (keep[s] && code[s].op == store && code[s].index == n) {
+                    code[s] = Instruction{Operation::drop};
+                    ++changes;
+                }
+            }
+        }
+        stats.forwarded += changes;
+        apply(code, keep);
+        return changes;
+    }
+
+    bool drop_pushes(Code& code) {
+        auto targets = branch_targets(code);
+        auto keep = std::vector<bool>(code.size(), true);
+        for (size_t pc = 0; pc + 1 < code.size(); ++pc) {
+            auto op = code[pc].op;
+            if (code[pc + 1].op == Operation::drop && !targets[pc + 1]
+                && (is_pure_push(op) || op == Operation::dup)) {
+                keep[pc] = false;
+                keep[pc + 1] = false;
+                ++pc;
+            }
+        }
+        return apply(code, keep);
+    }
+
+    bool thread_jumps(Code& code) {
+        auto keep = std::vector<bool>(code.size(), true);
+        auto entries = table_entries(code);
+        auto threaded = size_t{0};
+        for (size_t pc = 0; pc < code.size(); ++pc) {
+            auto&& i = code[pc];
+            if (!is_branch(i)) {
+                continue;
+            }
+            auto target = i.index;
+            auto hops = size_t{0};
+            while (code[target].op == Operation::br && hops < code.size()) {
+                target = code[target].index;
+                ++hops;
+            }
+            if (hops == code.size()) {
+                // a cycle of br
+                continue;
+            }
+            if (target != i.index) {
+                i.index = target;
+                ++threaded;
+            }
+            if (entries[pc]) {
+                continue;
+            }
+            if (i.op == Operation::br && code[target].op == Operation::ret) {
+                i = Instruction{Operation::ret};
+                ++threaded;
+            }
+            else if (target == pc + 1) {
+                if (i.op == Operation::br) {
+                    keep[pc] = false;
+                }
+                else {
+                    i = Instruction{Operation::drop};
+                }
+                ++threaded;
+            }
+        }
+        stats.threaded += threaded;
+        return apply(code, keep) || threaded != 0;
+    }
+
+    bool remove_unreachable(Code& code) {
+        auto reached = std::vector<bool>(code.size(), false);
+        auto work = std::vector<size_t>{0};
+        while (!work.empty()) {
+            auto pc = work.back();
+            work.pop_back();
+            if (pc >= code.size() || reached[pc]) {
+                continue;
+            }
+            reached[pc] = true;
+            if (is_branch(code[pc])) {
+                work.push_back(code[pc].index);
+            }
+            else if (is_switch(code[pc])) {
+                for (size_t k = 1; k <= code[pc].index + 1u; ++k) {
+                    work.push_back(pc + k);
+                }
+            }
+            if (!ends_flow(code[pc].op)) {
+                work.push_back(pc + 1);
+            }
+        }
+        return apply(code, reached);
+    }
+
+    // Renumbers the locals that are still referred to from 0 up.
+    bool drop_unused_locals(Code& code, FunctionInfo& f) {
+        auto new_index = std::vector<int32_t>(f.num_locals, -1);
+        for (auto&& i : code) {
+            if (i.op == Operation::ldloca || i.op == Operation::ldarga) {
+                // the frame is laid out for pointer arithmetic
+                return false;
+            }
+            if (i.op == Operation::ldloc || i.op == Operation::stloc) {
+                new_index[i.index] = 0;
+            }
+        }
+        auto n = index_t{0};
+        for (auto&& x : new_index) {
+            if (x == 0) {
+                x = n++;
+            }
+        }
+        if (n == f.num_locals) {
+            return false;
+        }
+        for (auto&& i : code) {
+            if (i.op == Operation::ldloc || i.op == Operation::stloc) {
+                i.index = static_cast<index_t>(new_index[i.index]);
+            }
+        }
+        stats.locals += f.num_locals - n;
+        f.num_locals = n;
+        return true;
+    }
+
+    static bool apply(Code& code, const std::vector<bool>& keep) {
+        for (auto k : keep) {
+            if (!k) {
+                compact(code, keep);
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+// Whether the function at `idx` can be spliced into a caller as it is: it
+// does not call itself or replace its frame, and has nothing but the return
+// value on its stack at every ret.
+bool inlinable(const Assembly& a, index_t idx, const std::vector<index_t>& native_arities) {
+    auto&& f = a.function_table[idx];
+    if (f.code.empty()) {
+        return false;
+    }
+    for (auto&& i : f.code) {
+        if ((i.op == Operation::call && i.index == idx)
+            || i.op == Operation::tailcall || i.op == Operation::tailcalla) {
+            return false;
+        }
+    }
+    try {
+        auto layout = analyze_stack(a, f, native_arities);
+        for (size_t pc = 0; pc < f.code.size(); ++pc) {
+            if (f.code[pc].op == Operation::ret && layout.depth[pc] > 1) {
+                return false;
+            }
+        }
+    }
+    catch (InvalidBytecodeError&) {
+        return false;
+    }
+    return true;
+}
+
+// Appends the code of `callee` with its arguments and locals moved to the
+// caller's locals from `base` on, entered with the arguments on the stack
+// and leaving the return value there.
+void splice(Code& out, const FunctionInfo& callee, index_t base, index_t zero) {
+    auto num_args = callee.num_args;
+    for (auto i = num_args; i-- > 0;) {
+        out.push_back(Instruction{Operation::stloc, static_cast<index_t>(base + i)});
+    }
+    // the locals of a call start out zeroed
+    auto reads_locals = std::any_of(callee.code.begin(), callee.code.end(), [](const Instruction& i) {
+        return i.op == Operation::ldloc || i.op == Operation::ldloca;
+    });
+    for (index_t i = 0; reads_locals && i < callee.num_locals; ++i) {
+        out.push_back(Instruction{Operation::ldc, zero});
+        out.push_back(Instruction{Operation::stloc, static_cast<index_t>(base + num_args + i)});
+    }
+    auto start = out.size();
+    // a ret at the very end falls through instead
+    auto size = callee.code.size() - (callee.code.back().op == Operation::ret);
+    auto end = static_cast<index_t>(start + size);
+    for (size_t pc = 0; pc < size; ++pc) {
+        auto i = callee.code[pc];
+        switch (i.op) {
+            case Operation::ldarg:
+                i = Instruction{Operation::ldloc, static_cast<index_t>(base + i.index)};
+                break;
+            case Operation::starg:
+                i = Instruction{Operation::stloc, static_cast<index_t>(base + i.index)};
+                break;
+            case Operation::ldarga:
+                i = Instruction{Operation::ldloca, static_cast<index_t>(base + i.index)};
+                break;
+            case Operation::ldloc:
+            case Operation::stloc:
+            case Operation::ldloca:
+                i.index = static_cast<index_t>(base + num_args + i.index);
+                break;
+            case Operation::br:
+            case Operation::brtrue:
+                i.index = static_cast<index_t>(start + i.index);
+                break;
+            case Operation::ret:
+                i = Instruction{Operation::br, end};
+                break;
+            default:
+                break;
+        }
+        out.push_back(i);
+    }
+}
+
+}
+
+size_t rvm::assembly::inline_calls(Assembly& a, const InlineOptions& options) {
+    // by function: 0 not known yet, 1 inlinable, -1 not
+    auto can_inline = std::vector<int8_t>(a.function_table.size(), 0);
+    auto zero = int32_t{-1};
+    auto inlined = size_t{0};
+    for (size_t caller = 0; caller < a.function_table.size(); ++caller) {
+        auto&& f = a.function_table[caller];
+        auto out = Code{};
+        auto new_pc = std::vector<index_t>(f.code.size() + 1);
+        // pcs in `out` of the caller's own branches
+        auto branches = std::vector<size_t>{};
+        auto num_locals = static_cast<size_t>(f.num_locals);
+        auto sites = size_t{0};
+        for (size_t pc = 0; pc < f.code.size(); ++pc) {
+            new_pc[pc] = static_cast<index_t>(out.size());
+            auto&& i = f.code[pc];
+            auto worth = false;
+            auto callee = i.index;
+            if (i.op == Operation::call && callee != caller) {
+                auto&& g = a.function_table[callee];
+                auto limit = options.max_size;
+                if (options.profile != nullptr) {
+                    auto&& counts = *options.profile;
+                    auto calls = caller < counts.size() && pc < counts[caller].size() ? counts[caller][pc] : 0;
+                    limit = calls >= options.min_calls ? options.hot_max_size : 0;
+                }
+                worth = g.code.size() <= limit
+                    && num_locals + g.num_args + g.num_locals <= UINT16_MAX
+                    && out.size() + 2 * (g.num_args + g.num_locals) + g.code.size() + (f.code.size() - pc) < UINT16_MAX;
+                if (worth && can_inline[callee] == 0) {
+                    can_inline[callee] = inlinable(a, callee, options.native_arities) ? 1 : -1;
+                }
+                worth = worth && can_inline[callee] == 1;
+            }
+            if (!worth) {
+                if (i.op == Operation::br || i.op == Operation::brtrue) {
+                    branches.push_back(out.size());
+                }
+                out.push_back(i);
+                continue;
+            }
+            if (zero < 0) {
+                auto found = std::find_if(a.constant_table.begin(), a.constant_table.end(), [](const ConstantInfo& c) {
+                    return c.type == ConstantType::int32 && c.int32 == 0;
+                });
+                if (found == a.constant_table.end() && a.constant_table.size() > UINT16_MAX) {
+                    // no room for the zero the callee's locals start as
+                    out.push_back(i);
+                    continue;
+                }
+                zero = static_cast<int32_t>(found - a.constant_table.begin());
+                if (found == a.constant_table.end()) {
+                    a.constant_table.push_back(ConstantInfo{0});
+                }
+            }
+            auto&& g = a.function_table[callee];
+            splice(out, g, static_cast<index_t>(num_locals), static_cast<index_t>(zero));
+            num_locals += g.num_args + g.num_locals;
+            ++sites;
+        }
+        if (sites == 0) {
+            continue;
+        }
+        new_pc[f.code.size()] = static_cast<index_t>(out.size());
+        for (auto b : branches) {
+            out[b].index = new_pc[out[b].index];
+        }
+        f.code = Bytecode(std::move(out));
+        f.num_locals = static_cast<index_t>(num_locals);
+        can_inline[caller] = 0;
+        inlined += sites;
+    }
+    return inlined;
+}
+
+size_t rvm::assembly::devirtualize(Assembly& a, const std::vector<std::vector<int32_t>>& targets) {
+    // a function whose address is taken has the arity every calla assumes
+    auto taken = std::vector<bool>(a.function_table.size(), false);
+    for (auto&& f : a.function_table) {
+        for (auto&& i : f.code) {
+            if (i.op == Operation::ldfuna) {
+                taken[i.index] = true;
+            }
+        }
+    }
+    auto guarded = size_t{0};
+    for (size_t idx = 0; idx < a.function_table.size() && idx < targets.size(); ++idx) {
+        auto&& f = a.function_table[idx];
+        auto out = Code{};
+        auto new_pc = std::vector<index_t>(f.code.size() + 1);
+        auto branches = std::vector<size_t>{};
+        auto branched = branch_targets(Code(f.code.begin(), f.code.end()));
+        auto sites = size_t{0};
+        for (size_t pc = 0; pc < f.code.size(); ++pc) {
+            new_pc[pc] = static_cast<index_t>(out.size());
+            auto&& i = f.code[pc];
+            auto target = pc < targets[idx].size() ? targets[idx][pc] : -1;
+            auto tail = i.op == Operation::tailcalla;
+            // A calla right after the ldfuna of its target takes that
+            // function's arity, see calla_arity(); behind the guard it
+            // would take the one every ldfuna'd function shares.
+            auto loaded = pc > 0 && f.code[pc - 1].op == Operation::ldfuna && !branched[pc];
+            if ((i.op != Operation::calla && !tail) || loaded || target < 0
+                || static_cast<size_t>(target) >= a.function_table.size() || !taken[target]
+                || out.size() + 8 + (f.code.size() - pc) >= UINT16_MAX) {
+                if (is_branch(i)) {
+                    branches.push_back(out.size());
+                }
+                out.push_back(i);
+                continue;
+            }
+            // dup; ldfuna T; teq; brtrue direct; calla; [br end;] direct:
+            // drop; call T; end:
+            auto direct = static_cast<index_t>(out.size() + (tail ? 5 : 6));
+            out.push_back(Instruction{Operation::dup});
+            out.push_back(Instruction{Operation::ldfuna, static_cast<index_t>(target)});
+            out.push_back(Instruction{Operation::teq, OperandType::int32});
+            out.push_back(Instruction{Operation::brtrue, direct});
+            out.push_back(i);
+            if (!tail) {
+                out.push_back(Instruction{Operation::br, static_cast<index_t>(direct + 2)});
+            }
+            out.push_back(Instruction{Operation::drop});
+            out.push_back(Instruction{tail ? Operation::tailcall : Operation::call, static_cast<index_t>(target)});
+            ++sites;
+        }
+        if (sites == 0) {
+            continue;
+        }
+        new_pc[f.code.size()] = static_cast<index_t>(out.size());
+        for (auto b : branches) {
+            out[b].index = new_pc[out[b].index];
+        }
+        f.code = Bytecode(std::move(out));
+        guarded += sites;
+    }
+    return guarded;
+}
+
+OptimizationStats rvm::assembly::optimize(Assembly& a) {
+    auto optimizer = Optimizer{a};
+    for (auto&& f : a.function_table) {
+        optimizer.function(f);
+    }
+    return optimizer.stats;
+}
+
+OptimizationStats rvm::assembly::optimize(std::istream& in, std::ostream& out) {
+    auto a = Assembly::parse(in);
+    validate(a);
+    auto stats = optimize(a);
+    dump(a, out);
+    return stats;
+}
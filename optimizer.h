@@ -0,0 +1,90 @@
+#pragma once
+#include <istream>
+#include <ostream>
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include "assembly.h"
+
+namespace rvm {
+namespace assembly {
+
+struct OptimizationStats {
+    // operations computed from constants, branches on constants included
+    size_t folded{0};
+    // stloc/ldloc pairs the value now flows through on the stack, and
+    // stores to locals or arguments nothing reads
+    size_t forwarded{0};
+    // branches sent straight to the end of a chain of br
+    size_t threaded{0};
+    // instructions removed in total
+    size_t removed{0};
+    // locals no instruction refers to any more, taken out of the frames
+    size_t locals{0};
+};
+
+// Peephole passes over the bytecode of every function of a validated
+// assembly, repeated until none applies:
+//
+//  - constant folding: ldc; ldc; <binop> and ldc; bnot become one ldc,
+//    ldc; brtrue becomes br or nothing, ldc; switch a br to the entry it
+//    picks; division by zero is left to fail at run time
+//  - store-load forwarding: stloc n; ldloc n goes away when that ldloc is
+//    the only read of n, and other stores to n become drop; the same for
+//    arguments. Not in functions that take the address of a local or an
+//    argument, which reaches the whole frame
+//  - dead pushes: ldc, ldloc, ldarg, ld*a or dup followed by drop
+//  - jump threading: a br or brtrue to a br jumps to its target instead, a
+//    br to ret is a ret, and branches to the next instruction go away;
+//    the br of a jump table are only retargeted
+//  - removal of code no path from pc 0 reaches, and of locals no
+//    instruction refers to, again unless an address is taken
+//
+// Sequences a branch jumps into the middle of are left alone. Constants
+// made by folding are appended to the constant table, or reused when an
+// equal one exists. The functions keep their indices and arguments.
+OptimizationStats optimize(Assembly&);
+
+struct InlineOptions {
+    // callees of at most this many instructions
+    size_t max_size{12};
+    // Executions by function and pc, as Interpreter::profile() returns
+    // them. With a profile only call sites that ran at least `min_calls`
+    // times are inlined, and their callees may be up to `hot_max_size`
+    // instructions long.
+    const std::vector<std::vector<uint64_t>>* profile{nullptr};
+    uint64_t min_calls{1000};
+    size_t hot_max_size{48};
+    // NativeInfo::num_args of the natives in order; callees that call a
+    // native not listed here are not inlined.
+    std::vector<index_t> native_arities{};
+};
+
+// Replaces `call f` by the code of f where f is small and does not call
+// itself or make tail calls. The arguments are stored into fresh locals of
+// the caller and f's locals follow them, so num_locals grows; ret becomes
+// a branch past the spliced code. Callees are taken as they are at the
+// time, already inlined into or not, and spliced code is not looked at
+// again, so mutual recursion stops after one level. Returns the number of
+// call sites inlined.
+//
+// Run optimize() afterwards: forwarding usually takes the stores of the
+// arguments back out, along with the locals they needed.
+size_t inline_calls(Assembly&, const InlineOptions& = InlineOptions{});
+
+// Speculates on the targets of calla and tailcalla: where `targets`, by
+// function and pc as Interpreter::call_targets() returns them, names a
+// function, the site compares its target with that one and makes a direct
+// call when they are equal, and the calla it was otherwise. The direct call
+// is what inline_calls() can then inline. Only targets some ldfuna already
+// loads are taken, since a guarded calla is verified with the arity of
+// those. Sites right after the ldfuna of their target keep that target's
+// own arity and are left alone. Returns the number of sites guarded.
+size_t devirtualize(Assembly&, const std::vector<std::vector<int32_t>>& targets);
+
+// Optimizes an assembly in the stream format and writes it back, so that
+// the work is done once at build time.
+OptimizationStats optimize(std::istream&, std::ostream&);
+
+}
+}
@@ -0,0 +1,181 @@
+#include "profile.h"
+#include <algorithm>
+#include <iomanip>
+#include <string>
+
+using namespace rvm;
+using namespace rvm::interpreter;
+using namespace rvm::assembly;
+
+namespace {
+
+constexpr size_t num_operations = static_cast<size_t>(Operation::switchctor) + 1;
+
+const char* name(Operation op) {
+    static const char* const names[num_operations] = {
+        "?", "add", "sub", "mul", "div", "rem", "band", "bor", "bxor", "bnot",
+        "dup", "drop", "ldc", "ldloc", "stloc", "ldarg", "starg", "call", "callnative",
+        "ret", "ldloca", "ldarga", "ldfuna", "calla", "ldind", "stind",
+        "teq", "tne", "tlt", "tlt_un", "tle", "tle_un", "tgt", "tgt_un", "tge", "tge_un",
+        "br", "brtrue", "mkadt", "dladt", "ldctor", "ldfld", "stfld", "tailcall", "tailcalla",
+        "switch", "switchctor"};
+    return names[static_cast<size_t>(op)];
+}
+
+double percent(uint64_t part, uint64_t total) {
+    return total == 0 ? 0 : 100.0 * static_cast<double>(part) / static_cast<double>(total);
+}
+
+// Indices of the `top` largest entries of `counts` that are not zero,
+// largest first.
+template <class Count>
+std::vector<size_t> hottest(const std::vector<Count>& counts, size_t top) {
+    auto re = std::vector<size_t>{};
+    for (size_t i = 0; i < counts.size(); ++i) {
+        if (counts[i] != Count{}) {
+            re.push_back(i);
+        }
+    }
+    auto n = std::min(top, re.size());
+    std::partial_sort(re.begin(), re.begin() + n, re.end(), [&](size_t x, size_t y) {
+        return counts[x] > counts[y];
+    });
+    re.resize(n);
+    return re;
+}
+
+// (function, pc) of the `top` largest counts, largest first.
+std::vector<std::pair<size_t, size_t>> hottest(const ExecutionProfile& counts, size_t top) {
+    auto flat = std::vector<uint64_t>{};
+    auto where = std::vector<std::pair<size_t, size_t>>{};
+    for (size_t f = 0; f < counts.size(); ++f) {
+        for (size_t pc = 0; pc < counts[f].size(); ++pc) {
+            flat.push_back(counts[f][pc]);
+            where.emplace_back(f, pc);
+        }
+    }
+    auto re = std::vector<std::pair<size_t, size_t>>{};
+    for (auto i : hottest(flat, top)) {
+        re.push_back(where[i]);
+    }
+    return re;
+}
+
+}
+
+Profile::Profile(const Assembly& a)
+    : operations(num_operations, 0), functions(a.function_table.size()) {
+    for (auto&& f : a.function_table) {
+        pcs.emplace_back(f.code.size(), 0);
+        back_edges.emplace_back(f.code.size(), 0);
+    }
+    nodes.push_back(Node{0, 0, 0});
+}
+
+void Profile::start(index_t function) {
+    current = 0;
+    enter(function);
+}
+
+void Profile::native(index_t idx, std::chrono::nanoseconds t) {
+    if (idx >= natives.size()) {
+        natives.resize(idx + size_t{1});
+    }
+    ++natives[idx].calls;
+    natives[idx].time += t;
+}
+
+void Profile::enter(index_t function) {
+    ++functions[function].calls;
+    current = child(current, function);
+}
+
+void Profile::leave() {
+    current = nodes[current].parent;
+}
+
+void Profile::tail_enter(index_t function) {
+    leave();
+    enter(function);
+}
+
+size_t Profile::child(size_t parent, index_t function) {
+    auto key = static_cast<uint64_t>(parent) << 16 | function;
+    auto found = children.find(key);
+    if (found != children.end()) {
+        return found->second;
+    }
+    nodes.push_back(Node{parent, function, 0});
+    children.emplace(key, nodes.size() - 1);
+    return nodes.size() - 1;
+}
+
+void Profile::write_report(std::ostream& out, size_t top) const {
+    auto total = uint64_t{0};
+    for (auto n : operations) {
+        total += n;
+    }
+    out << "instructions " << total << "\n";
+    auto flags = out.flags();
+    out << std::fixed << std::setprecision(1);
+
+    out << "\noperation       count       %\n";
+    for (auto op : hottest(operations, top)) {
+        out << std::left << std::setw(12) << name(static_cast<Operation>(op)) << std::right
+            << std::setw(12) << operations[op] << std::setw(8) << percent(operations[op], total) << "\n";
+    }
+
+    auto instructions = std::vector<uint64_t>{};
+    for (auto&& f : functions) {
+        instructions.push_back(f.instructions);
+    }
+    out << "\nfunction        calls   instructions       %\n";
+    for (auto f : hottest(instructions, top)) {
+        out << "f" << std::left << std::setw(8) << f << std::right << std::setw(12) << functions[f].calls
+            << std::setw(15) << functions[f].instructions << std::setw(8) << percent(functions[f].instructions, total)
+            << "\n";
+    }
+
+    out << "\npc                    count       %\n";
+    for (auto&& at : hottest(pcs, top)) {
+        auto where = "f" + std::to_string(at.first) + ":" + std::to_string(at.second);
+        out << std::left << std::setw(12) << where << std::right << std::setw(15) << pcs[at.first][at.second]
+            << std::setw(8) << percent(pcs[at.first][at.second], total) << "\n";
+    }
+
+    out << "\nback-edge        iterations\n";
+    for (auto&& at : hottest(back_edges, top)) {
+        auto where = "f" + std::to_string(at.first) + ":" + std::to_string(at.second);
+        out << std::left << std::setw(12) << where << std::right << std::setw(15)
+            << back_edges[at.first][at.second] << "\n";
+    }
+
+    auto times = std::vector<std::chrono::nanoseconds>{};
+    for (auto&& n : natives) {
+        times.push_back(n.time);
+    }
+    out << "\nnative          calls     total ms   mean ns\n";
+    for (auto n : hottest(times, top)) {
+        auto&& p = natives[n];
+        out << "n" << std::left << std::setw(8) << n << std::right << std::setw(12) << p.calls
+            << std::setw(13) << std::chrono::duration<double, std::milli>(p.time).count()
+            << std::setw(10) << static_cast<double>(p.time.count()) / static_cast<double>(p.calls) << "\n";
+    }
+    out.flags(flags);
+}
+
+void Profile::write_collapsed(std::ostream& out) const {
+    for (size_t n = 1; n < nodes.size(); ++n) {
+        if (nodes[n].instructions == 0) {
+            continue;
+        }
+        auto stack = std::vector<index_t>{};
+        for (auto i = n; i != 0; i = nodes[i].parent) {
+            stack.push_back(nodes[i].function);
+        }
+        for (auto i = stack.size(); i-- > 0;) {
+            out << "f" << stack[i] << (i == 0 ? " " : ";");
+        }
+        out << nodes[n].instructions << "\n";
+    }
+}
@@ -0,0 +1,85 @@
+#pragma once
+#include <chrono>
+#include <ostream>
+#include <stddef.h>
+#include <stdint.h>
+#include <unordered_map>
+#include <vector>
+#include "instruction.h"
+#include "assembly.h"
+#include "fusion.h"
+
+namespace rvm {
+namespace interpreter {
+
+struct FunctionProfile {
+    uint64_t calls{0};
+    // instructions executed in the function itself, not in its callees
+    uint64_t instructions{0};
+};
+
+struct NativeProfile {
+    uint64_t calls{0};
+    std::chrono::nanoseconds time{0};
+};
+
+// What a run with Options::record_profile executed, as counted by the
+// reference loop: instructions by operation, function and pc, taken loop
+// back-edges, time spent in natives, and instructions by call stack for
+// flame graphs.
+class Profile {
+public:
+    Profile() = default;
+    explicit Profile(const assembly::Assembly&);
+
+    // by Operation
+    std::vector<uint64_t> operations{};
+    // by function index
+    std::vector<FunctionProfile> functions{};
+    // executions by function and pc, as derive_fusion_set() takes them
+    ExecutionProfile pcs{};
+    // by function and pc of a br or brtrue: jumps backwards
+    ExecutionProfile back_edges{};
+    // by native table index
+    std::vector<NativeProfile> natives{};
+
+    // Totals and the hottest entries of each table.
+    void write_report(std::ostream&, size_t top = 20) const;
+    // One line per call stack, "f0;f3;f4 <instructions>", the collapsed
+    // format flamegraph.pl and speedscope read. Functions are named fN by
+    // their index.
+    void write_collapsed(std::ostream&) const;
+
+    // Recording, driven by the interpreter.
+    void start(index_t function);
+    void instruction(index_t function, index_t pc, Operation op) {
+        ++operations[static_cast<size_t>(op)];
+        ++functions[function].instructions;
+        ++pcs[function][pc];
+        ++nodes[current].instructions;
+    }
+    void back_edge(index_t function, index_t pc) {
+        ++back_edges[function][pc];
+    }
+    void native(index_t idx, std::chrono::nanoseconds);
+    void enter(index_t function);
+    void leave();
+    void tail_enter(index_t function);
+
+private:
+    // call tree; node 0 is above the entry function
+    struct Node {
+        size_t parent;
+        index_t function;
+        uint64_t instructions;
+    };
+    std::vector<Node> nodes{};
+    // node by parent node and function
+    std::unordered_map<uint64_t, size_t> children{};
+    size_t current{0};
+
+    size_t child(size_t parent, index_t function);
+};
+
+}
+}
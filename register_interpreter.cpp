@@ -0,0 +1,423 @@
+#include "register_interpreter.h"
+#include <algorithm>
+#include <exception>
+#include <functional>
+#include <string.h>
+
+using namespace rvm;
+using namespace rvm::interpreter;
+using namespace rvm::assembly;
+
+namespace {
+
+template <class T> T value(const Operand&);
+template <> int8_t value<int8_t>(const Operand& o) { return o.int8; }
+template <> int32_t value<int32_t>(const Operand& o) { return o.int32; }
+template <> uint8_t value<uint8_t>(const Operand& o) { return static_cast<uint8_t>(o.int8); }
+template <> uint32_t value<uint32_t>(const Operand& o) { return static_cast<uint32_t>(o.int32); }
+
+template <class T, class R, class Func>
+inline void binop(Operand* fp, const RegisterInstruction& i, Func f) {
+    fp[i.dst] = Operand{static_cast<R>(f(value<T>(fp[i.a]), value<T>(fp[i.b])))};
+}
+
+bool same(const Operand& x, const Operand& y) {
+    return memcmp(&x, &y, sizeof(Operand)) == 0;
+}
+
+}
+
+void RegisterInterpreter::start() {
+    auto arities = std::vector<index_t>{};
+    for (auto&& n : native_table) {
+        arities.push_back(n.num_args);
+    }
+    for (auto&& f : assembly.function_table) {
+        functions.push_back(translate(assembly, f, arities));
+    }
+    auto&& main = functions[MAIN_FUNCTION_INDEX];
+    registers.assign(2 + main.frame_size, Operand{});
+    registers[0] = Operand{static_cast<int32_t>(0)};
+    registers[1] = Operand{static_cast<int32_t>(0)};
+    frames.push_back(2);
+    current_function_index = MAIN_FUNCTION_INDEX;
+    program_counter = 0;
+}
+
+void RegisterInterpreter::reserve(size_t n) {
+    if (registers.size() < n) {
+        registers.resize(std::max(n, registers.size() * 2));
+    }
+}
+
+void RegisterInterpreter::run() {
+    if (functions.empty()) {
+        start();
+    }
+    execute<false>();
+}
+
+void RegisterInterpreter::step() {
+    if (functions.empty()) {
+        start();
+    }
+    execute<true>();
+}
+
+template <bool Single>
+void RegisterInterpreter::execute() {
+    if (!running) {
+        return;
+    }
+    auto base = registers.data();
+    auto fp = base + frames.back();
+    auto function = &functions[current_function_index];
+    auto code = function->code.data();
+    auto ip = code + program_counter;
+
+#define ENTER(idx) \
+    do { \
+        auto&& callee = functions[idx]; \
+        auto callee_fp = (fp - base) + i.a + callee.num_args + 2; \
+        reserve(callee_fp + callee.frame_size); \
+        base = registers.data(); \
+        base[callee_fp - 2] = Operand{static_cast<int32_t>(current_function_index)}; \
+        base[callee_fp - 1] = Operand{static_cast<int32_t>(ip - code)}; \
+        std::fill(base + callee_fp, base + callee_fp + callee.frame_size, Operand{}); \
+        frames.push_back(static_cast<int32_t>(callee_fp)); \
+        fp = base + callee_fp; \
+        current_function_index = (idx); \
+        function = &callee; \
+        code = function->code.data(); \
+        next = code; \
+    } while (0)
+
+// Moves the arguments starting at register a over those of the current
+// frame and turns it into the callee's, keeping the saved return slots.
+#define TAIL_ENTER(idx) \
+    do { \
+        auto&& callee = functions[idx]; \
+        auto fp_off = fp - base; \
+        auto args = fp_off - 2 - function->num_args; \
+        auto callee_fp = args + callee.num_args + 2; \
+        reserve(callee_fp + callee.frame_size); \
+        base = registers.data(); \
+        Operand header[2] = {base[fp_off - 2], base[fp_off - 1]}; \
+        memmove(base + args, base + fp_off + i.a, callee.num_args * sizeof(Operand)); \
+        base[callee_fp - 2] = header[0]; \
+        base[callee_fp - 1] = header[1]; \
+        std::fill(base + callee_fp, base + callee_fp + callee.frame_size, Operand{}); \
+        frames.back() = static_cast<int32_t>(callee_fp); \
+        fp = base + callee_fp; \
+        current_function_index = (idx); \
+        function = &callee; \
+        code = function->code.data(); \
+        next = code; \
+    } while (0)
+
+#define ARITHMETIC(name, f) \
+            case RegisterOp::name##_i8: binop<int8_t, int8_t>(fp, i, f); break; \
+            case RegisterOp::name##_i32: binop<int32_t, int32_t>(fp, i, f); break;
+#define LOGIC(name, f) \
+            case RegisterOp::name##_i8: binop<int8_t, int8_t>(fp, i, f); break; \
+            case RegisterOp::name##_i32: binop<int32_t, int8_t>(fp, i, f); break; \
+            case RegisterOp::name##_un_i8: binop<uint8_t, int8_t>(fp, i, f); break; \
+            case RegisterOp::name##_un_i32: binop<uint32_t, int8_t>(fp, i, f); break;
+#define BRANCH(name, cond) \
+            case RegisterOp::name: \
+            { \
+                auto&& x = fp[i.dst]; \
+                auto&& y = fp[i.a]; \
+                if (cond) { \
+                    next = code + i.b; \
+                } \
+                break; \
+            }
+
+    try {
+        for (;;) {
+            auto&& i = *ip;
+            auto next = ip + 1;
+            switch (i.op) {
+                case RegisterOp::mov:
+                    fp[i.dst] = fp[i.a];
+                    break;
+                case RegisterOp::ldi:
+                    fp[i.dst] = Operand{i.a};
+                    break;
+                case RegisterOp::ldc:
+                    fp[i.dst] = constants[i.index];
+                    break;
+                ARITHMETIC(add, std::plus<>{})
+                ARITHMETIC(sub, std::minus<>{})
+                ARITHMETIC(mul, std::multiplies<>{})
+                ARITHMETIC(div, std::divides<>{})
+                ARITHMETIC(rem, std::modulus<>{})
+                ARITHMETIC(band, std::bit_and<>{})
+                ARITHMETIC(bor, std::bit_or<>{})
+                ARITHMETIC(bxor, std::bit_xor<>{})
+                case RegisterOp::bnot_i8:
+                    fp[i.dst] = Operand{static_cast<int8_t>(~fp[i.a].int8)};
+                    break;
+                case RegisterOp::bnot_i32:
+                    fp[i.dst] = Operand{static_cast<int32_t>(~fp[i.a].int32)};
+                    break;
+                case RegisterOp::addi_i32:
+                    fp[i.dst] = Operand{static_cast<int32_t>(
+                        static_cast<uint32_t>(fp[i.a].int32) + static_cast<uint32_t>(i.b))};
+                    break;
+                case RegisterOp::teq:
+                    fp[i.dst] = Operand{static_cast<int8_t>(same(fp[i.a], fp[i.b]) ? -1 : 0)};
+                    break;
+                case RegisterOp::tne:
+                    fp[i.dst] = Operand{static_cast<int8_t>(same(fp[i.a], fp[i.b]) ? 0 : -1)};
+                    break;
+                LOGIC(tlt, std::less<>{})
+                LOGIC(tle, std::less_equal<>{})
+                LOGIC(tgt, std::greater<>{})
+                LOGIC(tge, std::greater_equal<>{})
+                case RegisterOp::br:
+                    next = code + i.b;
+                    break;
+                case RegisterOp::brtrue:
+                    if (fp[i.a].int8 != 0) {
+                        next = code + i.b;
+                    }
+                    break;
+                case RegisterOp::switch_:
+                    next = ip + 1 + std::min<uint32_t>(static_cast<uint32_t>(fp[i.a].int32), i.index);
+                    break;
+                BRANCH(blt_i32, x.int32 < y.int32)
+                BRANCH(ble_i32, x.int32 <= y.int32)
+                BRANCH(bgt_i32, x.int32 > y.int32)
+                BRANCH(bge_i32, x.int32 >= y.int32)
+                BRANCH(beq, same(x, y))
+                BRANCH(bne, !same(x, y))
+                case RegisterOp::call:
+                    ENTER(i.index);
+                    break;
+                case RegisterOp::calla:
+                {
+                    auto idx = static_cast<index_t>(fp[i.b].int32);
+                    if (idx >= functions.size()) {
+                        throw IndexOutOfBoundError{};
+                    }
+                    // the translation assumed the arity stored in `index`
+                    if (functions[idx].num_args != i.index) {
+                        throw InvalidBytecodeError{};
+                    }
+                    ENTER(idx);
+                    break;
+                }
+                case RegisterOp::tailcall:
+                    TAIL_ENTER(i.index);
+                    break;
+                case RegisterOp::tailcalla:
+                {
+                    auto idx = static_cast<index_t>(fp[i.b].int32);
+                    if (idx >= functions.size()) {
+                        throw IndexOutOfBoundError{};
+                    }
+                    if (functions[idx].num_args != i.index) {
+                        throw InvalidBytecodeError{};
+                    }
+                    TAIL_ENTER(idx);
+                    break;
+                }
+                case RegisterOp::callnative:
+                {
+                    auto&& ni = native_table[i.index];
+                    auto args = fp + i.a;
+                    *args = ni.func(args, ni.userdata);
+                    break;
+                }
+                case RegisterOp::ret:
+                {
+                    auto v = fp[i.a];
+                    if (frames.size() == 1) {
+                        running = false;
+                        return_value = v;
+                        program_counter = static_cast<uint32_t>(ip - code);
+                        return;
+                    }
+                    auto callee_fp = frames.back();
+                    auto old_func = base[callee_fp - 2].int32;
+                    auto old_pc = base[callee_fp - 1].int32;
+                    auto result = callee_fp - 2 - function->num_args;
+                    base[result] = v;
+                    frames.pop_back();
+                    fp = base + frames.back();
+                    current_function_index = static_cast<index_t>(old_func);
+                    function = &functions[current_function_index];
+                    // Temporaries above the result are dead but were not
+                    // scanned by collections in the callee; clear them
+                    // before they count as roots again.
+                    std::fill(base + result + 1, std::max(base + result + 1, fp + function->frame_size),
+                              Operand{});
+                    code = function->code.data();
+                    next = code + old_pc + 1;
+                    break;
+                }
+                case RegisterOp::ldloca:
+                    fp[i.dst] = Operand{static_cast<int32_t>(fp - base + i.a)};
+                    break;
+                case RegisterOp::ldind:
+                    fp[i.dst] = base[fp[i.a].int32];
+                    break;
+                case RegisterOp::stind:
+                    base[fp[i.a].int32] = fp[i.b];
+                    break;
+                case RegisterOp::mkadt:
+                {
+                    auto adt = heap.make(i.index, i.index2, static_cast<index_t>(i.b), base,
+                                         fp + function->frame_size);
+                    std::copy(fp + i.dst, fp + i.dst + i.b, adt->fields);
+                    fp[i.dst] = Operand{adt};
+                    break;
+                }
+                case RegisterOp::dladt:
+                    heap.release(fp[i.a].adt);
+                    break;
+                case RegisterOp::ldctor:
+                    fp[i.dst] = Operand{static_cast<int32_t>(fp[i.a].adt->constructor_index)};
+                    break;
+                case RegisterOp::ldfld:
+                {
+                    auto adt = fp[i.a].adt;
+                    if (i.index >= adt->num_fields) {
+                        throw IndexOutOfBoundError{};
+                    }
+                    fp[i.dst] = adt->fields[i.index];
+                    break;
+                }
+                case RegisterOp::stfld:
+                    if (i.index >= fp[i.a].adt->num_fields) {
+                        throw IndexOutOfBoundError{};
+                    }
+                    if (Heap::is_constant(fp[i.a].adt)) {
+                        throw ConstantModificationError{};
+                    }
+                    heap.store(fp[i.a].adt, i.index, fp[i.b]);
+                    break;
+            }
+            ip = next;
+            if (Single) {
+                program_counter = static_cast<uint32_t>(ip - code);
+                return;
+            }
+        }
+    }
+    catch (...) {
+        program_counter = static_cast<uint32_t>(ip - code);
+        throw;
+    }
+
+#undef ENTER
+#undef TAIL_ENTER
+#undef ARITHMETIC
+#undef LOGIC
+#undef BRANCH
+}
+
+namespace {
+
+struct NativeCall {
+    index_t index;
+    std::vector<Operand> args;
+};
+
+// userdata of a native that records its calls before forwarding them
+struct Recorder {
+    NativeInfo native;
+    index_t index;
+    std::vector<NativeCall>* trace;
+};
+
+Operand record(Operand* args, void* userdata) {
+    auto r = static_cast<Recorder*>(userdata);
+    r->trace->push_back({r->index, std::vector<Operand>(args, args + r->native.num_args)});
+    return r->native.func(args, r->native.userdata);
+}
+
+std::vector<NativeInfo> recording(const std::vector<NativeInfo>& natives,
+                                  std::vector<NativeCall>* trace,
+                                  std::vector<Recorder>* recorders) {
+    recorders->clear();
+    for (size_t i = 0; i < natives.size(); ++i) {
+        recorders->push_back({natives[i], static_cast<index_t>(i), trace});
+    }
+    auto re = std::vector<NativeInfo>{};
+    for (auto&& r : *recorders) {
+        re.push_back({record, r.native.num_args, &r});
+    }
+    return re;
+}
+
+}
+
+Operand rvm::interpreter::run_differential(const Assembly& a,
+                                           const std::vector<NativeInfo>& natives) {
+    auto options = Options{};
+    options.dispatch = Dispatch::switch_loop;
+    auto reference = Interpreter{a, options};
+    auto candidate = RegisterInterpreter{a};
+    auto reference_trace = std::vector<NativeCall>{};
+    auto candidate_trace = std::vector<NativeCall>{};
+    auto reference_recorders = std::vector<Recorder>{};
+    auto candidate_recorders = std::vector<Recorder>{};
+    for (auto&& n : recording(natives, &reference_trace, &reference_recorders)) {
+        reference.add_native_function(n);
+    }
+    for (auto&& n : recording(natives, &candidate_trace, &candidate_recorders)) {
+        candidate.add_native_function(n);
+    }
+
+    auto reference_error = std::exception_ptr{};
+    auto candidate_error = std::exception_ptr{};
+    try {
+        reference.run();
+    }
+    catch (...) {
+        reference_error = std::current_exception();
+    }
+    try {
+        candidate.run();
+    }
+    catch (...) {
+        candidate_error = std::current_exception();
+    }
+
+    auto n = std::min(reference_trace.size(), candidate_trace.size());
+    for (size_t c = 0; c < n; ++c) {
+        auto&& x = reference_trace[c];
+        auto&& y = candidate_trace[c];
+        if (x.index != y.index) {
+            throw DivergenceError{"native call " + std::to_string(c)
+                + " goes to native " + std::to_string(y.index)
+                + " instead of " + std::to_string(x.index)};
+        }
+        for (size_t arg = 0; arg < x.args.size(); ++arg) {
+            if (!same(x.args[arg], y.args[arg])) {
+                throw DivergenceError{"native call " + std::to_string(c)
+                    + " differs in argument " + std::to_string(arg)};
+            }
+        }
+    }
+    if (reference_trace.size() != candidate_trace.size()) {
+        throw DivergenceError{"native calls: " + std::to_string(reference_trace.size())
+            + " on the reference, " + std::to_string(candidate_trace.size())
+            + " on the register interpreter"};
+    }
+    if (reference_error || candidate_error) {
+        if (!reference_error || !candidate_error) {
+            throw DivergenceError{reference_error
+                ? "only the reference interpreter threw"
+                : "only the register interpreter threw"};
+        }
+        std::rethrow_exception(reference_error);
+    }
+    if (!same(reference.result(), candidate.result())) {
+        throw DivergenceError{"return values differ"};
+    }
+    return reference.result();
+}
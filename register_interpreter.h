@@ -0,0 +1,71 @@
+#pragma once
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "assembly.h"
+#include "interpreter.h"
+#include "register_ir.h"
+
+namespace rvm {
+namespace interpreter {
+
+// Executes the register form of an assembly. It has the same public
+// interface as Interpreter; functions are translated on the first run() or
+// step(), once the natives and their arities are known.
+class RegisterInterpreter {
+public:
+    struct IndexOutOfBoundError {};
+    struct ConstantModificationError {};
+
+    RegisterInterpreter(const assembly::Assembly& a, size_t nursery_size = size_t{1} << 20)
+        : assembly(a), heap(nursery_size) {
+        heap.add_size_classes(assembly.adt_table);
+        constants = heap.constants(assembly.constant_table);
+    }
+    void run();
+    void step();
+    void add_native_function(NativeInfo f) {
+        native_table.push_back(f);
+    }
+    Operand result() const {
+        return return_value;
+    }
+
+private:
+    assembly::Assembly assembly{};
+    std::vector<NativeInfo> native_table{};
+    std::vector<RegisterFunction> functions{};
+
+    Heap heap;
+    std::vector<Operand> constants{};
+    // The current frame and everything below it are GC roots; frames are
+    // cleared on entry so that no stale reference is ever scanned.
+    std::vector<Operand> registers{};
+    std::vector<int32_t> frames{};
+    index_t current_function_index{0};
+    uint32_t program_counter{0};
+    bool running{true};
+    Operand return_value{};
+
+    void start();
+    void reserve(size_t);
+    template <bool Single>
+    void execute();
+};
+
+struct DivergenceError {
+    std::string message;
+};
+
+// Runs the assembly on the reference stack interpreter and on the register
+// interpreter, recording every native call. Throws DivergenceError when the
+// native call sequences, their arguments or the return values of the entry
+// function differ. Operands are compared bitwise, so references can only be
+// compared through what natives observe of them. The same goes for the
+// stack indices of ldloca and ldarga, which differ with the frame layouts
+// (see register_ir.h): a program that returns one or passes it to a native
+// diverges without being wrong. Natives run twice.
+Operand run_differential(const assembly::Assembly&, const std::vector<NativeInfo>&);
+
+}
+}
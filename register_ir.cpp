@@ -0,0 +1,505 @@
+#include "register_ir.h"
+#include "analysis.h"
+
+using namespace rvm;
+using namespace rvm::interpreter;
+using namespace rvm::assembly;
+
+namespace {
+
+// Pointers are int32 stack indices, so they share the int32 operations.
+RegisterOp typed(OperandType t, RegisterOp i8, RegisterOp i32) {
+    switch (t) {
+        case OperandType::int8: return i8;
+        case OperandType::int32:
+        case OperandType::pointer: return i32;
+        default: throw InvalidBytecodeError{};
+    }
+}
+
+RegisterOp binary_op(const Instruction& i) {
+    switch (i.op) {
+        case Operation::add: return typed(i.type, RegisterOp::add_i8, RegisterOp::add_i32);
+        case Operation::sub: return typed(i.type, RegisterOp::sub_i8, RegisterOp::sub_i32);
+        case Operation::mul: return typed(i.type, RegisterOp::mul_i8, RegisterOp::mul_i32);
+        case Operation::div: return typed(i.type, RegisterOp::div_i8, RegisterOp::div_i32);
+        case Operation::rem: return typed(i.type, RegisterOp::rem_i8, RegisterOp::rem_i32);
+        case Operation::band: return typed(i.type, RegisterOp::band_i8, RegisterOp::band_i32);
+        case Operation::bor: return typed(i.type, RegisterOp::bor_i8, RegisterOp::bor_i32);
+        case Operation::bxor: return typed(i.type, RegisterOp::bxor_i8, RegisterOp::bxor_i32);
+        case Operation::teq: return RegisterOp::teq;
+        case Operation::tne: return RegisterOp::tne;
+        case Operation::tlt: return typed(i.type, RegisterOp::tlt_i8, RegisterOp::tlt_i32);
+        case Operation::tlt_un: return typed(i.type, RegisterOp::tlt_un_i8, RegisterOp::tlt_un_i32);
+        case Operation::tle: return typed(i.type, RegisterOp::tle_i8, RegisterOp::tle_i32);
+        case Operation::tle_un: return typed(i.type, RegisterOp::tle_un_i8, RegisterOp::tle_un_i32);
+        case Operation::tgt: return typed(i.type, RegisterOp::tgt_i8, RegisterOp::tgt_i32);
+        case Operation::tgt_un: return typed(i.type, RegisterOp::tgt_un_i8, RegisterOp::tgt_un_i32);
+        case Operation::tge: return typed(i.type, RegisterOp::tge_i8, RegisterOp::tge_i32);
+        case Operation::tge_un: return typed(i.type, RegisterOp::tge_un_i8, RegisterOp::tge_un_i32);
+        default: throw InvalidBytecodeError{};
+    }
+}
+
+bool branch_op(RegisterOp op, RegisterOp* branch) {
+    switch (op) {
+        case RegisterOp::tlt_i32: *branch = RegisterOp::blt_i32; return true;
+        case RegisterOp::tle_i32: *branch = RegisterOp::ble_i32; return true;
+        case RegisterOp::tgt_i32: *branch = RegisterOp::bgt_i32; return true;
+        case RegisterOp::tge_i32: *branch = RegisterOp::bge_i32; return true;
+        case RegisterOp::teq: *branch = RegisterOp::beq; return true;
+        case RegisterOp::tne: *branch = RegisterOp::bne; return true;
+        default: return false;
+    }
+}
+
+RegisterInstruction instruction(RegisterOp op, int32_t dst, int32_t a = 0, int32_t b = 0) {
+    auto re = RegisterInstruction{};
+    re.op = op;
+    re.dst = dst;
+    re.a = a;
+    re.b = b;
+    return re;
+}
+
+class Translator {
+public:
+    Translator(const Assembly& a, const FunctionInfo& f,
+               const std::vector<index_t>& natives)
+        : a(a), f(f), natives(natives), layout(analyze_stack(a, f, natives)) {}
+
+    RegisterFunction run();
+
+private:
+    // A stack slot is either held in a register (its own temporary, or a
+    // local it was loaded from) or is an immediate not materialized yet.
+    struct Value {
+        bool immediate;
+        int32_t v;
+    };
+
+    const Assembly& a;
+    const FunctionInfo& f;
+    const std::vector<index_t>& natives;
+    StackLayout layout;
+
+    std::vector<Value> stack{};
+    std::vector<bool> targets{};
+    std::vector<RegisterInstruction> code{};
+    std::vector<size_t> start_of{};
+    std::vector<size_t> fixups{};
+    // index of the last instruction whose destination may be retargeted
+    ptrdiff_t last_def{-1};
+
+    int32_t temp(size_t depth) const {
+        return f.num_locals + static_cast<int32_t>(depth);
+    }
+    int32_t arg(index_t idx) const {
+        return -2 - f.num_args + idx;
+    }
+    bool is_frame_slot(const Value& v) const {
+        return !v.immediate && v.v < f.num_locals;
+    }
+
+    void emit(RegisterInstruction i, bool retargetable = false) {
+        code.push_back(i);
+        last_def = retargetable ? static_cast<ptrdiff_t>(code.size() - 1) : -1;
+    }
+    void emit_branch(RegisterInstruction i, index_t target) {
+        i.b = target;
+        fixups.push_back(code.size());
+        emit(i);
+    }
+    void push_temp(size_t depth) {
+        stack.push_back(Value{false, temp(depth)});
+    }
+
+    void materialize(size_t depth) {
+        auto&& v = stack[depth];
+        if (!v.immediate && v.v == temp(depth)) {
+            return;
+        }
+        emit(instruction(v.immediate ? RegisterOp::ldi : RegisterOp::mov, temp(depth), v.v));
+        v = Value{false, temp(depth)};
+    }
+    int32_t reg(size_t depth) {
+        if (stack[depth].immediate) {
+            materialize(depth);
+        }
+        return stack[depth].v;
+    }
+    void flush() {
+        for (size_t d = 0; d < stack.size(); ++d) {
+            materialize(d);
+        }
+    }
+    // Called before a local or argument is overwritten.
+    void spill(int32_t slot) {
+        for (size_t d = 0; d < stack.size(); ++d) {
+            if (!stack[d].immediate && stack[d].v == slot) {
+                materialize(d);
+            }
+        }
+    }
+    void spill_frame_slots() {
+        for (size_t d = 0; d < stack.size(); ++d) {
+            if (is_frame_slot(stack[d])) {
+                materialize(d);
+            }
+        }
+    }
+
+    void store(int32_t slot);
+    void call(RegisterInstruction i, size_t consumed);
+    void tail_call(RegisterInstruction i, size_t consumed);
+    bool translate_branch(size_t pc, RegisterOp op);
+};
+
+void Translator::store(int32_t slot) {
+    auto v = stack.back();
+    stack.pop_back();
+    spill(slot);
+    auto d = stack.size();
+    if (!v.immediate && v.v == temp(d)
+     && last_def == static_cast<ptrdiff_t>(code.size()) - 1
+     && code.back().dst == temp(d)) {
+        code.back().dst = slot;
+        last_def = -1;
+        return;
+    }
+    emit(instruction(v.immediate ? RegisterOp::ldi : RegisterOp::mov, slot, v.v));
+}
+
+// Arguments are passed in their stack slots, so everything is flushed;
+// this also keeps locals up to date for callees writing through pointers.
+void Translator::call(RegisterInstruction i, size_t consumed) {
+    flush();
+    auto base = stack.size() - consumed;
+    i.a = temp(base);
+    emit(i);
+    stack.resize(base);
+    push_temp(base);
+}
+
+void Translator::tail_call(RegisterInstruction i, size_t consumed) {
+    flush();
+    auto base = stack.size() - consumed;
+    i.a = temp(base);
+    emit(i);
+    stack.resize(base);
+}
+
+// Fuses a comparison with the brtrue that consumes it.
+bool Translator::translate_branch(size_t pc, RegisterOp op) {
+    RegisterOp branch;
+    if (pc + 1 >= f.code.size()
+     || f.code[pc + 1].op != Operation::brtrue
+     || targets[pc + 1]
+     || !branch_op(op, &branch)) {
+        return false;
+    }
+    auto d = stack.size();
+    auto y = reg(d - 1);
+    auto x = reg(d - 2);
+    stack.resize(d - 2);
+    flush();
+    emit_branch(instruction(branch, x, y), f.code[pc + 1].index);
+    return true;
+}
+
+RegisterFunction Translator::run() {
+    auto n = f.code.size();
+    targets.assign(n, false);
+    for (auto&& i : f.code) {
+        if (i.op == Operation::br || i.op == Operation::brtrue) {
+            targets[i.index] = true;
+        }
+        else if (i.op == Operation::switch_ || i.op == Operation::switchctor) {
+            // each entry starts a block, so it turns into a single br
+            auto at = static_cast<size_t>(&i - f.code.data());
+            for (size_t k = 1; k <= i.index + 1u; ++k) {
+                targets[at + k] = true;
+            }
+        }
+    }
+    start_of.assign(n, 0);
+    auto falls_in = false;
+    for (size_t pc = 0; pc < n; ++pc) {
+        auto&& i = f.code[pc];
+        auto depth = layout.depth[pc];
+        if (targets[pc] && falls_in) {
+            flush();
+        }
+        start_of[pc] = code.size();
+        if (depth < 0) {
+            falls_in = false;
+            continue;
+        }
+        if (targets[pc] || !falls_in) {
+            stack.clear();
+            for (int32_t d = 0; d < depth; ++d) {
+                push_temp(d);
+            }
+            last_def = -1;
+        }
+        falls_in = true;
+        auto d = stack.size();
+        switch (i.op) {
+            case Operation::add:
+            case Operation::sub:
+            {
+                auto&& y = stack[d - 1];
+                if (y.immediate && (i.type == OperandType::int32 || i.type == OperandType::pointer)) {
+                    auto k = static_cast<uint32_t>(y.v);
+                    auto delta = static_cast<int32_t>(i.op == Operation::add ? k : 0u - k);
+                    auto x = reg(d - 2);
+                    stack.resize(d - 2);
+                    emit(instruction(RegisterOp::addi_i32, temp(d - 2), x, delta), true);
+                    push_temp(d - 2);
+                    break;
+                }
+            }
+            // fallthrough
+            case Operation::mul:
+            case Operation::div:
+            case Operation::rem:
+            case Operation::band:
+            case Operation::bor:
+            case Operation::bxor:
+            case Operation::teq:
+            case Operation::tne:
+            case Operation::tlt:
+            case Operation::tlt_un:
+            case Operation::tle:
+            case Operation::tle_un:
+            case Operation::tgt:
+            case Operation::tgt_un:
+            case Operation::tge:
+            case Operation::tge_un:
+            {
+                auto op = binary_op(i);
+                if (translate_branch(pc, op)) {
+                    ++pc;
+                    start_of[pc] = code.size();
+                    falls_in = true;
+                    break;
+                }
+                auto y = reg(d - 1);
+                auto x = reg(d - 2);
+                stack.resize(d - 2);
+                emit(instruction(op, temp(d - 2), x, y), true);
+                push_temp(d - 2);
+                break;
+            }
+            case Operation::bnot:
+            {
+                auto x = reg(d - 1);
+                stack.pop_back();
+                emit(instruction(typed(i.type, RegisterOp::bnot_i8, RegisterOp::bnot_i32),
+                                 temp(d - 1), x), true);
+                push_temp(d - 1);
+                break;
+            }
+            case Operation::dup:
+                stack.push_back(stack.back());
+                break;
+            case Operation::drop:
+                stack.pop_back();
+                break;
+            case Operation::ldc:
+            {
+                auto&& c = a.constant_table[i.index];
+                switch (c.type) {
+                    case ConstantType::int8:
+                        stack.push_back(Value{true, static_cast<uint8_t>(c.int8)});
+                        break;
+                    case ConstantType::int32:
+                        stack.push_back(Value{true, c.int32});
+                        break;
+                    case ConstantType::adt:
+                    {
+                        auto ins = instruction(RegisterOp::ldc, temp(d));
+                        ins.index = i.index;
+                        emit(ins, true);
+                        push_temp(d);
+                        break;
+                    }
+                }
+                break;
+            }
+            case Operation::ldloc:
+                stack.push_back(Value{false, i.index});
+                break;
+            case Operation::stloc:
+                store(i.index);
+                break;
+            case Operation::ldarg:
+                stack.push_back(Value{false, arg(i.index)});
+                break;
+            case Operation::starg:
+                store(arg(i.index));
+                break;
+            case Operation::call:
+            {
+                auto ins = instruction(RegisterOp::call, 0);
+                ins.index = i.index;
+                call(ins, a.function_table[i.index].num_args);
+                break;
+            }
+            case Operation::callnative:
+            {
+                auto ins = instruction(RegisterOp::callnative, 0);
+                ins.index = i.index;
+                call(ins, natives[i.index]);
+                break;
+            }
+            case Operation::calla:
+            {
+                flush();
+                auto ins = instruction(RegisterOp::calla, 0);
+                ins.b = temp(d - 1);
+                ins.index = calla_arity(a, f, pc);
+                call(ins, ins.index + 1);
+                break;
+            }
+            case Operation::tailcall:
+            {
+                auto ins = instruction(RegisterOp::tailcall, 0);
+                ins.index = i.index;
+                tail_call(ins, a.function_table[i.index].num_args);
+                falls_in = false;
+                break;
+            }
+            case Operation::tailcalla:
+            {
+                flush();
+                auto ins = instruction(RegisterOp::tailcalla, 0);
+                ins.b = temp(d - 1);
+                ins.index = calla_arity(a, f, pc);
+                tail_call(ins, ins.index + 1);
+                falls_in = false;
+                break;
+            }
+            case Operation::ret:
+                emit(instruction(RegisterOp::ret, 0, reg(d - 1)));
+                stack.pop_back();
+                falls_in = false;
+                break;
+            case Operation::ldloca:
+            case Operation::ldarga:
+            {
+                auto slot = i.op == Operation::ldloca ? i.index : arg(i.index);
+                emit(instruction(RegisterOp::ldloca, temp(d), slot), true);
+                push_temp(d);
+                break;
+            }
+            case Operation::ldfuna:
+                stack.push_back(Value{true, i.index});
+                break;
+            case Operation::ldind:
+            {
+                auto p = reg(d - 1);
+                stack.pop_back();
+                emit(instruction(RegisterOp::ldind, temp(d - 1), p), true);
+                push_temp(d - 1);
+                break;
+            }
+            case Operation::stind:
+            {
+                auto v = reg(d - 1);
+                auto p = reg(d - 2);
+                stack.resize(d - 2);
+                spill_frame_slots();
+                emit(instruction(RegisterOp::stind, 0, p, v));
+                break;
+            }
+            case Operation::br:
+                flush();
+                emit_branch(instruction(RegisterOp::br, 0), i.index);
+                falls_in = false;
+                break;
+            case Operation::brtrue:
+            {
+                auto x = reg(d - 1);
+                stack.pop_back();
+                flush();
+                emit_branch(instruction(RegisterOp::brtrue, 0, x), i.index);
+                break;
+            }
+            case Operation::switch_:
+            case Operation::switchctor:
+            {
+                auto x = reg(d - 1);
+                stack.pop_back();
+                if (i.op == Operation::switchctor) {
+                    emit(instruction(RegisterOp::ldctor, temp(d - 1), x));
+                    x = temp(d - 1);
+                }
+                flush();
+                auto ins = instruction(RegisterOp::switch_, 0, x);
+                ins.index = i.index;
+                emit(ins);
+                falls_in = false;
+                break;
+            }
+            case Operation::mkadt:
+            {
+                size_t num_fields = a.adt_table[i.index][i.index2].num_fields;
+                flush();
+                auto base = d - num_fields;
+                auto ins = instruction(RegisterOp::mkadt, temp(base), 0, static_cast<int32_t>(num_fields));
+                ins.index = i.index;
+                ins.index2 = i.index2;
+                emit(ins);
+                stack.resize(base);
+                push_temp(base);
+                break;
+            }
+            case Operation::dladt:
+                emit(instruction(RegisterOp::dladt, 0, reg(d - 1)));
+                stack.pop_back();
+                break;
+            case Operation::ldctor:
+            {
+                auto x = reg(d - 1);
+                stack.pop_back();
+                emit(instruction(RegisterOp::ldctor, temp(d - 1), x), true);
+                push_temp(d - 1);
+                break;
+            }
+            case Operation::ldfld:
+            {
+                auto x = reg(d - 1);
+                stack.pop_back();
+                auto ins = instruction(RegisterOp::ldfld, temp(d - 1), x);
+                ins.index = i.index;
+                emit(ins, true);
+                push_temp(d - 1);
+                break;
+            }
+            case Operation::stfld:
+            {
+                auto adt = reg(d - 1);
+                auto v = reg(d - 2);
+                stack.resize(d - 2);
+                auto ins = instruction(RegisterOp::stfld, 0, adt, v);
+                ins.index = i.index;
+                emit(ins);
+                break;
+            }
+        }
+    }
+    for (auto fixup : fixups) {
+        code[fixup].b = static_cast<int32_t>(start_of[code[fixup].b]);
+    }
+    return RegisterFunction{f.num_args, f.num_locals,
+                            static_cast<index_t>(f.num_locals + layout.max_depth),
+                            std::move(code)};
+}
+
+}
+
+RegisterFunction rvm::interpreter::translate(const Assembly& a, const FunctionInfo& f,
+                                             const std::vector<index_t>& native_arities) {
+    return Translator{a, f, native_arities}.run();
+}
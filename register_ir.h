@@ -0,0 +1,87 @@
+#pragma once
+#include <stdint.h>
+#include <vector>
+#include "instruction.h"
+#include "assembly.h"
+
+namespace rvm {
+namespace interpreter {
+
+// Register form of the bytecode. Registers are frame-relative slots in a
+// layout of the register interpreter's own: arguments below two saved
+// return slots, the caller's function index and pc, then the locals, then
+// one temporary per operand stack depth. The stack interpreter saves
+// FRAME_HEADER_SIZE slots instead, so the stack indices ldloca and ldarga
+// give differ between the two. `dst`, `a` and `b` name registers unless
+// noted otherwise.
+//
+//  mov        dst <- a
+//  ldi        dst <- int32 immediate `a` (int8 constants zero-extended)
+//  ldc        dst <- constant_table[index]
+//  <op>_<ty>  dst <- a op b              bnot: dst <- ~a
+//  addi_i32   dst <- a + immediate `b`
+//  br         goto b
+//  brtrue     if (a) goto b
+//  switch_    goto the a-th of the `index` br that follow, or past them
+//  b<cmp>     if (dst cmp a) goto b
+//  call       call function `index` with arguments starting at register a
+//  calla      same, function index in register b, arity `index`
+//  callnative call native `index` with arguments starting at register a
+//  tailcall   call and ret in one, reusing the frame
+//  tailcalla  same, function index in register b, arity `index`
+//  ret        return a
+//  ldloca     dst <- absolute stack index of register a
+//  ldind      dst <- stack[a]            stind: stack[a] <- b
+//  mkadt      dst <- adt `index`/`index2` with `b` fields starting at dst
+//  dladt      free a
+//  ldctor     dst <- constructor of a
+//  ldfld      dst <- a.fields[index]     stfld: a.fields[index] <- b
+#define RVM_REGISTER_OPS(X) \
+    X(mov) X(ldi) X(ldc) \
+    X(add_i8) X(add_i32) X(sub_i8) X(sub_i32) \
+    X(mul_i8) X(mul_i32) X(div_i8) X(div_i32) X(rem_i8) X(rem_i32) \
+    X(band_i8) X(band_i32) X(bor_i8) X(bor_i32) X(bxor_i8) X(bxor_i32) \
+    X(bnot_i8) X(bnot_i32) X(addi_i32) \
+    X(teq) X(tne) \
+    X(tlt_i8) X(tlt_i32) X(tlt_un_i8) X(tlt_un_i32) \
+    X(tle_i8) X(tle_i32) X(tle_un_i8) X(tle_un_i32) \
+    X(tgt_i8) X(tgt_i32) X(tgt_un_i8) X(tgt_un_i32) \
+    X(tge_i8) X(tge_i32) X(tge_un_i8) X(tge_un_i32) \
+    X(br) X(brtrue) X(switch_) \
+    X(blt_i32) X(ble_i32) X(bgt_i32) X(bge_i32) X(beq) X(bne) \
+    X(call) X(calla) X(callnative) X(tailcall) X(tailcalla) X(ret) \
+    X(ldloca) X(ldind) X(stind) \
+    X(mkadt) X(dladt) X(ldctor) X(ldfld) X(stfld)
+
+enum class RegisterOp: uint8_t {
+#define RVM_REGISTER_OP_ENUM(name) name,
+    RVM_REGISTER_OPS(RVM_REGISTER_OP_ENUM)
+#undef RVM_REGISTER_OP_ENUM
+};
+
+struct RegisterInstruction {
+    RegisterOp op;
+    sindex_t index2{0};
+    index_t index{0};
+    int32_t dst{0};
+    int32_t a{0};
+    int32_t b{0};
+};
+
+struct RegisterFunction {
+    index_t num_args;
+    index_t num_locals;
+    // locals plus one temporary per operand stack slot
+    index_t frame_size;
+    std::vector<RegisterInstruction> code;
+};
+
+// Translates a validated function. Stack values are tracked symbolically,
+// so loads of locals and constants only turn into moves where a value has
+// to live in its stack slot: at branches, calls and ADT construction.
+// `native_arities` holds NativeInfo::num_args of the natives in order.
+RegisterFunction translate(const assembly::Assembly&, const assembly::FunctionInfo&,
+                           const std::vector<index_t>& native_arities);
+
+}
+}
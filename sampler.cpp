@@ -0,0 +1,269 @@
+#include "sampler.h"
+#include <algorithm>
+#include <chrono>
+#include <errno.h>
+#include <iomanip>
+#include <signal.h>
+#include <string>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "vm_stack.h"
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+using namespace rvm;
+using namespace rvm::interpreter;
+using namespace rvm::assembly;
+
+namespace {
+
+// the sampler of the thread the signal interrupted
+thread_local Sampler* active = nullptr;
+
+// SIGPROF is installed by the first running sampler and put back by the
+// last one.
+std::mutex handler_lock{};
+size_t num_samplers = 0;
+struct sigaction previous{};
+
+double percent(uint64_t part, uint64_t total) {
+    return total == 0 ? 0 : 100.0 * static_cast<double>(part) / static_cast<double>(total);
+}
+
+}
+
+SampleProfile::SampleProfile(const Assembly& a)
+    : self(a.function_table.size(), 0), total(a.function_table.size(), 0) {
+    for (auto&& f : a.function_table) {
+        pcs.emplace_back(f.code.size(), 0);
+    }
+}
+
+void SampleProfile::write_report(std::ostream& out, size_t top) const {
+    out << "samples " << samples << ", dropped " << dropped << ", idle " << idle << "\n";
+    auto flags = out.flags();
+    out << std::fixed << std::setprecision(1);
+
+    auto order = std::vector<size_t>{};
+    for (size_t f = 0; f < self.size(); ++f) {
+        if (total[f] != 0) {
+            order.push_back(f);
+        }
+    }
+    std::sort(order.begin(), order.end(), [&](size_t x, size_t y) {
+        return self[x] != self[y] ? self[x] > self[y] : total[x] > total[y];
+    });
+    order.resize(std::min(top, order.size()));
+    out << "\nfunction         self       %       total       %\n";
+    for (auto f : order) {
+        out << "f" << std::left << std::setw(8) << f << std::right << std::setw(12) << self[f]
+            << std::setw(8) << percent(self[f], samples) << std::setw(12) << total[f]
+            << std::setw(8) << percent(total[f], samples) << "\n";
+    }
+
+    auto where = std::vector<std::pair<size_t, size_t>>{};
+    for (size_t f = 0; f < pcs.size(); ++f) {
+        for (size_t pc = 0; pc < pcs[f].size(); ++pc) {
+            if (pcs[f][pc] != 0) {
+                where.emplace_back(f, pc);
+            }
+        }
+    }
+    auto n = std::min(top, where.size());
+    std::partial_sort(where.begin(), where.begin() + n, where.end(), [&](auto x, auto y) {
+        return pcs[x.first][x.second] > pcs[y.first][y.second];
+    });
+    out << "\npc                  samples       %\n";
+    for (size_t i = 0; i < n; ++i) {
+        auto at = where[i];
+        auto name = "f" + std::to_string(at.first) + ":" + std::to_string(at.second);
+        out << std::left << std::setw(12) << name << std::right << std::setw(13) << pcs[at.first][at.second]
+            << std::setw(8) << percent(pcs[at.first][at.second], samples) << "\n";
+    }
+    out.flags(flags);
+}
+
+void SampleProfile::write_collapsed(std::ostream& out) const {
+    for (auto&& s : stacks) {
+        for (size_t i = 0; i < s.first.size(); ++i) {
+            out << "f" << s.first[i] << (i + 1 == s.first.size() ? " " : ";");
+        }
+        out << s.second << "\n";
+    }
+}
+
+Sampler::Sampler(const Interpreter& v, unsigned frequency)
+    : vm(v), ring(new Sample[ring_size]), result(v.assembly) {
+    if (active != nullptr) {
+        throw SystemError{EBUSY};
+    }
+    {
+        auto guard = std::lock_guard<std::mutex>{handler_lock};
+        if (num_samplers == 0) {
+            struct sigaction sa{};
+            sa.sa_handler = &Sampler::on_signal;
+            sa.sa_flags = SA_RESTART;
+            sigemptyset(&sa.sa_mask);
+            if (sigaction(SIGPROF, &sa, &previous) != 0) {
+                throw SystemError{errno};
+            }
+        }
+        ++num_samplers;
+    }
+
+    // ticks of this thread's CPU time, delivered to this thread
+    auto ev = sigevent{};
+    ev.sigev_notify = SIGEV_THREAD_ID;
+    ev.sigev_signo = SIGPROF;
+    ev.sigev_notify_thread_id = static_cast<pid_t>(syscall(SYS_gettid));
+    if (timer_create(CLOCK_THREAD_CPUTIME_ID, &ev, &timer) != 0) {
+        auto error = errno;
+        auto guard = std::lock_guard<std::mutex>{handler_lock};
+        if (--num_samplers == 0) {
+            sigaction(SIGPROF, &previous, nullptr);
+        }
+        throw SystemError{error};
+    }
+    armed = true;
+    active = this;
+    drainer = std::thread{[this] {
+        auto guard = std::unique_lock<std::mutex>{lock};
+        while (!stopping) {
+            wake.wait_for(guard, std::chrono::milliseconds{10});
+            drain();
+        }
+    }};
+
+    auto period = std::chrono::nanoseconds{std::chrono::seconds{1}} / std::max(frequency, 1u);
+    auto spec = itimerspec{};
+    spec.it_interval.tv_sec = static_cast<time_t>(period.count() / 1000000000);
+    spec.it_interval.tv_nsec = static_cast<long>(period.count() % 1000000000);
+    spec.it_value = spec.it_interval;
+    timer_settime(timer, 0, &spec, nullptr);
+}
+
+Sampler::~Sampler() {
+    stop();
+}
+
+void Sampler::stop() {
+    if (!armed) {
+        return;
+    }
+    // no signal is delivered after timer_delete(), so the handler is done
+    // with the ring
+    timer_delete(timer);
+    armed = false;
+    if (active == this) {
+        active = nullptr;
+    }
+    {
+        auto guard = std::lock_guard<std::mutex>{handler_lock};
+        if (--num_samplers == 0) {
+            sigaction(SIGPROF, &previous, nullptr);
+        }
+    }
+    {
+        auto guard = std::lock_guard<std::mutex>{lock};
+        stopping = true;
+    }
+    wake.notify_one();
+    drainer.join();
+    auto guard = std::lock_guard<std::mutex>{lock};
+    drain();
+}
+
+SampleProfile Sampler::profile() {
+    auto guard = std::lock_guard<std::mutex>{lock};
+    drain();
+    return result;
+}
+
+void Sampler::on_signal(int) {
+    auto saved = errno;
+    if (active != nullptr) {
+        active->sample();
+    }
+    errno = saved;
+}
+
+// Runs in the signal handler, on the interpreter's thread: no allocation,
+// no locks. The interrupted code may be halfway through a call or a return,
+// so every frame read is checked before it is followed.
+void Sampler::sample() {
+    auto function = vm.position.function;
+    auto pc = vm.position.pc;
+    auto frame = vm.position.frame;
+    if (function == Interpreter::Position::outside) {
+        outside.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    auto base = vm.operand_stack.data();
+    if (function == Interpreter::Position::current) {
+        function = static_cast<int32_t>(vm.current_function_index);
+        pc = static_cast<int32_t>(vm.program_counter);
+        frame = static_cast<int32_t>(vm.frame - base);
+    }
+
+    auto h = head.load(std::memory_order_relaxed);
+    if (h - tail.load(std::memory_order_acquire) == ring_size) {
+        lost.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    auto&& s = ring[h % ring_size];
+    auto&& functions = vm.assembly.function_table;
+    auto capacity = static_cast<int32_t>(std::min<size_t>(vm.operand_stack.capacity(), INT32_MAX));
+    s.depth = 0;
+    s.pc = static_cast<uint32_t>(pc);
+    while (s.depth < max_depth) {
+        if (function < 0 || static_cast<size_t>(function) >= functions.size()) {
+            break;
+        }
+        s.functions[s.depth++] = static_cast<index_t>(function);
+        if (frame < FRAME_HEADER_SIZE || frame > capacity) {
+            break;
+        }
+        auto caller = base[frame - 1].int32;
+        // the entry frame's caller is slot 0
+        if (caller <= 0 || caller >= frame) {
+            break;
+        }
+        function = base[frame - FRAME_HEADER_SIZE].int32;
+        frame = caller;
+    }
+    if (s.depth == 0) {
+        return;
+    }
+    head.store(h + 1, std::memory_order_release);
+}
+
+// With `lock` held.
+void Sampler::drain() {
+    auto&& functions = vm.assembly.function_table;
+    auto t = tail.load(std::memory_order_relaxed);
+    auto h = head.load(std::memory_order_acquire);
+    auto stack = std::vector<index_t>{};
+    for (; t != h; ++t) {
+        auto&& s = ring[t % ring_size];
+        auto top = s.functions[0];
+        ++result.samples;
+        ++result.self[top];
+        if (s.pc < functions[top].code.size()) {
+            ++result.pcs[top][s.pc];
+        }
+        stack.assign(s.functions, s.functions + s.depth);
+        std::reverse(stack.begin(), stack.end());
+        for (size_t i = 0; i < stack.size(); ++i) {
+            // recursion counts once
+            if (std::find(stack.begin(), stack.begin() + i, stack[i]) == stack.begin() + i) {
+                ++result.total[stack[i]];
+            }
+        }
+        ++result.stacks[stack];
+    }
+    tail.store(t, std::memory_order_release);
+    result.dropped = lost.load(std::memory_order_relaxed);
+    result.idle = outside.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,107 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <stddef.h>
+#include <stdint.h>
+#include <thread>
+#include <time.h>
+#include <vector>
+#include "instruction.h"
+#include "assembly.h"
+#include "fusion.h"
+#include "interpreter.h"
+
+namespace rvm {
+namespace interpreter {
+
+// What a Sampler saw: one sample per tick of CPU time the thread spent
+// while the interpreter was running.
+struct SampleProfile {
+    SampleProfile() = default;
+    explicit SampleProfile(const assembly::Assembly&);
+
+    uint64_t samples{0};
+    // samples lost because the ring was full
+    uint64_t dropped{0};
+    // ticks while the interpreter was not running, not in `samples`
+    uint64_t idle{0};
+    // by function index: samples in the function itself, and in it or
+    // anything it called
+    std::vector<uint64_t> self{};
+    std::vector<uint64_t> total{};
+    // samples by function and pc of the innermost frame
+    ExecutionProfile pcs{};
+    // samples by call stack, entry function first
+    std::map<std::vector<index_t>, uint64_t> stacks{};
+
+    void write_report(std::ostream&, size_t top = 20) const;
+    // Same format as Profile::write_collapsed(), in samples.
+    void write_collapsed(std::ostream&) const;
+};
+
+// Statistical profiler for an interpreter in production: a timer interrupts
+// the thread `frequency` times per second of its CPU time, and the signal
+// handler copies the function, the pc and the call stack into a ring that a
+// background thread folds into a SampleProfile. Nothing is counted per
+// instruction, so the interpreter runs at full speed with any engine.
+//
+// The reference loop is sampled at the exact pc. The threaded engine only
+// tells where it is on calls, returns and loop back-edges, so its pcs are
+// those of the last one of these, and code the JIT compiled counts as the
+// function it was entered in.
+//
+// Create and destroy the sampler on the thread that runs the interpreter;
+// one sampler per thread at a time. Linux only, SIGPROF underneath.
+class Sampler {
+public:
+    struct SystemError {
+        int error;
+    };
+    static constexpr size_t max_depth = 32;
+
+    explicit Sampler(const Interpreter&, unsigned frequency = 1000);
+    Sampler(const Sampler&) = delete;
+    Sampler& operator=(const Sampler&) = delete;
+    ~Sampler();
+
+    // Stops the timer; profile() keeps what was sampled.
+    void stop();
+    // Everything sampled so far.
+    SampleProfile profile();
+
+private:
+    struct Sample {
+        uint32_t depth;
+        uint32_t pc;
+        // innermost frame first
+        index_t functions[max_depth];
+    };
+    static constexpr size_t ring_size = 1024;
+
+    const Interpreter& vm;
+    // single producer, the signal handler; single consumer, `drainer`
+    std::unique_ptr<Sample[]> ring;
+    std::atomic<uint32_t> head{0};
+    std::atomic<uint32_t> tail{0};
+    std::atomic<uint64_t> lost{0};
+    std::atomic<uint64_t> outside{0};
+    timer_t timer{};
+    bool armed{false};
+
+    std::mutex lock{};
+    std::condition_variable wake{};
+    bool stopping{false};
+    SampleProfile result;
+    std::thread drainer{};
+
+    static void on_signal(int);
+    void sample();
+    void drain();
+};
+
+}
+}
@@ -0,0 +1,266 @@
+// Tests of Assembly::parse() over streams that cannot seek, like pipes,
+// which it reads as the format asks for bytes: what follows an assembly
+// stays in the stream, a truncated one fails, and a corrupt count fails at
+// the end of the input instead of allocating for it.
+//
+//   g++ -std=c++17 -O2 -I.. assembly.cpp ../assembly.cpp -o assembly
+//   ./assembly [--filter substring]
+//
+// Prints a line for every test that fails and exits with status 1 if there
+// was any.
+#include <functional>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <stdlib.h>
+#include <streambuf>
+#include <string>
+#include <vector>
+#include "../assembly.h"
+
+using namespace rvm;
+using namespace rvm::assembly;
+
+namespace {
+
+// the largest allocation since the last reset
+size_t largest_allocation = 0;
+
+}
+
+void* operator new(size_t size) {
+    largest_allocation = std::max(largest_allocation, size);
+    if (auto p = malloc(size == 0 ? 1 : size)) {
+        return p;
+    }
+    throw std::bad_alloc{};
+}
+
+// Not inlined, or GCC warns about free() of memory from operator new.
+__attribute__((noinline)) void operator delete(void* p) noexcept {
+    free(p);
+}
+
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+
+namespace {
+
+using O = Operation;
+
+struct Test {
+    std::string name;
+    // what went wrong, empty if nothing did
+    std::function<std::string()> run;
+};
+
+// Hands out `bytes` a few at a time and cannot seek, as a pipe would.
+class Pipe: public std::streambuf {
+public:
+    explicit Pipe(std::vector<uint8_t> bytes): bytes(std::move(bytes)) {}
+
+private:
+    std::vector<uint8_t> bytes;
+    size_t next{0};
+    char chunk[5];
+
+    int_type underflow() override {
+        if (next == bytes.size()) {
+            return traits_type::eof();
+        }
+        auto n = std::min(sizeof chunk, bytes.size() - next);
+        std::copy(bytes.begin() + static_cast<std::ptrdiff_t>(next),
+                  bytes.begin() + static_cast<std::ptrdiff_t>(next + n), chunk);
+        next += n;
+        setg(chunk, chunk, chunk + n);
+        return traits_type::to_int_type(chunk[0]);
+    }
+};
+
+ConstantInfo int32(int32_t x) {
+    return ConstantInfo{x};
+}
+
+// Something of every table and constant type.
+Assembly program() {
+    auto fields = new ConstantInfo[2]{ConstantInfo{int8_t{-3}}, int32(70000)};
+    auto list = ConstantInfo{AdtConstant{0, 1, 2, fields}};
+    auto main = Bytecode{
+        Instruction{O::ldc, 0}, Instruction{O::ldc, 1}, Instruction{O::call, 1}, Instruction{O::ret}};
+    auto f = Bytecode{Instruction{O::ldarg, 1}, Instruction{O::ldarg, 0}, Instruction{O::ret}};
+    return Assembly{{AdtInfo{ConstructorInfo{0}, ConstructorInfo{2}}},
+                    {int32(7), list, ConstantInfo{int8_t{1}}},
+                    {FunctionInfo{0, 0, main}, FunctionInfo{2, 1, f}}};
+}
+
+void u32(std::vector<uint8_t>* out, uint32_t x) {
+    for (auto shift = 24; shift >= 0; shift -= 8) {
+        out->push_back(static_cast<uint8_t>(x >> shift));
+    }
+}
+
+void u16(std::vector<uint8_t>* out, uint16_t x) {
+    out->push_back(static_cast<uint8_t>(x >> 8));
+    out->push_back(static_cast<uint8_t>(x));
+}
+
+// What parse() makes of `bytes` through a Pipe, and what it left unread.
+std::string parse_pipe(const std::vector<uint8_t>& bytes, Assembly* a, std::string* rest) {
+    auto pipe = Pipe{bytes};
+    auto in = std::istream{&pipe};
+    try {
+        *a = Assembly::parse(in);
+    }
+    catch (ParseError&) {
+        return "ParseError";
+    }
+    if (!in.good()) {
+        return "stream left failed";
+    }
+    *rest = std::string{std::istreambuf_iterator<char>{in}, std::istreambuf_iterator<char>{}};
+    return "";
+}
+
+// The assembly reads back the same, and the bytes after it are still there
+// for the next reader; also when nothing follows.
+std::string trailing_bytes() {
+    auto bytes = dump(program());
+    for (auto tail : {std::string{"next assembly"}, std::string{}}) {
+        auto input = bytes;
+        input.insert(input.end(), tail.begin(), tail.end());
+        auto a = Assembly{};
+        auto rest = std::string{};
+        auto error = parse_pipe(input, &a, &rest);
+        if (!error.empty()) {
+            return error;
+        }
+        if (dump(a) != bytes) {
+            return "read back differently";
+        }
+        if (rest != tail) {
+            return "left \"" + rest + "\" instead of \"" + tail + "\"";
+        }
+    }
+    return "";
+}
+
+// Every prefix short of the whole assembly fails.
+std::string truncated() {
+    auto bytes = dump(program());
+    for (size_t n = 0; n < bytes.size(); ++n) {
+        auto a = Assembly{};
+        auto rest = std::string{};
+        auto error = parse_pipe(std::vector<uint8_t>(bytes.begin(), bytes.begin() + static_cast<std::ptrdiff_t>(n)),
+                                &a, &rest);
+        if (error != "ParseError") {
+            return std::to_string(n) + " of " + std::to_string(bytes.size()) + " bytes: "
+                   + (error.empty() ? "parsed" : error);
+        }
+    }
+    return "";
+}
+
+// A count near 2^32 in each table, followed by a little more input: the
+// parse fails once the input runs out, having allocated about as much as
+// there was input.
+std::string huge_count() {
+    auto junk = std::vector<uint8_t>(100000, 1);
+    auto cases = std::vector<std::pair<std::string, std::vector<uint8_t>>>{};
+    auto header = std::vector<uint8_t>{};
+    u32(&header, MAGIC_NUMBER);
+
+    auto adts = header;
+    u32(&adts, 0xFFFFFFF0);
+    cases.emplace_back("adts", adts);
+    auto constructors = header;
+    u32(&constructors, 1);
+    u32(&constructors, 0xFFFFFFF0);
+    cases.emplace_back("constructors", constructors);
+    auto constants = header;
+    u32(&constants, 0);
+    u32(&constants, 0xFFFFFFF0);
+    cases.emplace_back("constants", constants);
+    auto functions = header;
+    u32(&functions, 0);
+    u32(&functions, 0);
+    u32(&functions, 0xFFFFFFF0);
+    cases.emplace_back("functions", functions);
+    auto code = header;
+    u32(&code, 0);
+    u32(&code, 0);
+    u32(&code, 1);
+    u16(&code, 0);
+    u16(&code, 0);
+    u32(&code, 0xFFFFFFF0);
+    cases.emplace_back("code", code);
+
+    for (auto&& c : cases) {
+        auto input = c.second;
+        input.insert(input.end(), junk.begin(), junk.end());
+        auto a = Assembly{};
+        auto rest = std::string{};
+        largest_allocation = 0;
+        auto error = std::string{};
+        try {
+            error = parse_pipe(input, &a, &rest);
+        }
+        catch (std::bad_alloc&) {
+            error = "bad_alloc";
+        }
+        if (error != "ParseError") {
+            return c.first + ": " + (error.empty() ? "parsed" : error);
+        }
+        if (largest_allocation > 4 * input.size()) {
+            return c.first + ": allocated " + std::to_string(largest_allocation) + " bytes";
+        }
+    }
+    return "";
+}
+
+// A seekable stream is read in one go, and left in the same place.
+std::string seekable() {
+    auto bytes = dump(program());
+    auto in = std::istringstream{std::string{bytes.begin(), bytes.end()} + "next"};
+    auto a = Assembly::parse(in);
+    auto rest = std::string{};
+    in >> rest;
+    return dump(a) == bytes && rest == "next" ? "" : "left \"" + rest + "\"";
+}
+
+std::vector<Test> tests() {
+    return {
+        {"trailing_bytes", trailing_bytes},
+        {"truncated", truncated},
+        {"huge_count", huge_count},
+        {"seekable", seekable},
+    };
+}
+
+}
+
+int main(int argc, char** argv) {
+    auto filter = std::string{};
+    for (auto i = 1; i < argc; ++i) {
+        auto arg = std::string{argv[i]};
+        if (arg != "--filter" || i + 1 == argc) {
+            std::cerr << "usage: assembly [--filter substring]\n";
+            return 2;
+        }
+        filter = argv[++i];
+    }
+
+    auto failures = 0;
+    for (auto&& t : tests()) {
+        if (t.name.find(filter) == std::string::npos) {
+            continue;
+        }
+        auto error = t.run();
+        if (!error.empty()) {
+            ++failures;
+            std::cout << t.name << "\t" << error << std::endl;
+        }
+    }
+    std::cout << (failures == 0 ? "all passed" : std::to_string(failures) + " failed") << std::endl;
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,305 @@
+// Tests of async natives: an interpreter driven by hand through
+// RunStatus::waiting and resume(), a compiled caller leaving at the async
+// callnative, many interpreters on one EventLoop reading from local pipes
+// that a writer thread fills, and the Executor refusing async natives.
+//
+//   g++ -std=c++17 -O2 -I.. async.cpp ../event_loop.cpp ../executor.cpp ../assembly.cpp
+//       ../image.cpp ../interpreter.cpp ../decoder.cpp ../threaded.cpp ../fusion.cpp
+//       ../analysis.cpp ../verifier.cpp ../jit.cpp ../heap.cpp ../vm_stack.cpp ../module.cpp
+//       ../profile.cpp -lpthread -o async
+//   ./async [--filter substring]
+//
+// Prints a line for every test that fails and exits with status 1 if there
+// was any.
+#include <array>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <sys/epoll.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include "../event_loop.h"
+#include "../executor.h"
+#include "../interpreter.h"
+
+using namespace rvm;
+using namespace rvm::assembly;
+using namespace rvm::interpreter;
+
+namespace {
+
+using O = Operation;
+using T = OperandType;
+
+struct Test {
+    std::string name;
+    // what went wrong, empty if nothing did
+    std::function<std::string()> run;
+};
+
+struct Engine {
+    std::string name;
+    Options options;
+};
+
+std::vector<Engine> engines() {
+    auto re = std::vector<Engine>{};
+    auto o = Options{};
+    o.dispatch = Dispatch::switch_loop;
+    re.push_back({"switch", o});
+    o = Options{};
+    o.jit = false;
+    re.push_back({"threaded", o});
+    o.unchecked = true;
+    re.push_back({"threaded.unchecked", o});
+    o = Options{};
+    o.jit_threshold = 1;
+    re.push_back({"jit", o});
+    o.unchecked = true;
+    re.push_back({"jit.unchecked", o});
+    return re;
+}
+
+std::shared_ptr<Module> load(const Assembly& a, const Options& o) {
+    return std::make_shared<Module>(a, ModuleOptions{o.fusion, o.unchecked});
+}
+
+ConstantInfo int32(int32_t x) {
+    return ConstantInfo{x};
+}
+
+// An operation nothing completes but the test: its token is the argument.
+struct Requests {
+    int32_t started{0};
+};
+
+Operand ask(Requests* r, int32_t x) {
+    ++r->started;
+    return Operand{x};
+}
+
+// ask(0) + ask(1) + ask(2) in a loop that is long enough for the JIT to
+// compile, see the sums of the tests below.
+Assembly asking() {
+    auto f = Bytecode{
+        Instruction{O::ldc, 0}, Instruction{O::stloc, 0}, Instruction{O::ldc, 0}, Instruction{O::stloc, 1},
+        Instruction{O::ldloc, 1}, Instruction{O::callnative, 0},                                              // 4
+        Instruction{O::ldloc, 0}, Instruction{O::add, T::int32}, Instruction{O::stloc, 0},
+        Instruction{O::ldloc, 0}, Instruction{O::ldc, 1}, Instruction{O::mul, T::int32}, Instruction{O::stloc, 0},
+        Instruction{O::ldloc, 0}, Instruction{O::ldc, 1}, Instruction{O::mul, T::int32}, Instruction{O::stloc, 0},
+        Instruction{O::ldloc, 0}, Instruction{O::ldc, 1}, Instruction{O::mul, T::int32}, Instruction{O::stloc, 0},
+        Instruction{O::ldloc, 1}, Instruction{O::ldc, 1}, Instruction{O::add, T::int32}, Instruction{O::stloc, 1},
+        Instruction{O::ldloc, 1}, Instruction{O::ldc, 2}, Instruction{O::tlt, T::int32}, Instruction{O::brtrue, 4},
+        Instruction{O::ldloc, 0}, Instruction{O::ret}};
+    auto main = Bytecode{Instruction{O::call, 1}, Instruction{O::ret}};
+    return Assembly{{}, {int32(0), int32(1), int32(3)}, {FunctionInfo{0, 0, main}, FunctionInfo{0, 2, f}}};
+}
+
+// Every ask() makes the run stop with its token; resuming with 10x+1
+// makes the result 1 + 11 + 21. A run while waiting does nothing.
+std::string waiting_and_resume() {
+    auto a = asking();
+    for (auto&& e : engines()) {
+        auto requests = Requests{};
+        auto m = load(a, e.options);
+        m->add_native_function(async_native<ask>(&requests));
+        auto vm = Interpreter{m, e.options};
+        for (int32_t i = 0; i < 3; ++i) {
+            if (vm.run_for(UINT64_MAX) != RunStatus::waiting || vm.pending().int32 != i) {
+                return e.name + ": no wait for ask(" + std::to_string(i) + ")";
+            }
+            if (vm.run_for(UINT64_MAX) != RunStatus::waiting || requests.started != i + 1) {
+                return e.name + ": ran on while waiting";
+            }
+            vm.resume(Operand{10 * i + 1});
+        }
+        if (vm.run_for(UINT64_MAX) != RunStatus::finished || vm.result().int32 != 33) {
+            return e.name + ": result " + std::to_string(vm.result().int32);
+        }
+    }
+    return "";
+}
+
+// With a threshold of 1 the loop of asking() is compiled, and leaves the
+// machine code at every ask().
+std::string compiled_caller() {
+    auto a = asking();
+    for (auto&& e : engines()) {
+        if (e.options.dispatch != Dispatch::threaded || !e.options.jit) {
+            continue;
+        }
+        auto requests = Requests{};
+        auto m = load(a, e.options);
+        m->add_native_function(async_native<ask>(&requests));
+        auto vm = Interpreter{m, e.options};
+        auto waits = 0;
+        while (vm.run_for(UINT64_MAX) == RunStatus::waiting) {
+            vm.resume(Operand{10 * vm.pending().int32 + 1});
+            ++waits;
+        }
+        if (!vm.compiled(1)) {
+            return e.name + ": not compiled";
+        }
+        if (waits != 3 || vm.result().int32 != 33) {
+            return e.name + ": " + std::to_string(waits) + " waits, result " + std::to_string(vm.result().int32);
+        }
+    }
+    return "";
+}
+
+Operand read_int(EventLoop* loop, int32_t fd) {
+    return loop->watch(fd, EPOLLIN, [fd] {
+        auto v = int32_t{0};
+        if (read(fd, &v, sizeof v) != sizeof v) {
+            throw EventLoop::SystemError{0};
+        }
+        return Operand{v};
+    });
+}
+
+Operand triple(EventLoop* loop, int32_t x) {
+    return loop->ready(Operand{3 * x});
+}
+
+// f(fd) = read(fd) + triple(read(fd)) + 10000, counted up to in a loop
+// that gives the interpreters something to take turns at.
+Assembly reading() {
+    auto f = Bytecode{
+        Instruction{O::ldarg, 0}, Instruction{O::callnative, 0}, Instruction{O::ldarg, 0}, Instruction{O::callnative, 0},
+        Instruction{O::callnative, 1}, Instruction{O::add, T::int32},
+        Instruction{O::ldc, 0}, Instruction{O::stloc, 0},
+        Instruction{O::ldloc, 0}, Instruction{O::ldc, 1}, Instruction{O::add, T::int32}, Instruction{O::stloc, 0},  // 8
+        Instruction{O::ldloc, 0}, Instruction{O::ldc, 2}, Instruction{O::tlt, T::int32}, Instruction{O::brtrue, 8},
+        Instruction{O::ldloc, 0}, Instruction{O::add, T::int32}, Instruction{O::ret}};
+    auto main = Bytecode{Instruction{O::ldc, 0}, Instruction{O::ret}};
+    return Assembly{{}, {int32(0), int32(1), int32(10000)}, {FunctionInfo{0, 0, main}, FunctionInfo{1, 1, f}}};
+}
+
+// Interpreter i reads i and then 1000 + i from a pipe of its own, which
+// the writer fills in reverse order, so that the interpreters wake up in
+// an order of the writer's making.
+std::string event_loop_pipes() {
+    constexpr int n = 100;
+    auto a = reading();
+    for (auto&& e : engines()) {
+        auto loop = EventLoop{1000};
+        auto m = load(a, e.options);
+        m->add_native_function(async_native<read_int>(&loop));
+        m->add_native_function(async_native<triple>(&loop));
+        auto pipes = std::vector<std::array<int, 2>>(n);
+        auto vms = std::vector<std::unique_ptr<Interpreter>>{};
+        auto finished = 0;
+        auto error = std::string{};
+        for (auto i = 0; i < n; ++i) {
+            if (pipe(pipes[i].data()) != 0) {
+                return "pipe() failed";
+            }
+            vms.push_back(std::make_unique<Interpreter>(m, e.options));
+            vms.back()->restart(1, {Operand{pipes[i][0]}});
+            loop.spawn(*vms.back(), [&, i](Interpreter& vm, std::exception_ptr thrown) {
+                ++finished;
+                auto expected = i + 3 * (1000 + i) + 10000;
+                if (thrown) {
+                    error = "interpreter " + std::to_string(i) + " threw";
+                }
+                else if (vm.result().int32 != expected) {
+                    error = "interpreter " + std::to_string(i) + " returned " + std::to_string(vm.result().int32);
+                }
+            });
+        }
+        auto writer = std::thread([&] {
+            for (auto i = n - 1; i >= 0; --i) {
+                auto v = int32_t{i};
+                if (write(pipes[i][1], &v, sizeof v) != sizeof v) {
+                    abort();
+                }
+                usleep(50);
+            }
+            for (auto i = 0; i < n; ++i) {
+                auto v = int32_t{1000 + i};
+                if (write(pipes[i][1], &v, sizeof v) != sizeof v) {
+                    abort();
+                }
+            }
+        });
+        loop.run();
+        writer.join();
+        for (auto&& p : pipes) {
+            close(p[0]);
+            close(p[1]);
+        }
+        if (!error.empty()) {
+            return e.name + ": " + error;
+        }
+        if (finished != n || loop.waiting() != 0) {
+            return e.name + ": " + std::to_string(finished) + " finished, " + std::to_string(loop.waiting())
+                   + " waiting";
+        }
+    }
+    return "";
+}
+
+// Jobs run to completion, so an async native fails the job, and the
+// worker's interpreter goes on with the next one.
+std::string executor_refuses() {
+    auto requests = Requests{};
+    auto m = std::make_shared<Module>(asking());
+    m->add_native_function(async_native<ask>(&requests));
+    auto o = ExecutorOptions{};
+    o.workers = 1;
+    auto executor = Executor{o};
+    auto refused = executor.submit(Job{m});
+    try {
+        refused.get();
+        return "no AsyncNativeError";
+    }
+    catch (Executor::AsyncNativeError&) {
+    }
+    auto again = executor.submit(Job{m});
+    try {
+        again.get();
+        return "no AsyncNativeError the second time";
+    }
+    catch (Executor::AsyncNativeError&) {
+    }
+    return requests.started == 2 ? "" : std::to_string(requests.started) + " operations started";
+}
+
+std::vector<Test> tests() {
+    return {
+        {"waiting_and_resume", waiting_and_resume},
+        {"compiled_caller", compiled_caller},
+        {"event_loop_pipes", event_loop_pipes},
+        {"executor_refuses", executor_refuses},
+    };
+}
+
+}
+
+int main(int argc, char** argv) {
+    auto filter = std::string{};
+    for (auto i = 1; i < argc; ++i) {
+        auto arg = std::string{argv[i]};
+        if (arg != "--filter" || i + 1 == argc) {
+            std::cerr << "usage: async [--filter substring]\n";
+            return 2;
+        }
+        filter = argv[++i];
+    }
+
+    auto failures = 0;
+    for (auto&& t : tests()) {
+        if (t.name.find(filter) == std::string::npos) {
+            continue;
+        }
+        auto error = t.run();
+        if (!error.empty()) {
+            ++failures;
+            std::cout << t.name << "\t" << error << std::endl;
+        }
+    }
+    std::cout << (failures == 0 ? "all passed" : std::to_string(failures) + " failed") << std::endl;
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,543 @@
+// Differential tests: a corpus of programs, built in code, runs on every
+// engine and mode, in one run() and in slices of a few instructions of
+// run_for(), as it is and after each of the assembly transformations, and
+// every run has to end like the program expects: the same return value and
+// the same native calls, or the same error. run_differential() puts the
+// register interpreter next to the reference loop in every comparison.
+//
+//   g++ -std=c++17 -O2 -I.. differential.cpp ../assembly.cpp ../image.cpp ../interpreter.cpp
+//       ../decoder.cpp ../threaded.cpp ../fusion.cpp ../analysis.cpp ../verifier.cpp
+//       ../jit.cpp ../heap.cpp ../vm_stack.cpp ../module.cpp ../profile.cpp ../optimizer.cpp
+//       ../register_ir.cpp ../register_interpreter.cpp -o differential
+//   ./differential [--filter substring]
+//
+// Build it once more with -DRVM_NO_COMPUTED_GOTO for the portable switch of
+// the threaded engine. Prints a line for every run that ends differently,
+// and exits with status 1 if there was any.
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "../interpreter.h"
+#include "../optimizer.h"
+#include "../register_interpreter.h"
+
+using namespace rvm;
+using namespace rvm::assembly;
+using namespace rvm::interpreter;
+
+namespace {
+
+using O = Operation;
+using T = OperandType;
+
+struct Case {
+    std::string name;
+    Assembly assembly;
+    // return value and native calls, or the error, as describe() puts them
+    std::string expected;
+};
+
+struct Engine {
+    std::string name;
+    std::function<Operand(const Assembly&)> run;
+};
+
+struct Transformation {
+    std::string name;
+    std::function<void(Assembly&)> apply;
+};
+
+// arguments of the print native in the order of its calls
+std::vector<int32_t> printed{};
+
+int32_t print(int32_t x) {
+    printed.push_back(x);
+    return x;
+}
+
+std::vector<NativeInfo> natives() {
+    return {native<print>()};
+}
+
+// The natives as InlineOptions::native_arities wants them.
+std::vector<index_t> native_arities() {
+    auto re = std::vector<index_t>{};
+    for (auto&& n : natives()) {
+        re.push_back(n.num_args);
+    }
+    return re;
+}
+
+std::string describe(int32_t result, const std::vector<int32_t>& calls) {
+    auto re = std::ostringstream{};
+    re << result;
+    for (auto c : calls) {
+        re << " " << c;
+    }
+    return re.str();
+}
+
+// Runs `run`, which leaves its native calls in `printed`, and describes how
+// it ended.
+std::string outcome(const std::function<Operand()>& run) {
+    printed.clear();
+    try {
+        return describe(run().int32, printed);
+    }
+    catch (Interpreter::IndexOutOfBoundError&) {
+        return "IndexOutOfBoundError";
+    }
+    catch (RegisterInterpreter::IndexOutOfBoundError&) {
+        return "IndexOutOfBoundError";
+    }
+    catch (Interpreter::ConstantModificationError&) {
+        return "ConstantModificationError";
+    }
+    catch (RegisterInterpreter::ConstantModificationError&) {
+        return "ConstantModificationError";
+    }
+    catch (Interpreter::StackUnderflowError&) {
+        return "StackUnderflowError";
+    }
+    catch (Interpreter::StackOverflowError&) {
+        return "StackOverflowError";
+    }
+    catch (Heap::OutOfMemoryError&) {
+        return "OutOfMemoryError";
+    }
+    catch (InvalidBytecodeError&) {
+        return "InvalidBytecodeError";
+    }
+    catch (DivergenceError& e) {
+        return "DivergenceError: " + e.message;
+    }
+    catch (...) {
+        return "unknown exception";
+    }
+}
+
+// Runs to the end in one run(), or for a `slice` other than 0, in turns of
+// run_for(slice), each of which has to resume where the last one stopped.
+Operand run_with(const Assembly& a, Options o, uint64_t slice) {
+    auto vm = Interpreter{a, o};
+    for (auto&& n : natives()) {
+        vm.add_native_function(n);
+    }
+    if (slice == 0) {
+        vm.run();
+    }
+    else {
+        while (vm.run_for(slice) == RunStatus::suspended) {
+        }
+    }
+    return vm.result();
+}
+
+std::vector<Engine> engines() {
+    auto modes = std::vector<std::pair<std::string, std::function<void(Options&)>>>{
+        {"switch", [](Options& o) { o.dispatch = Dispatch::switch_loop; }},
+        {"threaded", [](Options& o) { o.jit = false; }},
+        {"threaded.unfused", [](Options& o) {
+            o.jit = false;
+            o.fusion = FusionSet::none();
+        }},
+        {"unchecked", [](Options& o) {
+            o.jit = false;
+            o.unchecked = true;
+        }},
+        {"jit", [](Options& o) { o.jit_threshold = 1; }},
+        {"jit.unchecked", [](Options& o) {
+            o.jit_threshold = 1;
+            o.unchecked = true;
+        }},
+        // nurseries this small collect every few allocations
+        {"switch.gc", [](Options& o) {
+            o.dispatch = Dispatch::switch_loop;
+            o.nursery_size = 256;
+        }},
+        {"jit.gc", [](Options& o) {
+            o.jit_threshold = 1;
+            o.nursery_size = 256;
+        }},
+        {"manual", [](Options& o) { o.heap_mode = HeapMode::manual; }},
+    };
+    auto re = std::vector<Engine>{};
+    for (auto&& m : modes) {
+        // The smallest budgets run out at every call and back-edge, before
+        // compiled code is ever entered; the larger ones leave compiled
+        // loops halfway.
+        for (uint64_t slice : {0, 1, 2, 7, 40, 300}) {
+            auto name = slice == 0 ? m.first : m.first + ".for" + std::to_string(slice);
+            re.push_back(Engine{name, [set = m.second, slice](const Assembly& a) {
+                auto o = Options{};
+                set(o);
+                return run_with(a, o, slice);
+            }});
+        }
+    }
+    re.push_back(Engine{"register", [](const Assembly& a) {
+        auto re = run_differential(a, natives());
+        // natives run twice, once on each interpreter
+        printed.resize(printed.size() / 2);
+        return re;
+    }});
+    return re;
+}
+
+std::vector<Transformation> transformations() {
+    return {
+        {"none", [](Assembly&) {}},
+        {"reparsed", [](Assembly& a) {
+            auto s = std::stringstream{};
+            dump(a, s);
+            a = Assembly::parse(s);
+        }},
+        {"optimized", [](Assembly& a) { optimize(a); }},
+        {"inlined", [](Assembly& a) {
+            auto o = InlineOptions{};
+            o.native_arities = native_arities();
+            inline_calls(a, o);
+            optimize(a);
+        }},
+        // speculates on what a threaded run saw, up to the point it failed
+        {"devirtualized", [](Assembly& a) {
+            auto o = Options{};
+            o.jit = false;
+            auto vm = Interpreter{a, o};
+            for (auto&& n : natives()) {
+                vm.add_native_function(n);
+            }
+            try {
+                vm.run();
+            }
+            catch (...) {
+            }
+            devirtualize(a, vm.call_targets());
+        }},
+    };
+}
+
+ConstantInfo int32(int32_t x) {
+    return ConstantInfo{x};
+}
+
+// sum = 0; for (i = 0; i < 100; ++i) sum += i * 3 % 7; print(sum)
+Case loop() {
+    auto code = Bytecode{
+        Instruction{O::ldc, 0}, Instruction{O::stloc, 0}, Instruction{O::ldc, 0}, Instruction{O::stloc, 1},
+        Instruction{O::ldloc, 0}, Instruction{O::ldloc, 1}, Instruction{O::ldc, 2},       // 4
+        Instruction{O::mul, T::int32}, Instruction{O::ldc, 3}, Instruction{O::rem, T::int32},
+        Instruction{O::add, T::int32}, Instruction{O::stloc, 0},
+        Instruction{O::ldloc, 1}, Instruction{O::ldc, 1}, Instruction{O::add, T::int32},
+        Instruction{O::stloc, 1}, Instruction{O::ldloc, 1}, Instruction{O::ldc, 4},
+        Instruction{O::tlt, T::int32}, Instruction{O::brtrue, 4},
+        Instruction{O::ldloc, 0}, Instruction{O::callnative, 0}, Instruction{O::ret}};
+    auto a = Assembly{{}, {int32(0), int32(1), int32(3), int32(7), int32(100)},
+                      {FunctionInfo{0, 2, code}}};
+    return Case{"loop", a, "297 297"};
+}
+
+// int8 arithmetic wraps, and comparisons see signed or unsigned bytes
+Case bytes() {
+    auto code = Bytecode{
+        Instruction{O::ldc, 0}, Instruction{O::ldc, 0}, Instruction{O::add, T::int8},
+        Instruction{O::ldc, 1}, Instruction{O::tlt, T::int8}, Instruction{O::callnative, 0}, Instruction{O::drop},
+        Instruction{O::ldc, 0}, Instruction{O::ldc, 0}, Instruction{O::add, T::int8},
+        Instruction{O::ldc, 1}, Instruction{O::tlt_un, T::int8}, Instruction{O::callnative, 0}, Instruction{O::drop},
+        Instruction{O::ldc, 2}, Instruction{O::ldc, 3}, Instruction{O::div, T::int32}, Instruction{O::callnative, 0},
+        Instruction{O::ldc, 2}, Instruction{O::ldc, 3}, Instruction{O::rem, T::int32}, Instruction{O::callnative, 0},
+        Instruction{O::bxor, T::int32}, Instruction{O::bnot, T::int32}, Instruction{O::ret}};
+    auto a = Assembly{{}, {ConstantInfo{int8_t{100}}, ConstantInfo{int8_t{1}}, int32(-7), int32(2)},
+                      {FunctionInfo{0, 0, code}}};
+    return Case{"bytes", a, "-3 1 0 -3 -1"};
+}
+
+// fib(15), recursively
+Case fib() {
+    auto main = Bytecode{Instruction{O::ldc, 2}, Instruction{O::call, 1}, Instruction{O::ret}};
+    auto fib = Bytecode{
+        Instruction{O::ldarg, 0}, Instruction{O::ldc, 0}, Instruction{O::tlt, T::int32}, Instruction{O::brtrue, 14},
+        Instruction{O::ldarg, 0}, Instruction{O::ldc, 1}, Instruction{O::sub, T::int32}, Instruction{O::call, 1},
+        Instruction{O::ldarg, 0}, Instruction{O::ldc, 0}, Instruction{O::sub, T::int32}, Instruction{O::call, 1},
+        Instruction{O::add, T::int32}, Instruction{O::ret},
+        Instruction{O::ldarg, 0}, Instruction{O::ret}};                                  // 14
+    auto a = Assembly{{}, {int32(2), int32(1), int32(15)}, {FunctionInfo{0, 0, main}, FunctionInfo{1, 0, fib}}};
+    return Case{"fib", a, "610"};
+}
+
+// Lists of adt 0: nil, and cons with a head and a tail.
+const AdtTable lists = {AdtInfo{ConstructorInfo{0}, ConstructorInfo{2}}};
+
+// sum(l): the sum of a list, recursively
+Bytecode list_sum(index_t self, index_t zero) {
+    return Bytecode{
+        Instruction{O::ldarg, 0}, Instruction{O::ldctor}, Instruction{O::ldc, zero},
+        Instruction{O::teq, T::int32}, Instruction{O::brtrue, 12},
+        Instruction{O::ldarg, 0}, Instruction{O::ldfld, 0},
+        Instruction{O::ldarg, 0}, Instruction{O::ldfld, 1}, Instruction{O::call, self},
+        Instruction{O::add, T::int32}, Instruction{O::ret},
+        Instruction{O::ldc, zero}, Instruction{O::ret}};                                  // 12
+}
+
+// builds the list 99 .. 0 and sums it through calla
+Case list() {
+    auto main = Bytecode{
+        Instruction{O::mkadt, 0, 0}, Instruction{O::stloc, 0}, Instruction{O::ldc, 0}, Instruction{O::stloc, 1},
+        Instruction{O::ldloc, 1}, Instruction{O::ldloc, 0}, Instruction{O::mkadt, 0, 1}, Instruction{O::stloc, 0},
+        Instruction{O::ldloc, 1}, Instruction{O::ldc, 1}, Instruction{O::add, T::int32}, Instruction{O::stloc, 1},
+        Instruction{O::ldloc, 1}, Instruction{O::ldc, 2}, Instruction{O::tlt, T::int32}, Instruction{O::brtrue, 4},
+        Instruction{O::ldloc, 0}, Instruction{O::ldfuna, 1}, Instruction{O::calla},
+        Instruction{O::ldloc, 0}, Instruction{O::ldfld, 0}, Instruction{O::callnative, 0}, Instruction{O::drop},
+        Instruction{O::ret}};
+    auto a = Assembly{lists, {int32(0), int32(1), int32(100)},
+                      {FunctionInfo{0, 2, main}, FunctionInfo{1, 0, list_sum(1, 0)}}};
+    return Case{"list", a, "4950 99"};
+}
+
+// Rebuilds a list of 200 elements 30 times, publishing each through the
+// field of a box that gets old, and sums it every round.
+Case garbage() {
+    auto main = Bytecode{
+        Instruction{O::ldc, 0}, Instruction{O::mkadt, 0, 0}, Instruction{O::mkadt, 0, 1}, Instruction{O::stloc, 3},
+        Instruction{O::ldc, 0}, Instruction{O::stloc, 2},
+        Instruction{O::mkadt, 0, 0}, Instruction{O::stloc, 0}, Instruction{O::ldc, 0}, Instruction{O::stloc, 1}, // 6
+        Instruction{O::ldloc, 1}, Instruction{O::ldloc, 0}, Instruction{O::mkadt, 0, 1}, Instruction{O::stloc, 0}, // 10
+        Instruction{O::ldloc, 0}, Instruction{O::ldloc, 3}, Instruction{O::stfld, 1},
+        Instruction{O::ldloc, 1}, Instruction{O::ldc, 1}, Instruction{O::add, T::int32}, Instruction{O::stloc, 1},
+        Instruction{O::ldloc, 1}, Instruction{O::ldc, 2}, Instruction{O::tlt, T::int32}, Instruction{O::brtrue, 10},
+        Instruction{O::ldloc, 3}, Instruction{O::ldfld, 1}, Instruction{O::call, 1}, Instruction{O::stloc, 4},
+        Instruction{O::ldloc, 2}, Instruction{O::ldc, 1}, Instruction{O::add, T::int32}, Instruction{O::stloc, 2},
+        Instruction{O::ldloc, 2}, Instruction{O::ldc, 3}, Instruction{O::tlt, T::int32}, Instruction{O::brtrue, 6},
+        Instruction{O::ldloc, 2}, Instruction{O::callnative, 0}, Instruction{O::drop},
+        Instruction{O::ldloc, 4}, Instruction{O::ret}};
+    auto a = Assembly{lists, {int32(0), int32(1), int32(200), int32(30)},
+                      {FunctionInfo{0, 5, main}, FunctionInfo{1, 0, list_sum(1, 0)}}};
+    return Case{"garbage", a, "19900 30"};
+}
+
+// swap(&x, &y) through ldloca, ldind and stind, then an argument updated
+// through ldarga
+Case pointers() {
+    auto main = Bytecode{
+        Instruction{O::ldc, 0}, Instruction{O::stloc, 0}, Instruction{O::ldc, 1}, Instruction{O::stloc, 1},
+        Instruction{O::ldloca, 0}, Instruction{O::ldloca, 1}, Instruction{O::call, 1}, Instruction{O::drop},
+        Instruction{O::ldloc, 0}, Instruction{O::callnative, 0}, Instruction{O::drop},
+        Instruction{O::ldloc, 1}, Instruction{O::callnative, 0}, Instruction{O::drop},
+        Instruction{O::ldloc, 0}, Instruction{O::call, 2}, Instruction{O::ret}};
+    auto swap = Bytecode{
+        Instruction{O::ldarg, 0}, Instruction{O::ldind}, Instruction{O::stloc, 0},
+        Instruction{O::ldarg, 0}, Instruction{O::ldarg, 1}, Instruction{O::ldind}, Instruction{O::stind},
+        Instruction{O::ldarg, 1}, Instruction{O::ldloc, 0}, Instruction{O::stind},
+        Instruction{O::ldc, 0}, Instruction{O::ret}};
+    // x = *&x + 1
+    auto bump = Bytecode{
+        Instruction{O::ldarga, 0}, Instruction{O::ldarga, 0}, Instruction{O::ldind},
+        Instruction{O::ldc, 2}, Instruction{O::add, T::int32}, Instruction{O::stind},
+        Instruction{O::ldarg, 0}, Instruction{O::ret}};
+    auto a = Assembly{{}, {int32(11), int32(22), int32(1)},
+                      {FunctionInfo{0, 2, main}, FunctionInfo{2, 1, swap}, FunctionInfo{1, 0, bump}}};
+    return Case{"pointers", a, "23 22 11"};
+}
+
+// sum(n, acc) as a self tail call, then a tailcalla of a function taking
+// another number of arguments
+Case tail() {
+    auto main = Bytecode{
+        Instruction{O::ldc, 2}, Instruction{O::ldc, 0}, Instruction{O::call, 1}, Instruction{O::callnative, 0},
+        Instruction{O::ldc, 1}, Instruction{O::ldc, 1}, Instruction{O::ldfuna, 2}, Instruction{O::tailcalla}};
+    auto sum = Bytecode{
+        Instruction{O::ldarg, 0}, Instruction{O::ldc, 0}, Instruction{O::teq, T::int32}, Instruction{O::brtrue, 11},
+        Instruction{O::ldarg, 0}, Instruction{O::ldc, 1}, Instruction{O::sub, T::int32},
+        Instruction{O::ldarg, 1}, Instruction{O::ldarg, 0}, Instruction{O::add, T::int32},
+        Instruction{O::tailcall, 1},
+        Instruction{O::ldarg, 1}, Instruction{O::ret}};                                   // 11
+    auto add = Bytecode{Instruction{O::ldarg, 0}, Instruction{O::ldarg, 1}, Instruction{O::add, T::int32},
+                        Instruction{O::ldarg, 2}, Instruction{O::add, T::int32}, Instruction{O::ret}};
+    auto a = Assembly{{}, {int32(0), int32(1), int32(1000)},
+                      {FunctionInfo{0, 0, main}, FunctionInfo{2, 0, sum}, FunctionInfo{3, 0, add}}};
+    return Case{"tail", a, "500502 500500"};
+}
+
+// calla through a table of three functions kept in locals, picked by i % 3:
+// the call sites see one target after the other
+Case table() {
+    auto main = Bytecode{
+        Instruction{O::ldfuna, 1}, Instruction{O::stloc, 0}, Instruction{O::ldfuna, 2}, Instruction{O::stloc, 1},
+        Instruction{O::ldfuna, 3}, Instruction{O::stloc, 2},
+        Instruction{O::ldc, 0}, Instruction{O::stloc, 3}, Instruction{O::ldc, 0}, Instruction{O::stloc, 4},
+        Instruction{O::ldloc, 4}, Instruction{O::ldloca, 0}, Instruction{O::ldloc, 3}, Instruction{O::ldc, 2}, // 10
+        Instruction{O::rem, T::int32}, Instruction{O::add, T::int32}, Instruction{O::ldind}, Instruction{O::calla},
+        Instruction{O::stloc, 4},
+        Instruction{O::ldloc, 3}, Instruction{O::ldc, 1}, Instruction{O::add, T::int32}, Instruction{O::stloc, 3},
+        Instruction{O::ldloc, 3}, Instruction{O::ldc, 3}, Instruction{O::tlt, T::int32}, Instruction{O::brtrue, 10},
+        Instruction{O::ldloc, 4}, Instruction{O::ret}};
+    auto functions = FunctionTable{FunctionInfo{0, 5, main}};
+    for (index_t k = 0; k < 3; ++k) {
+        functions.push_back(FunctionInfo{1, 0, Bytecode{
+            Instruction{O::ldarg, 0}, Instruction{O::ldc, static_cast<index_t>(4 + k)},
+            Instruction{O::add, T::int32}, Instruction{O::ret}}});
+    }
+    auto a = Assembly{{}, {int32(0), int32(1), int32(3), int32(1000), int32(3), int32(5), int32(7)},
+                      std::move(functions)};
+    return Case{"table", a, "4998"};
+}
+
+
+// switch_ on i % 4 for i < 10, with the default for 3
+Case jump_table() {
+    auto code = Bytecode{
+        Instruction{O::ldc, 0}, Instruction{O::stloc, 0}, Instruction{O::ldc, 0}, Instruction{O::stloc, 1},
+        Instruction{O::ldloc, 1}, Instruction{O::ldc, 2}, Instruction{O::rem, T::int32},  // 4
+        Instruction{O::switch_, 3},
+        Instruction{O::br, 12}, Instruction{O::br, 14}, Instruction{O::br, 16},           // 8
+        Instruction{O::br, 18},
+        Instruction{O::ldc, 3}, Instruction{O::br, 19},                                   // 12
+        Instruction{O::ldc, 4}, Instruction{O::br, 19},
+        Instruction{O::ldc, 5}, Instruction{O::br, 19},
+        Instruction{O::ldc, 6},                                                           // 18
+        Instruction{O::ldloc, 0}, Instruction{O::add, T::int32}, Instruction{O::stloc, 0},
+        Instruction{O::ldloc, 1}, Instruction{O::ldc, 1}, Instruction{O::add, T::int32}, Instruction{O::stloc, 1},
+        Instruction{O::ldloc, 1}, Instruction{O::ldc, 7}, Instruction{O::tlt, T::int32}, Instruction{O::brtrue, 4},
+        Instruction{O::ldloc, 0}, Instruction{O::ret}};
+    auto a = Assembly{{}, {int32(0), int32(1), int32(4), int32(10), int32(20), int32(30), int32(100), int32(10)},
+                      {FunctionInfo{0, 2, code}}};
+    return Case{"jump_table", a, "350"};
+}
+
+// Shapes of adt 0: nothing, a square of one side and a rectangle.
+const AdtTable shapes = {AdtInfo{ConstructorInfo{0}, ConstructorInfo{1}, ConstructorInfo{2}}};
+
+// a constant rectangle of 3 by 4
+ConstantInfo rectangle_fields[] = {ConstantInfo{3}, ConstantInfo{4}};
+
+// area(s) through switchctor, on new shapes and on a constant one
+Case match() {
+    auto main = Bytecode{
+        Instruction{O::mkadt, 0, 0}, Instruction{O::call, 1}, Instruction{O::callnative, 0}, Instruction{O::drop},
+        Instruction{O::ldc, 0}, Instruction{O::mkadt, 0, 1}, Instruction{O::call, 1},
+        Instruction{O::callnative, 0}, Instruction{O::drop},
+        Instruction{O::ldc, 3}, Instruction{O::call, 1}, Instruction{O::callnative, 0}, Instruction{O::drop},
+        Instruction{O::ldc, 0}, Instruction{O::ldc, 1}, Instruction{O::mkadt, 0, 2}, Instruction{O::call, 1},
+        Instruction{O::ret}};
+    auto area = Bytecode{
+        Instruction{O::ldarg, 0}, Instruction{O::switchctor, 3},
+        Instruction{O::br, 7}, Instruction{O::br, 9}, Instruction{O::br, 14},
+        Instruction{O::ldc, 2}, Instruction{O::ret},
+        Instruction{O::ldc, 2}, Instruction{O::ret},                                      // 7
+        Instruction{O::ldarg, 0}, Instruction{O::ldfld, 0}, Instruction{O::dup},          // 9
+        Instruction{O::mul, T::int32}, Instruction{O::ret},
+        Instruction{O::ldarg, 0}, Instruction{O::ldfld, 0},                               // 14
+        Instruction{O::ldarg, 0}, Instruction{O::ldfld, 1}, Instruction{O::mul, T::int32}, Instruction{O::ret}};
+    auto a = Assembly{shapes, {int32(7), int32(6), int32(0), ConstantInfo{AdtConstant{0, 2, 2, rectangle_fields}}},
+                      {FunctionInfo{0, 0, main}, FunctionInfo{1, 0, area}}};
+    return Case{"match", a, "42 0 49 12"};
+}
+
+// Reads a constant; `store` then writes to it too.
+Case constants(bool store) {
+    auto code = Bytecode{
+        Instruction{O::ldc, 1}, Instruction{O::ldfld, 1}, Instruction{O::ldc, 1}, Instruction{O::ldctor},
+        Instruction{O::add, T::int32}};
+    if (store) {
+        for (auto&& i : {Instruction{O::ldc, 1}, Instruction{O::stfld, 0}, Instruction{O::ldc, 0}}) {
+            code.push_back(i);
+        }
+    }
+    code.push_back(Instruction{O::ret});
+    auto a = Assembly{shapes, {int32(5), ConstantInfo{AdtConstant{0, 2, 2, rectangle_fields}}},
+                      {FunctionInfo{0, 0, code}}};
+    return store ? Case{"constants.store", a, "ConstantModificationError"} : Case{"constants", a, "6"};
+}
+
+// A field past the ones of a square, read or written.
+Case field_bounds(bool store) {
+    auto code = Bytecode{Instruction{O::ldc, 0}, Instruction{O::mkadt, 0, 1}};
+    if (store) {
+        for (auto&& i : {Instruction{O::stloc, 0}, Instruction{O::ldc, 0}, Instruction{O::ldloc, 0},
+                         Instruction{O::stfld, 1}, Instruction{O::ldc, 0}}) {
+            code.push_back(i);
+        }
+    }
+    else {
+        code.push_back(Instruction{O::ldfld, 1});
+    }
+    code.push_back(Instruction{O::ret});
+    auto a = Assembly{shapes, {int32(1)}, {FunctionInfo{0, 1, code}}};
+    return Case{store ? "stfld.bounds" : "ldfld.bounds", a, "IndexOutOfBoundError"};
+}
+
+// A function loaded by ldfuna, overwritten through a pointer to its local
+// and called: the verifier must not assume the local still holds it, or
+// unchecked runs call function 40000.
+Case overwritten_function() {
+    auto main = Bytecode{
+        Instruction{O::ldfuna, 1}, Instruction{O::stloc, 0}, Instruction{O::ldloca, 0}, Instruction{O::ldc, 1},
+        Instruction{O::stind}, Instruction{O::ldc, 0}, Instruction{O::ldloc, 0}, Instruction{O::calla},
+        Instruction{O::ret}};
+    auto id = Bytecode{Instruction{O::ldarg, 0}, Instruction{O::ret}};
+    auto a = Assembly{{}, {int32(5), int32(40000)}, {FunctionInfo{0, 1, main}, FunctionInfo{1, 0, id}}};
+    return Case{"verifier.stind", a, "IndexOutOfBoundError"};
+}
+
+// ldfuna; calla of functions of different arities: each site has the
+// arity of its own target, which devirtualize() must keep.
+Case mixed_arities() {
+    auto main = Bytecode{
+        Instruction{O::ldc, 0}, Instruction{O::ldfuna, 1}, Instruction{O::calla},
+        Instruction{O::ldc, 0}, Instruction{O::ldc, 0}, Instruction{O::ldfuna, 2}, Instruction{O::calla},
+        Instruction{O::add, T::int32}, Instruction{O::ret}};
+    auto one = Bytecode{Instruction{O::ldarg, 0}, Instruction{O::ret}};
+    auto two = Bytecode{Instruction{O::ldarg, 0}, Instruction{O::ldarg, 1}, Instruction{O::add, T::int32},
+                        Instruction{O::ret}};
+    auto a = Assembly{{}, {int32(5)},
+                      {FunctionInfo{0, 0, main}, FunctionInfo{1, 0, one}, FunctionInfo{2, 0, two}}};
+    return Case{"devirtualize.arity", a, "15"};
+}
+
+std::vector<Case> cases() {
+    return {
+        loop(), bytes(), fib(), list(), garbage(), pointers(), tail(), table(), jump_table(), match(),
+        constants(false), constants(true), field_bounds(false), field_bounds(true),
+        overwritten_function(), mixed_arities(),
+    };
+}
+
+}
+
+int main(int argc, char** argv) {
+    auto filter = std::string{};
+    for (auto i = 1; i < argc; ++i) {
+        auto arg = std::string{argv[i]};
+        if (arg != "--filter" || i + 1 == argc) {
+            std::cerr << "usage: differential [--filter substring]\n";
+            return 2;
+        }
+        filter = argv[++i];
+    }
+
+    auto failures = 0;
+    for (auto&& c : cases()) {
+        if (c.name.find(filter) == std::string::npos) {
+            continue;
+        }
+        validate(c.assembly);
+        for (auto&& t : transformations()) {
+            auto a = c.assembly;
+            t.apply(a);
+            for (auto&& e : engines()) {
+                auto got = outcome([&] { return e.run(a); });
+                if (got != c.expected) {
+                    ++failures;
+                    std::cout << c.name << "\t" << t.name << "\t" << e.name << "\t" << got
+                              << "\texpected " << c.expected << std::endl;
+                }
+            }
+        }
+        // the last line tells which case a crash was in
+        std::cout << "ran " << c.name << std::endl;
+    }
+    std::cout << (failures == 0 ? "all passed" : std::to_string(failures) + " failed") << std::endl;
+    return failures == 0 ? 0 : 1;
+}
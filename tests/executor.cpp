@@ -0,0 +1,372 @@
+// Tests of the Executor: jobs from many threads across several modules,
+// stealing from the back of a blocked worker's queue, the least recently
+// used interpreter going first, jobs that fail and the worker statistics.
+//
+//   g++ -std=c++17 -O2 -I.. executor.cpp ../executor.cpp ../assembly.cpp ../image.cpp
+//       ../interpreter.cpp ../decoder.cpp ../threaded.cpp ../fusion.cpp ../analysis.cpp
+//       ../verifier.cpp ../jit.cpp ../heap.cpp ../vm_stack.cpp ../module.cpp ../profile.cpp
+//       -lpthread -o executor
+//   ./executor [--filter substring]
+//
+// Prints a line for every test that fails and exits with status 1 if there
+// was any.
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "../executor.h"
+
+using namespace rvm;
+using namespace rvm::assembly;
+using namespace rvm::interpreter;
+
+namespace {
+
+using O = Operation;
+using T = OperandType;
+
+struct Test {
+    std::string name;
+    // what went wrong, empty if nothing did
+    std::function<std::string()> run;
+};
+
+ConstantInfo int32(int32_t x) {
+    return ConstantInfo{x};
+}
+
+// main() returns 0; the functions to run come after it.
+Assembly with_main(ConstantTable constants, std::vector<FunctionInfo> functions, AdtTable adts = {}) {
+    constants.push_back(int32(0));
+    auto main = Bytecode{Instruction{O::ldc, static_cast<index_t>(constants.size() - 1)}, Instruction{O::ret}};
+    functions.insert(functions.begin(), FunctionInfo{0, 0, main});
+    return Assembly{std::move(adts), std::move(constants), std::move(functions)};
+}
+
+// 1: f(x, y) = 2x + y
+std::shared_ptr<Module> linear() {
+    auto f = Bytecode{
+        Instruction{O::ldarg, 0}, Instruction{O::ldarg, 0}, Instruction{O::add, T::int32},
+        Instruction{O::ldarg, 1}, Instruction{O::add, T::int32}, Instruction{O::ret}};
+    return std::make_shared<Module>(with_main({}, {FunctionInfo{2, 0, f}}));
+}
+
+// 1: fib(n)
+std::shared_ptr<Module> fibonacci() {
+    auto fib = Bytecode{
+        Instruction{O::ldarg, 0}, Instruction{O::ldc, 1}, Instruction{O::tlt, T::int32}, Instruction{O::brtrue, 14},
+        Instruction{O::ldarg, 0}, Instruction{O::ldc, 0}, Instruction{O::sub, T::int32}, Instruction{O::call, 1},
+        Instruction{O::ldarg, 0}, Instruction{O::ldc, 1}, Instruction{O::sub, T::int32}, Instruction{O::call, 1},
+        Instruction{O::add, T::int32}, Instruction{O::ret},
+        Instruction{O::ldarg, 0}, Instruction{O::ret}};
+    return std::make_shared<Module>(with_main({int32(1), int32(2)}, {FunctionInfo{1, 0, fib}}));
+}
+
+int32_t fib(int32_t n) {
+    return n < 2 ? n : fib(n - 1) + fib(n - 2);
+}
+
+// Jobs `block` wait in until released, and the order `record` saw its
+// arguments in, by thread.
+struct Gates {
+    std::atomic<int32_t> arrived{0};
+    std::atomic<bool> released[2]{};
+    std::mutex lock{};
+    std::vector<std::pair<std::thread::id, int32_t>> recorded{};
+};
+
+Gates gates{};
+
+int32_t block(int32_t gate) {
+    ++gates.arrived;
+    while (!gates.released[gate]) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return gate;
+}
+
+int32_t record(int32_t x) {
+    std::lock_guard<std::mutex> l(gates.lock);
+    gates.recorded.emplace_back(std::this_thread::get_id(), x);
+    return x;
+}
+
+// 1: block(gate), 2: record(x)
+std::shared_ptr<Module> gated() {
+    auto call = [](index_t native) {
+        return Bytecode{Instruction{O::ldarg, 0}, Instruction{O::callnative, native}, Instruction{O::ret}};
+    };
+    auto m = std::make_shared<Module>(with_main({}, {FunctionInfo{1, 0, call(0)}, FunctionInfo{1, 0, call(1)}}));
+    m->add_native_function(native<block>());
+    m->add_native_function(native<record>());
+    return m;
+}
+
+WorkerStats total(const std::vector<WorkerStats>& stats) {
+    auto re = WorkerStats{};
+    for (auto&& s : stats) {
+        re.jobs += s.jobs;
+        re.stolen += s.stolen;
+        re.interpreters += s.interpreters;
+        re.busy += s.busy;
+        re.total_queue_latency += s.total_queue_latency;
+        re.max_queue_latency = std::max(re.max_queue_latency, s.max_queue_latency);
+    }
+    return re;
+}
+
+// Eight threads submit to four workers that keep fewer interpreters than
+// there are modules, so contexts are evicted and created again all along.
+std::string many_submitters() {
+    constexpr int threads = 8;
+    constexpr int jobs = 300;
+    auto modules = std::vector<std::shared_ptr<Module>>{linear(), fibonacci(), gated()};
+    auto o = ExecutorOptions{};
+    o.workers = 4;
+    o.contexts_per_worker = 2;
+    o.interpreter.jit_threshold = 10;
+    auto executor = Executor{o};
+    auto wrong = std::atomic<int>{0};
+    auto submitters = std::vector<std::thread>{};
+    for (auto t = 0; t < threads; ++t) {
+        submitters.emplace_back([&, t] {
+            auto results = std::vector<std::pair<std::future<Operand>, int32_t>>{};
+            for (auto i = 0; i < jobs; ++i) {
+                auto x = t * jobs + i;
+                switch (i % 3) {
+                    case 0:
+                        results.emplace_back(executor.submit(Job{modules[0], 1, {Operand{x}, Operand{7}}}), 2 * x + 7);
+                        break;
+                    case 1:
+                        results.emplace_back(executor.submit(Job{modules[1], 1, {Operand{x % 15}}}), fib(x % 15));
+                        break;
+                    default:
+                        results.emplace_back(executor.submit(Job{modules[2], 2, {Operand{x}}}), x);
+                        break;
+                }
+            }
+            for (auto&& r : results) {
+                if (r.first.get().int32 != r.second) {
+                    ++wrong;
+                }
+            }
+        });
+    }
+    for (auto&& t : submitters) {
+        t.join();
+    }
+    if (wrong != 0) {
+        return std::to_string(wrong) + " wrong results";
+    }
+    auto stats = executor.stats();
+    auto sum = total(stats);
+    if (stats.size() != 4 || sum.jobs != threads * jobs) {
+        return std::to_string(sum.jobs) + " jobs in the stats";
+    }
+    if (sum.stolen > sum.jobs || sum.interpreters > sum.jobs || sum.interpreters < 3) {
+        return std::to_string(sum.stolen) + " stolen, " + std::to_string(sum.interpreters) + " interpreters";
+    }
+    if (sum.busy.count() <= 0 || sum.max_queue_latency > sum.total_queue_latency) {
+        return "times out of order";
+    }
+    return "";
+}
+
+// Both workers wait in a job of their own while the others are queued,
+// then one of them is let go: it runs its own queue from the front, then
+// steals the other's from the back.
+std::string stealing() {
+    constexpr int32_t n = 20;
+    gates.recorded.clear();
+    gates.arrived = 0;
+    gates.released[0] = gates.released[1] = false;
+    auto m = gated();
+    auto o = ExecutorOptions{};
+    o.workers = 2;
+    auto executor = Executor{o};
+    auto blocked = std::vector<std::future<Operand>>{};
+    blocked.push_back(executor.submit(Job{m, 1, {Operand{0}}}));
+    blocked.push_back(executor.submit(Job{m, 1, {Operand{1}}}));
+    while (gates.arrived < 2) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    // round-robin: job x goes to the queue of worker x % 2
+    auto results = std::vector<std::future<Operand>>{};
+    for (auto x = 2; x < 2 + 2 * n; ++x) {
+        results.push_back(executor.submit(Job{m, 2, {Operand{x}}}));
+    }
+    gates.released[1] = true;
+    for (auto&& r : results) {
+        r.get();
+    }
+    gates.released[0] = true;
+    for (auto&& b : blocked) {
+        b.get();
+    }
+
+    auto&& seen = gates.recorded;
+    if (seen.size() != 2 * n) {
+        return std::to_string(seen.size()) + " jobs recorded";
+    }
+    for (auto&& s : seen) {
+        if (s.first != seen[0].first) {
+            return "the blocked worker ran a job";
+        }
+    }
+    // own queue in order, the other one's backwards
+    auto own = seen[0].second % 2;
+    auto expected = std::vector<int32_t>{};
+    for (auto x = 2 + own; x < 2 + 2 * n; x += 2) {
+        expected.push_back(x);
+    }
+    for (auto x = 2 + 2 * n - 1 - own; x >= 2; x -= 2) {
+        expected.push_back(x);
+    }
+    for (size_t i = 0; i < seen.size(); ++i) {
+        if (seen[i].second != expected[i]) {
+            return "job " + std::to_string(seen[i].second) + " ran as number " + std::to_string(i);
+        }
+    }
+    auto sum = total(executor.stats());
+    if (sum.jobs != 2 + 2 * n || sum.stolen < n) {
+        return std::to_string(sum.jobs) + " jobs, " + std::to_string(sum.stolen) + " stolen";
+    }
+    return "";
+}
+
+// One worker keeping two interpreters, with modules A, B, A, C, A, B: the
+// second A reuses its interpreter, C replaces B rather than A, which was
+// used last, and the last B replaces C. Every job starts afresh all the
+// same.
+std::string least_recently_used() {
+    auto a = linear();
+    auto b = fibonacci();
+    auto c = linear();
+    auto o = ExecutorOptions{};
+    o.workers = 1;
+    o.contexts_per_worker = 2;
+    auto executor = Executor{o};
+    auto order = std::vector<std::pair<std::shared_ptr<Module>, int32_t>>{{a, 1}, {b, 2}, {a, 3}, {c, 4}, {a, 5}, {b, 6}};
+    auto created = std::vector<uint64_t>{};
+    for (auto&& job : order) {
+        auto x = job.second;
+        auto result = job.first == b ? executor.submit(Job{b, 1, {Operand{x}}})
+                                     : executor.submit(Job{job.first, 1, {Operand{x}, Operand{x}}});
+        auto expected = job.first == b ? fib(x) : 3 * x;
+        if (result.get().int32 != expected) {
+            return "wrong result for job " + std::to_string(x);
+        }
+        created.push_back(executor.stats()[0].interpreters);
+    }
+    if (created != std::vector<uint64_t>{1, 2, 2, 3, 3, 4}) {
+        auto re = std::string{"interpreters created:"};
+        for (auto n : created) {
+            re += " " + std::to_string(n);
+        }
+        return re;
+    }
+    return "";
+}
+
+// 1: an ADT of its own, 2: an ADT constant, 3: endless recursion
+std::shared_ptr<Module> failing() {
+    static ConstantInfo fields[] = {int32(5)};
+    auto adts = AdtTable{AdtInfo{ConstructorInfo{1}}};
+    auto constant = ConstantInfo{AdtConstant{0, 0, 1, fields}};
+    auto made = Bytecode{Instruction{O::ldc, 0}, Instruction{O::mkadt, 0, 0}, Instruction{O::ret}};
+    auto loaded = Bytecode{Instruction{O::ldc, 1}, Instruction{O::ret}};
+    auto endless = Bytecode{Instruction{O::call, 3}, Instruction{O::ret}};
+    return std::make_shared<Module>(with_main({int32(5), constant},
+        {FunctionInfo{0, 0, made}, FunctionInfo{0, 0, loaded}, FunctionInfo{0, 0, endless}}, adts));
+}
+
+template <class Error>
+bool throws(std::future<Operand> f) {
+    try {
+        f.get();
+    }
+    catch (Error&) {
+        return true;
+    }
+    catch (...) {
+    }
+    return false;
+}
+
+// Failed jobs resolve their futures with the exception, and the worker
+// goes on with the next job on the same interpreter.
+std::string failures() {
+    auto m = failing();
+    auto o = ExecutorOptions{};
+    o.workers = 1;
+    o.interpreter.stack_size = 4096;
+    auto executor = Executor{o};
+    if (!throws<Executor::AdtResultError>(executor.submit(Job{m, 1, {}}))) {
+        return "no AdtResultError";
+    }
+    auto constant = executor.submit(Job{m, 2, {}}).get();
+    if (constant.adt == nullptr || constant.adt->fields[0].int32 != 5) {
+        return "ADT constant not returned";
+    }
+    if (!throws<Interpreter::StackOverflowError>(executor.submit(Job{m, 3, {}}))) {
+        return "no StackOverflowError";
+    }
+    if (!throws<Interpreter::IndexOutOfBoundError>(executor.submit(Job{m, 9, {}}))) {
+        return "no IndexOutOfBoundError for a function out of range";
+    }
+    if (!throws<Interpreter::IndexOutOfBoundError>(executor.submit(Job{m, 1, {Operand{1}}}))) {
+        return "no IndexOutOfBoundError for too many arguments";
+    }
+    if (executor.submit(Job{m}).get().int32 != 0) {
+        return "wrong result after the failures";
+    }
+    auto stats = executor.stats()[0];
+    if (stats.jobs != 6 || stats.interpreters != 1) {
+        return std::to_string(stats.jobs) + " jobs, " + std::to_string(stats.interpreters) + " interpreters";
+    }
+    return "";
+}
+
+std::vector<Test> tests() {
+    return {
+        {"many_submitters", many_submitters},
+        {"stealing", stealing},
+        {"least_recently_used", least_recently_used},
+        {"failures", failures},
+    };
+}
+
+}
+
+int main(int argc, char** argv) {
+    auto filter = std::string{};
+    for (auto i = 1; i < argc; ++i) {
+        auto arg = std::string{argv[i]};
+        if (arg != "--filter" || i + 1 == argc) {
+            std::cerr << "usage: executor [--filter substring]\n";
+            return 2;
+        }
+        filter = argv[++i];
+    }
+
+    auto failures = 0;
+    for (auto&& t : tests()) {
+        if (t.name.find(filter) == std::string::npos) {
+            continue;
+        }
+        auto error = t.run();
+        if (!error.empty()) {
+            ++failures;
+            std::cout << t.name << "\t" << error << std::endl;
+        }
+    }
+    std::cout << (failures == 0 ? "all passed" : std::to_string(failures) + " failed") << std::endl;
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,143 @@
+// Tests of the Heap on its own: collections under a small capacity, where
+// promoting the nursery has to find room in the old generation.
+//
+//   g++ -std=c++17 -O2 -I.. heap.cpp ../heap.cpp -o heap
+//   ./heap [--filter substring]
+//
+// Prints a line for every test that fails and exits with status 1 if there
+// was any.
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "../heap.h"
+
+using namespace rvm;
+using namespace rvm::interpreter;
+
+namespace {
+
+struct Test {
+    std::string name;
+    // what went wrong, empty if nothing did
+    std::function<std::string()> run;
+};
+
+constexpr size_t nursery = size_t{1} << 20;
+// four slabs
+constexpr size_t capacity = size_t{4} << 20;
+// objects of two fields take 24 bytes, so a slab holds about 43000
+constexpr int32_t slab_cells = (1 << 20) / 24;
+
+// Conses `n` cells holding n-1 down to 0 in front of `*list`.
+void cons(Heap& h, Operand* list, int32_t n) {
+    for (int32_t i = 0; i < n; ++i) {
+        auto cell = h.make(0, 0, 2, list, list + 1);
+        cell->fields[0] = Operand{i};
+        cell->fields[1] = *list;
+        *list = Operand{cell};
+    }
+}
+
+// Whether `list` holds n-1 down to 0 and then ends.
+bool holds(Operand list, int32_t n) {
+    for (auto i = n - 1; i >= 0; --i) {
+        if (list.adt == nullptr || list.adt->fields[0].int32 != i) {
+            return false;
+        }
+        list = list.adt->fields[1];
+    }
+    return list.adt == nullptr;
+}
+
+// A major collection sets the next one at twice the live bytes, which here
+// is past the capacity, so only the collection before promoting finds the
+// garbage the first list has become; without it the second minor
+// collection of the second list would run out of slabs halfway.
+std::string garbage_before_promotion() {
+    auto h = Heap{nursery, capacity};
+    auto list = Operand{};
+    cons(h, &list, slab_cells * 11 / 5);
+    h.collect(&list, &list + 1);
+    list = Operand{};
+    try {
+        cons(h, &list, slab_cells * 5 / 2);
+    }
+    catch (Heap::OutOfMemoryError&) {
+        return "out of memory";
+    }
+    if (!holds(list, slab_cells * 5 / 2)) {
+        return "list broken";
+    }
+    if (h.stats().major_collections < 2) {
+        return "no major collection before promoting";
+    }
+    return "";
+}
+
+// Running out for good throws before anything moved, and the heap goes on
+// once the roots let go.
+std::string out_of_memory_leaves_heap_intact() {
+    auto h = Heap{nursery, capacity};
+    auto list = Operand{};
+    auto threw = false;
+    auto n = 0;
+    try {
+        for (; n < slab_cells * 5; n += 1000) {
+            cons(h, &list, 1000);
+        }
+    }
+    catch (Heap::OutOfMemoryError&) {
+        threw = true;
+    }
+    if (!threw) {
+        return "no OutOfMemoryError";
+    }
+    // the cells of the interrupted cons() are there too
+    auto length = 0;
+    for (auto p = list; p.adt != nullptr; p = p.adt->fields[1]) {
+        ++length;
+    }
+    if (length < n || length > n + 1000) {
+        return "list of " + std::to_string(length) + " after " + std::to_string(n);
+    }
+    list = Operand{};
+    h.collect(&list, &list + 1);
+    cons(h, &list, slab_cells * 2);
+    return holds(list, slab_cells * 2) ? "" : "list broken after out of memory";
+}
+
+std::vector<Test> tests() {
+    return {
+        {"garbage_before_promotion", garbage_before_promotion},
+        {"out_of_memory_leaves_heap_intact", out_of_memory_leaves_heap_intact},
+    };
+}
+
+}
+
+int main(int argc, char** argv) {
+    auto filter = std::string{};
+    for (auto i = 1; i < argc; ++i) {
+        auto arg = std::string{argv[i]};
+        if (arg != "--filter" || i + 1 == argc) {
+            std::cerr << "usage: heap [--filter substring]\n";
+            return 2;
+        }
+        filter = argv[++i];
+    }
+
+    auto failures = 0;
+    for (auto&& t : tests()) {
+        if (t.name.find(filter) == std::string::npos) {
+            continue;
+        }
+        auto error = t.run();
+        if (!error.empty()) {
+            ++failures;
+            std::cout << t.name << "\t" << error << std::endl;
+        }
+    }
+    std::cout << (failures == 0 ? "all passed" : std::to_string(failures) + " failed") << std::endl;
+    return failures == 0 ? 0 : 1;
+}
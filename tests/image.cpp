@@ -0,0 +1,323 @@
+// Tests of the image format: images written by dump_image() load back as
+// the same assembly, and Assembly::load() refuses images whose header or
+// records point outside the file.
+//
+//   g++ -std=c++17 -O2 -I.. image.cpp ../assembly.cpp ../image.cpp -o image
+//   ./image [--filter substring]
+//
+// Writes its images to $TMPDIR, or /tmp. Prints a line for every test that
+// fails and exits with status 1 if there was any.
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
+#include "../assembly.h"
+
+using namespace rvm;
+using namespace rvm::assembly;
+
+namespace {
+
+using O = Operation;
+
+struct Test {
+    std::string name;
+    // what went wrong, empty if nothing did
+    std::function<std::string()> run;
+};
+
+// The layout of the header and records in image.cpp.
+struct ImageHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t num_adts;
+    uint32_t num_constructors;
+    uint32_t num_constants;
+    uint32_t num_constant_records;
+    uint32_t num_functions;
+    uint32_t num_instructions;
+    uint64_t adts;
+    uint64_t constructors;
+    uint64_t constants;
+    uint64_t functions;
+    uint64_t code;
+    uint64_t size;
+};
+
+struct ImageAdt {
+    uint32_t first_constructor;
+    uint32_t num_constructors;
+};
+
+struct ImageConstant {
+    uint8_t type;
+    uint8_t constructor_index;
+    uint16_t adt_table_index;
+    uint16_t num_fields;
+    uint16_t reserved;
+    uint32_t value;
+};
+
+struct ImageFunction {
+    uint16_t num_args;
+    uint16_t num_locals;
+    uint32_t first_instruction;
+    uint32_t num_instructions;
+    uint32_t reserved;
+};
+
+ConstantInfo int32(int32_t x) {
+    return ConstantInfo{x};
+}
+
+// Two ADTs, a list constant [7, -3] whose fields are constants in turn,
+// and two functions.
+Assembly program() {
+    auto nil = ConstantInfo{AdtConstant{0, 0, 0, nullptr}};
+    auto tail = ConstantInfo{AdtConstant{0, 1, 2, new ConstantInfo[2]{ConstantInfo{int8_t{-3}}, nil}}};
+    auto list = ConstantInfo{AdtConstant{0, 1, 2, new ConstantInfo[2]{int32(7), tail}}};
+    auto main = Bytecode{
+        Instruction{O::ldc, 0}, Instruction{O::ldc, 1}, Instruction{O::call, 1}, Instruction{O::ret}};
+    auto f = Bytecode{Instruction{O::ldarg, 1}, Instruction{O::ldarg, 0}, Instruction{O::ret}};
+    return Assembly{{AdtInfo{ConstructorInfo{0}, ConstructorInfo{2}}, AdtInfo{ConstructorInfo{3}}},
+                    {int32(70000), list, ConstantInfo{int8_t{1}}},
+                    {FunctionInfo{0, 0, main}, FunctionInfo{2, 1, f}}};
+}
+
+std::string image_of(const Assembly& a) {
+    auto out = std::ostringstream{};
+    dump_image(a, out);
+    return out.str();
+}
+
+template <class T>
+T get(const std::string& image, size_t offset) {
+    auto re = T{};
+    memcpy(&re, image.data() + offset, sizeof(re));
+    return re;
+}
+
+template <class T>
+void put(std::string& image, size_t offset, T x) {
+    memcpy(&image[offset], &x, sizeof(x));
+}
+
+ImageHeader header(const std::string& image) {
+    return get<ImageHeader>(image, 0);
+}
+
+// A file that goes away with it.
+class TemporaryFile {
+public:
+    explicit TemporaryFile(const std::string& contents) {
+        auto dir = getenv("TMPDIR");
+        path = std::string{dir != nullptr ? dir : "/tmp"} + "/rvm-image-XXXXXX";
+        auto fd = mkstemp(&path[0]);
+        if (fd < 0 || write(fd, contents.data(), contents.size()) != static_cast<ssize_t>(contents.size())) {
+            abort();
+        }
+        close(fd);
+    }
+    TemporaryFile(const TemporaryFile&) = delete;
+    TemporaryFile& operator=(const TemporaryFile&) = delete;
+    ~TemporaryFile() {
+        unlink(path.c_str());
+    }
+
+    std::string path;
+};
+
+// Whether load() refuses `image`.
+bool refused(const std::string& image) {
+    auto file = TemporaryFile{image};
+    try {
+        Assembly::load(file.path);
+    }
+    catch (ParseError&) {
+        return true;
+    }
+    return false;
+}
+
+// The image loads as the assembly it was written from, and writes the same
+// image again; so does the empty assembly. A file in the stream format is
+// parsed.
+std::string round_trip() {
+    for (auto&& a : {program(), Assembly{}}) {
+        auto image = image_of(a);
+        auto file = TemporaryFile{image};
+        auto loaded = Assembly::load(file.path);
+        if (dump(loaded) != dump(a)) {
+            return "loaded differently";
+        }
+        if (loaded.storage == nullptr || image_of(loaded) != image) {
+            return "not mapped";
+        }
+    }
+    auto stream = dump(program());
+    auto file = TemporaryFile{std::string{stream.begin(), stream.end()}};
+    return dump(Assembly::load(file.path)) == stream ? "" : "stream format loaded differently";
+}
+
+// Header fields that do not match this build or the file.
+std::string bad_header() {
+    auto image = image_of(program());
+    auto h = header(image);
+    struct Case {
+        std::string name;
+        size_t offset;
+        uint64_t value;
+        size_t size;
+    };
+    auto cases = std::vector<Case>{
+        {"magic", offsetof(ImageHeader, magic), IMAGE_MAGIC_NUMBER + 1, 4},
+        {"version", offsetof(ImageHeader, version), IMAGE_VERSION + 1, 4},
+        {"size", offsetof(ImageHeader, size), h.size + 8, 8},
+        {"num_constants", offsetof(ImageHeader, num_constants), h.num_constant_records + 1, 4},
+    };
+    for (auto&& c : cases) {
+        auto corrupt = image;
+        if (c.size == 4) {
+            put(corrupt, c.offset, static_cast<uint32_t>(c.value));
+        }
+        else {
+            put(corrupt, c.offset, c.value);
+        }
+        if (!refused(corrupt)) {
+            return "wrong " + c.name + " loaded";
+        }
+    }
+    if (!refused(image.substr(0, sizeof(ImageHeader) - 1)) || !refused(image.substr(0, image.size() - 8))
+        || !refused(image + std::string(8, '\0'))) {
+        return "wrong file size loaded";
+    }
+    return "";
+}
+
+// Each section with its offset past the end, misaligned, or with more
+// records than fit in the file.
+std::string bad_sections() {
+    auto image = image_of(program());
+    auto h = header(image);
+    struct Section {
+        std::string name;
+        size_t offset;
+        size_t count;
+    };
+    auto sections = std::vector<Section>{
+        {"adts", offsetof(ImageHeader, adts), offsetof(ImageHeader, num_adts)},
+        {"constructors", offsetof(ImageHeader, constructors), offsetof(ImageHeader, num_constructors)},
+        {"constants", offsetof(ImageHeader, constants), offsetof(ImageHeader, num_constant_records)},
+        {"functions", offsetof(ImageHeader, functions), offsetof(ImageHeader, num_functions)},
+        {"code", offsetof(ImageHeader, code), offsetof(ImageHeader, num_instructions)},
+    };
+    for (auto&& s : sections) {
+        auto at = get<uint64_t>(image, s.offset);
+        for (auto offset : {h.size + 8, uint64_t{UINT64_MAX} & ~uint64_t{7}, at + 4, at + 2, at + 1}) {
+            auto corrupt = image;
+            put(corrupt, s.offset, offset);
+            if (!refused(corrupt)) {
+                return s.name + " at " + std::to_string(offset) + " of " + std::to_string(h.size) + " loaded";
+            }
+        }
+        for (auto count : {uint32_t{UINT32_MAX}, static_cast<uint32_t>(h.size - at + 1)}) {
+            auto corrupt = image;
+            put(corrupt, s.count, count);
+            if (!refused(corrupt)) {
+                return std::to_string(count) + " " + s.name + " loaded";
+            }
+        }
+    }
+    return "";
+}
+
+// Records that index past their sections, and ADT constants whose fields
+// do not come after them.
+std::string bad_records() {
+    auto image = image_of(program());
+    auto h = header(image);
+    auto adt = [&](uint32_t i) {
+        return h.adts + i * sizeof(ImageAdt);
+    };
+    auto constant = [&](uint32_t i) {
+        return h.constants + i * sizeof(ImageConstant);
+    };
+    auto function = [&](uint32_t i) {
+        return h.functions + i * sizeof(ImageFunction);
+    };
+    struct Case {
+        std::string name;
+        size_t offset;
+        uint32_t value;
+    };
+    // constant 1 is the list, with its fields in records 3 and 4
+    auto cases = std::vector<Case>{
+        {"first constructor", adt(1) + offsetof(ImageAdt, first_constructor), h.num_constructors + 1},
+        {"constructors", adt(1) + offsetof(ImageAdt, num_constructors), 2},
+        {"constructors", adt(0) + offsetof(ImageAdt, num_constructors), UINT32_MAX},
+        {"first instruction", function(1) + offsetof(ImageFunction, first_instruction), h.num_instructions + 1},
+        {"instructions", function(1) + offsetof(ImageFunction, num_instructions), 4},
+        {"instructions", function(0) + offsetof(ImageFunction, num_instructions), UINT32_MAX},
+        {"fields before", constant(1) + offsetof(ImageConstant, value), 1},
+        {"fields before", constant(1) + offsetof(ImageConstant, value), 0},
+        {"fields past", constant(1) + offsetof(ImageConstant, value), h.num_constant_records},
+        {"fields past", constant(1) + offsetof(ImageConstant, value), UINT32_MAX},
+    };
+    for (auto&& c : cases) {
+        auto corrupt = image;
+        put(corrupt, c.offset, c.value);
+        if (!refused(corrupt)) {
+            return c.name + " " + std::to_string(c.value) + " loaded";
+        }
+    }
+    auto corrupt = image;
+    put(corrupt, constant(1) + offsetof(ImageConstant, num_fields), static_cast<uint16_t>(h.num_constant_records));
+    if (!refused(corrupt)) {
+        return "too many fields loaded";
+    }
+    corrupt = image;
+    put(corrupt, constant(0) + offsetof(ImageConstant, type), uint8_t{7});
+    return refused(corrupt) ? "" : "unknown constant type loaded";
+}
+
+std::vector<Test> tests() {
+    return {
+        {"round_trip", round_trip},
+        {"bad_header", bad_header},
+        {"bad_sections", bad_sections},
+        {"bad_records", bad_records},
+    };
+}
+
+}
+
+int main(int argc, char** argv) {
+    auto filter = std::string{};
+    for (auto i = 1; i < argc; ++i) {
+        auto arg = std::string{argv[i]};
+        if (arg != "--filter" || i + 1 == argc) {
+            std::cerr << "usage: image [--filter substring]\n";
+            return 2;
+        }
+        filter = argv[++i];
+    }
+
+    auto failures = 0;
+    for (auto&& t : tests()) {
+        if (t.name.find(filter) == std::string::npos) {
+            continue;
+        }
+        auto error = t.run();
+        if (!error.empty()) {
+            ++failures;
+            std::cout << t.name << "\t" << error << std::endl;
+        }
+    }
+    std::cout << (failures == 0 ? "all passed" : std::to_string(failures) + " failed") << std::endl;
+    return failures == 0 ? 0 : 1;
+}
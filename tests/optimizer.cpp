@@ -0,0 +1,478 @@
+// Tests of optimize() and inline_calls(): for each pass, a function before
+// and the code it has to become, and the result both have to compute, on the
+// reference loop and on the register interpreter through run_differential().
+//
+//   g++ -std=c++17 -O2 -I.. optimizer.cpp ../assembly.cpp ../image.cpp ../interpreter.cpp
+//       ../decoder.cpp ../threaded.cpp ../fusion.cpp ../analysis.cpp ../verifier.cpp
+//       ../jit.cpp ../heap.cpp ../vm_stack.cpp ../module.cpp ../profile.cpp ../optimizer.cpp
+//       ../register_ir.cpp ../register_interpreter.cpp -o optimizer
+//   ./optimizer [--filter substring]
+//
+// Prints a line for every test that fails and exits with status 1 if there
+// was any.
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "../interpreter.h"
+#include "../optimizer.h"
+#include "../register_interpreter.h"
+
+using namespace rvm;
+using namespace rvm::assembly;
+using namespace rvm::interpreter;
+
+namespace {
+
+using O = Operation;
+using T = OperandType;
+
+// An instruction of the expected code. An ldc is given by the value of its
+// constant, since folding picks the index.
+struct Expected {
+    Instruction instruction;
+    bool constant;
+    int32_t value;
+};
+
+Expected op(Instruction i) {
+    return Expected{i, false, 0};
+}
+
+Expected ldc(int32_t value) {
+    return Expected{Instruction{O::ldc}, true, value};
+}
+
+struct Test {
+    std::string name;
+    Assembly before;
+    // the function `function` after `pass`, with `locals` locals
+    index_t function;
+    std::vector<Expected> after;
+    index_t locals;
+    int32_t result;
+    // what turns `before` into `after`
+    std::function<void(Assembly&)> pass{[](Assembly& a) {
+        optimize(a);
+    }};
+};
+
+// inline_calls() alone, so that the spliced code is seen as it is, with
+// `profile` as InlineOptions::profile unless it is empty.
+std::function<void(Assembly&)> inlining(InlineOptions o, std::vector<std::vector<uint64_t>> profile = {}) {
+    auto counts = std::make_shared<std::vector<std::vector<uint64_t>>>(std::move(profile));
+    return [o, counts](Assembly& a) {
+        auto options = o;
+        if (!counts->empty()) {
+            options.profile = counts.get();
+        }
+        inline_calls(a, options);
+    };
+}
+
+ConstantInfo int32(int32_t x) {
+    return ConstantInfo{x};
+}
+
+// main() { return f(x); }
+FunctionInfo call_with(index_t x) {
+    return FunctionInfo{0, 0, Bytecode{Instruction{O::ldc, x}, Instruction{O::call, 1}, Instruction{O::ret}}};
+}
+
+// The instructions of `f`, with the value of every constant loaded.
+std::string listing(const Assembly& a, const FunctionInfo& f) {
+    auto re = std::ostringstream{};
+    for (auto&& i : f.code) {
+        re << " " << static_cast<int>(i.op) << ":";
+        if (i.op == O::ldc && a.constant_table[i.index].type == ConstantType::int32) {
+            re << "=" << a.constant_table[i.index].int32;
+        }
+        else {
+            re << i.index;
+        }
+    }
+    return re.str();
+}
+
+bool same_code(const Assembly& a, const FunctionInfo& f, const std::vector<Expected>& expected) {
+    if (f.code.size() != expected.size()) {
+        return false;
+    }
+    for (size_t pc = 0; pc < expected.size(); ++pc) {
+        auto&& i = f.code[pc];
+        auto&& e = expected[pc];
+        if (e.constant) {
+            auto&& c = a.constant_table[i.index];
+            if (i.op != O::ldc || c.type != ConstantType::int32 || c.int32 != e.value) {
+                return false;
+            }
+        }
+        else if (i.op != e.instruction.op || i.index != e.instruction.index) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Folds ldc; ldc; <binop> twice over.
+Test fold_arithmetic() {
+    auto main = Bytecode{
+        Instruction{O::ldc, 0}, Instruction{O::ldc, 1}, Instruction{O::add, T::int32},
+        Instruction{O::ldc, 2}, Instruction{O::mul, T::int32}, Instruction{O::ret}};
+    auto a = Assembly{{}, {int32(2), int32(3), int32(4)}, {FunctionInfo{0, 0, main}}};
+    return Test{"fold.arithmetic", a, 0, {ldc(20), op(Instruction{O::ret})}, 0, 20};
+}
+
+// ldc; brtrue becomes a br, which goes away along with the code it skips.
+Test fold_branch() {
+    auto main = Bytecode{
+        Instruction{O::ldc, 0}, Instruction{O::brtrue, 4}, Instruction{O::ldc, 1}, Instruction{O::ret},
+        Instruction{O::ldc, 2}, Instruction{O::ret}};
+    auto a = Assembly{{}, {ConstantInfo{int8_t{1}}, int32(1), int32(2)}, {FunctionInfo{0, 0, main}}};
+    return Test{"fold.branch", a, 0, {ldc(2), op(Instruction{O::ret})}, 0, 2};
+}
+
+// A division by zero stays, to fail when it runs, which f(0) does not.
+Test fold_division_by_zero() {
+    auto f = std::vector<Instruction>{
+        Instruction{O::ldarg, 0}, Instruction{O::ldc, 0}, Instruction{O::teq, T::int32}, Instruction{O::brtrue, 8},
+        Instruction{O::ldc, 1}, Instruction{O::ldc, 0}, Instruction{O::div, T::int32}, Instruction{O::ret},
+        Instruction{O::ldc, 2}, Instruction{O::ret}};
+    auto after = std::vector<Expected>{};
+    for (auto&& i : f) {
+        after.push_back(op(i));
+    }
+    auto a = Assembly{{}, {int32(0), int32(1), int32(3)}, {call_with(0), FunctionInfo{1, 0, Bytecode(f)}}};
+    return Test{"fold.division_by_zero", a, 1, after, 0, 3};
+}
+
+// stloc n; ldloc n with no other read of n goes, a store nothing reads
+// becomes drop, and the locals go with them.
+Test forward_single_read() {
+    auto main = Bytecode{
+        Instruction{O::ldc, 2}, Instruction{O::stloc, 2},
+        Instruction{O::ldc, 0}, Instruction{O::stloc, 0}, Instruction{O::ldloc, 0},
+        Instruction{O::ldc, 1}, Instruction{O::add, T::int32},
+        Instruction{O::stloc, 1}, Instruction{O::ldloc, 1}, Instruction{O::ret}};
+    auto a = Assembly{{}, {int32(5), int32(1), int32(9)}, {FunctionInfo{0, 3, main}}};
+    return Test{"forward.single_read", a, 0, {ldc(6), op(Instruction{O::ret})}, 0, 6};
+}
+
+// Locals and arguments read twice stay.
+Test forward_two_reads() {
+    auto f = std::vector<Instruction>{
+        Instruction{O::ldarg, 0}, Instruction{O::stloc, 0}, Instruction{O::ldloc, 0}, Instruction{O::ldloc, 0},
+        Instruction{O::mul, T::int32}, Instruction{O::ret}};
+    auto after = std::vector<Expected>{};
+    for (auto&& i : f) {
+        after.push_back(op(i));
+    }
+    auto a = Assembly{{}, {int32(7)}, {call_with(0), FunctionInfo{1, 1, Bytecode(f)}}};
+    return Test{"forward.two_reads", a, 1, after, 1, 49};
+}
+
+// Through a jump table: its entries are only retargeted, even where they
+// lead to a ret, while the br past the table becomes that ret.
+Test thread_jump_table() {
+    auto main = Bytecode{
+        Instruction{O::ldc, 2}, Instruction{O::call, 1}, Instruction{O::ldc, 3}, Instruction{O::call, 1},
+        Instruction{O::add, T::int32}, Instruction{O::ldc, 4}, Instruction{O::call, 1},
+        Instruction{O::add, T::int32}, Instruction{O::ret}};
+    auto f = Bytecode{
+        Instruction{O::ldc, 0}, Instruction{O::ldarg, 0}, Instruction{O::switch_, 2},
+        Instruction{O::br, 6}, Instruction{O::br, 7},
+        Instruction{O::br, 6},
+        Instruction{O::br, 10},
+        Instruction{O::drop}, Instruction{O::ldc, 1}, Instruction{O::ret},                 // 7
+        Instruction{O::ret}};                                                              // 10
+    auto after = std::vector<Expected>{
+        ldc(10), op(Instruction{O::ldarg, 0}), op(Instruction{O::switch_, 2}),
+        op(Instruction{O::br, 9}), op(Instruction{O::br, 6}),
+        op(Instruction{O::ret}),
+        op(Instruction{O::drop}), ldc(20), op(Instruction{O::ret}),
+        op(Instruction{O::ret})};
+    auto a = Assembly{{}, {int32(10), int32(20), int32(0), int32(1), int32(5)},
+                      {FunctionInfo{0, 0, main}, FunctionInfo{1, 0, f}}};
+    return Test{"thread.jump_table", a, 1, after, 0, 40};
+}
+
+// Taking the address of a local reaches every slot of the frame, here
+// local 1 through pointer arithmetic: folding still applies, but no store
+// is forwarded or dropped and no local goes, not even local 2 which no
+// instruction names.
+Test ldloca_frame() {
+    auto main = Bytecode{
+        Instruction{O::ldc, 0}, Instruction{O::ldc, 1}, Instruction{O::add, T::int32}, Instruction{O::stloc, 0},
+        Instruction{O::ldc, 2}, Instruction{O::stloc, 1},
+        Instruction{O::ldloca, 0}, Instruction{O::ldc, 3}, Instruction{O::add, T::int32}, Instruction{O::ldind},
+        Instruction{O::ldloc, 0}, Instruction{O::add, T::int32}, Instruction{O::ret}};
+    auto after = std::vector<Expected>{
+        ldc(5), op(Instruction{O::stloc, 0}), ldc(7), op(Instruction{O::stloc, 1}),
+        op(Instruction{O::ldloca, 0}), ldc(1), op(Instruction{O::add, T::int32}), op(Instruction{O::ldind}),
+        op(Instruction{O::ldloc, 0}), op(Instruction{O::add, T::int32}), op(Instruction{O::ret})};
+    auto a = Assembly{{}, {int32(2), int32(3), int32(7), int32(1)}, {FunctionInfo{0, 3, main}}};
+    return Test{"ldloca.frame", a, 0, after, 3, 12};
+}
+
+// A ret before the end of the callee becomes a br past the spliced code,
+// the one at the end goes, and the argument is stored into a new local.
+Test inline_early_ret() {
+    auto main = Bytecode{Instruction{O::ldc, 1}, Instruction{O::call, 1}, Instruction{O::ret}};
+    auto f = Bytecode{
+        Instruction{O::ldarg, 0}, Instruction{O::ldc, 0}, Instruction{O::tlt, T::int32}, Instruction{O::brtrue, 6},
+        Instruction{O::ldarg, 0}, Instruction{O::ret},
+        Instruction{O::ldc, 0}, Instruction{O::ldarg, 0}, Instruction{O::sub, T::int32}, Instruction{O::ret}};
+    auto after = std::vector<Expected>{
+        ldc(-5), op(Instruction{O::stloc, 0}),
+        op(Instruction{O::ldloc, 0}), ldc(0), op(Instruction{O::tlt, T::int32}), op(Instruction{O::brtrue, 8}),
+        op(Instruction{O::ldloc, 0}), op(Instruction{O::br, 11}),
+        ldc(0), op(Instruction{O::ldloc, 0}), op(Instruction{O::sub, T::int32}),
+        op(Instruction{O::ret})};
+    auto a = Assembly{{}, {int32(0), int32(-5)}, {FunctionInfo{0, 0, main}, FunctionInfo{1, 0, f}}};
+    return Test{"inline.early_ret", a, 0, after, 1, 5, inlining(InlineOptions{})};
+}
+
+// Every copy of a callee's jump table leads into that copy.
+Test inline_switch() {
+    auto main = Bytecode{
+        Instruction{O::ldc, 0}, Instruction{O::call, 1}, Instruction{O::ldc, 1}, Instruction{O::call, 1},
+        Instruction{O::add, T::int32}, Instruction{O::ldc, 2}, Instruction{O::call, 1},
+        Instruction{O::add, T::int32}, Instruction{O::ret}};
+    auto f = Bytecode{
+        Instruction{O::ldarg, 0}, Instruction{O::switch_, 2}, Instruction{O::br, 6}, Instruction{O::br, 8},
+        Instruction{O::ldc, 5}, Instruction{O::ret},
+        Instruction{O::ldc, 3}, Instruction{O::ret},                                                    // 6
+        Instruction{O::ldc, 4}, Instruction{O::ret}};                                                   // 8
+    auto copy = [](index_t local, index_t start) {
+        return std::vector<Expected>{
+            op(Instruction{O::stloc, local}), op(Instruction{O::ldloc, local}), op(Instruction{O::switch_, 2}),
+            op(Instruction{O::br, static_cast<index_t>(start + 6)}),
+            op(Instruction{O::br, static_cast<index_t>(start + 8)}),
+            ldc(30), op(Instruction{O::br, static_cast<index_t>(start + 9)}),
+            ldc(10), op(Instruction{O::br, static_cast<index_t>(start + 9)}),
+            ldc(20)};
+    };
+    auto after = std::vector<Expected>{ldc(0)};
+    for (auto&& e : copy(0, 2)) {
+        after.push_back(e);
+    }
+    after.push_back(ldc(1));
+    for (auto&& e : copy(1, 13)) {
+        after.push_back(e);
+    }
+    after.push_back(op(Instruction{O::add, T::int32}));
+    after.push_back(ldc(5));
+    for (auto&& e : copy(2, 25)) {
+        after.push_back(e);
+    }
+    after.push_back(op(Instruction{O::add, T::int32}));
+    after.push_back(op(Instruction{O::ret}));
+    auto a = Assembly{{}, {int32(0), int32(1), int32(5), int32(10), int32(20), int32(30)},
+                      {FunctionInfo{0, 0, main}, FunctionInfo{1, 0, f}}};
+    return Test{"inline.switch", a, 0, after, 3, 60, inlining(InlineOptions{})};
+}
+
+// The callee's local is zeroed on every iteration, as a call would find it;
+// without that the sum would be 10.
+Test inline_locals_in_loop() {
+    auto main = Bytecode{
+        Instruction{O::ldloc, 1}, Instruction{O::ldloc, 0}, Instruction{O::call, 1}, Instruction{O::add, T::int32},
+        Instruction{O::stloc, 1},
+        Instruction{O::ldloc, 0}, Instruction{O::ldc, 1}, Instruction{O::add, T::int32}, Instruction{O::stloc, 0},
+        Instruction{O::ldloc, 0}, Instruction{O::ldc, 2}, Instruction{O::tlt, T::int32}, Instruction{O::brtrue, 0},
+        Instruction{O::ldloc, 1}, Instruction{O::ret}};
+    // f(x) { local += x; return local; }
+    auto f = Bytecode{
+        Instruction{O::ldloc, 0}, Instruction{O::ldarg, 0}, Instruction{O::add, T::int32}, Instruction{O::stloc, 0},
+        Instruction{O::ldloc, 0}, Instruction{O::ret}};
+    auto after = std::vector<Expected>{
+        op(Instruction{O::ldloc, 1}), op(Instruction{O::ldloc, 0}),
+        op(Instruction{O::stloc, 2}), ldc(0), op(Instruction{O::stloc, 3}),
+        op(Instruction{O::ldloc, 3}), op(Instruction{O::ldloc, 2}), op(Instruction{O::add, T::int32}),
+        op(Instruction{O::stloc, 3}), op(Instruction{O::ldloc, 3}),
+        op(Instruction{O::add, T::int32}), op(Instruction{O::stloc, 1}),
+        op(Instruction{O::ldloc, 0}), ldc(1), op(Instruction{O::add, T::int32}), op(Instruction{O::stloc, 0}),
+        op(Instruction{O::ldloc, 0}), ldc(4), op(Instruction{O::tlt, T::int32}), op(Instruction{O::brtrue, 0}),
+        op(Instruction{O::ldloc, 1}), op(Instruction{O::ret})};
+    auto a = Assembly{{}, {int32(0), int32(1), int32(4)}, {FunctionInfo{0, 2, main}, FunctionInfo{1, 1, f}}};
+    return Test{"inline.locals_in_loop", a, 0, after, 4, 6, inlining(InlineOptions{})};
+}
+
+// main() { return f(10) + g(10) + f(10); } where f(x) = x + 1 takes 14
+// instructions, over max_size, and g(x) = 2x is small.
+Assembly profiled() {
+    auto main = Bytecode{
+        Instruction{O::ldc, 3}, Instruction{O::call, 1}, Instruction{O::ldc, 3}, Instruction{O::call, 2},
+        Instruction{O::add, T::int32}, Instruction{O::ldc, 3}, Instruction{O::call, 1},
+        Instruction{O::add, T::int32}, Instruction{O::ret}};
+    auto f = std::vector<Instruction>{Instruction{O::ldarg, 0}};
+    for (auto i = 0; i < 5; ++i) {
+        f.push_back(Instruction{O::ldc, 0});
+        f.push_back(Instruction{O::add, T::int32});
+    }
+    f.push_back(Instruction{O::ldc, 1});
+    f.push_back(Instruction{O::add, T::int32});
+    f.push_back(Instruction{O::ret});
+    auto g = Bytecode{Instruction{O::ldarg, 0}, Instruction{O::ldc, 2}, Instruction{O::mul, T::int32},
+                      Instruction{O::ret}};
+    return Assembly{{}, {int32(1), int32(-4), int32(2), int32(10)},
+                    {FunctionInfo{0, 0, main}, FunctionInfo{1, 0, Bytecode(f)}, FunctionInfo{1, 0, g}}};
+}
+
+// calls at pc 1, 3 and 6 of profiled()
+const std::vector<std::vector<uint64_t>> call_counts = {{0, 5000, 0, 10, 0, 0, 999, 0, 0}};
+
+// With a profile only the site that ran min_calls times is inlined, even
+// though its callee is over max_size; g is small but cold.
+Test inline_profile() {
+    auto after = std::vector<Expected>{ldc(10), op(Instruction{O::stloc, 0}), op(Instruction{O::ldloc, 0})};
+    for (auto i = 0; i < 5; ++i) {
+        after.push_back(ldc(1));
+        after.push_back(op(Instruction{O::add, T::int32}));
+    }
+    after.push_back(ldc(-4));
+    after.push_back(op(Instruction{O::add, T::int32}));
+    for (auto&& i : std::vector<Instruction>{
+             Instruction{O::ldc, 3}, Instruction{O::call, 2}, Instruction{O::add, T::int32},
+             Instruction{O::ldc, 3}, Instruction{O::call, 1}, Instruction{O::add, T::int32},
+             Instruction{O::ret}}) {
+        after.push_back(i.op == O::ldc ? ldc(10) : op(i));
+    }
+    return Test{"inline.profile", profiled(), 0, after, 1, 42, inlining(InlineOptions{}, call_counts)};
+}
+
+// A hot site is still left alone when its callee is over hot_max_size.
+Test inline_hot_max_size() {
+    auto a = profiled();
+    auto after = std::vector<Expected>{};
+    for (auto&& i : a.function_table[0].code) {
+        after.push_back(i.op == O::ldc ? ldc(10) : op(i));
+    }
+    auto o = InlineOptions{};
+    o.hot_max_size = 13;
+    return Test{"inline.hot_max_size", a, 0, after, 0, 42, inlining(o, call_counts)};
+}
+
+// f(x) = x > 0 ? g(x - 1) + 1 : 0 and g(x) = x > 0 ? f(x - 1) + 2 : 0, with
+// main() { return f(5); }.
+Assembly mutually_recursive() {
+    auto body = [](index_t callee, index_t added) {
+        return Bytecode{
+            Instruction{O::ldarg, 0}, Instruction{O::ldc, 0}, Instruction{O::tgt, T::int32}, Instruction{O::brtrue, 6},
+            Instruction{O::ldc, 0}, Instruction{O::ret},
+            Instruction{O::ldarg, 0}, Instruction{O::ldc, 1}, Instruction{O::sub, T::int32}, Instruction{O::call, callee},
+            Instruction{O::ldc, added}, Instruction{O::add, T::int32}, Instruction{O::ret}};
+    };
+    auto main = Bytecode{Instruction{O::ldc, 3}, Instruction{O::call, 1}, Instruction{O::ret}};
+    return Assembly{{}, {int32(0), int32(1), int32(2), int32(5)},
+                    {FunctionInfo{0, 0, main}, FunctionInfo{1, 0, body(2, 1)}, FunctionInfo{1, 0, body(1, 2)}}};
+}
+
+// Room for f after g is spliced into it, so that only the call of itself
+// keeps it out of g.
+InlineOptions thirty_instructions() {
+    auto o = InlineOptions{};
+    o.max_size = 30;
+    return o;
+}
+
+// f takes in g as g was, calling f; spliced code is not looked at again,
+// so that call stays.
+Test inline_mutual_recursion() {
+    auto after = std::vector<Expected>{
+        op(Instruction{O::ldarg, 0}), ldc(0), op(Instruction{O::tgt, T::int32}), op(Instruction{O::brtrue, 6}),
+        ldc(0), op(Instruction{O::ret}),
+        op(Instruction{O::ldarg, 0}), ldc(1), op(Instruction{O::sub, T::int32}),
+        op(Instruction{O::stloc, 0}),
+        op(Instruction{O::ldloc, 0}), ldc(0), op(Instruction{O::tgt, T::int32}), op(Instruction{O::brtrue, 16}),
+        ldc(0), op(Instruction{O::br, 22}),
+        op(Instruction{O::ldloc, 0}), ldc(1), op(Instruction{O::sub, T::int32}), op(Instruction{O::call, 1}),
+        ldc(2), op(Instruction{O::add, T::int32}),
+        ldc(1), op(Instruction{O::add, T::int32}), op(Instruction{O::ret})};
+    return Test{"inline.mutual_recursion", mutually_recursive(), 1, after, 1, 7,
+                inlining(thirty_instructions())};
+}
+
+// ... after which f calls itself, so g keeps its call of f.
+Test inline_mutual_recursion_stops() {
+    auto a = mutually_recursive();
+    auto after = std::vector<Expected>{};
+    for (auto&& i : a.function_table[2].code) {
+        after.push_back(op(i));
+    }
+    return Test{"inline.mutual_recursion.stops", a, 2, after, 0, 7, inlining(thirty_instructions())};
+}
+
+std::vector<Test> tests() {
+    return {
+        fold_arithmetic(), fold_branch(), fold_division_by_zero(), forward_single_read(), forward_two_reads(),
+        thread_jump_table(), ldloca_frame(), inline_early_ret(), inline_switch(), inline_locals_in_loop(),
+        inline_profile(), inline_hot_max_size(), inline_mutual_recursion(), inline_mutual_recursion_stops(),
+    };
+}
+
+// What `a` returns on both interpreters, or why it failed.
+std::string run(const Assembly& a, int32_t* result) {
+    try {
+        validate(a);
+        *result = run_differential(a, {}).int32;
+        return "";
+    }
+    catch (DivergenceError& e) {
+        return e.message;
+    }
+    catch (InvalidBytecodeError&) {
+        return "invalid bytecode";
+    }
+    catch (...) {
+        return "exception";
+    }
+}
+
+// Prints what is wrong with `t`, if anything.
+bool check(const Test& t) {
+    auto result = int32_t{0};
+    auto error = run(t.before, &result);
+    if (!error.empty() || result != t.result) {
+        std::cout << t.name << "\tbefore: " << (error.empty() ? std::to_string(result) : error) << "\n";
+        return false;
+    }
+    auto a = t.before;
+    t.pass(a);
+    auto&& f = a.function_table[t.function];
+    if (!same_code(a, f, t.after) || f.num_locals != t.locals) {
+        std::cout << t.name << "\tcode:" << listing(a, f) << " with " << f.num_locals << " locals\n";
+        return false;
+    }
+    error = run(a, &result);
+    if (!error.empty() || result != t.result) {
+        std::cout << t.name << "\tafter: " << (error.empty() ? std::to_string(result) : error) << "\n";
+        return false;
+    }
+    return true;
+}
+
+}
+
+int main(int argc, char** argv) {
+    auto filter = std::string{};
+    for (auto i = 1; i < argc; ++i) {
+        auto arg = std::string{argv[i]};
+        if (arg != "--filter" || i + 1 == argc) {
+            std::cerr << "usage: optimizer [--filter substring]\n";
+            return 2;
+        }
+        filter = argv[++i];
+    }
+
+    auto failures = 0;
+    for (auto&& t : tests()) {
+        if (t.name.find(filter) != std::string::npos && !check(t)) {
+            ++failures;
+        }
+    }
+    std::cout << (failures == 0 ? "all passed" : std::to_string(failures) + " failed") << std::endl;
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,248 @@
+// Tests of Profile: exact counts for a small program with a call, a
+// tailcall, a loop and a native, and the call stacks write_collapsed()
+// makes of them.
+//
+//   g++ -std=c++17 -O2 -I.. profile.cpp ../assembly.cpp ../image.cpp ../interpreter.cpp
+//       ../decoder.cpp ../threaded.cpp ../fusion.cpp ../analysis.cpp ../verifier.cpp
+//       ../jit.cpp ../heap.cpp ../vm_stack.cpp ../module.cpp ../profile.cpp -o profile
+//   ./profile [--filter substring]
+//
+// Prints a line for every test that fails and exits with status 1 if there
+// was any.
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "../interpreter.h"
+
+using namespace rvm;
+using namespace rvm::assembly;
+using namespace rvm::interpreter;
+
+namespace {
+
+using O = Operation;
+using T = OperandType;
+
+struct Test {
+    std::string name;
+    // what went wrong, empty if nothing did
+    std::function<std::string()> run;
+};
+
+ConstantInfo int32(int32_t x) {
+    return ConstantInfo{x};
+}
+
+int32_t twice(int32_t x) {
+    return 2 * x;
+}
+
+// main() { return twice(f1(3)); }, where f1(n) tailcalls f2(n), which
+// sums n down to 1 in a loop. 4 instructions in main, 2 in f1 and
+// 2 + 3 * 12 + 2 in f2.
+Assembly program() {
+    auto main = Bytecode{
+        Instruction{O::ldc, 2}, Instruction{O::call, 1}, Instruction{O::callnative, 0}, Instruction{O::ret}};
+    auto f1 = Bytecode{Instruction{O::ldarg, 0}, Instruction{O::tailcall, 2}};
+    auto f2 = Bytecode{
+        Instruction{O::ldc, 0}, Instruction{O::stloc, 0},
+        Instruction{O::ldloc, 0}, Instruction{O::ldarg, 0}, Instruction{O::add, T::int32}, Instruction{O::stloc, 0},  // 2
+        Instruction{O::ldarg, 0}, Instruction{O::ldc, 1}, Instruction{O::sub, T::int32}, Instruction{O::starg, 0},
+        Instruction{O::ldarg, 0}, Instruction{O::ldc, 0}, Instruction{O::tgt, T::int32}, Instruction{O::brtrue, 2},
+        Instruction{O::ldloc, 0}, Instruction{O::ret}};                                                              // 14
+    return Assembly{{}, {int32(0), int32(1), int32(3)},
+                    {FunctionInfo{0, 0, main}, FunctionInfo{1, 0, f1}, FunctionInfo{1, 1, f2}}};
+}
+
+// Runs program() `runs` times from the start, in slices of `slice`
+// instructions, or in one go if it is 0.
+std::string record(Profile* p, int runs, uint64_t slice = 0) {
+    auto m = std::make_shared<Module>(program());
+    m->add_native_function(native<twice>());
+    auto o = Options{};
+    o.record_profile = true;
+    auto vm = Interpreter{m, o};
+    for (auto i = 0; i < runs; ++i) {
+        if (i != 0) {
+            vm.restart(MAIN_FUNCTION_INDEX, {});
+        }
+        if (slice == 0) {
+            vm.run();
+        }
+        else {
+            while (vm.run_for(slice) == RunStatus::suspended) {
+            }
+        }
+        if (vm.result().int32 != 12) {
+            return "result " + std::to_string(vm.result().int32);
+        }
+    }
+    *p = vm.detailed_profile();
+    return "";
+}
+
+std::string collapsed(const Profile& p) {
+    auto out = std::ostringstream{};
+    p.write_collapsed(out);
+    return out.str();
+}
+
+// Every table after one run.
+std::string counts() {
+    auto p = Profile{};
+    auto error = record(&p, 1);
+    if (!error.empty()) {
+        return error;
+    }
+    struct Count {
+        O op;
+        uint64_t n;
+    };
+    auto expected = std::vector<Count>{
+        {O::ldc, 8}, {O::call, 1}, {O::callnative, 1}, {O::ret, 2}, {O::ldarg, 10}, {O::tailcall, 1},
+        {O::stloc, 4}, {O::ldloc, 4}, {O::add, 3}, {O::sub, 3}, {O::starg, 3}, {O::tgt, 3}, {O::brtrue, 3}};
+    auto total = uint64_t{0};
+    for (auto&& c : expected) {
+        if (p.operations[static_cast<size_t>(c.op)] != c.n) {
+            return "operation " + std::to_string(static_cast<int>(c.op)) + " counted "
+                   + std::to_string(p.operations[static_cast<size_t>(c.op)]) + " times";
+        }
+        total += c.n;
+    }
+    for (auto n : p.operations) {
+        total -= n;
+    }
+    if (total != 0) {
+        return "operations nothing executed counted";
+    }
+    auto functions = std::vector<FunctionProfile>{{1, 4}, {1, 2}, {1, 40}};
+    for (size_t f = 0; f < functions.size(); ++f) {
+        if (p.functions[f].calls != functions[f].calls || p.functions[f].instructions != functions[f].instructions) {
+            return "f" + std::to_string(f) + ": " + std::to_string(p.functions[f].calls) + " calls, "
+                   + std::to_string(p.functions[f].instructions) + " instructions";
+        }
+    }
+    if (p.pcs[0] != std::vector<uint64_t>(4, 1) || p.pcs[1] != std::vector<uint64_t>(2, 1)) {
+        return "pcs of f0 or f1";
+    }
+    auto loop = std::vector<uint64_t>{1, 1, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 1, 1};
+    if (p.pcs[2] != loop) {
+        return "pcs of f2";
+    }
+    for (size_t f = 0; f < p.back_edges.size(); ++f) {
+        for (size_t pc = 0; pc < p.back_edges[f].size(); ++pc) {
+            if (p.back_edges[f][pc] != (f == 2 && pc == 13 ? 2 : 0)) {
+                return "back-edges at f" + std::to_string(f) + ":" + std::to_string(pc);
+            }
+        }
+    }
+    if (p.natives.size() != 1 || p.natives[0].calls != 1) {
+        return "natives";
+    }
+    return "";
+}
+
+// The tailcall replaces f1 under main, and the ret of f2 goes back to
+// main, not to f1.
+std::string call_tree() {
+    auto p = Profile{};
+    auto error = record(&p, 1);
+    if (!error.empty()) {
+        return error;
+    }
+    auto lines = collapsed(p);
+    return lines == "f0 4\nf0;f1 2\nf0;f2 40\n" ? "" : "collapsed:\n" + lines;
+}
+
+// restart() begins at the root again, so later runs add to the same
+// stacks instead of nesting under where the last one ended.
+std::string restarts() {
+    auto p = Profile{};
+    auto error = record(&p, 3);
+    if (!error.empty()) {
+        return error;
+    }
+    auto lines = collapsed(p);
+    if (lines != "f0 12\nf0;f1 6\nf0;f2 120\n") {
+        return "collapsed:\n" + lines;
+    }
+    return p.functions[2].calls == 3 && p.back_edges[2][13] == 6 ? "" : "counts after three runs";
+}
+
+// Stopping every few instructions records the same as one run.
+std::string slices() {
+    auto whole = Profile{};
+    auto error = record(&whole, 1);
+    for (uint64_t slice = 1; error.empty() && slice <= 5; ++slice) {
+        auto p = Profile{};
+        error = record(&p, 1, slice);
+        if (error.empty()
+            && (collapsed(p) != collapsed(whole) || p.operations != whole.operations || p.pcs != whole.pcs
+                || p.back_edges != whole.back_edges)) {
+            error = "slices of " + std::to_string(slice);
+        }
+    }
+    return error;
+}
+
+// The report begins with the total and names the loop's back-edge.
+std::string report() {
+    auto p = Profile{};
+    auto error = record(&p, 1);
+    if (!error.empty()) {
+        return error;
+    }
+    auto out = std::ostringstream{};
+    p.write_report(out);
+    auto text = out.str();
+    if (text.rfind("instructions 46\n", 0) != 0) {
+        return "report begins with " + text.substr(0, text.find('\n'));
+    }
+    auto at = text.find("\nf2:13 ", text.find("back-edge"));
+    auto line = at == std::string::npos ? std::string{} : text.substr(at + 1, text.find('\n', at + 1) - at - 1);
+    if (line.size() < 2 || line.compare(line.size() - 2, 2, " 2") != 0) {
+        return "no back-edge f2:13 taken twice in\n" + text;
+    }
+    return "";
+}
+
+std::vector<Test> tests() {
+    return {
+        {"counts", counts},
+        {"call_tree", call_tree},
+        {"restarts", restarts},
+        {"slices", slices},
+        {"report", report},
+    };
+}
+
+}
+
+int main(int argc, char** argv) {
+    auto filter = std::string{};
+    for (auto i = 1; i < argc; ++i) {
+        auto arg = std::string{argv[i]};
+        if (arg != "--filter" || i + 1 == argc) {
+            std::cerr << "usage: profile [--filter substring]\n";
+            return 2;
+        }
+        filter = argv[++i];
+    }
+
+    auto failures = 0;
+    for (auto&& t : tests()) {
+        if (t.name.find(filter) == std::string::npos) {
+            continue;
+        }
+        auto error = t.run();
+        if (!error.empty()) {
+            ++failures;
+            std::cout << t.name << "\t" << error << std::endl;
+        }
+    }
+    std::cout << (failures == 0 ? "all passed" : std::to_string(failures) + " failed") << std::endl;
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,182 @@
+// Tests of the Sampler: a hot loop on each engine, and the ticks after a
+// run that threw.
+//
+//   g++ -std=c++17 -O2 -I.. sampler.cpp ../sampler.cpp ../assembly.cpp ../image.cpp
+//       ../interpreter.cpp ../decoder.cpp ../threaded.cpp ../fusion.cpp ../analysis.cpp
+//       ../verifier.cpp ../jit.cpp ../heap.cpp ../vm_stack.cpp ../module.cpp ../profile.cpp
+//       -lpthread -lrt -o sampler
+//   ./sampler [--filter substring]
+//
+// Needs a few seconds of CPU time. Prints a line for every test that fails
+// and exits with status 1 if there was any.
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "../sampler.h"
+
+using namespace rvm;
+using namespace rvm::assembly;
+using namespace rvm::interpreter;
+
+namespace {
+
+using O = Operation;
+using T = OperandType;
+
+struct Test {
+    std::string name;
+    // what went wrong, empty if nothing did
+    std::function<std::string()> run;
+};
+
+struct Engine {
+    std::string name;
+    Options options;
+};
+
+std::vector<Engine> engines() {
+    auto re = std::vector<Engine>{};
+    auto o = Options{};
+    o.dispatch = Dispatch::switch_loop;
+    re.push_back({"switch", o});
+    o = Options{};
+    o.jit = false;
+    re.push_back({"threaded", o});
+    re.push_back({"jit", Options{}});
+    return re;
+}
+
+ConstantInfo int32(int32_t x) {
+    return ConstantInfo{x};
+}
+
+// 1: hot(n), counting n down; 2: start(n) = cold() + hot(n); 3: cold();
+// 4: endless recursion
+Assembly program() {
+    auto hot = Bytecode{
+        Instruction{O::ldarg, 0}, Instruction{O::ldc, 1}, Instruction{O::sub, T::int32}, Instruction{O::starg, 0},
+        Instruction{O::ldarg, 0}, Instruction{O::ldc, 0}, Instruction{O::tgt, T::int32}, Instruction{O::brtrue, 0},
+        Instruction{O::ldarg, 0}, Instruction{O::ret}};
+    auto start = Bytecode{
+        Instruction{O::call, 3}, Instruction{O::ldarg, 0}, Instruction{O::call, 1}, Instruction{O::add, T::int32},
+        Instruction{O::ret}};
+    auto cold = Bytecode{Instruction{O::ldc, 0}, Instruction{O::ret}};
+    auto endless = Bytecode{Instruction{O::call, 4}, Instruction{O::ret}};
+    auto main = Bytecode{Instruction{O::ldc, 0}, Instruction{O::ret}};
+    return Assembly{{}, {int32(0), int32(1)},
+                    {FunctionInfo{0, 0, main}, FunctionInfo{1, 0, hot}, FunctionInfo{1, 0, start},
+                     FunctionInfo{0, 0, cold}, FunctionInfo{0, 0, endless}}};
+}
+
+// Burns CPU time outside the interpreter.
+void spin(std::chrono::milliseconds how_long) {
+    auto until = std::chrono::steady_clock::now() + how_long;
+    volatile uint64_t x = 0;
+    while (std::chrono::steady_clock::now() < until) {
+        for (auto i = 0; i < 10000; ++i) {
+            x = x + 1;
+        }
+    }
+}
+
+// Runs start(n) until a few hundred samples are in: nearly all of them in
+// hot(), under start(), where every stack walk ends. Nothing outside
+// main() ever called start(), so main() must not show up.
+std::string hot_loop() {
+    auto a = program();
+    for (auto&& e : engines()) {
+        auto vm = Interpreter{a, e.options};
+        auto sampler = Sampler{vm, 1000};
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+        while (sampler.profile().samples < 300 && std::chrono::steady_clock::now() < deadline) {
+            vm.restart(2, {Operand{int32_t{3000000}}});
+            vm.run();
+        }
+        sampler.stop();
+        auto p = sampler.profile();
+        if (p.samples < 300) {
+            return e.name + ": " + std::to_string(p.samples) + " samples";
+        }
+        if (p.self[1] * 10 < p.samples * 9 || p.total[2] != p.samples) {
+            return e.name + ": hot() has " + std::to_string(p.self[1]) + " of " + std::to_string(p.samples)
+                   + ", start() " + std::to_string(p.total[2]);
+        }
+        for (auto&& s : p.stacks) {
+            auto&& stack = s.first;
+            if (stack.empty() || stack[0] != 2 || stack.size() > 2 || (stack.size() == 2 && stack[1] == 2)) {
+                auto re = e.name + ": stack";
+                for (auto f : stack) {
+                    re += " f" + std::to_string(f);
+                }
+                return re;
+            }
+        }
+        if (p.total[0] != 0) {
+            return e.name + ": main() sampled";
+        }
+    }
+    return "";
+}
+
+// After a run that ended in StackOverflowError, ticks are idle again.
+std::string idle_after_throw() {
+    auto a = program();
+    for (auto&& e : engines()) {
+        auto o = e.options;
+        o.stack_size = 1 << 16;
+        auto vm = Interpreter{a, o};
+        auto sampler = Sampler{vm, 1000};
+        vm.restart(4, {});
+        try {
+            vm.run();
+            return e.name + ": no StackOverflowError";
+        }
+        catch (Interpreter::StackOverflowError&) {
+        }
+        auto before = sampler.profile();
+        spin(std::chrono::milliseconds(200));
+        auto after = sampler.profile();
+        if (after.samples != before.samples || after.idle < before.idle + 10) {
+            return e.name + ": " + std::to_string(after.samples - before.samples) + " samples and "
+                   + std::to_string(after.idle - before.idle) + " idle while outside";
+        }
+    }
+    return "";
+}
+
+std::vector<Test> tests() {
+    return {
+        {"hot_loop", hot_loop},
+        {"idle_after_throw", idle_after_throw},
+    };
+}
+
+}
+
+int main(int argc, char** argv) {
+    auto filter = std::string{};
+    for (auto i = 1; i < argc; ++i) {
+        auto arg = std::string{argv[i]};
+        if (arg != "--filter" || i + 1 == argc) {
+            std::cerr << "usage: sampler [--filter substring]\n";
+            return 2;
+        }
+        filter = argv[++i];
+    }
+
+    auto failures = 0;
+    for (auto&& t : tests()) {
+        if (t.name.find(filter) == std::string::npos) {
+            continue;
+        }
+        auto error = t.run();
+        if (!error.empty()) {
+            ++failures;
+            std::cout << t.name << "\t" << error << std::endl;
+        }
+    }
+    std::cout << (failures == 0 ? "all passed" : std::to_string(failures) + " failed") << std::endl;
+    return failures == 0 ? 0 : 1;
+}
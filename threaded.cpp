@@ -0,0 +1,586 @@
+#include "interpreter.h"
+#include <algorithm>
+#include <functional>
+#include <stddef.h>
+#include <string.h>
+
+// Direct-threaded execution of the pre-decoded code. With labels-as-values
+// every handler jumps straight to the next one; otherwise the same handler
+// bodies are compiled as the cases of a portable switch.
+#if !defined(RVM_NO_COMPUTED_GOTO) && (defined(__GNUC__) || defined(__clang__))
+#define RVM_COMPUTED_GOTO 1
+#else
+#define RVM_COMPUTED_GOTO 0
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define RVM_UNLIKELY(c) __builtin_expect(!!(c), 0)
+#define RVM_COLD __attribute__((noinline, cold))
+#else
+#define RVM_UNLIKELY(c) (c)
+#define RVM_COLD
+#endif
+
+using namespace rvm;
+using namespace rvm::interpreter;
+using namespace rvm::assembly;
+
+namespace {
+
+template <class T> T value(const Operand&);
+template <> int8_t value<int8_t>(const Operand& o) { return o.int8; }
+template <> int32_t value<int32_t>(const Operand& o) { return o.int32; }
+template <> uint8_t value<uint8_t>(const Operand& o) { return static_cast<uint8_t>(o.int8); }
+template <> uint32_t value<uint32_t>(const Operand& o) { return static_cast<uint32_t>(o.int32); }
+
+template <class T, class R, class Func>
+inline Operand* binop(Operand* sp, Func f) {
+    auto y = value<T>(sp[-1]);
+    auto x = value<T>(sp[-2]);
+    sp[-2] = Operand{static_cast<R>(f(x, y))};
+    return sp - 1;
+}
+
+}
+
+// Counts a call or loop back-edge of function `idx`, compiling it when it
+// becomes hot. Returns true when compiled code can be entered.
+inline bool Interpreter::jit_ready(index_t idx) {
+    if (jit.compiled(idx)) {
+        return true;
+    }
+    if (++hotness[idx] != options.jit_threshold) {
+        return false;
+    }
+    return jit.compile(assembly, idx, native_table, constants);
+}
+
+// A calla whose target is not in the first way of its cache: a hit in one
+// of the others, or else the checks calla makes and a new entry. `arity` is
+// the number of arguments an unchecked run reserved space for, -1 when
+// checked; `check` is false where the verifier saw the target come from
+// ldfuna. Returns `target`, which spares the caller keeping it around.
+RVM_COLD index_t Interpreter::call_site_miss(CallSiteCache& c, index_t target, bool check, int32_t arity) {
+    for (size_t w = 1; w < CallSiteCache::ways; ++w) {
+        if (c.targets[w] == target) {
+            ++c.hits;
+            return target;
+        }
+    }
+    ++c.misses;
+    if (check) {
+        if (target >= assembly.function_table.size()) {
+            throw IndexOutOfBoundError{};
+        }
+        if (arity >= 0 && assembly.function_table[target].num_args != arity) {
+            throw InvalidBytecodeError{};
+        }
+    }
+    if (c.megamorphic) {
+        return target;
+    }
+    for (auto&& t : c.targets) {
+        if (t == -1) {
+            t = target;
+            return target;
+        }
+    }
+    c.megamorphic = true;
+    return target;
+}
+
+template <bool Checked>
+void Interpreter::run_threaded() {
+#if RVM_COMPUTED_GOTO
+    static const void* const labels[] = {
+#define RVM_OPCODE_LABEL(name) &&op_##name,
+        RVM_OPCODES(RVM_OPCODE_LABEL)
+#undef RVM_OPCODE_LABEL
+    };
+    module->prepare(labels);
+#else
+    module->prepare(nullptr);
+#endif
+    if (!running) {
+        return;
+    }
+    auto&& decoded = module->decoded;
+    auto&& frame_space = module->frame_space;
+    if (call_sites.empty()) {
+        call_sites.resize(module->call_sites.size() + 1);
+        call_sites.back().megamorphic = true;
+    }
+    auto sites = call_sites.data();
+
+    // While the loop runs, the top of operand_stack and the frame pointer
+    // live in `sp` and `fp`; both are written back on every exit. The stack
+    // never moves, so neither has to be rebased.
+    auto base = operand_stack.data();
+    auto limit = base + operand_stack.capacity();
+    auto sp = base + operand_stack.size();
+    auto fp = frame;
+    auto code = decoded[current_function_index].data();
+    auto ip = code + program_counter;
+    auto runtime = JitRuntime{&assembly, &native_table, &heap, base, 0, nullptr};
+    // kept out of `runtime` while interpreting, so it can stay in a register
+    auto left = budget;
+
+#define SYNC() \
+    do { \
+        program_counter = static_cast<index_t>(ip - code); \
+        operand_stack.set_top(sp); \
+        frame = fp; \
+    } while (0)
+
+// Tells a Sampler where the run is; done on every call, return and loop
+// back-edge.
+#define PUBLISH() \
+    do { \
+        position.function = static_cast<int32_t>(current_function_index); \
+        position.pc = static_cast<int32_t>(ip - code); \
+        position.frame = static_cast<int32_t>(fp - base); \
+    } while (0)
+
+#define RESERVE(n) \
+    do { \
+        if (RVM_UNLIKELY(limit - sp < static_cast<ptrdiff_t>(n))) { \
+            throw StackOverflowError{}; \
+        } \
+    } while (0)
+
+// Stack space for pushes. Unchecked runs reserve the whole frame on entry.
+#define RESERVE_PUSH(n) \
+    do { \
+        if (Checked) { \
+            RESERVE(n); \
+        } \
+    } while (0)
+
+#define ENTER(idx, num_locals) \
+    do { \
+        RESERVE(Checked ? FRAME_HEADER_SIZE + (num_locals) : frame_space[idx]); \
+        sp[0] = Operand{static_cast<int32_t>(current_function_index)}; \
+        sp[1] = Operand{static_cast<int32_t>(ip - code)}; \
+        sp[2] = Operand{static_cast<int32_t>(fp - base)}; \
+        sp += FRAME_HEADER_SIZE; \
+        fp = sp; \
+        ++frame_count; \
+        std::fill(sp, sp + (num_locals), Operand{}); \
+        sp += (num_locals); \
+        current_function_index = (idx); \
+        code = decoded[current_function_index].data(); \
+        ip = code; \
+        SAFEPOINT(decoded[current_function_index].size()); \
+    } while (0)
+
+// Replaces the current frame with one for `idx`: the arguments on top of
+// the stack move down over the current ones, the header is kept, so the
+// callee returns straight to the caller of the current function.
+#define TAIL_ENTER(idx, callee_args, callee_locals) \
+    do { \
+        RESERVE(Checked ? FRAME_HEADER_SIZE + (callee_locals) : frame_space[idx]); \
+        auto args = fp - FRAME_HEADER_SIZE - assembly.function_table[current_function_index].num_args; \
+        Operand header[FRAME_HEADER_SIZE]; \
+        std::copy(fp - FRAME_HEADER_SIZE, fp, header); \
+        memmove(args, sp - (callee_args), (callee_args) * sizeof(Operand)); \
+        sp = std::copy(header, header + FRAME_HEADER_SIZE, args + (callee_args)); \
+        fp = sp; \
+        std::fill(sp, sp + (callee_locals), Operand{}); \
+        sp += (callee_locals); \
+        current_function_index = (idx); \
+        code = decoded[current_function_index].data(); \
+        ip = code; \
+        SAFEPOINT(decoded[current_function_index].size()); \
+    } while (0)
+
+// Calls and loop back-edges, with `ip` at the first instruction to run:
+// charges `cost` instructions to the budget, suspending the run once it is
+// used up, then switches to compiled code when the current function has
+// some.
+#define SAFEPOINT(cost) \
+    do { \
+        PUBLISH(); \
+        if (RVM_UNLIKELY((left -= static_cast<int64_t>(cost)) <= 0)) { \
+            goto suspend; \
+        } \
+        if (options.jit && jit_ready(current_function_index)) { \
+            goto jit_enter; \
+        } \
+    } while (0)
+
+#if RVM_COMPUTED_GOTO
+#define TARGET(name) op_##name:
+#define NEXT() goto *(++ip)->handler
+#define JUMP() goto *ip->handler
+#else
+#define TARGET(name) case Opcode::name:
+#define NEXT() { ++ip; continue; }
+#define JUMP() continue
+#endif
+
+    if (!Checked) {
+        // covers whatever the frames already on the stack still need
+        RESERVE(*std::max_element(frame_space.begin(), frame_space.end()));
+    }
+
+    PUBLISH();
+    try {
+dispatch:
+#if RVM_COMPUTED_GOTO
+        JUMP();
+#else
+        for (;;) switch (ip->op) {
+#endif
+#define ARITHMETIC(name, f) \
+        TARGET(name##_i8) sp = binop<int8_t, int8_t>(sp, f); NEXT(); \
+        TARGET(name##_i32) sp = binop<int32_t, int32_t>(sp, f); NEXT();
+#define LOGIC(name, f) \
+        TARGET(name##_i8) sp = binop<int8_t, int8_t>(sp, f); NEXT(); \
+        TARGET(name##_i32) sp = binop<int32_t, int8_t>(sp, f); NEXT(); \
+        TARGET(name##_un_i8) sp = binop<uint8_t, int8_t>(sp, f); NEXT(); \
+        TARGET(name##_un_i32) sp = binop<uint32_t, int8_t>(sp, f); NEXT();
+
+        ARITHMETIC(add, std::plus<>{})
+        ARITHMETIC(sub, std::minus<>{})
+        ARITHMETIC(mul, std::multiplies<>{})
+        ARITHMETIC(div, std::divides<>{})
+        ARITHMETIC(rem, std::modulus<>{})
+        ARITHMETIC(band, std::bit_and<>{})
+        ARITHMETIC(bor, std::bit_or<>{})
+        ARITHMETIC(bxor, std::bit_xor<>{})
+        TARGET(bnot_i8) sp[-1] = Operand{static_cast<int8_t>(~sp[-1].int8)}; NEXT();
+        TARGET(bnot_i32) sp[-1] = Operand{static_cast<int32_t>(~sp[-1].int32)}; NEXT();
+        TARGET(dup)
+        {
+            RESERVE_PUSH(1);
+            sp[0] = sp[-1];
+            ++sp;
+        }
+        NEXT();
+        TARGET(drop)
+        {
+            if (Checked && RVM_UNLIKELY(sp == fp + ip->imm)) {
+                throw StackUnderflowError{};
+            }
+            --sp;
+        }
+        NEXT();
+        TARGET(ldc)
+        {
+            RESERVE_PUSH(1);
+            *sp++ = constants[ip->index];
+        }
+        NEXT();
+        TARGET(ldloc)
+        {
+            RESERVE_PUSH(1);
+            *sp = fp[ip->index];
+            ++sp;
+        }
+        NEXT();
+        TARGET(stloc) fp[ip->index] = *--sp; NEXT();
+        TARGET(ldarg)
+        {
+            RESERVE_PUSH(1);
+            *sp = fp[ip->imm];
+            ++sp;
+        }
+        NEXT();
+        TARGET(starg) fp[ip->imm] = *--sp; NEXT();
+        TARGET(call) ENTER(ip->index, ip->imm); JUMP();
+        TARGET(callnative)
+        {
+            RESERVE_PUSH(1);
+            auto&& ni = native_table[ip->index];
+            auto args = sp - ni.num_args;
+            *args = ni.func(args, ni.userdata);
+            sp = args + 1;
+            if (RVM_UNLIKELY(ni.async)) {
+                pending_token = *args;
+                waiting = true;
+                ++ip;
+                goto suspend;
+            }
+        }
+        NEXT();
+        TARGET(ret)
+        {
+            auto retval = *--sp;
+            if (frame_count == 1) {
+                running = false;
+                return_value = retval;
+                SYNC();
+                return;
+            }
+            auto old_func = fp[-3].int32;
+            auto old_pc = fp[-2].int32;
+            sp = fp - FRAME_HEADER_SIZE - ip->imm;
+            fp = base + fp[-1].int32;
+            *sp++ = retval;
+            --frame_count;
+            current_function_index = static_cast<index_t>(old_func);
+            code = decoded[current_function_index].data();
+            ip = code + old_pc;
+            PUBLISH();
+            if (options.jit && jit.compiled(current_function_index)) {
+                ++ip;
+                goto jit_enter;
+            }
+        }
+        NEXT();
+        TARGET(ldloca)
+        {
+            RESERVE_PUSH(1);
+            *sp++ = Operand{static_cast<int32_t>(fp - base + ip->index)};
+        }
+        NEXT();
+        TARGET(ldarga)
+        {
+            RESERVE_PUSH(1);
+            *sp++ = Operand{static_cast<int32_t>(fp - base + ip->imm)};
+        }
+        NEXT();
+        TARGET(ldfuna)
+        {
+            RESERVE_PUSH(1);
+            *sp++ = Operand{static_cast<int32_t>(ip->index)};
+        }
+        NEXT();
+        TARGET(calla)
+        {
+            auto idx = static_cast<index_t>(sp[-1].int32);
+            auto&& site = sites[ip->index];
+            if (RVM_UNLIKELY(site.targets[0] != idx)) {
+                // imm is set when the verifier saw the target come from
+                // ldfuna; the reserved frame space relies on the verified
+                // arity
+                idx = call_site_miss(site, idx, Checked || ip->imm == 0, Checked ? -1 : ip->imm2);
+            }
+            else {
+                ++site.hits;
+            }
+            --sp;
+            ENTER(idx, assembly.function_table[idx].num_locals);
+        }
+        JUMP();
+        TARGET(tailcall) TAIL_ENTER(ip->index, ip->imm2, ip->imm); JUMP();
+        TARGET(tailcalla)
+        {
+            auto idx = static_cast<index_t>(sp[-1].int32);
+            auto&& site = sites[ip->index];
+            if (RVM_UNLIKELY(site.targets[0] != idx)) {
+                idx = call_site_miss(site, idx, Checked || ip->imm == 0, Checked ? -1 : ip->imm2);
+            }
+            else {
+                ++site.hits;
+            }
+            --sp;
+            auto&& callee = assembly.function_table[idx];
+            TAIL_ENTER(idx, callee.num_args, callee.num_locals);
+        }
+        JUMP();
+        TARGET(ldind) sp[-1] = base[sp[-1].int32]; NEXT();
+        TARGET(stind)
+        {
+            base[sp[-2].int32] = sp[-1];
+            sp -= 2;
+        }
+        NEXT();
+        TARGET(teq)
+        {
+            auto eq = memcmp(&sp[-2], &sp[-1], sizeof(Operand)) == 0;
+            sp[-2] = Operand{static_cast<int8_t>(eq ? -1 : 0)};
+            --sp;
+        }
+        NEXT();
+        TARGET(tne)
+        {
+            auto eq = memcmp(&sp[-2], &sp[-1], sizeof(Operand)) == 0;
+            sp[-2] = Operand{static_cast<int8_t>(eq ? 0 : -1)};
+            --sp;
+        }
+        NEXT();
+        LOGIC(tlt, std::less<>{})
+        LOGIC(tle, std::less_equal<>{})
+        LOGIC(tgt, std::greater<>{})
+        LOGIC(tge, std::greater_equal<>{})
+        TARGET(br)
+        {
+            auto length = ip - code - ip->index + 1;
+            ip = code + ip->index;
+            if (length > 0) {
+                SAFEPOINT(length);
+            }
+        }
+        JUMP();
+        TARGET(brtrue)
+        {
+            if ((--sp)->int8 != 0) {
+                auto length = ip - code - ip->index + 1;
+                ip = code + ip->index;
+                if (length > 0) {
+                    SAFEPOINT(length);
+                }
+                JUMP();
+            }
+        }
+        NEXT();
+        TARGET(mkadt)
+        {
+            auto n = ip->imm;
+            auto adt = heap.make(ip->index, ip->index2, n, base, sp);
+            sp -= n;
+            std::copy(sp, sp + n, adt->fields);
+            *sp++ = Operand{adt};
+        }
+        NEXT();
+        TARGET(dladt) heap.release((--sp)->adt); NEXT();
+        TARGET(ldctor)
+        {
+            sp[-1] = Operand{static_cast<int32_t>(sp[-1].adt->constructor_index)};
+        }
+        NEXT();
+        // Onto the br of the table, which takes care of back-edges.
+        TARGET(switch_)
+        {
+            auto k = static_cast<uint32_t>((--sp)->int32);
+            ip += 1 + std::min<uint32_t>(k, ip->index);
+        }
+        JUMP();
+        TARGET(switchctor)
+        {
+            uint32_t k = (--sp)->adt->constructor_index;
+            ip += 1 + std::min<uint32_t>(k, ip->index);
+        }
+        JUMP();
+        TARGET(ldfld)
+        {
+            auto adt = sp[-1].adt;
+            if (RVM_UNLIKELY(ip->index >= adt->num_fields)) {
+                throw IndexOutOfBoundError{};
+            }
+            sp[-1] = adt->fields[ip->index];
+        }
+        NEXT();
+        TARGET(stfld)
+        {
+            if (RVM_UNLIKELY(ip->index >= sp[-1].adt->num_fields)) {
+                throw IndexOutOfBoundError{};
+            }
+            if (RVM_UNLIKELY(Heap::is_constant(sp[-1].adt))) {
+                throw ConstantModificationError{};
+            }
+            heap.store(sp[-1].adt, ip->index, sp[-2]);
+            sp -= 2;
+        }
+        NEXT();
+        TARGET(inc_local_by_const)
+        {
+            auto&& slot = fp[ip->imm2];
+            slot = Operand{static_cast<int32_t>(
+                static_cast<uint32_t>(slot.int32) + static_cast<uint32_t>(ip->imm))};
+            ip += 3;
+        }
+        NEXT();
+        TARGET(add_local_const)
+        {
+            RESERVE_PUSH(1);
+            *sp++ = Operand{static_cast<int32_t>(
+                static_cast<uint32_t>(fp[ip->imm2].int32) + static_cast<uint32_t>(ip->imm))};
+            ip += 2;
+        }
+        NEXT();
+        TARGET(ldloc_ldloc)
+        {
+            RESERVE_PUSH(2);
+            sp[0] = fp[ip->imm];
+            sp[1] = fp[ip->imm2];
+            sp += 2;
+            ++ip;
+        }
+        NEXT();
+        TARGET(stloc_ldloc)
+        {
+            fp[ip->imm] = sp[-1];
+            sp[-1] = fp[ip->imm2];
+            ++ip;
+        }
+        NEXT();
+#define CMP_BRANCH(name, cond) \
+        TARGET(cmp_local_const_branch_##name) \
+        { \
+            auto&& x = fp[ip->imm2]; \
+            auto k = Operand{ip->imm}; \
+            if (cond) { \
+                auto length = ip - code - ip->index + 1; \
+                ip = code + ip->index; \
+                if (length > 0) { \
+                    SAFEPOINT(length); \
+                } \
+                JUMP(); \
+            } \
+            ip += 3; \
+        } \
+        NEXT();
+        CMP_BRANCH(lt, x.int32 < k.int32)
+        CMP_BRANCH(le, x.int32 <= k.int32)
+        CMP_BRANCH(gt, x.int32 > k.int32)
+        CMP_BRANCH(ge, x.int32 >= k.int32)
+        CMP_BRANCH(eq, memcmp(&x, &k, sizeof(Operand)) == 0)
+        CMP_BRANCH(ne, memcmp(&x, &k, sizeof(Operand)) != 0)
+#if !RVM_COMPUTED_GOTO
+        }
+#endif
+
+jit_enter:
+        {
+            // Compiled code addresses operand stack slots by their static
+            // depth; a calla of unexpected arity may have broken that.
+            auto&& f = assembly.function_table[current_function_index];
+            auto pc = static_cast<index_t>(ip - code);
+            if (sp != fp + f.num_locals + jit.depth(current_function_index, pc)) {
+                goto dispatch;
+            }
+            RESERVE(jit.frame_size(current_function_index));
+            runtime.budget = left;
+            pc = jit.run(current_function_index, fp, base, pc, &runtime);
+            left = runtime.budget;
+            ip = code + pc;
+            sp = fp + f.num_locals + jit.depth(current_function_index, pc);
+            if (RVM_UNLIKELY(runtime.error != nullptr)) {
+                auto error = runtime.error;
+                runtime.error = nullptr;
+                std::rethrow_exception(error);
+            }
+            if (left <= 0) {
+                goto suspend;
+            }
+        }
+        goto dispatch;
+
+suspend:
+        SYNC();
+        return;
+    }
+    catch (...) {
+        SYNC();
+        throw;
+    }
+
+#undef ARITHMETIC
+#undef LOGIC
+#undef CMP_BRANCH
+#undef SYNC
+#undef PUBLISH
+#undef RESERVE
+#undef RESERVE_PUSH
+#undef ENTER
+#undef TAIL_ENTER
+#undef SAFEPOINT
+#undef TARGET
+#undef NEXT
+#undef JUMP
+}
+
+template void Interpreter::run_threaded<true>();
+template void Interpreter::run_threaded<false>();
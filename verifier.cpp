@@ -0,0 +1,307 @@
+#include "verifier.h"
+#include <algorithm>
+#include "analysis.h"
+
+#define assert(c) if(!(c)) throw InvalidBytecodeError{}
+
+using namespace rvm;
+using namespace rvm::assembly;
+
+namespace {
+
+struct State {
+    bool reached{false};
+    std::vector<ValueType> stack{};
+    std::vector<ValueType> locals{};
+};
+
+ValueType value_type(OperandType t) {
+    switch (t) {
+        case OperandType::int8: return ValueType::int8;
+        case OperandType::int32: return ValueType::int32;
+        case OperandType::pointer: return ValueType::pointer;
+        case OperandType::adt: return ValueType::adt;
+    }
+    throw InvalidBytecodeError{};
+}
+
+ValueType value_type(const ConstantInfo& c) {
+    switch (c.type) {
+        case ConstantType::int8: return ValueType::int8;
+        case ConstantType::int32: return ValueType::int32;
+        case ConstantType::adt: return ValueType::adt;
+    }
+    throw InvalidBytecodeError{};
+}
+
+// Whether an instruction expecting `expected` can take a value of type `t`.
+// Pointers are plain slot numbers, and so are usable as int32 and the other
+// way around; function indexes are int32 too, but not every int32 is a
+// function.
+bool accepts(ValueType expected, ValueType t) {
+    if (expected == t || expected == ValueType::any || t == ValueType::any || t == ValueType::unset) {
+        return true;
+    }
+    switch (expected) {
+        case ValueType::int32:
+            return t == ValueType::pointer || t == ValueType::function;
+        case ValueType::pointer:
+            return t == ValueType::int32;
+        default:
+            return false;
+    }
+}
+
+ValueType join(ValueType x, ValueType y) {
+    if (x == y || y == ValueType::unset) {
+        return x;
+    }
+    if (x == ValueType::unset) {
+        return y;
+    }
+    return ValueType::any;
+}
+
+class Verifier {
+public:
+    Verifier(const Assembly& a, const FunctionInfo& f, const std::vector<index_t>& native_arities)
+        : a(a), f(f), native_arities(native_arities), states(f.code.size()) {}
+
+    Verification run() {
+        auto re = Verification{};
+        re.depth.assign(f.code.size(), -1);
+        re.types.resize(f.code.size());
+        if (f.code.empty()) {
+            return re;
+        }
+        auto entry = State{true, {}, std::vector<ValueType>(f.num_locals, ValueType::unset)};
+        flow(0, entry);
+        while (!work.empty()) {
+            auto pc = work.back();
+            work.pop_back();
+            auto state = states[pc];
+            step(pc, state);
+        }
+        for (size_t pc = 0; pc < f.code.size(); ++pc) {
+            if (states[pc].reached) {
+                re.depth[pc] = static_cast<int32_t>(states[pc].stack.size());
+                re.types[pc] = std::move(states[pc].stack);
+            }
+        }
+        assert(max_stack <= UINT16_MAX);
+        re.max_stack = static_cast<index_t>(max_stack);
+        return re;
+    }
+
+private:
+    const Assembly& a;
+    const FunctionInfo& f;
+    const std::vector<index_t>& native_arities;
+    std::vector<State> states;
+    std::vector<size_t> work{};
+    size_t max_stack{0};
+
+    // Merges `state` into the entry state of `target`, queueing it when
+    // anything changed.
+    void flow(size_t target, const State& state) {
+        assert(target < f.code.size());
+        auto&& s = states[target];
+        if (!s.reached) {
+            s = state;
+            work.push_back(target);
+            return;
+        }
+        assert(s.stack.size() == state.stack.size());
+        auto changed = false;
+        for (size_t i = 0; i < s.stack.size(); ++i) {
+            auto t = join(s.stack[i], state.stack[i]);
+            assert(t != ValueType::any || s.stack[i] == ValueType::any || state.stack[i] == ValueType::any
+                || accepts(s.stack[i], state.stack[i]) || accepts(state.stack[i], s.stack[i]));
+            changed |= t != s.stack[i];
+            s.stack[i] = t;
+        }
+        for (size_t i = 0; i < s.locals.size(); ++i) {
+            auto t = join(s.locals[i], state.locals[i]);
+            changed |= t != s.locals[i];
+            s.locals[i] = t;
+        }
+        if (changed) {
+            work.push_back(target);
+        }
+    }
+
+    static ValueType pop(State& s, ValueType expected) {
+        assert(!s.stack.empty());
+        auto t = s.stack.back();
+        s.stack.pop_back();
+        assert(accepts(expected, t));
+        return t;
+    }
+    static void pop_n(State& s, size_t n) {
+        assert(s.stack.size() >= n);
+        s.stack.resize(s.stack.size() - n);
+    }
+    void push(State& s, ValueType t) {
+        s.stack.push_back(t);
+        max_stack = std::max(max_stack, s.stack.size());
+    }
+    // Pointers are plain slot numbers and any int32 is one, so stind and
+    // whatever a callee does may have written every local.
+    static void clobber_locals(State& s) {
+        std::fill(s.locals.begin(), s.locals.end(), ValueType::any);
+    }
+
+    void step(size_t pc, State& s) {
+        auto&& i = f.code[pc];
+        switch (i.op) {
+            case Operation::add:
+            case Operation::sub:
+            case Operation::mul:
+            case Operation::div:
+            case Operation::rem:
+            case Operation::band:
+            case Operation::bor:
+            case Operation::bxor:
+            {
+                auto t = value_type(i.type);
+                pop(s, t);
+                pop(s, t);
+                push(s, t);
+                break;
+            }
+            case Operation::bnot:
+            {
+                auto t = value_type(i.type);
+                pop(s, t);
+                push(s, t);
+                break;
+            }
+            case Operation::teq:
+            case Operation::tne:
+            case Operation::tlt:
+            case Operation::tlt_un:
+            case Operation::tle:
+            case Operation::tle_un:
+            case Operation::tgt:
+            case Operation::tgt_un:
+            case Operation::tge:
+            case Operation::tge_un:
+            {
+                auto t = value_type(i.type);
+                pop(s, t);
+                pop(s, t);
+                push(s, ValueType::int8);
+                break;
+            }
+            case Operation::dup:
+            {
+                auto t = pop(s, ValueType::any);
+                push(s, t);
+                push(s, t);
+                break;
+            }
+            case Operation::drop:
+                pop(s, ValueType::any);
+                break;
+            case Operation::ldc:
+                push(s, value_type(a.constant_table[i.index]));
+                break;
+            case Operation::ldloc:
+                push(s, s.locals[i.index]);
+                break;
+            case Operation::stloc:
+                s.locals[i.index] = pop(s, ValueType::any);
+                break;
+            case Operation::ldarg:
+                push(s, ValueType::any);
+                break;
+            case Operation::starg:
+                pop(s, ValueType::any);
+                break;
+            case Operation::call:
+                pop_n(s, a.function_table[i.index].num_args);
+                push(s, ValueType::any);
+                clobber_locals(s);
+                break;
+            case Operation::callnative:
+                assert(i.index < native_arities.size());
+                pop_n(s, native_arities[i.index]);
+                push(s, ValueType::any);
+                break;
+            case Operation::calla:
+                pop(s, ValueType::function);
+                pop_n(s, calla_arity(a, f, pc));
+                push(s, ValueType::any);
+                clobber_locals(s);
+                break;
+            case Operation::ret:
+                pop(s, ValueType::any);
+                return;
+            case Operation::tailcall:
+                pop_n(s, a.function_table[i.index].num_args);
+                return;
+            case Operation::tailcalla:
+                pop(s, ValueType::function);
+                pop_n(s, calla_arity(a, f, pc));
+                return;
+            case Operation::ldloca:
+            case Operation::ldarga:
+                push(s, ValueType::pointer);
+                break;
+            case Operation::ldfuna:
+                push(s, ValueType::function);
+                break;
+            case Operation::ldind:
+                pop(s, ValueType::pointer);
+                push(s, ValueType::any);
+                break;
+            case Operation::stind:
+                pop(s, ValueType::any);
+                pop(s, ValueType::pointer);
+                clobber_locals(s);
+                break;
+            case Operation::br:
+                flow(i.index, s);
+                return;
+            case Operation::brtrue:
+                pop(s, ValueType::int8);
+                flow(i.index, s);
+                break;
+            case Operation::mkadt:
+                pop_n(s, a.adt_table[i.index][i.index2].num_fields);
+                push(s, ValueType::adt);
+                break;
+            case Operation::dladt:
+                pop(s, ValueType::adt);
+                break;
+            case Operation::ldctor:
+                pop(s, ValueType::adt);
+                push(s, ValueType::int32);
+                break;
+            case Operation::ldfld:
+                pop(s, ValueType::adt);
+                push(s, ValueType::any);
+                break;
+            case Operation::stfld:
+                pop(s, ValueType::adt);
+                pop(s, ValueType::any);
+                break;
+            case Operation::switch_:
+            case Operation::switchctor:
+                pop(s, i.op == Operation::switch_ ? ValueType::int32 : ValueType::adt);
+                // every entry of the table, and past it
+                for (size_t k = 1; k <= i.index + 1u; ++k) {
+                    flow(pc + k, s);
+                }
+                return;
+        }
+        flow(pc + 1, s);
+    }
+};
+
+}
+
+Verification rvm::assembly::verify(const Assembly& a, const FunctionInfo& f,
+                                   const std::vector<index_t>& native_arities) {
+    return Verifier{a, f, native_arities}.run();
+}
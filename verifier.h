@@ -0,0 +1,45 @@
+#pragma once
+#include <stdint.h>
+#include <vector>
+#include "assembly.h"
+
+namespace rvm {
+namespace assembly {
+
+// What the verifier knows about a value.
+enum class ValueType: uint8_t {
+    // a local nothing has been stored to yet: zero, which every type accepts
+    unset,
+    int8,
+    int32,
+    // operand stack address, from ldloca or ldarga
+    pointer,
+    // function table index, from ldfuna
+    function,
+    adt,
+    // arguments, results of calls, fields and anything loaded indirectly
+    any
+};
+
+// Operand stack of a function on entry to every pc, counted above the
+// locals. `types[pc]` lists the stack bottom first; unreachable pcs have
+// depth -1 and no types.
+struct Verification {
+    std::vector<int32_t> depth;
+    std::vector<std::vector<ValueType>> types;
+    index_t max_stack{0};
+};
+
+// Data-flow verification of a validated function. Throws
+// InvalidBytecodeError when the stack underflows the frame or control runs
+// off the end of the code, when two paths reach a pc with different depths
+// or with different types in one stack slot, or when an instruction gets an
+// operand of a type it does not take. Locals may hold different types on
+// different paths; they are then `any` after the merge, and after stind or
+// a call, which may have written them through a pointer.
+// `native_arities` holds NativeInfo::num_args of the natives in order.
+Verification verify(const Assembly&, const FunctionInfo&,
+                    const std::vector<index_t>& native_arities);
+
+}
+}
@@ -0,0 +1,48 @@
+#include "vm_stack.h"
+#include <sys/mman.h>
+#include <unistd.h>
+
+using namespace rvm;
+using namespace rvm::interpreter;
+
+VmStack::VmStack(size_t capacity) {
+    auto page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    auto bytes = (std::max<size_t>(capacity, 1) * sizeof(Operand) + page - 1) / page * page;
+    auto p = mmap(nullptr, bytes + page, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) {
+        throw StackOverflowError{};
+    }
+    mprotect(static_cast<char*>(p) + bytes, page, PROT_NONE);
+    slots = static_cast<Operand*>(p);
+    slots_capacity = bytes / sizeof(Operand);
+    mapped = bytes + page;
+}
+
+VmStack::VmStack(VmStack&& other) {
+    *this = std::move(other);
+}
+
+VmStack& VmStack::operator=(VmStack&& other) {
+    if (this != &other) {
+        release();
+        slots = other.slots;
+        used = other.used;
+        slots_capacity = other.slots_capacity;
+        mapped = other.mapped;
+        other.slots = nullptr;
+        other.used = other.slots_capacity = other.mapped = 0;
+    }
+    return *this;
+}
+
+VmStack::~VmStack() {
+    release();
+}
+
+void VmStack::release() {
+    if (slots != nullptr) {
+        munmap(slots, mapped);
+        slots = nullptr;
+    }
+}
@@ -0,0 +1,83 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <algorithm>
+#include "operand.h"
+
+namespace rvm {
+namespace interpreter {
+
+// Slots between the arguments and the locals of a frame: the caller's
+// function index, pc and frame, the last one as a slot number.
+static constexpr int32_t FRAME_HEADER_SIZE = 3;
+
+// Operand stack of an interpreter, frames included:
+//
+//   [args][caller function][caller pc][caller frame] fp -> [locals][temps]
+//
+// The whole capacity is reserved up front and the stack never moves, so
+// pointers into it stay valid for the life of the interpreter; pages are
+// only committed as the stack grows. An inaccessible guard page follows the
+// last slot.
+class VmStack {
+public:
+    struct StackOverflowError {};
+
+    explicit VmStack(size_t capacity = size_t{1} << 20);
+    VmStack(const VmStack&) = delete;
+    VmStack(VmStack&&);
+    VmStack& operator=(const VmStack&) = delete;
+    VmStack& operator=(VmStack&&);
+    ~VmStack();
+
+    Operand* data() const {
+        return slots;
+    }
+    size_t size() const {
+        return used;
+    }
+    size_t capacity() const {
+        return slots_capacity;
+    }
+    Operand& operator[](size_t i) {
+        return slots[i];
+    }
+    Operand& back() {
+        return slots[used - 1];
+    }
+    void push_back(Operand o) {
+        if (used == slots_capacity) {
+            throw StackOverflowError{};
+        }
+        slots[used++] = o;
+    }
+    void pop_back() {
+        --used;
+    }
+    // New slots are zeroed.
+    void resize(size_t n) {
+        if (n > slots_capacity) {
+            throw StackOverflowError{};
+        }
+        if (n > used) {
+            std::fill(slots + used, slots + n, Operand{});
+        }
+        used = n;
+    }
+    // For code that wrote the slots up to `top` itself.
+    void set_top(Operand* top) {
+        used = static_cast<size_t>(top - slots);
+    }
+
+private:
+    Operand* slots{nullptr};
+    size_t used{0};
+    size_t slots_capacity{0};
+    // the mapping, guard page included
+    size_t mapped{0};
+
+    void release();
+};
+
+}
+}